@@ -0,0 +1,40 @@
+#include "mbed.h"
+#include "Profiler.h"
+
+ProfileCounter Profiler::counters[PROFILE_ZONES];
+
+void Profiler::init() {
+    /** the DWT unit is only clocked with trace enabled in the debug monitor */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    reset();
+}
+
+void Profiler::add(int zone, uint32_t cycles) {
+    ProfileCounter & c = counters[zone];
+
+    c.count++;
+    c.total += cycles;
+
+    if (cycles < c.min) {
+        c.min = cycles;
+    }
+    if (cycles > c.max) {
+        c.max = cycles;
+    }
+}
+
+const ProfileCounter & Profiler::get(int zone) {
+    return counters[zone];
+}
+
+void Profiler::reset() {
+    for (int z = 0; z < PROFILE_ZONES; z++) {
+        counters[z].count = 0;
+        counters[z].min   = 0xFFFFFFFF;
+        counters[z].max   = 0;
+        counters[z].total = 0;
+    }
+}
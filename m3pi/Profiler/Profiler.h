@@ -0,0 +1,98 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "mbed.h"
+
+/** Parts of the firmware whose CPU cycles are counted.
+ *
+ * Zones may be nested, each counts all cycles spent inside it including the
+ * zones it calls: PROFILE_EXECUTE contains the PROFILE_SONAR, PROFILE_REPORTPING
+ * and PROFILE_LCD cycles of the command.
+ */
+enum ProfileZone {
+    PROFILE_PAYLOAD = 0,    // processPayload()
+    PROFILE_EXECUTE,        // executeCommand()
+    PROFILE_SONAR,          // one HC-SR04 measurement, HCSR04::startMeasurement()
+    PROFILE_REPORTPING,     // reportPing()
+    PROFILE_LCD,            // a call to the m3pi LCD
+    PROFILE_ZONES
+};
+
+/** Cycles counted for one zone since the last reset. */
+struct ProfileCounter {
+    uint32_t count;         // number of times the zone has been left
+    uint32_t min;           // in cycles, 0xFFFFFFFF while count is 0
+    uint32_t max;           // in cycles
+    uint64_t total;         // in cycles
+};
+
+/** Counts CPU cycles per zone with the cycle counter of the Cortex-M3 DWT unit.
+ *
+ * The counter runs at the core clock, SystemCoreClock cycles per second, and
+ * wraps after 2^32 cycles. A single zone must therefore be left within about
+ * 44 s at 96 MHz to be counted correctly. Entering and leaving a zone costs a
+ * read of DWT->CYCCNT each and a few additions.
+ *
+ * Example of use:
+ * @code
+ * Profiler::init();
+ *
+ * void processPayload() {
+ *     ProfileScope scope(PROFILE_PAYLOAD);   // counted until the end of the block
+ *     ...
+ * }
+ * @endcode
+ */
+class Profiler {
+
+    public:
+
+    /** Enables the DWT cycle counter, call this once before any zone is entered. */
+    static void init();
+
+    /** @returns the current value of the cycle counter. */
+    static inline uint32_t cycles() {
+        return DWT->CYCCNT;
+    }
+
+    /** Adds one pass through a zone.
+     * @param zone a ProfileZone
+     * @param cycles cycles spent in the zone
+     */
+    static void add(int zone, uint32_t cycles);
+
+    /** @returns the counter of a zone.
+     * @param zone a ProfileZone
+     */
+    static const ProfileCounter & get(int zone);
+
+    /** Sets all counters back to zero. */
+    static void reset();
+
+    private:
+
+    static ProfileCounter counters[PROFILE_ZONES];
+};
+
+/** Counts the cycles from its construction to the end of the enclosing block
+ *  towards a zone.
+ */
+class ProfileScope {
+
+    public:
+
+    /** @param zone a ProfileZone */
+    ProfileScope(int zone) : zone(zone), start(Profiler::cycles()) {
+    }
+
+    ~ProfileScope() {
+        Profiler::add(zone, Profiler::cycles() - start);
+    }
+
+    private:
+
+    int zone;
+    uint32_t start;
+};
+
+#endif
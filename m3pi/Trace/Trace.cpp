@@ -0,0 +1,57 @@
+#include "mbed.h"
+#include "Trace.h"
+
+volatile uint32_t Trace::ring[TRACE_RING_WORDS];
+volatile uint32_t Trace::head = 0;
+volatile uint32_t Trace::tail = 0;
+volatile uint32_t Trace::dropped = 0;
+
+static void sendWord(Serial & port, uint32_t value) {
+    port.putc(value >> 24);
+    port.putc(value >> 16);
+    port.putc(value >> 8);
+    port.putc(value);
+}
+
+void Trace::dropRecord() {
+    uint32_t d;
+
+    /** an interrupt may drop a record of its own in between */
+    do {
+        d = __LDREXW(&dropped);
+    } while (__STREXW(d + 1, &dropped));
+}
+
+int Trace::drain(Serial & port, int maxRecords) {
+    int sent = 0;
+    uint32_t header, words, d;
+
+    while (sent < maxRecords && tail != head) {
+        header = ring[tail & (TRACE_RING_WORDS - 1)];
+        if (header == 0) {
+            // reserved but still being written by the code we interrupted
+            break;
+        }
+
+        words = 2 + (header & 0xFF);
+        for (uint32_t w = 0; w < words; w++) {
+            sendWord(port, ring[(tail + w) & (TRACE_RING_WORDS - 1)]);
+            ring[(tail + w) & (TRACE_RING_WORDS - 1)] = 0;
+        }
+        tail += words;
+        sent++;
+    }
+
+    /** reported once everything before it has been sent, so that its time is the latest */
+    if (dropped > 0 && tail == head) {
+        do {
+            d = __LDREXW(&dropped);
+        } while (__STREXW(0, &dropped));
+
+        sendWord(port, (TRACE_MAGIC << 24) | (TRACE_DROPPED << 8) | TRACE_ARGS_DROPPED);
+        sendWord(port, Profiler::cycles());
+        sendWord(port, d);
+    }
+
+    return sent;
+}
@@ -0,0 +1,119 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "mbed.h"
+#include "Profiler.h"
+#include "TraceEvents.h"
+
+/** highest level of the trace points that are compiled in, see TraceEvents.h */
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_INFO
+#endif
+
+/** size of the ring in 4 byte words, a power of two */
+#ifndef TRACE_RING_WORDS
+#define TRACE_RING_WORDS 256
+#endif
+
+#define TRACE_MAGIC 0xA5    // top byte of every record header
+
+#define TRACE_EVENT(name, level, args, format) TRACE_##name,
+enum TraceEvent {
+    TRACE_EVENTS
+    TRACE_EVENT_COUNT
+};
+#undef TRACE_EVENT
+
+#define TRACE_EVENT(name, level, args, format) TRACE_LEVEL_##name = level, TRACE_ARGS_##name = args,
+enum TraceEventInfo {
+    TRACE_EVENTS
+};
+#undef TRACE_EVENT
+
+/** Trace points, they cost nothing when their event is above TRACE_LEVEL.
+ *
+ * The arguments are stored as ints, chars and bools are fine.
+ */
+#define TRACE0(name)          do { if (TRACE_LEVEL_##name <= TRACE_LEVEL) Trace::record(TRACE_##name, TRACE_ARGS_##name, 0, 0, 0); } while (0)
+#define TRACE1(name, a)       do { if (TRACE_LEVEL_##name <= TRACE_LEVEL) Trace::record(TRACE_##name, TRACE_ARGS_##name, (a), 0, 0); } while (0)
+#define TRACE2(name, a, b)    do { if (TRACE_LEVEL_##name <= TRACE_LEVEL) Trace::record(TRACE_##name, TRACE_ARGS_##name, (a), (b), 0); } while (0)
+#define TRACE3(name, a, b, c) do { if (TRACE_LEVEL_##name <= TRACE_LEVEL) Trace::record(TRACE_##name, TRACE_ARGS_##name, (a), (b), (c)); } while (0)
+
+/** Lock-free ring of binary trace records, written from interrupts and the main
+ *  loop alike and sent to a serial port when the firmware has nothing else to do.
+ *
+ * A record is a header word (TRACE_MAGIC, event, number of args), the cycle
+ * counter of the Profiler when it was written and its args. Space is reserved
+ * by advancing the head with LDREX/STREX, so an interrupt that records in the
+ * middle of another record simply takes the space behind it. The header is
+ * written last: drain() stops at a reserved record whose header is still 0 and
+ * picks it up on its next call.
+ *
+ * When the ring is full records are dropped and counted, drain() reports them
+ * with a DROPPED record once the ring has been emptied. Recording never waits.
+ *
+ * Records are sent as their words, MSB first. tools/tracedecode turns them back
+ * into text with the formats of TraceEvents.h.
+ *
+ * Example of use:
+ * @code
+ * Serial tracePort(USBTX, USBRX);
+ *
+ * Profiler::init();
+ * TRACE1(EXECUTE, cmd);
+ *
+ * while (1) {
+ *     if (idle) {
+ *         Trace::drain(tracePort, 8);
+ *     }
+ * }
+ * @endcode
+ */
+class Trace {
+
+    public:
+
+    /** Adds a record to the ring, drops it when the ring is full.
+     *
+     * Use the TRACE macros instead, they check the level and the number of args.
+     * @param event a TraceEvent
+     * @param args number of args to store, 0 to 3
+     */
+    static inline void record(int event, int args, uint32_t a, uint32_t b, uint32_t c) {
+        uint32_t words = 2 + args;
+        uint32_t start;
+
+        do {
+            start = __LDREXW(&head);
+            if (start + words - tail > TRACE_RING_WORDS) {
+                __CLREX();
+                dropRecord();
+                return;
+            }
+        } while (__STREXW(start + words, &head));
+
+        ring[(start + 1) & (TRACE_RING_WORDS - 1)] = Profiler::cycles();
+        if (args > 0) ring[(start + 2) & (TRACE_RING_WORDS - 1)] = a;
+        if (args > 1) ring[(start + 3) & (TRACE_RING_WORDS - 1)] = b;
+        if (args > 2) ring[(start + 4) & (TRACE_RING_WORDS - 1)] = c;
+        ring[start & (TRACE_RING_WORDS - 1)] = (TRACE_MAGIC << 24) | (event << 8) | args;
+    }
+
+    /** Sends complete records from the ring, call this from the main loop only.
+     * @param port where the records go
+     * @param maxRecords stop after this many, putc() waits for the UART
+     * @returns the number of records sent
+     */
+    static int drain(Serial & port, int maxRecords);
+
+    private:
+
+    static void dropRecord();
+
+    static volatile uint32_t ring[TRACE_RING_WORDS];
+    static volatile uint32_t head;      // next free word, only ever grows
+    static volatile uint32_t tail;      // next word to send, only drain() moves it
+    static volatile uint32_t dropped;
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef TRACEEVENTS_H
+#define TRACEEVENTS_H
+
+/** Levels of the trace events, a trace point is compiled in when its level is
+ *  at most TRACE_LEVEL.
+ */
+#define TRACE_ERROR 1
+#define TRACE_WARN  2
+#define TRACE_INFO  3
+#define TRACE_DEBUG 4
+
+/** Every trace event of the firmware: TRACE_EVENT(name, level, args, format)
+ *
+ * args is the number of int arguments (at most 3) a record of the event carries,
+ * format turns them back into text on the host, see tools/tracedecode. Records
+ * only hold the index of their event, so add new events at the end or the
+ * decoder has to be rebuilt together with the firmware.
+ *
+ * This header is shared with the host and must not include anything.
+ */
+#define TRACE_EVENTS \
+    TRACE_EVENT(DROPPED,       TRACE_ERROR, 1, "%u records dropped, the ring was full") \
+    TRACE_EVENT(BOOT,          TRACE_INFO,  1, "boot, core clock %u Hz") \
+    TRACE_EVENT(RECEIVED,      TRACE_DEBUG, 1, "received: %c") \
+    TRACE_EVENT(FRAME_ERROR,   TRACE_WARN,  2, "unexpected %c in state %d") \
+    TRACE_EVENT(PAYLOAD,       TRACE_INFO,  2, "processing payload for %c complete. result: %d") \
+    TRACE_EVENT(VERIFY,        TRACE_DEBUG, 2, "verifying command %c complete, result: %d") \
+    TRACE_EVENT(EXECUTE,       TRACE_INFO,  1, "executing command: %c") \
+    TRACE_EVENT(EXECUTED,      TRACE_INFO,  2, "executing command %c complete. result: %d") \
+    TRACE_EVENT(PING,          TRACE_DEBUG, 2, "ping at %d degrees: %d mm") \
+    TRACE_EVENT(CLEANUP,       TRACE_DEBUG, 1, "cleaned up after command. new cmdState is now %d")
+
+#endif
@@ -1,7 +1,10 @@
 #include "mbed.h"
+#include "us_ticker_api.h"
 #include "m3pi.h"
 #include "HCSR04.h"
 #include "Servo.h"
+#include "Profiler.h"
+#include "Trace.h"
 
 m3pi m3pi;
 Serial wixel(p28, p27);
@@ -11,6 +14,7 @@ HCSR04 sonar(p15, p16);
 Servo servo(p22);
 
 DigitalOut led(LED1);
+Serial tracePort(USBTX, USBRX);      // trace records, see tools/tracedecode
 
 //---- commands ---------------------------------------------------------------
 #define SRLCMD_CMD_NOOP 0x00
@@ -30,7 +34,7 @@ DigitalOut led(LED1);
  * angle is an int (4 bytes)
  *
  * request syntax:  #l:[angle]\n
- * response syntax: #K\n
+ * response syntax: #K:[times]\n
  */
 #define SRLCMD_CMD_TURNLEFT 'l'
 
@@ -40,7 +44,7 @@ DigitalOut led(LED1);
  * angle is an int (4 bytes)
  *
  * request syntax:  #r:[angle]\n
- * response syntax: #K\n
+ * response syntax: #K:[times]\n
  */
 #define SRLCMD_CMD_TURNRIGHT 'r'
 
@@ -50,7 +54,7 @@ DigitalOut led(LED1);
  * distance is an int (4 byte)
  *
  * request syntax:  #m:[distance]\n
- * response syntax: #K\n
+ * response syntax: #K:[times]\n
  */
 #define SRLCMD_CMD_MOVEFORWARD 'm'
 
@@ -60,7 +64,7 @@ DigitalOut led(LED1);
  * distance is an int (4 byte)
  *
  * request syntax:  #e:[distance]\n
- * response syntax: #K\n
+ * response syntax: #K:[times]\n
  */
 #define SRLCMD_CMD_MOVEBACKWARD 'e'
 
@@ -68,7 +72,7 @@ DigitalOut led(LED1);
  * request to clear the LCD screen.
  *
  * request syntax:  #c:\n
- * response syntax: #K\n
+ * response syntax: #K:[times]\n
  */
 #define SRLCMD_CMD_LCDCLEAR 'c'
 
@@ -78,7 +82,7 @@ DigitalOut led(LED1);
  * x and y are ints (4 byte), the text is an array of char
  *
  * request syntax:  #w:[x],[y],[cext]\n
- * response syntax: #K\n
+ * response syntax: #K:[times]\n
  */
 #define SRLCMD_CMD_LCDWRITE 'w'
 
@@ -105,10 +109,23 @@ DigitalOut led(LED1);
  * request syntax:  #s:[startAngle],[endAngle],[stepSize]\n
  * response syntax:
  *   sends one line per angle: #P:[angle],[range]\n
- *   followed by a final:      #K\n
+ *   followed by a final:      #K:[times]\n
  */
  #define SRLCMD_CMD_SONAR_SWEEP 's'
 
+/** 
+ * request for the profiling counters, which are reset afterwards
+ *
+ * response parameters per zone: zone is char (1 byte), count, min and max cycles
+ * are int (4 byte), total cycles are a long (8 byte), all MSB first
+ *
+ * request syntax:  #f:\n
+ * response syntax:
+ *   sends one line per ProfileZone: #F:[zone][count][min][max][total]\n
+ *   followed by a final:            #K:[times]\n
+ */
+#define SRLCMD_CMD_PROFILE 'f'
+
 //---- scaling constants ------------------------------------------------------
 #define TURNRATE_LEFT 440.0 / 45.0      
 #define TURNRATE_RIGHT 460.0 / 45.0
@@ -124,6 +141,9 @@ DigitalOut led(LED1);
   i.e.  "#a:\n"      for a command 'a' without any parameters - NOTE that the CMDSEP char is mandatory
   i.e.  "#b:P\n"     for a command 'b' with a single byte, single argument payload "P"
   i.e.  "#c:O,V\n"   for a command 'c' with payload consisting of two arguments of one byte each, 'O' and 'V'
+  
+  ints are sent as binary and may contain the SRLCMD_CHAR_END byte, so a command only ends 
+  at SRLCMD_CHAR_END once at least payloadSize() bytes of its payload have been received
 */
 #define SRLCMD_CHAR_START '#'               // sent on the beginning of each new command
 #define SRLCMD_CHAR_CMDSEP ':'              // separates the command char from the payload
@@ -170,15 +190,45 @@ char sonarStepSize = 0;
 int sonarRange = 0; // in mm
 char sonarMeasurementsPerPing = 5;
 
+// us_ticker_read() times of the current command, sent back with its #K
+volatile uint32_t cmdReceivedAt = 0;     // the terminating '\n' arrived
+uint32_t cmdParsedAt = 0;                // processPayload() returned
+uint32_t cmdStartedAt = 0;               // executeCommand() was called
 
 
 
 
+
+/**
+ * sends an int as 4 bytes, MSB first
+ *
+ * @param uint32_t value
+ */
+void sendInt(uint32_t value) {
+    wixel.putc(value >> 24);
+    wixel.putc(value >> 16);
+    wixel.putc(value >> 8);
+    wixel.putc(value);
+}
+
 /** 
- * sends a single K\n over serial to confirm that a queued command has been executed
+ * sends #K over serial to confirm that a queued command has been executed, along
+ * with when it has been received, parsed, started and now finished
+ *
+ * the times are us_ticker_read() values, ints (4 byte) MSB first. They wrap after
+ * about 71 minutes, only their differences mean anything
+ *
+ * response syntax: #K:[received][parsed][started][finished]\n
  */
 void reportCmdComplete() {
-    wixel.printf("#K\n");
+    uint32_t finishedAt = us_ticker_read();
+    
+    wixel.printf("#K:");
+    sendInt(cmdReceivedAt);
+    sendInt(cmdParsedAt);
+    sendInt(cmdStartedAt);
+    sendInt(finishedAt);
+    wixel.putc('\n');
 }
 
 /**
@@ -188,6 +238,7 @@ void reportCmdComplete() {
  * @param int range     in mm
  */
 void reportPing(int angle, int range) {
+    ProfileScope scope(PROFILE_REPORTPING);
     SerialInt a;
     SerialInt r;
     
@@ -208,6 +259,22 @@ void reportBattery(float voltage) {
     wixel.printf("#B:%c%c%c%c\n", v.c[3], v.c[2], v.c[1], v.c[0]); 
 }
 
+/**
+ * sends the counter of a profiling zone over Serial
+ *
+ * @param char zone                 a ProfileZone
+ * @param ProfileCounter counter
+ */
+void reportProfile(char zone, const ProfileCounter & counter) {
+    wixel.printf("#F:%c", zone);
+    sendInt(counter.count);
+    sendInt(counter.count > 0 ? counter.min : 0);
+    sendInt(counter.max);
+    sendInt(counter.total >> 32);
+    sendInt(counter.total);
+    wixel.putc(SRLCMD_CHAR_END);
+}
+
     
     
     
@@ -299,7 +366,10 @@ void cmdMoveBackward(int distance) {
  * will send a confirmation over serial when the turn is completed: #K\n
  */
 void cmdLcdClear() {
-    m3pi.cls();
+    {
+        ProfileScope scope(PROFILE_LCD);
+        m3pi.cls();
+    }
     
     reportCmdComplete();
 }
@@ -314,8 +384,11 @@ void cmdLcdClear() {
  * @param char * text       text to write
  */
 void cmdLcdWrite(int x, int y, char * text) {
-    m3pi.locate(x, y);
-    m3pi.printf(text);
+    {
+        ProfileScope scope(PROFILE_LCD);
+        m3pi.locate(x, y);
+        m3pi.printf(text);
+    }
         
     reportCmdComplete();
 }
@@ -339,14 +412,17 @@ void cmdSonarPing(int angle) {
     float range = 0;
     // take multiple samples and calculate the average
     for (char i = 0; i < sonarMeasurementsPerPing; i++) {
+        ProfileScope scope(PROFILE_SONAR);
         range += 10 * sonar.getDistance_cm();
     }
     
     range /= sonarMeasurementsPerPing;
     sonarRange = (int) range;
     
+    TRACE2(PING, angle, sonarRange);
     reportPing(angle, sonarRange);
     
+    ProfileScope scope(PROFILE_LCD);
     m3pi.locate(0, 0);
     m3pi.printf("%d %d mm ", angle, sonarRange);
 }
@@ -370,10 +446,51 @@ void cmdSonarSweep(int startAngle, int endAngle, char stepSize) {
     reportCmdComplete();
 }
 
+/**
+ * sends the counters of all profiling zones and resets them
+ *
+ * the counters are reset before executeCommand() returns, so its zone starts
+ * over with the rest of this command
+ */
+void cmdProfile() {
+    for (char zone = 0; zone < PROFILE_ZONES; zone++) {
+        reportProfile(zone, Profiler::get(zone));
+    }
+    Profiler::reset();
+    
+    reportCmdComplete();
+}
+
 
 
 
 
+/**
+ * number of payload bytes a command carries before its terminator can follow
+ *
+ * the binary ints of a payload may contain a '\n', which must not end the command. 
+ * Only the text of SRLCMD_CMD_LCDWRITE comes after this fixed part, unknown commands 
+ * end at the first '\n' and are rejected by verifyCommand()
+ *
+ * @param char cmd
+ * @return int
+ */
+int payloadSize(char cmd) {
+    switch (cmd) {
+        case SRLCMD_CMD_TURNLEFT:
+        case SRLCMD_CMD_TURNRIGHT:
+        case SRLCMD_CMD_MOVEFORWARD:
+        case SRLCMD_CMD_MOVEBACKWARD:
+        case SRLCMD_CMD_SONARPING:
+            return 4;
+        case SRLCMD_CMD_LCDWRITE:
+            return 10;      // x and y with their separators, followed by the text
+        case SRLCMD_CMD_SONAR_SWEEP:
+            return 11;
+    }
+    return 0;
+}
+
 /**
  * processes serial-in character by character and assigns a new state to
  * the state-machine according to what is found.
@@ -386,13 +503,14 @@ void serialCallback() {
         && wixel.readable()) {
     
         inChar = wixel.getc();
-        //serialPort.printf("received: %c\n", inChar);
+        TRACE1(RECEIVED, inChar);
                 
         switch (cmdState) {
             case SRLCMD_STATE_IDLE:
                 if (inChar == SRLCMD_CHAR_START) {
                     cmdState = SRLCMD_STATE_WAITINGFORCMDBYTE;
                 } else {
+                    TRACE2(FRAME_ERROR, inChar, cmdState);
                     cmdState = SRLCMD_STATE_ERR;
                 }
                 break; 
@@ -406,14 +524,19 @@ void serialCallback() {
                 if (inChar == SRLCMD_CHAR_CMDSEP) {
                     cmdState = SRLCMD_STATE_WAITINGFORPAYLOAD;
                 } else {
+                    TRACE2(FRAME_ERROR, inChar, cmdState);
                     cmdState = SRLCMD_STATE_ERR;
                 }
                 break;
             
             case SRLCMD_STATE_WAITINGFORPAYLOAD:
-                if (inChar == SRLCMD_CHAR_END) {
+                if (inChar == SRLCMD_CHAR_END && cmdPayloadPos >= payloadSize(command)) {
                     // payload end has been reached
+                    cmdReceivedAt = us_ticker_read();
                     cmdState = SRLCMD_STATE_CMDAVAILABLE;
+                } else if (cmdPayloadPos == cmdPayloadSize) {
+                    TRACE2(FRAME_ERROR, inChar, cmdState);
+                    cmdState = SRLCMD_STATE_ERR;
                 } else {
                     // add inChar to payload for later processing
                     cmdPayload[cmdPayloadPos] = inChar;
@@ -437,12 +560,14 @@ void serialCallback() {
  * @return char
  */
 char processPayload(char cmd, char * payload, int payloadPos) {
+    ProfileScope scope(PROFILE_PAYLOAD);
     char processed = SRLCMD_STATE_ERR;
     
     // these are test commands to verify variable-type unpacking
     switch (cmd) {
         case SRLCMD_CMD_BATTERY:
         case SRLCMD_CMD_LCDCLEAR:
+        case SRLCMD_CMD_PROFILE:
             // no params at all
             if (payloadPos == 0) {
                 processed = SRLCMD_STATE_PROCESSED;
@@ -515,7 +640,7 @@ char processPayload(char cmd, char * payload, int payloadPos) {
             break;
     }
     
-    //serialPort.printf("processing payload for %c complete. result: %d\n", cmd, processed);
+    TRACE2(PAYLOAD, cmd, processed);
     return processed;
 }
 
@@ -527,8 +652,6 @@ char processPayload(char cmd, char * payload, int payloadPos) {
  * @return bool
  */
 bool verifyCommand(char cmd) {
-    //serialPort.printf("verifying command: %c\n", cmd);
-    
     bool verification = false;
     // @todo return true here for every command that your program accepts
     // you can also extend this to validate the parameters associated with each command
@@ -542,11 +665,12 @@ bool verifyCommand(char cmd) {
         case SRLCMD_CMD_LCDWRITE:
         case SRLCMD_CMD_SONARPING:
         case SRLCMD_CMD_SONAR_SWEEP:
+        case SRLCMD_CMD_PROFILE:
             verification = true;
             break;
     }
     
-    //serialPort.printf("verifying command %c complete, result: %b\n", cmd, verification);
+    TRACE2(VERIFY, cmd, verification);
     return verification;
 }
 
@@ -562,10 +686,11 @@ bool verifyCommand(char cmd) {
  * @return char
  */
 char executeCommand(char cmd) {
+    ProfileScope scope(PROFILE_EXECUTE);
     char execution = SRLCMD_STATE_ERR;
     // @todo implement executeCommand() by calling your custom handlers here
     //m3pi.locate(0, 0);
-    //serialPort.printf("executing command: %c\n", cmd);
+    TRACE1(EXECUTE, cmd);
     
     switch (cmd) {
         case SRLCMD_CMD_BATTERY:
@@ -605,9 +730,13 @@ char executeCommand(char cmd) {
             cmdSonarSweep(sonarStartAngle, sonarEndAngle, sonarStepSize);
             execution = SRLCMD_STATE_FINISHED;
             break;
+        case SRLCMD_CMD_PROFILE:
+            cmdProfile();
+            execution = SRLCMD_STATE_FINISHED;
+            break;
     }
     
-    //serialPort.printf("executing command %c complete. result: %d\n", cmd, execution);
+    TRACE2(EXECUTED, cmd, execution);
     return execution;
 }
 
@@ -632,6 +761,9 @@ void resetWixelEnd() {
  */
 int main() {
     
+    Profiler::init();
+    tracePort.baud(115200);
+    TRACE1(BOOT, SystemCoreClock);
     m3pi.reset();
     
     wixelResetButton.mode(PullUp);
@@ -661,11 +793,13 @@ int main() {
             case SRLCMD_STATE_CMDAVAILABLE:
                 // new command is ready for post processing
                 cmdState = processPayload(command, cmdPayload, cmdPayloadPos);
+                cmdParsedAt = us_ticker_read();
                 break;
             
             case SRLCMD_STATE_PROCESSED:
                 // execute
                 if (verifyCommand(command)) {
+                    cmdStartedAt = us_ticker_read();
                     cmdState = executeCommand(command);
                 } else {
                     cmdState = SRLCMD_STATE_ERR;
@@ -677,7 +811,7 @@ int main() {
                 command = SRLCMD_CMD_NOOP;
                 cmdPayloadPos = 0;
                 cmdState = SRLCMD_STATE_IDLE;
-                //serialPort.printf("cleaned up after command. new cmdState is now %c\n", cmdState);
+                TRACE1(CLEANUP, cmdState);
                 break;
             
             case SRLCMD_STATE_ERR:
@@ -687,10 +821,16 @@ int main() {
             break;
             
             // all other states are input-related and can be ignored here
+            default:
+                // nothing to do until the next command arrives, send some of the trace
+                Trace::drain(tracePort, 4);
+                break;
         }
         
-        m3pi.locate(0, 1);
-        m3pi.printf("%d:%c   ", cmdState, command);
-        
+        {
+            ProfileScope scope(PROFILE_LCD);
+            m3pi.locate(0, 1);
+            m3pi.printf("%d:%c   ", cmdState, command);
+        }
     }
 }
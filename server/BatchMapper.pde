@@ -0,0 +1,281 @@
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
+import java.util.concurrent.atomic.AtomicInteger;
+
+/**
+ * Rebuilds a map from recorded sessions without the window, the link or the
+ * MapWorker.
+ *
+ * Each session, a file written by LinkRecorder, is decoded on a thread of its
+ * own: the sent frames tell which command is in flight, the received bytes are
+ * parsed and applied to a SonarBot just like processLinkEvents() does, and every
+ * completed sonar command is located and stored in an ObservationStore of the
+ * session the way the MapWorker does it. The pose handling within a session is
+ * sequential, sessions are independent of each other. All sessions start at the
+ * origin, their stores are appended into one in the order they were given.
+ *
+ * The combined store is indexed by a MapRenderer and its tiles are then rendered
+ * on all cores: each thread takes the next tile that is left, integrates every
+ * ping reaching it into a tile buffer of its own with an OccupancyUpdater of its
+ * own and keeps the result. The pings of a tile are integrated in the order they
+ * were taken, so the map comes out the same as the interactive one, whatever the
+ * number of threads. The buffers are merged into the Landscape at the end and
+ * written to a new MapFile, which the sketch then starts on with --map.
+ */
+class BatchMapper {
+  private Landscape landscape;
+  private String localization;
+  private int threads;
+
+  /**
+   * @param Landscape l       the tiles are written into it, it should be empty
+   * @param String mode       how poses are corrected, see localization in server.pde
+   */
+  BatchMapper(Landscape l, String mode) {
+    this.landscape    = l;
+    this.localization = mode;
+    this.threads      = Runtime.getRuntime().availableProcessors();
+
+    if (mode.equals("particles")) {
+      println("particles need the live map, sessions are mapped by odometry");
+      this.localization = "odometry";
+    }
+  }
+
+  /**
+   * maps all sessions and saves the map
+   *
+   * @param String[] sessions     paths of the recordings
+   * @param String output         path of the map file
+   * @return boolean false if a session could not be read or the map could not be written
+   */
+  boolean run(String[] sessions, String output) {
+    ExecutorService pool = Executors.newFixedThreadPool(this.threads);
+    ArrayList<Future<ObservationStore>> decoded = new ArrayList<Future<ObservationStore>>();
+    ObservationStore store = new ObservationStore();
+    int begin = millis();
+    int decodedAt, renderedAt;
+
+    println("mapping " + sessions.length + " sessions on " + this.threads + " threads");
+
+    for (final String path : sessions) {
+      decoded.add(pool.submit(new Callable<ObservationStore>() {
+        public ObservationStore call() throws IOException {
+          return BatchMapper.this.decode(path);
+        }
+      }));
+    }
+
+    try {
+      for (int i = 0; i < sessions.length; i++) {
+        store.appendAll(decoded.get(i).get());
+      }
+      decodedAt = millis();
+
+      this.render(store, pool);
+      renderedAt = millis();
+    } catch (InterruptedException e) {
+      pool.shutdownNow();
+      return false;
+    } catch (ExecutionException e) {
+      println("unable to map: " + e.getCause().getMessage());
+      pool.shutdownNow();
+      return false;
+    }
+    pool.shutdown();
+
+    if (!this.save(output)) {
+      return false;
+    }
+
+    println("mapped " + store.size() + " pings at " + store.getPoseCount() + " poses into "
+            + this.landscape.getTileCount() + " tiles: decoded in " + (decodedAt - begin) + " ms, rendered in "
+            + (renderedAt - decodedAt) + " ms, saved in " + (millis() - renderedAt) + " ms");
+
+    return true;
+  }
+
+  /**
+   * replays one session into a store of its own
+   */
+  private ObservationStore decode(String path) throws IOException {
+    ObservationStore store = new ObservationStore();
+    SonarBot bot = new SonarBot(0, 0, 0.0, 5.0);
+    FrameParser parser = new FrameParser();
+    QueuedCommand inFlight = new QueuedCommand();
+    boolean waiting = false;
+    SonarSweep sweep = null;
+    LinkLogReader log = new LinkLogReader(path);
+    ScanMatcher matcher = null;
+    PoseGraph graph = null;
+    Response response;
+    int param;
+
+    if (this.localization.equals("scans") || this.localization.equals("graph")) {
+      matcher = new ScanMatcher();
+    }
+    if (this.localization.equals("graph")) {
+      graph = new PoseGraph(matcher, store);
+    }
+
+    try {
+      while (log.next()) {
+        if (log.direction == LinkRecorder.SENT) {
+          waiting = inFlight.decode(log.data, 0, log.length) || waiting;
+          continue;
+        }
+
+        for (int i = 0; i < log.length; i++) {
+          response = parser.parse(log.data[i]);
+
+          if (response instanceof PingResult) {
+            if (sweep == null) {
+              sweep = new SonarSweep();
+            }
+            sweep.add(new SonarReading(bot.getPosX(), bot.getPosY(), bot.getAngle(), (PingResult) response));
+
+          } else if (response instanceof CompletionResult && waiting) {
+            waiting = false;
+            param   = inFlight.paramCount > 0 ? inFlight.params[0] : 0;
+
+            if (inFlight.cmd == CommandQueue.CMD_TURNLEFT || inFlight.cmd == CommandQueue.CMD_TURNRIGHT) {
+              bot.rotate(param);
+            } else if (inFlight.cmd == CommandQueue.CMD_MOVEFORWARD) {
+              bot.move(param);
+            } else if (inFlight.cmd == CommandQueue.CMD_MOVEBACKWARD) {
+              bot.move(-param);
+            } else if (inFlight.cmd == CommandQueue.CMD_SONARPING || inFlight.cmd == CommandQueue.CMD_SONARSWEEP) {
+              if (sweep == null) {
+                sweep = new SonarSweep();
+              }
+              sweep.close(inFlight.cmd, bot.getPosX(), bot.getPosY(), bot.getAngle());
+              this.integrate(sweep, store, bot, matcher, graph);
+              sweep = null;
+            }
+          }
+        }
+      }
+    } finally {
+      log.close();
+    }
+
+    return store;
+  }
+
+  /**
+   * locates a sweep and stores it, the same as MapWorker.integrateSweep() and the
+   * correction of the bot in processLinkEvents()
+   */
+  private void integrate(SonarSweep sweep, ObservationStore store, SonarBot bot, ScanMatcher matcher, PoseGraph graph) {
+    PoseCorrection correction, moved;
+    int pose;
+
+    if (sweep.cmd != CommandQueue.CMD_SONARSWEEP) {
+      store.append(sweep, sweep.posX, sweep.posY, sweep.heading);
+      return;
+    }
+
+    correction = matcher != null ? matcher.locate(sweep) : new PoseCorrection(sweep.posX, sweep.posY, sweep.heading);
+    pose       = store.append(sweep, correction.toX, correction.toY, correction.toHeading);
+
+    if (graph != null) {
+      moved = graph.add(sweep, pose, correction);
+
+      if (moved.matched) {
+        matcher.relocate(moved);
+        correction.toX       = moved.toX;
+        correction.toY       = moved.toY;
+        correction.toHeading = moved.toHeading;
+      }
+    }
+
+    bot.correct(correction);
+  }
+
+  /**
+   * renders all tiles of the store on the pool and merges them into the Landscape
+   */
+  private void render(ObservationStore store, ExecutorService pool) throws InterruptedException, ExecutionException {
+    final MapRenderer renderer = new MapRenderer(store, this.landscape);
+    final ArrayList<Long> tiles;
+    final byte[][] results;
+    final AtomicInteger next = new AtomicInteger();
+    ArrayList<Future<Object>> workers = new ArrayList<Future<Object>>();
+    int cellX, cellY;
+    Long key;
+
+    renderer.indexAll();
+    tiles   = renderer.getTiles();
+    results = new byte[tiles.size()][];
+
+    for (int t = 0; t < this.threads; t++) {
+      workers.add(pool.submit(new Callable<Object>() {
+        public Object call() {
+          OccupancyUpdater updater = new OccupancyUpdater(BatchMapper.this.landscape);
+          int[] bounds = new int[4];
+          int i;
+          Long k;
+
+          while ((i = next.getAndIncrement()) < tiles.size()) {
+            k          = tiles.get(i);
+            results[i] = new byte[LandscapeTile.SIZE * LandscapeTile.SIZE];
+            renderer.renderTile((int) (k >> 32), (int) (long) k, updater, results[i], bounds);
+          }
+
+          return null;
+        }
+      }));
+    }
+
+    for (Future<Object> worker : workers) {
+      worker.get();
+    }
+
+    for (int i = 0; i < tiles.size(); i++) {
+      key   = tiles.get(i);
+      cellX = (int) (key >> 32) << LandscapeTile.SHIFT;
+      cellY = (int) (long) key << LandscapeTile.SHIFT;
+
+      for (int y = 0; y < LandscapeTile.SIZE; y++) {
+        for (int x = 0; x < LandscapeTile.SIZE; x++) {
+          if (results[i][(y << LandscapeTile.SHIFT) + x] != 0) {
+            this.landscape.setLogOdds(cellX + x, cellY + y, results[i][(y << LandscapeTile.SHIFT) + x]);
+          }
+        }
+      }
+      results[i] = null;
+    }
+  }
+
+  /**
+   * writes all tiles of the Landscape into a new MapFile, an existing file is replaced
+   */
+  private boolean save(String path) {
+    MapFile file;
+    int saved;
+
+    new File(path).delete();
+
+    try {
+      file = new MapFile(path);
+    } catch (IOException e) {
+      println("unable to write the map to " + path + ": " + e.getMessage());
+      return false;
+    }
+
+    this.landscape.attach(file);
+    saved = this.landscape.saveTiles();
+    file.close();
+
+    if (saved < this.landscape.getTileCount()) {
+      println("unable to write " + (this.landscape.getTileCount() - saved) + " tiles to " + path);
+      return false;
+    }
+
+    println("saved the map to " + path + ", " + file.size() / 1024 + " kB");
+    return true;
+  }
+}
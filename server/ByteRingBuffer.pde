@@ -0,0 +1,94 @@
+/**
+ * Fixed size ring buffer for raw bytes.
+ *
+ * Safe for exactly one producer thread (i.e. the serial library calling serialEvent())
+ * and one consumer thread (i.e. draw()) without locking: the producer only ever
+ * advances the head, the consumer only ever advances the tail.
+ *
+ * The capacity must be a power of two.
+ */
+class ByteRingBuffer {
+  private byte[] buffer;
+  private int mask;
+  private volatile int head;             // next position to write, only changed by the producer
+  private volatile int tail;             // next position to read, only changed by the consumer
+  private int droppedBytes;
+
+  /**
+   * @param int capacity     power of two
+   */
+  ByteRingBuffer(int capacity) {
+    this.buffer       = new byte[capacity];
+    this.mask         = capacity - 1;
+    this.head         = 0;
+    this.tail         = 0;
+    this.droppedBytes = 0;
+  }
+
+  /**
+   * @return int number of bytes that can be read
+   */
+  int available() {
+    return this.head - this.tail;
+  }
+
+  /**
+   * @return int number of bytes that can be written without dropping any
+   */
+  int free() {
+    return this.buffer.length - this.available();
+  }
+
+  /**
+   * @return int number of bytes that could not be stored because the buffer was full
+   */
+  int getDroppedBytes() {
+    return this.droppedBytes;
+  }
+
+  /**
+   * appends length bytes from data, starting at offset.
+   *
+   * bytes that do not fit are dropped and counted.
+   *
+   * @param byte[] data
+   * @param int offset
+   * @param int length
+   * @return int number of bytes stored
+   */
+  int write(byte[] data, int offset, int length) {
+    int h     = this.head;
+    int free  = this.buffer.length - (h - this.tail);
+    int count = min(length, free);
+
+    for (int i = 0; i < count; i++) {
+      this.buffer[(h + i) & this.mask] = data[offset + i];
+    }
+
+    this.droppedBytes += length - count;
+    this.head = h + count;               // publishes the bytes to the consumer
+
+    return count;
+  }
+
+  /**
+   * copies up to length bytes into data, starting at offset
+   *
+   * @param byte[] data
+   * @param int offset
+   * @param int length
+   * @return int number of bytes read
+   */
+  int read(byte[] data, int offset, int length) {
+    int t     = this.tail;
+    int count = min(length, this.head - t);
+
+    for (int i = 0; i < count; i++) {
+      data[offset + i] = this.buffer[(t + i) & this.mask];
+    }
+
+    this.tail = t + count;               // hands the space back to the producer
+
+    return count;
+  }
+}
@@ -1,19 +1,77 @@
-import java.nio.ByteBuffer;
-
-
+/**
+ * Queues commands for the robot and resolves its responses.
+ *
+ * processQueues() runs on the LinkThread. The cmd*() functions may be called from 
+ * any thread, they are serialized among each other but never block the link thread.
+ * Decoded responses are published to draw() through the events queue.
+ *
+ * Completions, timeouts and the other answers are never dropped: what does not
+ * fit into a full events queue waits in a backlog on the link thread, and no new
+ * command is sent until draw() caught up with it. Pings are dropped when they do
+ * not fit, the completion of their command then carries how many were lost so
+ * that draw() discards the whole group.
+ *
+ * With LinkStats set, the round-trip time of every command and the depths of
+ * both queues are measured as well.
+ *
+ * The firmware sends no completion for a frame it could not parse. A command
+ * whose completion has not arrived COMPLETION_TIMEOUT after the time it should
+ * take is given up: the commands queued behind it are dropped, as they were
+ * meant to follow from it, and a CommandTimeout is published instead.
+ *
+ * The robot may still be executing it though, and its completion carries nothing
+ * that tells which command it completes. So after a timeout the link is synced
+ * again before anything else is sent: a probe whose answer the timed out command
+ * cannot give, a battery request or a ping if a battery request timed out, is
+ * sent right away. The firmware only reads it once it is done with whatever it
+ * was doing, every completion and ping before the answer to the probe is
+ * discarded, and the completion that follows the answer ends the sync.
+ */
 class CommandQueue {
   private SerialConnection conn;
 
-  private ArrayList<ArrayList<Byte>> commandQueue;
-  private ArrayList<String> inputQueue;
+  /**
+   * ring of preallocated slots, the cmd*() functions encode their frames in place
+   * into the slot at commandQueueTail. 
+   *
+   * only the producers advance the tail, only the link thread advances the head
+   */
+  private QueuedCommand[] commandQueue;
+  private volatile int commandQueueHead;
+  private volatile int commandQueueTail;
+  private ArrayList<Response> inputQueue;
+  
+  /**
+   * responses handed to the render thread, drained by processLinkEvents() in draw()
+   */
+  EventQueue events;
+  private ArrayDeque<Object> eventBacklog;       // link thread side of events
+  private int droppedPings;                      // of the command in flight
   /** 
-   * the cmd*() functions will store the raw parameters in this buffer to
-   * allow access to the values again once the confirmation from the robot
-   * has been received without caching and unserializing the byte stream again
+   * copy of the command that has been sent last. 
+   *
+   * allows access to its raw parameters again once the confirmation from the 
+   * robot has been received without unserializing the byte stream again
    */
-  private ArrayList<ArrayList<Integer>> parameterBuffer;
+  private QueuedCommand inFlight;
+  
+  /**
+   * measures the link when set, on the link thread
+   */
+  LinkStats stats;
+  
+  /**
+   * gives up commands whose completion does not arrive, off while a LinkReplay
+   * plays back the completions of a log at its own pace
+   */
+  boolean timeouts;
+  
   char lastCommand;
   private boolean cmdProcessed;
+  private int deadline;                          // millis() by which the completion of inFlight is due
+  private QueuedCommand probe;
+  private char syncAnswer;                       // response type answering the probe, 0 while in sync
+  private boolean syncAnswered;
     
   final static char CMD_NOOP         = ' ';
   final static char CMD_BATTERY      = 'b';
@@ -25,19 +83,43 @@ class CommandQueue {
   final static char CMD_LCDWRITE     = 'w';
   final static char CMD_SONARPING    = 'p';
   final static char CMD_SONARSWEEP   = 's';
+  final static char CMD_PROFILE      = 'f';
+  
+  final static int COMMAND_QUEUE_CAPACITY = 64;  // power of two
+  final static int EVENT_QUEUE_CAPACITY   = 16384;
+  final static int LCD_MAX_TEXT           = 8;   // the m3pi LCD has 8 chars per line
+  
+  final static int COMPLETION_TIMEOUT     = 6000;  // in ms, longer than the 5 s the firmware pauses after a bad frame
+  final static float TURN_TIME            = 10.5;  // in ms per degree
+  final static float MOVE_TIME            = 14;    // in ms per mm
+  final static int PING_TIME              = 200;   // in ms, servo settling and five measurements
+  final static int SYNC_ANGLE             = 90;    // of the ping probe, straight ahead
   
   
   CommandQueue(SerialConnection c) {
-    this.commandQueue    = new ArrayList<ArrayList<Byte>>();
-    this.inputQueue      = new ArrayList<String>();
-    this.parameterBuffer = new ArrayList<ArrayList<Integer>>();
-    this.conn            = c;
-    this.lastCommand     = CommandQueue.CMD_NOOP;
-    this.cmdProcessed    = true;
+    this.commandQueue     = new QueuedCommand[CommandQueue.COMMAND_QUEUE_CAPACITY];
+    this.commandQueueHead = 0;
+    this.commandQueueTail = 0;
+    this.inputQueue       = new ArrayList<Response>();
+    this.events           = new EventQueue(CommandQueue.EVENT_QUEUE_CAPACITY);
+    this.eventBacklog     = new ArrayDeque<Object>();
+    this.droppedPings     = 0;
+    this.inFlight         = new QueuedCommand();
+    this.conn             = c;
+    this.lastCommand      = CommandQueue.CMD_NOOP;
+    this.cmdProcessed     = true;
+    this.timeouts         = true;
+    this.probe            = new QueuedCommand();
+    this.syncAnswer       = 0;
+    this.syncAnswered     = false;
+    
+    for (int i = 0; i < this.commandQueue.length; i++) {
+      this.commandQueue[i] = new QueuedCommand();
+    }
   }
   
   int getCommandQueueSize() {
-    return this.commandQueue.size();
+    return this.commandQueueTail - this.commandQueueHead;
   }
   
   int getInputQueueSize() {
@@ -45,16 +127,27 @@ class CommandQueue {
   }
   
   /**
-   * call this from draw()
+   * call this from the LinkThread
    *
    * will fetch all incoming data and store it in the input queue.
    *
    * after that both the input and the command queues are processed
    */
   void processQueues() {
+    this.flushEvents();
     this.readFromSerial();
+    
+    if (this.stats != null) {
+      this.stats.sampleQueues(this.getCommandQueueSize(), this.getInputQueueSize());
+    }
+    
     this.processInputQueue();
+    this.checkCompletionTimeout();
     this.processCommandQueue();
+    
+    if (this.stats != null) {
+      this.stats.tick();
+    }
   }
 
   /**
@@ -64,313 +157,205 @@ class CommandQueue {
    * no input processing is performed
    */
   private void readFromSerial() {
-    String response;
+    Response response;
     
     do {
       response = conn.readResponse();
       
-      if (!"".equals(response)) {
+      if (response != null) {
         this.inputQueue.add(response);
       }
-    } while(!"".equals(response));
+    } while(response != null);
   }
   
   /** 
    * processes every entry in the input queue
    */
   private void processInputQueue() {
-    String response;
-    String[] list;
+    Response response;
     
-    if (this.getInputQueueSize() > 0) {
-      println(this.inputQueue.size() + " lines in the input queue");
-
+    while (this.getInputQueueSize() > 0) {
       response = this.inputQueue.remove(0);
       
-      if (!"".equals(response)) {
-        list = splitTokens(response, ":,\n");
-        println("serial input: " + response);
-        println("last command: " + this.lastCommand);
-        
-        switch (this.lastCommand) {
-          case CommandQueue.CMD_BATTERY:
-            processCmdBatteryResponse(list);
-            break;
-          case CommandQueue.CMD_TURNLEFT:
-          case CommandQueue.CMD_TURNRIGHT:
-          case CommandQueue.CMD_MOVEFORWARD:
-          case CommandQueue.CMD_MOVEBACKWARD:
-          case CommandQueue.CMD_LCDCLEAR:
-          case CommandQueue.CMD_LCDWRITE:
-            break;
-          case CommandQueue.CMD_SONARPING:
-          case CommandQueue.CMD_SONARSWEEP:
-            processCmdSonarPingResponse(list);
-            break;          
-        }
-        
-        processCmdCompletion(list);
+      switch (response.type) {
+        case Response.TYPE_BATTERY:
+          processCmdBatteryResponse((BatteryResult) response);
+          break;
+        case Response.TYPE_PING:
+          processCmdSonarPingResponse((PingResult) response);
+          break;
+        case Response.TYPE_COMPLETE:
+          processCmdCompletion((CompletionResult) response);
+          break;
+        case Response.TYPE_PROFILE:
+          this.publish(response);
+          break;
+        default:
+          println("unknown response #" + response.type + " to command " + this.lastCommand);
       }
     }
   }
   
   /**
-   * if the serial connection is free the oldest
-   * command is sent
+   * hands an event to draw(), keeping it in the backlog if the events queue is full
+   * or older events are still waiting
+   *
+   * @param Object event
    */
-  private void processCommandQueue() {    
-    ArrayList<Byte> cmdString;
-    byte cmd;
-    
-    /*
-    if (this.commandQueue.size() > 0) {
-      println(this.commandQueue.size() + " commands in the queue");
-      
-      for (int i = 0; i < this.commandQueue.size(); i++) {
-        println(this.commandQueue.get(i));
-      }
-      
-      println("-----------");
-    }
-    */
-    if (this.commandQueue.size() > 0 && this.cmdProcessed) {
-      cmdString = this.commandQueue.remove(0);
-      cmd       = (byte) cmdString.get(1);
-      
-      println("sending command " + (char) cmd);
-      this.lastCommand = (char) cmd;
-                  
-      this.conn.write(cmdString);
-      this.cmdProcessed = false;
+  private void publish(Object event) {
+    if (!this.eventBacklog.isEmpty() || !this.events.offer(event)) {
+      this.eventBacklog.add(event);
     }
   }
   
   /**
-   * adds the given command with its parameters to the queue.
-   *
-   * returns true if the command was valid, false otherwise
-   *
-   * @param char cmd
-   * @param Object... params
-   * @return boolean
+   * hands the backlog on in order, as far as the events queue takes it
    */
-  boolean addCommand(char cmd, Object... params) {
-    boolean retval = false;
-    Integer i, x, y, a, b, s;
-    String t;
-    
-    switch(cmd) {
-      case CommandQueue.CMD_BATTERY:
-        retval = this.cmdBattery();
-        break;
-
-      case CommandQueue.CMD_TURNLEFT:
-        i = (Integer) params[0];
-        retval = this.cmdTurnLeft(i.intValue());
-        break;
-        
-      case CommandQueue.CMD_TURNRIGHT:
-        i = (Integer) params[0];
-        retval = this.cmdTurnRight(i.intValue());
-        break;
-        
-      case CommandQueue.CMD_MOVEFORWARD:
-        i = (Integer) params[0];
-        retval = this.cmdMoveForward(i.intValue());
-        break;
-        
-      case CommandQueue.CMD_MOVEBACKWARD:
-        i = (Integer) params[0];
-        retval = this.cmdMoveBackward(i.intValue());
-        break;
-        
-      case CommandQueue.CMD_LCDCLEAR:
-        retval = this.cmdLcdClear(); 
-        break;
-        
-      case CommandQueue.CMD_LCDWRITE:
-        x = (Integer) params[0];
-        y = (Integer) params[1];
-        t = (String)  params[2];
-        retval = this.cmdLcdWrite(x.intValue(), y.intValue(), t);
-        break;
-        
-      case CommandQueue.CMD_SONARPING:
-        i = (Integer) params[0];
-        retval = this.cmdSonarPing(i.intValue());
-        break;
-        
-      case CommandQueue.CMD_SONARSWEEP:
-        a = (Integer) params[0];
-        b = (Integer) params[1];
-        s = (Integer) params[2];
-        retval = this.cmdSonarSweep(a.intValue(), b.intValue(), s.intValue());
-        break;
-        
-      default:
+  private void flushEvents() {
+    while (!this.eventBacklog.isEmpty() && this.events.offer(this.eventBacklog.peek())) {
+      this.eventBacklog.poll();
     }
-    
-    return retval;
   }
   
-  
-  
-  
   /**
-   * converts each of the parameters into a representation that is transmittable over Serial
-   *
-   * @param Object... objects
-   * @return String
+   * if the serial connection is free and draw() keeps up with the events the
+   * oldest command is sent
    */
-  private ArrayList<Byte> serialize(Object... objects) {
-    ArrayList<Byte> retval = new ArrayList<Byte>();
-    byte[] tmp;
-    
-    for (Object o : objects) {
-      if (o.getClass().equals(Integer.class)) {
-        Integer i = (Integer) o;
-        tmp = this.makeSerialInt(i.intValue());
-        
-      } else if (o.getClass().equals(Float.class)) {
-        Float f = (Float) o;
-        tmp = this.makeSerialFloat(f.floatValue());
+  private void processCommandQueue() {    
+    QueuedCommand next;
+    int head = this.commandQueueHead;
+    
+    if (this.commandQueueTail != head && this.cmdProcessed && this.eventBacklog.isEmpty()) {
+      next = this.commandQueue[head & (this.commandQueue.length - 1)];
+      
+      // the slot is free for reuse once the head moves on, keep a copy for the completion
+      this.inFlight.copyFrom(next);
+      this.commandQueueHead = head + 1;
       
-      } else if (o.getClass().equals(Byte.class)) {
-        tmp = new byte[] {(byte) o};
-        
-      } else if (o.getClass().equals(String.class)) {
-        tmp = this.makeSerialString((String) o);
-        
-      } else if (o.getClass().equals(Character.class)) {
-        Character c = (Character) o;
-        tmp = new byte[]{(byte) c.charValue()};
-        
-      } else {
-        println("unrecognized type for serialization");
-        tmp = null;
+      if (this.conn.debug) {
+        println("sending command " + this.inFlight.cmd);
       }
+      this.lastCommand = this.inFlight.cmd;
+                  
+      this.conn.write(this.inFlight.frame, this.inFlight.length);
+      this.cmdProcessed = false;
+      this.deadline     = millis() + this.expectedDuration(this.inFlight) + CommandQueue.COMPLETION_TIMEOUT;
       
-      if (tmp != null) {
-        
-        for (Byte b : tmp) {
-          retval.add(b);
-        }
+      if (this.stats != null) {
+        this.stats.commandSent(this.inFlight.cmd);
       }
-    }  
-    
-    return retval;    
+    }
   }
   
-
   /**
-   * converts a Java int to four bytes and sends those individually, MSB first
-   *
-   * @param int number
-   * @return byte[]
+   * gives up the command in flight if its completion is overdue
    */
-  private byte[] makeSerialInt(int number) {
-    byte[] i = new byte[] {0,0,0,0};
+  private void checkCompletionTimeout() {
+    int dropped;
     
-    i[0] = (byte) (number >> 24);
-    i[1] = (byte) (number >> 16);
-    i[2] = (byte) (number >> 8);
-    i[3] = (byte) (number);
+    if (this.cmdProcessed || !this.timeouts || millis() - this.deadline < 0) {
+      return;
+    }
     
-    return i;    
-  }
+    if (this.syncAnswer != 0) {
+      println("no answer to the sync probe, sending it again");
+      this.sendProbe();
+      return;
+    }
+    
+    // the consumer may skip published slots, producers only ever look at the tail
+    dropped = this.getCommandQueueSize();
+    this.commandQueueHead += dropped;
+    
+    println("no completion for command " + this.inFlight.cmd + ", giving it up along with " + dropped + " queued commands");
+    this.publish(new CommandTimeout(this.inFlight.cmd, this.inFlight.paramCount > 0 ? this.inFlight.params[0] : 0));
+    this.droppedPings = 0;
     
+    if (this.inFlight.cmd == CommandQueue.CMD_BATTERY) {
+      this.probe.begin(CommandQueue.CMD_SONARPING).putInt(CommandQueue.SYNC_ANGLE).end();
+      this.syncAnswer = Response.TYPE_PING;
+    } else {
+      this.probe.begin(CommandQueue.CMD_BATTERY).end();
+      this.syncAnswer = Response.TYPE_BATTERY;
+    }
+    this.sendProbe();
+  }
+  
   /**
-   * converts a Java float to four bytes and sends those individually, MSB first
-   *
-   * @param int number
-   * @return byte[]
+   * sends the sync probe in place of a command, nothing else is sent until its
+   * completion arrived
    */
-    private byte[] makeSerialFloat(float number) {
-    return ByteBuffer.allocate(4).putFloat(number).array();
+  private void sendProbe() {
+    this.inFlight.copyFrom(this.probe);
+    this.lastCommand  = this.inFlight.cmd;
+    this.syncAnswered = false;
+    
+    this.conn.write(this.inFlight.frame, this.inFlight.length);
+    this.cmdProcessed = false;
+    this.deadline     = millis() + this.expectedDuration(this.inFlight) + CommandQueue.COMPLETION_TIMEOUT;
   }
   
   /**
-   * converts a Java String into its byte representation and sends those individually
-   *
-   * @param String text
-   * @return String
+   * @param QueuedCommand c
+   * @return int how long the robot takes to execute the command, in ms
    */
-    private byte[] makeSerialString(String text) {
-    int len = text.length();
-    byte[] s = new byte[len];
+  private int expectedDuration(QueuedCommand c) {
+    int steps;
     
-    for (int i = 0; i < len; i++) {
-      s[i] = byte(text.charAt(i));
+    switch (c.cmd) {
+      case CommandQueue.CMD_TURNLEFT:
+      case CommandQueue.CMD_TURNRIGHT:
+        return round(abs(c.params[0]) * CommandQueue.TURN_TIME);
+      case CommandQueue.CMD_MOVEFORWARD:
+      case CommandQueue.CMD_MOVEBACKWARD:
+        return round(abs(c.params[0]) * CommandQueue.MOVE_TIME);
+      case CommandQueue.CMD_SONARPING:
+        return CommandQueue.PING_TIME;
+      case CommandQueue.CMD_SONARSWEEP:
+        steps = c.params[2] != 0 ? 1 + abs((c.params[1] - c.params[0]) / c.params[2]) : 1;
+        return steps * CommandQueue.PING_TIME;
+      default:
+        return 0;
     }
-    
-    return s;
-  }    
-  
-  private float convertStringToFloat(String text) {
-    return this.convertBytesToFloat(this.convertStringToBytes(text));
-  }
-  
-  private int convertStringToInt(String text) {
-    return this.convertBytesToInt(this.convertStringToBytes(text));
-  }
-  
-  private byte[] convertStringToBytes(String text) {
-    return text.getBytes();
   }
   
   /**
-   * converts a four byte representation of a integer into a int primitive
+   * returns the next free slot of the command queue, null if the queue is full.
    *
-   * SHOULD NOT BE NECESSARY TO CALL THIS FROM HI-LEVEL FUNCTIONS
+   * the slot only becomes part of the queue once it is passed to enqueue()
    *
-   * @param byte[] b     expects a 4 byte array
-   * @return int
+   * @return QueuedCommand
    */
-  private int convertBytesToInt(byte[] b) {
-    byte[] f = new byte[]{b[0], b[1], b[2], b[3]};
-    return ByteBuffer.wrap(f).getInt();
+  private QueuedCommand nextFreeSlot() {
+    if (this.getCommandQueueSize() == this.commandQueue.length) {
+      println("command queue is full");
+      return null;
+    }
+    
+    return this.commandQueue[this.commandQueueTail & (this.commandQueue.length - 1)];
   }
   
   /**
-   * converts a four byte representation of a float into a float primitive
-   *
-   * SHOULD NOT BE NECESSARY TO CALL THIS FROM HI-LEVEL FUNCTIONS
-   *
-   * @param byte[] b     expects a 4 byte array
-   * @return float
+   * appends the slot returned by nextFreeSlot() to the queue, publishing it to the link thread
    */
-  private float convertBytesToFloat(byte[] b) {
-    byte[] f = new byte[]{b[0], b[1], b[2], b[3]};
-    return ByteBuffer.wrap(f).getFloat();
+  private void enqueue() {
+    this.commandQueueTail = this.commandQueueTail + 1;
   }
   
-    
-  
-  
-  
-  
-  
-  
-  
   /**
    * sends the request for battery voltage to the m3pi
    *
    * @return boolean
    */
-  private boolean cmdBattery() {
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_BATTERY)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .append(SerialConnection.SRLCMD_CHAR_END)
-          .toString()
-      )
-    );
+  synchronized boolean cmdBattery() {
+    QueuedCommand slot = this.nextFreeSlot();
+    
+    if (slot == null) {
+      return false;
+    }
+    
+    slot.begin(CommandQueue.CMD_BATTERY).end();
+    this.enqueue();
  
     return true;
   }
@@ -381,23 +366,16 @@ class CommandQueue {
    * @param int angle
    * @return boolean
    */
-  private boolean cmdTurnLeft(int angle) {
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    params.add(angle);
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_TURNLEFT)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .toString(),
-        angle, 
-        SerialConnection.SRLCMD_CHAR_END
-      )
-    );
+  synchronized boolean cmdTurnLeft(int angle) {
+    QueuedCommand slot = this.nextFreeSlot();
+    
+    if (slot == null) {
+      return false;
+    }
     
+    slot.begin(CommandQueue.CMD_TURNLEFT).putInt(angle).end();
+    this.enqueue();
+ 
     return true;
   }
   
@@ -407,23 +385,16 @@ class CommandQueue {
    * @param int angle
    * @return boolean
    */
-  private boolean cmdTurnRight(int angle) {
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    params.add(angle);
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_TURNRIGHT)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .toString(), 
-        angle, 
-        SerialConnection.SRLCMD_CHAR_END
-      )
-    );
+  synchronized boolean cmdTurnRight(int angle) {
+    QueuedCommand slot = this.nextFreeSlot();
     
+    if (slot == null) {
+      return false;
+    }
+    
+    slot.begin(CommandQueue.CMD_TURNRIGHT).putInt(angle).end();
+    this.enqueue();
+ 
     return true;
   }
   
@@ -433,23 +404,16 @@ class CommandQueue {
    * @param int distance
    * @return boolean
    */
-  private boolean cmdMoveForward(int distance) {
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    params.add(distance);
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_MOVEFORWARD)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .toString(), 
-        distance, 
-        SerialConnection.SRLCMD_CHAR_END
-      )
-    );
+  synchronized boolean cmdMoveForward(int distance) {
+    QueuedCommand slot = this.nextFreeSlot();
     
+    if (slot == null) {
+      return false;
+    }
+    
+    slot.begin(CommandQueue.CMD_MOVEFORWARD).putInt(distance).end();
+    this.enqueue();
+ 
     return true;
   }
   
@@ -459,23 +423,16 @@ class CommandQueue {
    * @param int distance
    * @return boolean
    */
-  private boolean cmdMoveBackward(int distance) {
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    params.add(distance);
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_MOVEBACKWARD)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .toString(), 
-        distance, 
-        SerialConnection.SRLCMD_CHAR_END
-      )
-    );
+  synchronized boolean cmdMoveBackward(int distance) {
+    QueuedCommand slot = this.nextFreeSlot();
     
+    if (slot == null) {
+      return false;
+    }
+    
+    slot.begin(CommandQueue.CMD_MOVEBACKWARD).putInt(distance).end();
+    this.enqueue();
+ 
     return true;
   }
   
@@ -484,21 +441,16 @@ class CommandQueue {
    *
    * @return boolean
    */
-  private boolean cmdLcdClear() {
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_LCDCLEAR)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .append(SerialConnection.SRLCMD_CHAR_END)
-          .toString()        
-      )
-    );
+  synchronized boolean cmdLcdClear() {
+    QueuedCommand slot = this.nextFreeSlot();
+    
+    if (slot == null) {
+      return false;
+    }
     
+    slot.begin(CommandQueue.CMD_LCDCLEAR).end();
+    this.enqueue();
+ 
     return true;
   }
   
@@ -511,32 +463,25 @@ class CommandQueue {
    * @param String text
    * @return boolean
    */
-  private boolean cmdLcdWrite(int x, int y, String text) {
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    params.add(x);
-    params.add(y);
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_LCDWRITE)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .toString(), 
-        x, 
-        SerialConnection.SRLCMD_CHAR_PAYLOADSEP, 
-        y, 
-        SerialConnection.SRLCMD_CHAR_PAYLOADSEP, 
-        text, 
-        SerialConnection.SRLCMD_CHAR_END
-      )
-    );
+  synchronized boolean cmdLcdWrite(int x, int y, String text) {
+    QueuedCommand slot = this.nextFreeSlot();
+    
+    if (slot == null) {
+      return false;
+    }
     
+    slot.begin(CommandQueue.CMD_LCDWRITE)
+      .putInt(x)
+      .separator()
+      .putInt(y)
+      .separator()
+      .putText(text, CommandQueue.LCD_MAX_TEXT)
+      .end();
+    this.enqueue();
+ 
     return true;
   }
   
-  
   /**
    * sends the request to perform a ranging 'ping' into the given
    * direction
@@ -544,23 +489,16 @@ class CommandQueue {
    * @param int angle
    * @return boolean
    */
-  private boolean cmdSonarPing(int angle) {  
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    params.add(angle);
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_SONARPING)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .toString(), 
-        angle, 
-        SerialConnection.SRLCMD_CHAR_END
-      )
-    );
+  synchronized boolean cmdSonarPing(int angle) {
+    QueuedCommand slot = this.nextFreeSlot();
     
+    if (slot == null) {
+      return false;
+    }
+    
+    slot.begin(CommandQueue.CMD_SONARPING).putInt(angle).end();
+    this.enqueue();
+ 
     return true;
   }
   
@@ -573,80 +511,125 @@ class CommandQueue {
    * @param int stepSize
    * @return boolean
    */
-  private boolean cmdSonarSweep(int startAngle, int endAngle, int stepSize) {
-    ArrayList<Integer> params = new ArrayList<Integer>();
-    params.add(startAngle);
-    params.add(endAngle);
-    params.add(stepSize);
-    this.parameterBuffer.add(params);
-    
-    this.commandQueue.add(
-      this.serialize(
-        new StringBuilder("")
-          .append(SerialConnection.SRLCMD_CHAR_START)
-          .append(CommandQueue.CMD_SONARSWEEP)
-          .append(SerialConnection.SRLCMD_CHAR_CMDSEP)
-          .toString(), 
-        startAngle, 
-        SerialConnection.SRLCMD_CHAR_PAYLOADSEP,
-        endAngle, 
-        SerialConnection.SRLCMD_CHAR_PAYLOADSEP, 
-        byte(stepSize), 
-        SerialConnection.SRLCMD_CHAR_END
-      )
-    );
+  synchronized boolean cmdSonarSweep(int startAngle, int endAngle, int stepSize) {
+    QueuedCommand slot = this.nextFreeSlot();
+    
+    if (slot == null) {
+      return false;
+    }
     
+    slot.begin(CommandQueue.CMD_SONARSWEEP)
+      .putInt(startAngle)
+      .separator()
+      .putInt(endAngle)
+      .separator()
+      .putByte(stepSize)
+      .end();
+    this.enqueue();
+ 
     return true;
-  }  
-  
-  
-  
-  
-  
-  
+  }
   
   
   
+  /**
+   * requests the cycle counters of the firmware's profiling zones, which are
+   * reset on the robot afterwards
+   *
+   * @return boolean
+   */
+  synchronized boolean cmdProfile() {
+    QueuedCommand slot = this.nextFreeSlot();
+    
+    if (slot == null) {
+      return false;
+    }
     
-  void processCmdCompletion(String[] list) {
-    ArrayList<Integer> buffer;
+    slot.begin(CommandQueue.CMD_PROFILE).end();
+    this.enqueue();
+ 
+    return true;
+  }
+  
+  /**
+   * queues a frame as it has been sent before, i.e. by a LinkReplay
+   *
+   * @param byte[] data
+   * @param int offset
+   * @param int length
+   * @return boolean false if the frame is no known command or the queue is full
+   */
+  synchronized boolean cmdFrame(byte[] data, int offset, int length) {
+    QueuedCommand slot = this.nextFreeSlot();
     
-    if (list[0].charAt(1) == 'K') {
+    if (slot == null || !slot.decode(data, offset, length)) {
+      return false;
+    }
+    this.enqueue();
+ 
+    return true;
+  }
+  
+  void processCmdCompletion(CompletionResult response) {
+    if (this.conn.debug) {
       println("processing for command " + this.lastCommand + " complete");
-      buffer = this.parameterBuffer.remove(0);
-      
-      if (this.lastCommand == CommandQueue.CMD_TURNLEFT
-          || this.lastCommand == CommandQueue.CMD_TURNRIGHT) {
-        bot.rotate(buffer.get(0).intValue());
-            
-      } else if (this.lastCommand == CommandQueue.CMD_MOVEFORWARD) {
-        bot.move(buffer.get(0).intValue());
+    }
+    if (this.syncAnswer != 0) {
+      if (!this.syncAnswered) {
+        println("discarding a completion that arrived after its command timed out");
+        return;
       }
       
-      this.lastCommand = CommandQueue.CMD_NOOP;
+      println("link synced again");
+      this.syncAnswer   = 0;
+      this.lastCommand  = CommandQueue.CMD_NOOP;
       this.cmdProcessed = true;
+      return;
+    }
+    
+    if (this.cmdProcessed) {
+      println("unexpected completion, no command in flight");
+      return;
+    }
+    
+    if (this.stats != null) {
+      this.stats.commandCompleted(response);
     }
+    
+    response.cmd   = this.inFlight.cmd;
+    response.param = this.inFlight.paramCount > 0 ? this.inFlight.params[0] : 0;
+    response.droppedPings = this.droppedPings;
+    this.publish(response);
+    this.droppedPings = 0;
+    
+    this.lastCommand = CommandQueue.CMD_NOOP;
+    this.cmdProcessed = true;
   }
   
-  void processCmdBatteryResponse(String[] list) {
-    if (list[0].charAt(1) == 'B') {
-      float v = this.convertStringToFloat(list[1]);
-      println(v);
-      bot.setVoltage(v);
+  void processCmdBatteryResponse(BatteryResult response) {
+    if (this.conn.debug) {
+      println("battery: " + response.volts + " V");
     }
+    if (this.syncAnswer == Response.TYPE_BATTERY) {
+      this.syncAnswered = true;
+    }
+    this.publish(response);
   }
   
-  void processCmdSonarPingResponse(String[] list) {  
-    if (list[0].charAt(1) == 'P') {
-      int angle = this.convertStringToInt(list[1]);
-      int range = this.convertStringToInt(list[2]);
-      println("angle: "+ angle + " range: " + range);
-      
-      if (this.lastCommand == CommandQueue.CMD_SONARPING) {
-        this.lastCommand = CommandQueue.CMD_NOOP;
-      }
-    } else if (list[0].charAt(1) == 'K' && this.lastCommand == CommandQueue.CMD_SONARSWEEP) {
-      this.lastCommand = CommandQueue.CMD_NOOP;
+  void processCmdSonarPingResponse(PingResult response) {  
+    if (this.conn.debug) {
+      println("angle: "+ response.angle + " range: " + response.range);
+    }
+    
+    // late pings of a timed out command, or the answer to the probe
+    if (this.syncAnswer != 0) {
+      this.syncAnswered = this.syncAnswered || this.syncAnswer == Response.TYPE_PING;
+      return;
+    }
+    
+    // the pings of a command are only worth anything together, see droppedPings
+    if (!this.eventBacklog.isEmpty() || !this.events.offer(response)) {
+      this.droppedPings++;
     }
   }
 }
\ No newline at end of file
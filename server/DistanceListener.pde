@@ -0,0 +1,15 @@
+/**
+ * Gets notified by the DistanceMap whenever the distance of a cell to its closest
+ * obstacle changes.
+ *
+ * Called on the map worker thread while the distance map is being updated, the
+ * distances may still be in flux. Listeners should only note the cell and read
+ * the clearance once the update is done.
+ */
+interface DistanceListener {
+  /**
+   * @param int x         cell of the distance map level
+   * @param int y         cell of the distance map level
+   */
+  void clearanceChanged(int x, int y);
+}
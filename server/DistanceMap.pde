@@ -0,0 +1,474 @@
+/**
+ * Keeps the Euclidean distance of every cell to its closest obstacle up to date.
+ *
+ * Works on a window of WINDOW x WINDOW cells of the pyramid level LEVEL (40mm per
+ * cell, about 20m across), a cell counts as an obstacle if the max-pooled log-odds
+ * of the Landscape are above OCCUPIED_LOGODDS. Unknown cells are free.
+ *
+ * The distances are maintained with the dynamic brushfire algorithm of Lau et al.:
+ * every cell remembers its closest obstacle. A new obstacle starts a lowering
+ * wave that only spreads as long as it brings cells closer to an obstacle. A
+ * removed obstacle starts a raising wave that resets the cells that pointed to it
+ * and stops at cells that have another valid obstacle, which then lower the reset
+ * cells again. Only cells whose distance actually changes are ever touched, so a
+ * sweep costs about as much as the area it changes.
+ *
+ * Occupancy changes are collected from the Landscape as they happen and the waves
+ * are run once per pass of the MapWorker. Lookups are an array access.
+ *
+ * The window only moves when a range that has to be covered sticks out of it, and
+ * is then centered on that range so that it stays put for a while. Moving shifts
+ * what is known along: only the obstacles of the strip that comes into view are
+ * read from the Landscape, cells whose closest obstacle left the window start a
+ * raising wave, and the waves spread into the new strip from its border.
+ */
+class DistanceMap implements Runnable, LandscapeListener {
+  final static int LEVEL            = 2;
+  final static int WINDOW_SHIFT     = 9;
+  final static int WINDOW           = 1 << DistanceMap.WINDOW_SHIFT;  // in cells
+  final static int OCCUPIED_LOGODDS = 10;         // cells above this are obstacles
+  final static int NONE             = -1;
+  final static int FAR              = Integer.MAX_VALUE;
+
+  private Landscape landscape;
+  private float cellSize;                         // in mm
+
+  /**
+   * cell coordinates of the top left cell of the window
+   */
+  private int originX;
+  private int originY;
+
+  private boolean[] occupied;
+  private int[] closest;                          // index of the closest obstacle, NONE if there is none
+  private int[] distances;                        // squared distance to it in cells, FAR if there is none
+  private boolean[] raise;
+  private IndexedHeap open;
+
+  private ArrayList<DistanceListener> listeners;
+
+  DistanceMap(Landscape l) {
+    int cells = DistanceMap.WINDOW * DistanceMap.WINDOW;
+
+    this.landscape = l;
+    this.cellSize  = l.CELL_SIZE << DistanceMap.LEVEL;
+    this.occupied  = new boolean[cells];
+    this.closest   = new int[cells];
+    this.distances = new int[cells];
+    this.raise     = new boolean[cells];
+    this.open      = new IndexedHeap(cells);
+    this.listeners = new ArrayList<DistanceListener>();
+
+    // home in the center
+    this.originX = -DistanceMap.WINDOW / 2;
+    this.originY = -DistanceMap.WINDOW / 2;
+    this.load();
+  }
+
+  /**
+   * @param DistanceListener listener
+   */
+  void addListener(DistanceListener listener) {
+    this.listeners.add(listener);
+  }
+
+  /**
+   * @return float edge length of a cell in mm
+   */
+  float getCellSize() {
+    return this.cellSize;
+  }
+
+  /**
+   * distance from the center of a cell to the closest point an obstacle in another
+   * cell may be at, i.e. how far the center of a robot in that cell can be from
+   * anything it may bump into
+   *
+   * @param int x         cell of the distance map level
+   * @param int y         cell of the distance map level
+   * @return float clearance in mm, infinite if there is no obstacle in the window
+   */
+  float getClearance(int x, int y) {
+    int wx = x - this.originX;
+    int wy = y - this.originY;
+    int d;
+
+    if (!this.inWindow(wx, wy)) {
+      return Float.POSITIVE_INFINITY;
+    }
+
+    d = this.distances[this.index(wx, wy)];
+
+    if (d == DistanceMap.FAR) {
+      return Float.POSITIVE_INFINITY;
+    }
+
+    return max(0, (sqrt(d) - 0.5 * sqrt(2)) * this.cellSize);
+  }
+
+  /**
+   * @param int x         cell of the distance map level
+   * @param int y         cell of the distance map level
+   * @return float distance between the centers of the cell and the closest obstacle
+   *               in mm, infinite if there is no obstacle in the window
+   */
+  float getDistance(int x, int y) {
+    int wx = x - this.originX;
+    int wy = y - this.originY;
+    int d;
+
+    if (!this.inWindow(wx, wy)) {
+      return Float.POSITIVE_INFINITY;
+    }
+
+    d = this.distances[this.index(wx, wy)];
+
+    return d == DistanceMap.FAR ? Float.POSITIVE_INFINITY : sqrt(d) * this.cellSize;
+  }
+
+  /**
+   * follows a ray until it enters an obstacle.
+   *
+   * the distances make this a sphere trace: nothing is closer than the distance
+   * of the current cell less the extent of two cells, so the ray can skip ahead
+   * by that much. Only reads the distances, may be called from several threads as long
+   * as the map is not updated at the same time
+   *
+   * @param float x           start of the ray in mm
+   * @param float y           in mm
+   * @param float direction   in radians
+   * @param float maxRange    in mm
+   * @return float distance to the first obstacle in mm, maxRange if there is none
+   */
+  float castRay(float x, float y, float direction, float maxRange) {
+    float dx = cos(direction);
+    float dy = sin(direction);
+    float t  = 0;
+    float d;
+
+    while (t < maxRange) {
+      d = this.getDistance(this.cellOf(x + t * dx), this.cellOf(y + t * dy));
+
+      if (d < 0.5 * this.cellSize) {
+        return t;
+      }
+      t += max(d - 1.5 * this.cellSize, 0.5 * this.cellSize);
+    }
+
+    return maxRange;
+  }
+
+  /**
+   * @param float x       in mm
+   * @param float y       in mm
+   * @return float clearance in mm of the cell the position is in
+   */
+  float getClearanceAt(float x, float y) {
+    return this.getClearance(this.cellOf(x), this.cellOf(y));
+  }
+
+  /**
+   * @param float mm
+   * @return int cell of the distance map level a position is in
+   */
+  int cellOf(float mm) {
+    return round(mm / this.landscape.CELL_SIZE) >> DistanceMap.LEVEL;
+  }
+
+  /**
+   * @param int cell      of the distance map level
+   * @return float position of the center of the cell in mm
+   */
+  float centerOf(int cell) {
+    return ((cell << DistanceMap.LEVEL) + ((1 << DistanceMap.LEVEL) - 1) / 2.0) * this.landscape.CELL_SIZE;
+  }
+
+  /**
+   * moves the window if the given range of cells is not inside it and recomputes
+   * all distances
+   *
+   * @return boolean true if the window has been moved
+   */
+  boolean cover(int minX, int minY, int maxX, int maxY) {
+    if (minX >= this.originX && minY >= this.originY
+        && maxX < this.originX + DistanceMap.WINDOW && maxY < this.originY + DistanceMap.WINDOW) {
+      return false;
+    }
+
+    this.shift(((minX + maxX) >> 1) - DistanceMap.WINDOW / 2 - this.originX,
+               ((minY + maxY) >> 1) - DistanceMap.WINDOW / 2 - this.originY);
+
+    return true;
+  }
+
+  /**
+   * runs the waves of all occupancy changes collected since the last pass
+   */
+  public void run() {
+    this.update();
+  }
+
+  /**
+   * notes cells turning into obstacles and back
+   */
+  public void cellChanged(int x, int y, byte previous, byte logOdds) {
+    int cx = x >> DistanceMap.LEVEL;
+    int cy = y >> DistanceMap.LEVEL;
+    int wx = cx - this.originX;
+    int wy = cy - this.originY;
+    boolean occ;
+
+    if (!this.inWindow(wx, wy)) {
+      return;
+    }
+
+    occ = this.landscape.getLevelLogOdds(DistanceMap.LEVEL, cx, cy) > DistanceMap.OCCUPIED_LOGODDS;
+
+    if (occ && !this.occupied[this.index(wx, wy)]) {
+      this.setObstacle(this.index(wx, wy));
+    } else if (!occ && this.occupied[this.index(wx, wy)]) {
+      this.removeObstacle(this.index(wx, wy));
+    }
+  }
+
+  /**
+   * notes the obstacles of a tile read from the MapFile, as far as it is in the window
+   */
+  public void tileLoaded(int tileX, int tileY) {
+    int shift = LandscapeTile.SHIFT - DistanceMap.LEVEL;
+
+    for (int y = 0; y < 1 << shift; y++) {
+      for (int x = 0; x < 1 << shift; x++) {
+        this.cellChanged(((tileX << shift) + x) << DistanceMap.LEVEL, ((tileY << shift) + y) << DistanceMap.LEVEL, (byte) 0, (byte) 0);
+      }
+    }
+  }
+
+  /**
+   * moves the window by dx/dy cells and updates only what the move changes, reads
+   * the whole window again if it moves too far to keep anything
+   */
+  private void shift(int dx, int dy) {
+    int w = DistanceMap.WINDOW;
+    int xlo = max(0, -dx);                        // range of the new window that was in the old one
+    int xhi = min(w, w - dx);
+    int ylo = max(0, -dy);
+    int yhi = min(w, w - dy);
+    int s, c, ox, oy;
+
+    this.originX += dx;
+    this.originY += dy;
+
+    if (xlo >= xhi || ylo >= yhi) {
+      this.load();
+      return;
+    }
+
+    // the waves of the old window are finished first, their cells are about to move
+    this.update();
+
+    // rows are moved in the order that reads every old row before it is overwritten
+    for (int i = 0; i < w; i++) {
+      int y = dy > 0 ? i : w - 1 - i;
+      int to = this.index(0, y);
+
+      if (y < ylo || y >= yhi) {
+        this.resetCells(to, to + w);
+        continue;
+      }
+
+      int from = this.index(xlo + dx, y + dy);
+      System.arraycopy(this.occupied, from, this.occupied, to + xlo, xhi - xlo);
+      System.arraycopy(this.closest, from, this.closest, to + xlo, xhi - xlo);
+      System.arraycopy(this.distances, from, this.distances, to + xlo, xhi - xlo);
+      this.resetCells(to, to + xlo);
+      this.resetCells(to + xhi, to + w);
+    }
+
+    for (int y = 0; y < w; y++) {
+      for (int x = 0; x < w; x++) {
+        s = this.index(x, y);
+
+        if (x < xlo || x >= xhi || y < ylo || y >= yhi) {
+          // came into view
+          if (this.landscape.getLevelLogOdds(DistanceMap.LEVEL, this.originX + x, this.originY + y) > DistanceMap.OCCUPIED_LOGODDS) {
+            this.setObstacle(s);
+          }
+          continue;
+        }
+
+        c = this.closest[s];
+        if (c == DistanceMap.NONE) {
+          continue;
+        }
+
+        ox = (c & (w - 1)) - dx;
+        oy = (c >> DistanceMap.WINDOW_SHIFT) - dy;
+
+        if (!this.inWindow(ox, oy)) {
+          // the obstacle left the window, like a removed one
+          this.clearCell(s);
+          this.raise[s] = true;
+          this.open.insert(s, 0, 0);
+        } else {
+          this.closest[s] = this.index(ox, oy);
+
+          // the border of what was known lowers the new cells
+          if ((x == xlo && xlo > 0) || (x == xhi - 1 && xhi < w) || (y == ylo && ylo > 0) || (y == yhi - 1 && yhi < w)) {
+            this.open.insert(s, this.distances[s], 0);
+          }
+        }
+      }
+    }
+
+    this.update();
+  }
+
+  /**
+   * resets a range of cells to free and without an obstacle in reach
+   */
+  private void resetCells(int from, int to) {
+    java.util.Arrays.fill(this.occupied, from, to, false);
+    java.util.Arrays.fill(this.closest, from, to, DistanceMap.NONE);
+    java.util.Arrays.fill(this.distances, from, to, DistanceMap.FAR);
+  }
+
+  /**
+   * reads all obstacles of the window from the Landscape and runs the brushfire
+   */
+  private void load() {
+    java.util.Arrays.fill(this.occupied, false);
+    java.util.Arrays.fill(this.closest, DistanceMap.NONE);
+    java.util.Arrays.fill(this.distances, DistanceMap.FAR);
+    java.util.Arrays.fill(this.raise, false);
+    this.open.clear();
+
+    for (int y = 0; y < DistanceMap.WINDOW; y++) {
+      for (int x = 0; x < DistanceMap.WINDOW; x++) {
+        if (this.landscape.getLevelLogOdds(DistanceMap.LEVEL, this.originX + x, this.originY + y) > DistanceMap.OCCUPIED_LOGODDS) {
+          this.setObstacle(this.index(x, y));
+        }
+      }
+    }
+
+    this.update();
+  }
+
+  private void setObstacle(int s) {
+    this.occupied[s]  = true;
+    this.closest[s]   = s;
+    this.distances[s] = 0;
+    this.raise[s]     = false;
+    this.open.insert(s, 0, 0);
+    this.changed(s);
+  }
+
+  private void removeObstacle(int s) {
+    this.occupied[s] = false;
+    this.clearCell(s);
+    this.raise[s] = true;
+    this.open.insert(s, 0, 0);
+  }
+
+  private void clearCell(int s) {
+    this.closest[s]   = DistanceMap.NONE;
+    this.distances[s] = DistanceMap.FAR;
+    this.changed(s);
+  }
+
+  /**
+   * processes the open cells in the order of their distance
+   */
+  private void update() {
+    int s;
+
+    while (!this.open.isEmpty()) {
+      s = this.open.top();
+      this.open.remove(s);
+
+      if (this.raise[s]) {
+        this.raise(s);
+      } else if (this.closest[s] != DistanceMap.NONE && this.occupied[this.closest[s]]) {
+        this.lower(s);
+      }
+    }
+  }
+
+  /**
+   * resets the neighbours whose closest obstacle is gone and queues those that
+   * still have a valid one to lower the reset cells again
+   */
+  private void raise(int s) {
+    int sx = s & (DistanceMap.WINDOW - 1);
+    int sy = s >> DistanceMap.WINDOW_SHIFT;
+    int n;
+
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        if ((dx == 0 && dy == 0) || !this.inWindow(sx + dx, sy + dy)) {
+          continue;
+        }
+        n = this.index(sx + dx, sy + dy);
+
+        if (this.closest[n] != DistanceMap.NONE && !this.raise[n]) {
+          this.open.insert(n, this.distances[n], 0);
+
+          if (!this.occupied[this.closest[n]]) {
+            this.clearCell(n);
+            this.raise[n] = true;
+          }
+        }
+      }
+    }
+
+    this.raise[s] = false;
+  }
+
+  /**
+   * passes the closest obstacle of s on to the neighbours it is closer to
+   */
+  private void lower(int s) {
+    int sx = s & (DistanceMap.WINDOW - 1);
+    int sy = s >> DistanceMap.WINDOW_SHIFT;
+    int ox = this.closest[s] & (DistanceMap.WINDOW - 1);
+    int oy = this.closest[s] >> DistanceMap.WINDOW_SHIFT;
+    int n, d;
+
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        if ((dx == 0 && dy == 0) || !this.inWindow(sx + dx, sy + dy)) {
+          continue;
+        }
+        n = this.index(sx + dx, sy + dy);
+
+        if (!this.raise[n]) {
+          d = (sx + dx - ox) * (sx + dx - ox) + (sy + dy - oy) * (sy + dy - oy);
+
+          if (d < this.distances[n]) {
+            this.distances[n] = d;
+            this.closest[n]   = this.closest[s];
+            this.open.insert(n, d, 0);
+            this.changed(n);
+          }
+        }
+      }
+    }
+  }
+
+  private void changed(int s) {
+    int x = (s & (DistanceMap.WINDOW - 1)) + this.originX;
+    int y = (s >> DistanceMap.WINDOW_SHIFT) + this.originY;
+
+    for (int i = 0; i < this.listeners.size(); i++) {
+      this.listeners.get(i).clearanceChanged(x, y);
+    }
+  }
+
+  private boolean inWindow(int x, int y) {
+    return x >= 0 && y >= 0 && x < DistanceMap.WINDOW && y < DistanceMap.WINDOW;
+  }
+
+  private int index(int x, int y) {
+    return (y << DistanceMap.WINDOW_SHIFT) + x;
+  }
+}
@@ -0,0 +1,82 @@
+/**
+ * Lock-free queue to hand objects from exactly one producer thread to exactly one 
+ * consumer thread, i.e. decoded responses from the LinkThread to draw().
+ *
+ * The producer only ever advances the head, the consumer only ever advances the 
+ * tail. Publishing is a single volatile write, neither side ever blocks. When the 
+ * queue is full new objects are dropped and counted.
+ *
+ * The capacity must be a power of two.
+ */
+class EventQueue {
+  private Object[] events;
+  private int mask;
+  private volatile int head;             // next position to write, only changed by the producer
+  private volatile int tail;             // next position to read, only changed by the consumer
+  private int droppedEvents;
+
+  /**
+   * @param int capacity     power of two
+   */
+  EventQueue(int capacity) {
+    this.events        = new Object[capacity];
+    this.mask          = capacity - 1;
+    this.head          = 0;
+    this.tail          = 0;
+    this.droppedEvents = 0;
+  }
+
+  /**
+   * appends an object, call this from the producer thread only
+   *
+   * @param Object event
+   * @return boolean false if the queue was full and the event has been dropped
+   */
+  boolean offer(Object event) {
+    int h = this.head;
+
+    if (h - this.tail == this.events.length) {
+      this.droppedEvents++;
+      return false;
+    }
+
+    this.events[h & this.mask] = event;
+    this.head = h + 1;                   // publishes the event to the consumer
+
+    return true;
+  }
+
+  /**
+   * removes the oldest object, call this from the consumer thread only
+   *
+   * @return Object null if the queue is empty
+   */
+  Object poll() {
+    int t = this.tail;
+    Object event;
+
+    if (t == this.head) {
+      return null;
+    }
+
+    event = this.events[t & this.mask];
+    this.events[t & this.mask] = null;   // don't keep the event alive
+    this.tail = t + 1;                   // hands the slot back to the producer
+
+    return event;
+  }
+
+  /**
+   * @return int number of queued objects
+   */
+  int size() {
+    return this.head - this.tail;
+  }
+
+  /**
+   * @return int number of objects dropped because the queue was full
+   */
+  int getDroppedEvents() {
+    return this.droppedEvents;
+  }
+}
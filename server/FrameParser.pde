@@ -0,0 +1,225 @@
+/**
+ * State machine that turns the raw byte stream from the robot into decoded Responses.
+ *
+ * Responses have the format
+ *   "#K:[times]\n"               for completion confirmations, "#K\n" from older firmware
+ *   "#[type]:[payload]\n"        for everything else
+ *
+ * Payloads are binary. For the known response types the payload length is fixed,
+ * so the parser counts bytes instead of looking for the '\n' terminator. A payload
+ * byte that happens to be 0x0a therefore does not end a frame early.
+ *
+ * Known response types are decoded straight from the payload bytes into
+ * PingResult, BatteryResult and CompletionResult, anything else is passed on as
+ * a raw ResponseFrame.
+ *
+ * When unexpected bytes are received the current frame is dropped and the parser
+ * skips everything up to the next '#' to get back in sync.
+ */
+class FrameParser {
+  private static final byte STATE_IDLE               = 0;  // waiting for the '#' start char
+  private static final byte STATE_WAITINGFORTYPEBYTE = 1;  // received '#', waiting for the response type
+  private static final byte STATE_TYPEBYTERECEIVED   = 2;  // received type, expecting ':' (or '\n' for an untimed #K)
+  private static final byte STATE_WAITINGFORPAYLOAD  = 3;  // received ':', collecting payload bytes
+  private static final byte STATE_WAITINGFOREND      = 4;  // payload complete, expecting '\n'
+  private static final byte STATE_RESYNC             = 5;  // dropping bytes until the next '#'
+
+  static final int ARG_LENGTH     = 4;                      // ints and floats are sent as 4 bytes
+  static final int MAX_PAYLOAD    = 64;
+  static final int PAYLOAD_ANY    = -1;                     // unknown type, payload ends at '\n'
+
+  private byte state;
+  private char type;
+  private byte[] payload;
+  private int payloadPos;
+  private int payloadLength;
+
+  private int frameCount;
+  private int parseErrors;
+  private int resyncs;
+
+  FrameParser() {
+    this.state       = FrameParser.STATE_IDLE;
+    this.payload     = new byte[FrameParser.MAX_PAYLOAD];
+    this.payloadPos  = 0;
+    this.frameCount  = 0;
+    this.parseErrors = 0;
+    this.resyncs     = 0;
+  }
+
+  /**
+   * number of payload bytes that follow the ':' separator for the given response type
+   *
+   * @param char t
+   * @return int
+   */
+  int payloadLength(char t) {
+    switch (t) {
+      case Response.TYPE_COMPLETE:
+        return 4 * FrameParser.ARG_LENGTH;        // [received][parsed][started][finished]
+      case Response.TYPE_PING:
+        return 2 * FrameParser.ARG_LENGTH + 1;    // [angle],[range]
+      case Response.TYPE_BATTERY:
+        return FrameParser.ARG_LENGTH;            // [voltage]
+      case Response.TYPE_PROFILE:
+        return 1 + 5 * FrameParser.ARG_LENGTH;    // [zone][count][min][max][total]
+      default:
+        return FrameParser.PAYLOAD_ANY;
+    }
+  }
+
+  /**
+   * feeds a single byte into the state machine
+   *
+   * @param byte b
+   * @return Response the response completed by this byte, null otherwise
+   */
+  Response parse(byte b) {
+    char inChar = (char) (b & 0xFF);
+    Response frame = null;
+
+    switch (this.state) {
+      case FrameParser.STATE_IDLE:
+      case FrameParser.STATE_RESYNC:
+        if (inChar == SerialConnection.SRLCMD_CHAR_START) {
+          if (this.state == FrameParser.STATE_RESYNC) {
+            this.resyncs++;
+          }
+          this.payloadPos = 0;
+          this.state = FrameParser.STATE_WAITINGFORTYPEBYTE;
+        } else if (this.state == FrameParser.STATE_IDLE) {
+          this.error(inChar);
+        }
+        break;
+
+      case FrameParser.STATE_WAITINGFORTYPEBYTE:
+        this.type          = inChar;
+        this.payloadLength = this.payloadLength(inChar);
+        this.state         = FrameParser.STATE_TYPEBYTERECEIVED;
+        break;
+
+      case FrameParser.STATE_TYPEBYTERECEIVED:
+        if (inChar == SerialConnection.SRLCMD_CHAR_CMDSEP) {
+          this.state = this.payloadLength == 0 ? FrameParser.STATE_WAITINGFOREND : FrameParser.STATE_WAITINGFORPAYLOAD;
+        } else if (inChar == SerialConnection.SRLCMD_CHAR_END && this.type == Response.TYPE_COMPLETE) {
+          frame = this.complete();
+        } else {
+          this.error(inChar);
+        }
+        break;
+
+      case FrameParser.STATE_WAITINGFORPAYLOAD:
+        if (this.payloadLength == FrameParser.PAYLOAD_ANY && inChar == SerialConnection.SRLCMD_CHAR_END) {
+          frame = this.complete();
+        } else if (this.payloadPos == FrameParser.MAX_PAYLOAD) {
+          this.error(inChar);
+        } else {
+          this.payload[this.payloadPos++] = b;
+
+          if (this.payloadPos == this.payloadLength) {
+            this.state = FrameParser.STATE_WAITINGFOREND;
+          }
+        }
+        break;
+
+      case FrameParser.STATE_WAITINGFOREND:
+        if (inChar == SerialConnection.SRLCMD_CHAR_END) {
+          frame = this.complete();
+        } else {
+          this.error(inChar);
+        }
+        break;
+    }
+
+    return frame;
+  }
+
+  /**
+   * @return int number of frames parsed successfully
+   */
+  int getFrameCount() {
+    return this.frameCount;
+  }
+
+  /**
+   * @return int number of malformed frames and stray bytes
+   */
+  int getParseErrors() {
+    return this.parseErrors;
+  }
+
+  /**
+   * @return int number of times the parser had to skip ahead to the next '#'
+   */
+  int getResyncs() {
+    return this.resyncs;
+  }
+
+  private Response complete() {
+    Response response;
+
+    this.state = FrameParser.STATE_IDLE;
+
+    switch (this.type) {
+      case Response.TYPE_COMPLETE:
+        if (this.payloadPos == 0) {
+          response = new CompletionResult();
+        } else {
+          response = new CompletionResult(this.readInt(0) & 0xFFFFFFFFL, this.readInt(4) & 0xFFFFFFFFL,
+                                          this.readInt(8) & 0xFFFFFFFFL, this.readInt(12) & 0xFFFFFFFFL);
+        }
+        break;
+      case Response.TYPE_PING:
+        if (this.payload[FrameParser.ARG_LENGTH] != SerialConnection.SRLCMD_CHAR_PAYLOADSEP) {
+          this.parseErrors++;
+          return null;
+        }
+        response = new PingResult(this.readInt(0), this.readInt(FrameParser.ARG_LENGTH + 1));
+        break;
+      case Response.TYPE_BATTERY:
+        response = new BatteryResult(Float.intBitsToFloat(this.readInt(0)));
+        break;
+      case Response.TYPE_PROFILE:
+        response = new ProfileResult(this.payload[0], this.readInt(1) & 0xFFFFFFFFL, this.readInt(5) & 0xFFFFFFFFL,
+                                     this.readInt(9) & 0xFFFFFFFFL,
+                                     ((long) this.readInt(13) << 32) | (this.readInt(17) & 0xFFFFFFFFL));
+        break;
+      default:
+        response = new ResponseFrame(this.type, this.payload, this.payloadPos);
+    }
+
+    this.frameCount++;
+
+    return response;
+  }
+
+  /**
+   * reads a 4 byte int, MSB first, from the payload
+   *
+   * @param int offset
+   * @return int
+   */
+  private int readInt(int offset) {
+    return ((this.payload[offset] & 0xFF) << 24)
+         | ((this.payload[offset + 1] & 0xFF) << 16)
+         | ((this.payload[offset + 2] & 0xFF) << 8)
+         | (this.payload[offset + 3] & 0xFF);
+  }
+
+  /**
+   * drops the current frame. A '#' in the wrong place is taken as the start of the next frame.
+   *
+   * @param char inChar     the offending char
+   */
+  private void error(char inChar) {
+    this.parseErrors++;
+
+    if (inChar == SerialConnection.SRLCMD_CHAR_START && this.state != FrameParser.STATE_IDLE) {
+      this.resyncs++;
+      this.payloadPos = 0;
+      this.state = FrameParser.STATE_WAITINGFORTYPEBYTE;
+    } else {
+      this.state = FrameParser.STATE_RESYNC;
+    }
+  }
+}
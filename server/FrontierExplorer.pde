@@ -0,0 +1,664 @@
+import java.util.ArrayDeque;
+import java.util.HashSet;
+
+/**
+ * Explores the surroundings on its own by driving to the frontiers of the map.
+ *
+ * A frontier cell is a free cell next to an unknown one, on the pyramid level of
+ * the DistanceMap (40mm per cell). Cells only change where pings are integrated,
+ * so the set of frontier cells is kept up to date from the cellChanged()
+ * notifications of the Landscape: the changed cells and their neighbours are
+ * classified again once per pass, the rest of the map is never looked at. Tiles
+ * read from the MapFile are classified as a whole, and so is the window around
+ * the bot when exploring starts.
+ *
+ * To pick a target the frontier cells are grouped into 8-connected clusters and
+ * small ones are dropped. A Dijkstra search from the bot over the cells the bot
+ * fits on gives the travel cost to every cell of a window around it. The target
+ * of a cluster is its reachable cell closest to the cluster's centroid, its gain
+ * is the unknown area within GAIN_RADIUS of it. Of all clusters the one with the
+ * most area gained per minute of driving, sweeping on the way and surveying the
+ * target wins.
+ *
+ * The PathPlanner drives the bot there, sweeping after segments as it sees fit.
+ * Once it arrives the survey is queued as one batch around the full circle: the
+ * SweepPlanner is asked for a sweep at each heading SURVEY_TURN degrees apart,
+ * headings it finds nothing to gain at are skipped along with the turn to them.
+ * When the last sweep completed the next target is picked. A target the planner
+ * fails to reach is not tried again; one whose frontier has been explored on the
+ * way is given up for a better one.
+ *
+ * Runs on the MapWorker after the PathPlanner. toggle() and reportCompletion()
+ * may be called from the render thread.
+ */
+class FrontierExplorer implements Runnable, LandscapeListener {
+  final static int LEVEL           = DistanceMap.LEVEL;
+  final static int WINDOW_SHIFT    = 8;
+  final static int WINDOW          = 1 << FrontierExplorer.WINDOW_SHIFT;   // in cells, around the bot
+  final static int MIN_CLUSTER     = 6;          // in cells
+  final static int GAIN_LEVEL      = 4;          // 160mm per cell
+  final static float GAIN_RADIUS   = 1500;       // in mm, about what a survey sees
+  final static float TARGET_RADIUS = 200;        // in mm, the target is given up once no frontier cell is this close
+  final static float FAILED_RADIUS = 300;        // in mm, around targets that could not be reached
+  final static float DRIVE_SPEED   = 73;         // in mm/s, the firmware drives 200mm in 2730ms
+  final static float TURN_TIME     = 0.01;       // in s per degree
+  final static float SWEEP_TIME    = 6;          // in s, of a full sweep, taken as the worst case
+  final static int SURVEY_TURN     = 120;        // in degrees, one sweep covers -60 to 60
+  final static int SURVEY_SWEEPS   = 3;
+  final static float SQRT2         = 1.4142135;
+
+  final static int STATE_OFF        = 0;
+  final static int STATE_SELECTING  = 1;
+  final static int STATE_NAVIGATING = 2;         // the PathPlanner drives to the target
+  final static int STATE_SURVEYING  = 3;         // survey sent, waiting for its sweeps
+
+  private Landscape landscape;
+  private DistanceMap distanceMap;
+  private PathPlanner planner;
+  private CommandQueue commands;
+  private SweepPlanner sweeps;
+  private MapWorker worker;
+  private int botRadius;                         // in mm
+  private float cellSize;                        // in mm
+
+  /**
+   * keys of frontier cells, see key()
+   */
+  private HashSet<Long> frontiers;
+
+  /**
+   * cells of the Landscape that are known, counted as they change
+   */
+  private int knownCells;
+
+  /**
+   * cells changed since the last pass, the last one to skip repeats cheaply
+   */
+  private HashSet<Long> dirty;
+  private HashSet<Long> classifying;             // the dirty cells of the running pass
+  private long lastDirty;
+
+  /**
+   * scratch space of selectTarget()
+   */
+  private HashSet<Long> visited;
+  private ArrayDeque<Long> queue;
+  private IntList clusterX;
+  private IntList clusterY;
+
+  /**
+   * travel costs in mm from the bot to each cell of the window, INF if unreachable
+   */
+  private float[] costs;
+  private IndexedHeap open;
+  private int originX;
+  private int originY;
+
+  private FloatList failedX;
+  private FloatList failedY;
+
+  private float targetX;                         // in mm
+  private float targetY;                         // in mm
+  private float poseX;                           // in mm
+  private float poseY;                           // in mm
+  private float poseHeading;                     // in degrees
+  private int surveySweeps;                      // still to complete
+
+  private int startTime;                         // millis() exploring has been started at
+  private int startKnown;                        // cells of the Landscape known at that time
+
+  private volatile int state;
+
+  /**
+   * @param Landscape l
+   * @param DistanceMap d
+   * @param PathPlanner p
+   * @param CommandQueue q
+   * @param SweepPlanner s
+   * @param MapWorker w       the worker the explorer is run on
+   * @param int radius        of the bot in mm
+   */
+  FrontierExplorer(Landscape l, DistanceMap d, PathPlanner p, CommandQueue q, SweepPlanner s, MapWorker w, int radius) {
+    int cells = FrontierExplorer.WINDOW * FrontierExplorer.WINDOW;
+
+    this.landscape   = l;
+    this.distanceMap = d;
+    this.planner     = p;
+    this.commands    = q;
+    this.sweeps      = s;
+    this.worker      = w;
+    this.botRadius   = radius;
+    this.cellSize    = d.getCellSize();
+    this.frontiers   = new HashSet<Long>();
+    this.knownCells  = 0;
+    this.dirty       = new HashSet<Long>();
+    this.classifying = new HashSet<Long>();
+    this.lastDirty   = Long.MIN_VALUE;
+    this.visited     = new HashSet<Long>();
+    this.queue       = new ArrayDeque<Long>();
+    this.clusterX    = new IntList();
+    this.clusterY    = new IntList();
+    this.costs       = new float[cells];
+    this.open        = new IndexedHeap(cells);
+    this.failedX     = new FloatList();
+    this.failedY     = new FloatList();
+    this.state       = FrontierExplorer.STATE_OFF;
+  }
+
+  /**
+   * @return boolean true while exploring
+   */
+  boolean isExploring() {
+    return this.state != FrontierExplorer.STATE_OFF;
+  }
+
+  /**
+   * starts exploring from the given pose or stops it, call this from the render thread
+   *
+   * @param float posX        of the bot in mm
+   * @param float posY        of the bot in mm
+   * @param float heading     of the bot in degrees
+   */
+  void toggle(final float posX, final float posY, final float heading) {
+    this.worker.submit(new Runnable() {
+      public void run() {
+        FrontierExplorer.this.toggleExploring(posX, posY, heading);
+      }
+    });
+  }
+
+  /**
+   * forwards a completed command along with the pose of the bot after it, call
+   * this from the render thread
+   *
+   * @param char cmd
+   * @param float posX        in mm
+   * @param float posY        in mm
+   * @param float heading     in degrees
+   */
+  void reportCompletion(final char cmd, final float posX, final float posY, final float heading) {
+    if (cmd != CommandQueue.CMD_MOVEFORWARD && cmd != CommandQueue.CMD_SONARSWEEP
+        && cmd != CommandQueue.CMD_TURNLEFT && cmd != CommandQueue.CMD_TURNRIGHT) {
+      return;
+    }
+
+    this.worker.submit(new Runnable() {
+      public void run() {
+        FrontierExplorer.this.commandCompleted(cmd, posX, posY, heading);
+      }
+    });
+  }
+
+  /**
+   * stops exploring when a command got no completion, the commands queued after
+   * it have been dropped. call this from the render thread
+   *
+   * @param char cmd
+   */
+  void reportFailure(final char cmd) {
+    this.worker.submit(new Runnable() {
+      public void run() {
+        if (FrontierExplorer.this.state != FrontierExplorer.STATE_OFF) {
+          FrontierExplorer.this.finish("command " + cmd + " got no completion");
+        }
+      }
+    });
+  }
+
+  /**
+   * notes the cell of the frontier level, it is classified again with the next pass,
+   * and counts the cell if it became known
+   */
+  public void cellChanged(int x, int y, byte previous, byte logOdds) {
+    long k = this.key(x >> FrontierExplorer.LEVEL, y >> FrontierExplorer.LEVEL);
+
+    if (previous == 0 && logOdds != 0) {
+      this.knownCells++;
+    } else if (previous != 0 && logOdds == 0) {
+      this.knownCells--;
+    }
+
+    if (k != this.lastDirty) {
+      this.lastDirty = k;
+      this.dirty.add(k);
+    }
+  }
+
+  /**
+   * notes all cells of the tile, it may hold frontiers nobody has been notified of
+   */
+  public void tileLoaded(int tileX, int tileY) {
+    int shift = LandscapeTile.SHIFT - FrontierExplorer.LEVEL;
+
+    for (int y = 0; y < 1 << shift; y++) {
+      for (int x = 0; x < 1 << shift; x++) {
+        this.dirty.add(this.key((tileX << shift) + x, (tileY << shift) + y));
+      }
+    }
+  }
+
+  /**
+   * updates the frontiers and advances the state machine, must run after the PathPlanner
+   */
+  public void run() {
+    this.updateFrontiers();
+
+    if (this.state == FrontierExplorer.STATE_SELECTING) {
+      this.selectTarget();
+
+    } else if (this.state == FrontierExplorer.STATE_NAVIGATING) {
+      if (!this.planner.isNavigating()) {
+        if (this.planner.hasArrived()) {
+          this.survey();
+        } else {
+          this.failedX.append(this.targetX);
+          this.failedY.append(this.targetY);
+          this.state = FrontierExplorer.STATE_SELECTING;
+        }
+      } else if (!this.isFrontierNear(this.targetX, this.targetY) && this.planner.cancel()) {
+        // explored on the way, there may be a better target now
+        this.state = FrontierExplorer.STATE_SELECTING;
+      }
+    }
+  }
+
+  private void toggleExploring(float posX, float posY, float heading) {
+    this.poseX       = posX;
+    this.poseY       = posY;
+    this.poseHeading = heading;
+
+    if (this.state != FrontierExplorer.STATE_OFF) {
+      this.planner.cancel();
+      this.finish("exploration stopped");
+      return;
+    }
+
+    println("exploring");
+    this.markWindow();
+    this.failedX.clear();
+    this.failedY.clear();
+    this.startTime  = millis();
+    this.startKnown = this.knownCells;
+    this.state      = FrontierExplorer.STATE_SELECTING;
+  }
+
+  private void commandCompleted(char cmd, float posX, float posY, float heading) {
+    this.poseX       = posX;
+    this.poseY       = posY;
+    this.poseHeading = heading;
+
+    if (this.state == FrontierExplorer.STATE_SURVEYING && cmd == CommandQueue.CMD_SONARSWEEP) {
+      this.surveySweeps--;
+
+      if (this.surveySweeps == 0) {
+        this.state = FrontierExplorer.STATE_SELECTING;
+      }
+    }
+  }
+
+  /**
+   * classifies the changed cells and their neighbours again
+   */
+  private void updateFrontiers() {
+    HashSet<Long> cells = this.dirty;
+    int x, y;
+
+    // classifying may read tiles from the MapFile, which marks more cells dirty
+    this.dirty       = this.classifying;
+    this.classifying = cells;
+    this.lastDirty   = Long.MIN_VALUE;
+
+    for (Long k : cells) {
+      x = (int) (k >> 32);
+      y = (int) (long) k;
+
+      this.classify(x, y);
+      this.classify(x - 1, y);
+      this.classify(x + 1, y);
+      this.classify(x, y - 1);
+      this.classify(x, y + 1);
+    }
+    cells.clear();
+  }
+
+  /**
+   * notes all cells of the window around the bot
+   */
+  private void markWindow() {
+    int cx = this.distanceMap.cellOf(this.poseX) - FrontierExplorer.WINDOW / 2;
+    int cy = this.distanceMap.cellOf(this.poseY) - FrontierExplorer.WINDOW / 2;
+
+    for (int y = 0; y < FrontierExplorer.WINDOW; y++) {
+      for (int x = 0; x < FrontierExplorer.WINDOW; x++) {
+        this.dirty.add(this.key(cx + x, cy + y));
+      }
+    }
+  }
+
+  /**
+   * a cell is free if all its cells of the Landscape are more likely free than
+   * not, unknown if none of them is known to be blocked but some are not known
+   */
+  private void classify(int x, int y) {
+    byte v = this.landscape.getLevelLogOdds(FrontierExplorer.LEVEL, x, y);
+    long k = this.key(x, y);
+
+    if (v < 0 && (this.isUnknown(x - 1, y) || this.isUnknown(x + 1, y)
+                  || this.isUnknown(x, y - 1) || this.isUnknown(x, y + 1))) {
+      this.frontiers.add(k);
+    } else {
+      this.frontiers.remove(k);
+    }
+  }
+
+  private boolean isUnknown(int x, int y) {
+    return this.landscape.getLevelLogOdds(FrontierExplorer.LEVEL, x, y) == 0;
+  }
+
+  /**
+   * picks the cluster with the best rate of area gained per time and sends the
+   * PathPlanner on its way
+   */
+  private void selectTarget() {
+    HashSet<Long> visited = this.visited;
+    ArrayDeque<Long> queue = this.queue;
+    IntList clusterX = this.clusterX;
+    IntList clusterY = this.clusterY;
+    float bestRate = 0;
+    float bestX = 0;
+    float bestY = 0;
+    float bestGain = 0;
+    float meanX, meanY, gain, time, rate, d, closest, cost;
+    int x, y, cx, cy, wx, wy, target;
+    long k;
+
+    if (this.frontiers.isEmpty()) {
+      this.finish("no frontiers left");
+      return;
+    }
+
+    this.computeCosts();
+    visited.clear();
+
+    for (Long seed : this.frontiers) {
+      if (visited.contains(seed)) {
+        continue;
+      }
+
+      clusterX.clear();
+      clusterY.clear();
+      visited.add(seed);
+      queue.add(seed);
+
+      while (!queue.isEmpty()) {
+        k = queue.poll();
+        x = (int) (k >> 32);
+        y = (int) k;
+        clusterX.append(x);
+        clusterY.append(y);
+
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            Long n = this.key(x + dx, y + dy);
+
+            if (this.frontiers.contains(n) && visited.add(n)) {
+              queue.add(n);
+            }
+          }
+        }
+      }
+
+      if (clusterX.size() < FrontierExplorer.MIN_CLUSTER) {
+        continue;
+      }
+
+      meanX = 0;
+      meanY = 0;
+      for (int i = 0; i < clusterX.size(); i++) {
+        meanX += clusterX.get(i);
+        meanY += clusterY.get(i);
+      }
+      meanX /= clusterX.size();
+      meanY /= clusterY.size();
+
+      // the reachable cell of the cluster closest to its centroid
+      target  = -1;
+      closest = Float.POSITIVE_INFINITY;
+      for (int i = 0; i < clusterX.size(); i++) {
+        cx = clusterX.get(i);
+        cy = clusterY.get(i);
+        wx = cx - this.originX;
+        wy = cy - this.originY;
+
+        if (!this.inWindow(wx, wy) || this.costs[this.index(wx, wy)] == Float.POSITIVE_INFINITY) {
+          continue;
+        }
+
+        d = sq(cx - meanX) + sq(cy - meanY);
+        if (d < closest) {
+          closest = d;
+          target  = i;
+        }
+      }
+
+      if (target < 0) {
+        continue;
+      }
+
+      cx = clusterX.get(target);
+      cy = clusterY.get(target);
+
+      if (this.hasFailedNear(this.distanceMap.centerOf(cx), this.distanceMap.centerOf(cy))) {
+        continue;
+      }
+
+      cost = this.costs[this.index(cx - this.originX, cy - this.originY)];
+      gain = this.getUnknownArea(this.distanceMap.centerOf(cx), this.distanceMap.centerOf(cy));
+      time = cost / FrontierExplorer.DRIVE_SPEED
+           + ceil(cost / PathPlanner.MAX_SEGMENT) * FrontierExplorer.SWEEP_TIME
+           + FrontierExplorer.SURVEY_SWEEPS * FrontierExplorer.SWEEP_TIME
+           + (FrontierExplorer.SURVEY_SWEEPS - 1) * FrontierExplorer.SURVEY_TURN * FrontierExplorer.TURN_TIME;
+      rate = gain / time;
+
+      if (rate > bestRate) {
+        bestRate = rate;
+        bestGain = gain;
+        bestX    = this.distanceMap.centerOf(cx);
+        bestY    = this.distanceMap.centerOf(cy);
+      }
+    }
+
+    if (bestRate == 0) {
+      this.finish("no reachable frontier left");
+      return;
+    }
+
+    this.targetX = bestX;
+    this.targetY = bestY;
+    this.planner.setGoal(this.targetX, this.targetY, this.poseX, this.poseY, this.poseHeading);
+
+    if (!this.planner.isNavigating()) {
+      this.failedX.append(this.targetX);
+      this.failedY.append(this.targetY);
+      return;
+    }
+
+    println("exploring frontier at " + round(this.targetX) + " / " + round(this.targetY)
+            + ", expecting " + nf(bestGain, 1, 2) + " m² at " + nf(60 * bestRate, 1, 2) + " m²/min");
+    this.state = FrontierExplorer.STATE_NAVIGATING;
+  }
+
+  /**
+   * queues the survey of the target: the sweeps worth taking all around, with
+   * turns in between
+   */
+  private void survey() {
+    boolean queued = true;
+    int last = 0;
+    int count = 0;
+    int[] sweep;
+    int turn;
+
+    for (int i = 0; i < FrontierExplorer.SURVEY_SWEEPS && queued; i++) {
+      sweep = this.sweeps.plan(this.poseX, this.poseY, this.poseHeading + i * FrontierExplorer.SURVEY_TURN);
+
+      if (sweep == null) {
+        continue;
+      }
+
+      turn = (i - last) * FrontierExplorer.SURVEY_TURN;
+      turn = ((turn % 360) + 540) % 360 - 180;    // to [-180, 180)
+
+      if (turn > 0) {
+        queued = this.commands.cmdTurnRight(turn);
+      } else if (turn < 0) {
+        queued = this.commands.cmdTurnLeft(turn);
+      }
+      queued = queued && this.commands.cmdSonarSweep(sweep[0], sweep[1], sweep[2]);
+      last   = i;
+      count++;
+    }
+
+    if (!queued) {
+      this.finish("command queue is full");
+      return;
+    }
+
+    this.surveySweeps = count;
+    this.state        = count > 0 ? FrontierExplorer.STATE_SURVEYING : FrontierExplorer.STATE_SELECTING;
+  }
+
+  /**
+   * Dijkstra from the bot over all cells of a window around it the bot fits on
+   */
+  private void computeCosts() {
+    int sx = this.distanceMap.cellOf(this.poseX);
+    int sy = this.distanceMap.cellOf(this.poseY);
+    int u, ux, uy, n;
+    float c;
+
+    this.originX = sx - FrontierExplorer.WINDOW / 2;
+    this.originY = sy - FrontierExplorer.WINDOW / 2;
+    this.distanceMap.cover(this.originX, this.originY,
+                           this.originX + FrontierExplorer.WINDOW - 1, this.originY + FrontierExplorer.WINDOW - 1);
+
+    java.util.Arrays.fill(this.costs, Float.POSITIVE_INFINITY);
+    this.open.clear();
+
+    u = this.index(sx - this.originX, sy - this.originY);
+    this.costs[u] = 0;
+    this.open.insert(u, 0, 0);
+
+    while (!this.open.isEmpty()) {
+      u  = this.open.top();
+      ux = u & (FrontierExplorer.WINDOW - 1);
+      uy = u >> FrontierExplorer.WINDOW_SHIFT;
+      this.open.remove(u);
+
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          if ((dx == 0 && dy == 0) || !this.inWindow(ux + dx, uy + dy)
+              || this.isBlocked(ux + dx, uy + dy)
+              || (dx != 0 && dy != 0 && (this.isBlocked(ux + dx, uy) || this.isBlocked(ux, uy + dy)))) {
+            continue;
+          }
+
+          n = this.index(ux + dx, uy + dy);
+          c = this.costs[u] + (dx != 0 && dy != 0 ? FrontierExplorer.SQRT2 : 1) * this.cellSize;
+
+          if (c < this.costs[n]) {
+            this.costs[n] = c;
+            this.open.insert(n, c, 0);
+          }
+        }
+      }
+    }
+  }
+
+  /**
+   * @return boolean true if the bot would touch an obstacle with its center on the cell
+   */
+  private boolean isBlocked(int wx, int wy) {
+    return this.distanceMap.getClearance(wx + this.originX, wy + this.originY) < this.botRadius;
+  }
+
+  /**
+   * @param float x       in mm
+   * @param float y       in mm
+   * @return float unknown area within GAIN_RADIUS in m²
+   */
+  private float getUnknownArea(float x, float y) {
+    float size = this.landscape.CELL_SIZE << FrontierExplorer.GAIN_LEVEL;
+    int r      = ceil(FrontierExplorer.GAIN_RADIUS / size);
+    int gx     = round(x / this.landscape.CELL_SIZE) >> FrontierExplorer.GAIN_LEVEL;
+    int gy     = round(y / this.landscape.CELL_SIZE) >> FrontierExplorer.GAIN_LEVEL;
+    int count  = 0;
+
+    for (int dy = -r; dy <= r; dy++) {
+      for (int dx = -r; dx <= r; dx++) {
+        if (dx * dx + dy * dy <= r * r
+            && this.landscape.getLevelLogOdds(FrontierExplorer.GAIN_LEVEL, gx + dx, gy + dy) == 0) {
+          count++;
+        }
+      }
+    }
+
+    return count * size * size / 1000000;
+  }
+
+  /**
+   * @return boolean true if there is a frontier cell within TARGET_RADIUS
+   */
+  private boolean isFrontierNear(float x, float y) {
+    int r  = ceil(FrontierExplorer.TARGET_RADIUS / this.cellSize);
+    int cx = this.distanceMap.cellOf(x);
+    int cy = this.distanceMap.cellOf(y);
+
+    for (int dy = -r; dy <= r; dy++) {
+      for (int dx = -r; dx <= r; dx++) {
+        if (this.frontiers.contains(this.key(cx + dx, cy + dy))) {
+          return true;
+        }
+      }
+    }
+
+    return false;
+  }
+
+  private boolean hasFailedNear(float x, float y) {
+    for (int i = 0; i < this.failedX.size(); i++) {
+      if (dist(x, y, this.failedX.get(i), this.failedY.get(i)) < FrontierExplorer.FAILED_RADIUS) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * stops exploring and reports how fast the map grew
+   */
+  private void finish(String reason) {
+    float minutes = (millis() - this.startTime) / 60000.0;
+    float area    = (this.knownCells - this.startKnown) * this.landscape.CELL_SIZE * this.landscape.CELL_SIZE / 1000000.0;
+
+    println(reason + ", explored " + nf(area, 1, 2) + " m² in " + nf(minutes, 1, 1) + " min"
+            + (minutes > 0 ? " (" + nf(area / minutes, 1, 2) + " m²/min)" : ""));
+    this.state = FrontierExplorer.STATE_OFF;
+  }
+
+  /**
+   * @return long hash key of a cell of the frontier level
+   */
+  private long key(int x, int y) {
+    return ((long) x << 32) | (y & 0xFFFFFFFFL);
+  }
+
+  private boolean inWindow(int x, int y) {
+    return x >= 0 && y >= 0 && x < FrontierExplorer.WINDOW && y < FrontierExplorer.WINDOW;
+  }
+
+  private int index(int x, int y) {
+    return (y << FrontierExplorer.WINDOW_SHIFT) + x;
+  }
+}
@@ -0,0 +1,157 @@
+/**
+ * Binary min-heap of node indices with two-part keys, compared lexicographically.
+ *
+ * Every node can be in the heap at most once. The position of each node is kept
+ * so the key of a queued node can be changed and nodes can be removed in
+ * O(log n), which is what D* Lite needs. Nothing is allocated after construction.
+ */
+class IndexedHeap {
+  private int[] nodes;
+  private int[] positions;         // per node, -1 if not queued
+  private float[] keys1;           // per node
+  private float[] keys2;           // per node
+  private int size;
+
+  /**
+   * @param int capacity     number of nodes, nodes are 0 .. capacity - 1
+   */
+  IndexedHeap(int capacity) {
+    this.nodes     = new int[capacity];
+    this.positions = new int[capacity];
+    this.keys1     = new float[capacity];
+    this.keys2     = new float[capacity];
+    this.size      = 0;
+
+    java.util.Arrays.fill(this.positions, -1);
+  }
+
+  boolean isEmpty() {
+    return this.size == 0;
+  }
+
+  int size() {
+    return this.size;
+  }
+
+  boolean contains(int node) {
+    return this.positions[node] >= 0;
+  }
+
+  /**
+   * @return int node with the smallest key, the heap must not be empty
+   */
+  int top() {
+    return this.nodes[0];
+  }
+
+  float topKey1() {
+    return this.keys1[this.nodes[0]];
+  }
+
+  float topKey2() {
+    return this.keys2[this.nodes[0]];
+  }
+
+  /**
+   * removes all nodes
+   */
+  void clear() {
+    for (int i = 0; i < this.size; i++) {
+      this.positions[this.nodes[i]] = -1;
+    }
+    this.size = 0;
+  }
+
+  /**
+   * queues a node or changes its key if it is queued already
+   *
+   * @param int node
+   * @param float k1
+   * @param float k2
+   */
+  void insert(int node, float k1, float k2) {
+    int pos = this.positions[node];
+
+    this.keys1[node] = k1;
+    this.keys2[node] = k2;
+
+    if (pos < 0) {
+      pos = this.size++;
+      this.nodes[pos] = node;
+      this.positions[node] = pos;
+    }
+
+    this.siftDown(this.siftUp(pos));
+  }
+
+  /**
+   * @param int node      is ignored if it is not queued
+   */
+  void remove(int node) {
+    int pos = this.positions[node];
+    int last;
+
+    if (pos < 0) {
+      return;
+    }
+
+    this.positions[node] = -1;
+    last = this.nodes[--this.size];
+
+    if (pos < this.size) {
+      this.nodes[pos] = last;
+      this.positions[last] = pos;
+      this.siftDown(this.siftUp(pos));
+    }
+  }
+
+  /**
+   * @return boolean true if the key of node a is smaller than the key of node b
+   */
+  private boolean less(int a, int b) {
+    return this.keys1[a] < this.keys1[b] || (this.keys1[a] == this.keys1[b] && this.keys2[a] < this.keys2[b]);
+  }
+
+  private int siftUp(int pos) {
+    int node = this.nodes[pos];
+    int parent;
+
+    while (pos > 0) {
+      parent = (pos - 1) >> 1;
+
+      if (!this.less(node, this.nodes[parent])) {
+        break;
+      }
+      this.nodes[pos] = this.nodes[parent];
+      this.positions[this.nodes[pos]] = pos;
+      pos = parent;
+    }
+
+    this.nodes[pos] = node;
+    this.positions[node] = pos;
+
+    return pos;
+  }
+
+  private int siftDown(int pos) {
+    int node = this.nodes[pos];
+    int child;
+
+    while ((child = 2 * pos + 1) < this.size) {
+      if (child + 1 < this.size && this.less(this.nodes[child + 1], this.nodes[child])) {
+        child++;
+      }
+      if (!this.less(this.nodes[child], node)) {
+        break;
+      }
+      this.nodes[pos] = this.nodes[child];
+      this.positions[this.nodes[pos]] = pos;
+      pos = child;
+    }
+
+    this.nodes[pos] = node;
+    this.positions[node] = pos;
+
+    return pos;
+  }
+}
@@ -1,77 +1,537 @@
+import java.util.concurrent.ConcurrentHashMap;
+
 /**
- * Represents and manages a grid of 10x10mm large squares of ground.
+ * Represents and manages an unbounded map of 10x10mm large squares of ground.
+ *
+ * The value stored for each cell represents the probability of being blocked as
+ * log-odds in a single byte: 0 means unknown (50%), positive values are likely 
+ * blocked, negative values likely empty. getCell() and setCell() convert from and
+ * to the probability in [0, 100].
+ *
+ * Cells are grouped into LandscapeTiles which are only allocated when a cell in 
+ * them is written for the first time. Tiles are kept in a hash map keyed by their
+ * tile coordinates, so memory scales with the explored area and there is no edge
+ * of the map. Tiles that have not been accessed for a while are spilled to a 
+ * memory-mapped file and faulted back in on the next access.
+ *
+ * With a MapFile attached, the tiles in it are known from the start but only read
+ * on their first access, and changed tiles are written to it by saveTiles(). Cold
+ * tiles that are saved are dropped instead of spilled, the MapFile has them.
  *
- * Must be initiated with the width and height in cells.
+ * The bots position 0/0 refers to cell 0/0, cell coordinates can be negative.
  *
- * The value [0, 100] stored for each grid represents the probability of being blocked. 
- * A value of 100 is the highest probability of being blocked. 0 represents a cell that is 
- * likely to be empty.
+ * Each tile maintains a max-pooled pyramid of coarser levels. Each cell of level n 
+ * holds the maximum of the 2x2 cells below it on level n-1, so a blocked cell stays 
+ * visible however far the view is zoomed out. Zoomed out views and coarse planning 
+ * queries use the level that matches their scale.
  *
- * Initially all cells have a value of 50. 
+ * Each level of a tile is mirrored into a texture with one pixel per cell, drawing 
+ * is one scaled image() call per visible tile.
  *
- * The bots position 0/0 refers to width/2 / height/2 on the grid stored in this array
+ * The tiles are owned by the MapWorker, all methods but draw() must be called from
+ * the worker thread only. After each pass the worker publishes a TileSnapshot of 
+ * every tile that changed, each one replaces the previous snapshot of its tile in
+ * a concurrent map on its own. A snapshot copies only the levels that changed and
+ * shares the others with the snapshot before it, so publishing costs about as
+ * much as the change, however large the map is. draw() reads the map without any
+ * locking; a snapshot never changes after it has been published, a frame may just
+ * show some tiles of a pass before the others.
  */
 class Landscape {
-  int width;
-  int height;
-  int[][] grid;
-  int gridCenterX;
-  int gridCenterY;
   final int CELL_SIZE = 10; // in mm
   
-  Landscape(int w, int h) {
-    this.width = w;
-    this.height = h;
-    this.grid = new int[w][h];
+  final static float LOGODDS_SCALE = 16.0;   // byte value of a log-odds of 1.0
+  final static int SPILL_AFTER     = 30000;  // in ms without access
+  
+  HashMap<Long, LandscapeTile> tiles;
+  TileSpill spill;
+  MapFile mapFile;
+  
+  /**
+   * latest snapshot of every tile, written by publish() and read by draw()
+   */
+  private ConcurrentHashMap<Long, TileSnapshot> published;
+  
+  /**
+   * tiles that changed since the last publish()
+   */
+  private ArrayList<LandscapeTile> dirtyTiles;
+  
+  /**
+   * tiles that changed since the last saveTiles()
+   */
+  private ArrayList<LandscapeTile> unsavedTiles;
+  
+  /**
+   * keys of spilled tiles draw() wants to see, from the render thread to the worker
+   */
+  private EventQueue faultRequests;
+  
+  private ArrayList<LandscapeListener> listeners;
+  
+  /**
+   * the last tile that has been looked up, cells are mostly accessed close to each other
+   */
+  private LandscapeTile lastTile;
+  
+  /**
+   * millis() as of the current pass of the worker, stamped on tiles as they are accessed
+   */
+  private int accessClock;
+  
+  /**
+   * probability [0, 100] and gray ARGB color per log-odds value, indexed by value + 128
+   */
+  private int[] probabilities;
+  private int[] colors;
+  
+  Landscape() {
+    this.tiles         = new HashMap<Long, LandscapeTile>();
+    this.spill         = new TileSpill();
+    this.published     = new ConcurrentHashMap<Long, TileSnapshot>();
+    this.dirtyTiles    = new ArrayList<LandscapeTile>();
+    this.unsavedTiles  = new ArrayList<LandscapeTile>();
+    this.faultRequests = new EventQueue(1024);
+    this.listeners     = new ArrayList<LandscapeListener>();
+    this.lastTile      = null;
+    this.accessClock   = millis();
+    this.probabilities = new int[256];
+    this.colors        = new int[256];
+    
+    for (int v = -128; v < 128; v++) {
+      float p = 1.0 / (1.0 + exp(-v / Landscape.LOGODDS_SCALE));
+      int gray = round(p * 255);
+      
+      this.probabilities[v + 128] = round(p * 100);
+      this.colors[v + 128]        = 0xFF000000 | (gray << 16) | (gray << 8) | gray;
+    }
+  }
+  
+  /**
+   * registers a listener to be notified of every changed cell, call this before
+   * the MapWorker is started
+   *
+   * @param LandscapeListener listener
+   */
+  void addListener(LandscapeListener listener) {
+    this.listeners.add(listener);
+  }
+  
+  /**
+   * @param int tx
+   * @param int ty
+   * @return Long hash map key of a tile
+   */
+  private Long tileKey(int tx, int ty) {
+    return ((long) tx << 32) | (ty & 0xFFFFFFFFL);
+  }
+  
+  /**
+   * makes the tiles of a map file known, they are read from it on their first
+   * access. Call this before the MapWorker is started
+   *
+   * @param MapFile file      changed tiles are saved to it from now on
+   */
+  void attach(MapFile file) {
+    LandscapeTile tile;
+    
+    this.mapFile = file;
+    
+    for (Long key : file.getTiles()) {
+      if (!this.tiles.containsKey(key)) {
+        tile = new LandscapeTile((int) (key >> 32), (int) (long) key, true);
+        this.tiles.put(key, tile);
+        this.dirtyTiles.add(tile);
+      }
+    }
+  }
+  
+  /**
+   * looks up a tile, faulting it back in if it has been spilled or is in the
+   * MapFile only
+   *
+   * @param int tx
+   * @param int ty
+   * @param boolean create    allocate the tile if it doesn't exist yet
+   * @return LandscapeTile null if the tile does not exist and create is false
+   */
+  LandscapeTile getTile(int tx, int ty, boolean create) {
+    LandscapeTile tile = this.lastTile;
+    
+    if (tile == null || tile.tileX != tx || tile.tileY != ty) {
+      tile = this.tiles.get(this.tileKey(tx, ty));
+      
+      if (tile == null) {
+        if (!create) {
+          return null;
+        }
+        tile = new LandscapeTile(tx, ty);
+        this.tiles.put(this.tileKey(tx, ty), tile);
+        this.dirtyTiles.add(tile);
+      }
+      this.lastTile = tile;
+    }
+    
+    tile.lastAccess = this.accessClock;
     
-    for (int y = 0; y < this.height; y++) {
-      for (int x = 0; x < this.width; x++) {
-        this.grid[x][y] = 50; 
+    if (tile.mapped) {
+      tile.allocate();
+      this.mapFile.read(tx, ty, tile.levels[0]);
+      tile.mapped = false;
+      tile.rebuildPyramid();
+      this.markDirty(tile);
+      
+      for (int i = 0; i < this.listeners.size(); i++) {
+        this.listeners.get(i).tileLoaded(tx, ty);
       }
+    } else if (!tile.isResident()) {
+      tile.allocate();
+      this.spill.load(tile.spillSlot, tile.levels[0]);
+      tile.spillSlot = -1;
+      tile.rebuildPyramid();
+      this.markDirty(tile);
     }
     
-    this.gridCenterX = ceil(this.width / 2);
-    this.gridCenterY = ceil(this.height / 2);
-    this.grid[this.gridCenterX][this.gridCenterY] = 100;  // @todo remove this
+    return tile;
   }
   
-  void draw(float scrollX, float scrollY) {
-    float edgeLen = scaleMMtoPx(this.CELL_SIZE);
-
-    int cellsX = ceil(windowWidth / edgeLen);
-    int cellsY = ceil(windowHeight / edgeLen);
-
-    float centerCellX = this.gridCenterX + (bot.getPosX() / this.CELL_SIZE) - (scalePxToMM(scrollX) / this.CELL_SIZE);
-    float centerCellY = this.gridCenterY + (bot.getPosY() / this.CELL_SIZE) - (scalePxToMM(scrollY) / this.CELL_SIZE);
+  /**
+   * @return int number of allocated tiles, spilled or not
+   */
+  int getTileCount() {
+    return this.tiles.size();
+  }
+  
+  /**
+   * @param int x
+   * @param int y
+   * @return byte log-odds of the cell being blocked, 0 for unknown
+   */
+  byte getLogOdds(int x, int y) {
+    LandscapeTile tile = this.getTile(x >> LandscapeTile.SHIFT, y >> LandscapeTile.SHIFT, false);
+    
+    if (tile == null) {
+      return 0;
+    }
+    
+    return tile.get(x & LandscapeTile.MASK, y & LandscapeTile.MASK);
+  }
+  
+  /**
+   * @param int x
+   * @param int y
+   * @param byte value    log-odds of the cell being blocked
+   * @return boolean true if the cell changed
+   */
+  boolean setLogOdds(int x, int y, byte value) {
+    LandscapeTile tile = this.getTile(x >> LandscapeTile.SHIFT, y >> LandscapeTile.SHIFT, value != 0);
+    byte previous;
     
-    float startCellX = centerCellX - cellsX / 2;
-    float startCellY = centerCellY - cellsY / 2;
+    if (tile == null) {
+      return false;
+    }
     
-    float offsetX = (round(startCellX) - startCellX) * edgeLen;
-    float offsetY = (round(startCellY) - startCellY) * edgeLen;
+    previous = tile.get(x & LandscapeTile.MASK, y & LandscapeTile.MASK);
+    if (!tile.set(x & LandscapeTile.MASK, y & LandscapeTile.MASK, value)) {
+      return false;
+    }
     
-    int posX, posY;
+    this.markDirty(tile);
     
-    rectMode(CENTER);
-    noStroke();
-/*    stroke(0, 0, 0, 100);
-    strokeWeight(1);*/
-        
-    for (int y = 0; y <= cellsY; y++) {
-      for (int x = 0; x <= cellsX; x++) {
-        posX = round(startCellX) + x;
-        posY = round(startCellY) + y;
+    if (!tile.unsaved) {
+      tile.unsaved = true;
+      this.unsavedTiles.add(tile);
+    }
+    
+    for (int i = 0; i < this.listeners.size(); i++) {
+      this.listeners.get(i).cellChanged(x, y, previous, value);
+    }
+    
+    return true;
+  }
+  
+  /**
+   * @param LandscapeTile tile    to be published with the next publish()
+   */
+  private void markDirty(LandscapeTile tile) {
+    if (!tile.dirty) {
+      tile.dirty = true;
+      this.dirtyTiles.add(tile);
+    }
+  }
+  
+  /**
+   * adds to the log-odds of a cell, clamped to [-127, 127]
+   *
+   * @param int x
+   * @param int y
+   * @param int delta
+   * @return boolean true if the cell changed
+   */
+  boolean addLogOdds(int x, int y, int delta) {
+    return this.setLogOdds(x, y, (byte) constrain(this.getLogOdds(x, y) + delta, -127, 127));
+  }
+  
+  /**
+   * @param int x
+   * @param int y
+   * @return int probability [0, 100] of the cell being blocked
+   */
+  int getCell(int x, int y) {
+    return this.probabilities[this.getLogOdds(x, y) + 128];
+  }
+  
+  /**
+   * @param int x
+   * @param int y
+   * @param int value     probability [0, 100] of the cell being blocked
+   */
+  void setCell(int x, int y, int value) {
+    this.setLogOdds(x, y, this.toLogOdds(value));
+  }
+  
+  /**
+   * @param int value     probability [0, 100]
+   * @return byte log-odds
+   */
+  byte toLogOdds(int value) {
+    float p = constrain(value / 100.0, 0.0001, 0.9999);
+    
+    return (byte) constrain(round(log(p / (1 - p)) * Landscape.LOGODDS_SCALE), -127, 127);
+  }
+  
+  /**
+   * @param byte logOdds
+   * @return int probability [0, 100]
+   */
+  int toProbability(byte logOdds) {
+    return this.probabilities[logOdds + 128];
+  }
+  
+  /**
+   * @return int number of levels including the full resolution cells
+   */
+  int getLevelCount() {
+    return LandscapeTile.LEVELS;
+  }
+  
+  /**
+   * @param int level
+   * @param int x
+   * @param int y
+   * @return int highest probability of being blocked of all cells covered by the cell x/y of the given level
+   */
+  int getLevelCell(int level, int x, int y) {
+    return this.probabilities[this.getLevelLogOdds(level, x, y) + 128];
+  }
+  
+  /**
+   * @param int level
+   * @param int x
+   * @param int y
+   * @return byte highest log-odds of all cells covered by the cell x/y of the given level, 0 for unknown
+   */
+  byte getLevelLogOdds(int level, int x, int y) {
+    int shift = LandscapeTile.SHIFT - level;
+    int mask  = (1 << shift) - 1;
+    LandscapeTile tile = this.getTile(x >> shift, y >> shift, false);
+    
+    if (tile == null) {
+      return 0;
+    }
+    
+    return tile.getLevel(level, x & mask, y & mask);
+  }
+  
+  /**
+   * picks the coarsest level whose cells are not larger than the given size
+   *
+   * @param float mm      edge length in mm
+   * @return int
+   */
+  int selectLevel(float mm) {
+    int level = 0;
+    
+    while (level + 1 < LandscapeTile.LEVELS && (this.CELL_SIZE << (level + 1)) <= mm) {
+      level++;
+    }
+    
+    return level;
+  }
+  
+  /**
+   * advances the clock tiles are stamped with on access, called by the worker once per pass
+   */
+  void updateClock() {
+    this.accessClock = millis();
+  }
+  
+  /**
+   * moves tiles that have been neither accessed nor drawn for SPILL_AFTER ms into
+   * the spill file, or drops them if the MapFile has their cells
+   */
+  void spillColdTiles() {
+    for (LandscapeTile tile : this.tiles.values()) {
+      if (tile.isResident() 
+          && this.accessClock - tile.lastAccess > Landscape.SPILL_AFTER
+          && this.accessClock - tile.textures.lastDrawn > Landscape.SPILL_AFTER) {
+        if (this.mapFile != null && !tile.unsaved) {
+          tile.mapped = true;
+        } else if (this.spill.available()) {
+          tile.spillSlot = this.spill.store(tile.levels[0]);
+        }
         
-        if (posX > -1 && posX < this.width && posY > -1 && posY < this.height) {
-          fill(255, 255, 255, this.grid[posX][posY]);
+        if (tile.mapped || tile.spillSlot >= 0) {
+          tile.release();
+          this.markDirty(tile);
+        }
+      }
+    }
+  }
+  
+  /**
+   * writes the tiles changed since the last call to the MapFile and checkpoints it
+   *
+   * @return int number of tiles written
+   */
+  int saveTiles() {
+    int saved = 0;
+    
+    if (this.mapFile == null || this.unsavedTiles.isEmpty()) {
+      return 0;
+    }
+    
+    for (int i = this.unsavedTiles.size() - 1; i >= 0; i--) {
+      LandscapeTile tile = this.unsavedTiles.get(i);
+      
+      // unsaved tiles are spilled but never dropped, a spilled one is faulted in
+      this.getTile(tile.tileX, tile.tileY, false);
+      
+      if (this.mapFile.write(tile.tileX, tile.tileY, tile.levels[0])) {
+        tile.unsaved = false;
+        this.unsavedTiles.remove(i);
+        saved++;
+      }
+    }
+    this.mapFile.checkpoint();
+    
+    return saved;
+  }
+  
+  /**
+   * faults in the spilled tiles draw() has asked for, they are published with the 
+   * next publish()
+   */
+  void processFaultRequests() {
+    Object key;
+    LandscapeTile tile;
+    
+    while ((key = this.faultRequests.poll()) != null) {
+      tile = this.tiles.get(key);
+      
+      if (tile != null) {
+        this.getTile(tile.tileX, tile.tileY, false);
+        this.markDirty(tile);
+      }
+    }
+  }
+  
+  /**
+   * publishes snapshots of all tiles changed since the last call
+   *
+   * @return boolean true if anything has been published
+   */
+  boolean publish() {
+    if (this.dirtyTiles.isEmpty()) {
+      return false;
+    }
+    
+    for (LandscapeTile tile : this.dirtyTiles) {
+      tile.version++;
+      tile.dirty         = false;
+      tile.snapshot      = new TileSnapshot(tile, tile.snapshot);
+      tile.changedLevels = 0;
+      this.published.put(this.tileKey(tile.tileX, tile.tileY), tile.snapshot);   // hands it to draw()
+    }
+    this.dirtyTiles.clear();
+    
+    return true;
+  }
+  
+  /**
+   * draws the visible tiles from the level that has about one cell per pixel.
+   *
+   * the cell 0/0 is centered on the home position, just like the bot is drawn 
+   * relative to it. Reads the last published snapshots only, call this from the
+   * render thread
+   *
+   * @param float scrollX
+   * @param float scrollY
+   */
+  void draw(float scrollX, float scrollY) {
+    int level    = this.selectLevel(scalePxToMM(1));
+    float cellPx = scaleMMtoPx(this.CELL_SIZE);
+    float tilePx = cellPx * LandscapeTile.SIZE;
+    int unknown  = round(255 * 0.5);
+    int now      = millis();
+    ConcurrentHashMap<Long, TileSnapshot> view = this.published;
+    
+    // screen position of the top left corner of cell 0/0
+    float originX = centerX + scrollX - 0.5 * cellPx;
+    float originY = centerY + scrollY - 0.5 * cellPx;
+    
+    // visible range of tiles
+    int startTileX = floor(-originX / tilePx);
+    int startTileY = floor(-originY / tilePx);
+    int endTileX   = ceil((windowWidth - originX) / tilePx);
+    int endTileY   = ceil((windowHeight - originY) / tilePx);
+    
+    // everything that has not been mapped yet is unknown
+    rectMode(CORNER);
+    noStroke();
+    fill(unknown, unknown, unknown, 100);
+    rect(0, 0, windowWidth, windowHeight);
+    
+    imageMode(CORNER);
+    
+    if ((long) (endTileX - startTileX) * (endTileY - startTileY) <= view.size()) {
+      for (int ty = startTileY; ty < endTileY; ty++) {
+        for (int tx = startTileX; tx < endTileX; tx++) {
+          TileSnapshot tile = view.get(this.tileKey(tx, ty));
           
-          rect(offsetX + x * edgeLen, 
-               offsetY + y * edgeLen,
-               edgeLen,
-               edgeLen
-          );
+          if (tile != null) {
+            this.drawTile(tile, level, originX, originY, tilePx, now);
+          }
+        }
+      }
+    } else {
+      // far zoomed out, fewer tiles exist than would fit on the screen
+      for (TileSnapshot tile : view.values()) {
+        if (tile.tileX >= startTileX && tile.tileX < endTileX && tile.tileY >= startTileY && tile.tileY < endTileY) {
+          this.drawTile(tile, level, originX, originY, tilePx, now);
         }
       }
     }
   }
+  
+  private void drawTile(TileSnapshot tile, int level, float originX, float originY, float tilePx, int now) {
+    tile.textures.lastDrawn = now;
+    
+    if (!tile.isResident()) {
+      // spilled, ask the worker for the cells once and draw it as unknown until then
+      tile.textures.release();
+      
+      if (tile.textures.faultRequested != tile.version && this.faultRequests.offer(this.tileKey(tile.tileX, tile.tileY))) {
+        tile.textures.faultRequested = tile.version;
+      }
+      return;
+    }
+    
+    image(tile.getTexture(level, this.colors), 
+          originX + tile.tileX * tilePx, 
+          originY + tile.tileY * tilePx,
+          tilePx,
+          tilePx
+    );
+  }
 }
\ No newline at end of file
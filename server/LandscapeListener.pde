@@ -0,0 +1,26 @@
+/**
+ * Gets notified by the Landscape whenever a cell changes or a tile is read from
+ * the MapFile.
+ *
+ * Listeners are called on the map worker thread, right after the change and with
+ * the tile still at hand, so they must be quick. Anything derived from the map
+ * (planning, clearance, ...) keeps itself up to date through this.
+ */
+interface LandscapeListener {
+  /**
+   * @param int x
+   * @param int y
+   * @param byte previous     the value of the cell before, 0 if it was unknown
+   * @param byte logOdds      the new value of the cell
+   */
+  void cellChanged(int x, int y, byte previous, byte logOdds);
+
+  /**
+   * called when the cells of a tile have been read from the MapFile, none of them
+   * is notified through cellChanged()
+   *
+   * @param int tileX
+   * @param int tileY
+   */
+  void tileLoaded(int tileX, int tileY);
+}
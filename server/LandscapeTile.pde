@@ -0,0 +1,207 @@
+/**
+ * A square tile of SIZE x SIZE Landscape cells.
+ *
+ * Cells are stored as log-odds of being blocked in a single byte each, 0 means
+ * unknown. On top of the cells the tile keeps a max-pooled pyramid down to a single
+ * value for the whole tile, and one texture per level which is brought up to date
+ * lazily when the level is drawn.
+ *
+ * Tiles are owned by the map worker. What Landscape.draw() gets to see are the
+ * TileSnapshots published from them, the version counts the changes that have
+ * been published. Only the textures are handed on to the render thread.
+ *
+ * While a tile is spilled to disk or only in the MapFile its levels and textures
+ * are released.
+ */
+class LandscapeTile {
+  final static int SHIFT  = 6;
+  final static int SIZE   = 1 << LandscapeTile.SHIFT;       // in cells
+  final static int MASK   = LandscapeTile.SIZE - 1;
+  final static int LEVELS = LandscapeTile.SHIFT + 1;
+  final static int ALL_LEVELS = (1 << LandscapeTile.LEVELS) - 1;
+
+  int tileX;
+  int tileY;
+
+  /**
+   * levels[0] are the cells, levels[n] is max-pooled from levels[n-1].
+   * cells are stored row by row, null while the tile is spilled
+   */
+  byte[][] levels;
+
+  TileTextures textures;
+
+  /**
+   * incremented whenever a changed tile is published
+   */
+  int version;
+
+  /**
+   * true if the tile changed since it has been published last
+   */
+  boolean dirty;
+
+  /**
+   * bit per level that changed since the tile has been published last
+   */
+  int changedLevels;
+
+  /**
+   * the last snapshot published of the tile, the next one shares its unchanged levels
+   */
+  TileSnapshot snapshot;
+
+  /**
+   * slot in the TileSpill holding the cells while the tile is spilled, -1 otherwise
+   */
+  int spillSlot;
+
+  /**
+   * true while the cells are in the MapFile only, they are read on the next access
+   */
+  boolean mapped;
+
+  /**
+   * true if the cells changed since they have been written to the MapFile
+   */
+  boolean unsaved;
+
+  /**
+   * millis() of the last access, used to find cold tiles
+   */
+  int lastAccess;
+
+  LandscapeTile(int tx, int ty) {
+    this(tx, ty, false);
+  }
+
+  /**
+   * @param int tx
+   * @param int ty
+   * @param boolean m     the tile is in the MapFile, its levels are allocated when it is read
+   */
+  LandscapeTile(int tx, int ty, boolean m) {
+    this.tileX        = tx;
+    this.tileY        = ty;
+    this.spillSlot    = -1;
+    this.mapped       = m;
+    this.unsaved      = false;
+    this.textures     = new TileTextures();
+    this.version      = 0;
+    this.dirty        = true;
+    this.snapshot     = null;
+
+    if (!m) {
+      this.allocate();
+    }
+  }
+
+  /**
+   * allocates empty levels, all cells unknown
+   */
+  void allocate() {
+    this.levels = new byte[LandscapeTile.LEVELS][];
+
+    for (int l = 0; l < LandscapeTile.LEVELS; l++) {
+      int edge = LandscapeTile.SIZE >> l;
+      this.levels[l] = new byte[edge * edge];
+    }
+    this.changedLevels = LandscapeTile.ALL_LEVELS;
+  }
+
+  /**
+   * @return boolean true if the cells are in memory
+   */
+  boolean isResident() {
+    return this.levels != null;
+  }
+
+  /**
+   * drops the levels, the cells must have been saved by the caller. The textures
+   * are dropped by the render thread once it draws the spilled snapshot
+   */
+  void release() {
+    this.levels = null;
+  }
+
+  /**
+   * @param int x         cell within the tile
+   * @param int y         cell within the tile
+   * @return byte log-odds
+   */
+  byte get(int x, int y) {
+    return this.levels[0][(y << LandscapeTile.SHIFT) + x];
+  }
+
+  /**
+   * @param int level
+   * @param int x         cell within the level of the tile
+   * @param int y         cell within the level of the tile
+   * @return byte highest log-odds below the given cell
+   */
+  byte getLevel(int level, int x, int y) {
+    return this.levels[level][y * (LandscapeTile.SIZE >> level) + x];
+  }
+
+  /**
+   * stores a cell and propagates the change up the pyramid as far as the maximum changes
+   *
+   * @param int x         cell within the tile
+   * @param int y         cell within the tile
+   * @param byte value    log-odds
+   * @return boolean true if the cell changed
+   */
+  boolean set(int x, int y, byte value) {
+    int i = (y << LandscapeTile.SHIFT) + x;
+
+    if (this.levels[0][i] == value) {
+      return false;
+    }
+
+    this.levels[0][i] = value;
+    this.changedLevels |= 1;
+
+    for (int l = 1; l < LandscapeTile.LEVELS; l++) {
+      x >>= 1;
+      y >>= 1;
+
+      byte v = this.pool(l, x, y);
+      i = y * (LandscapeTile.SIZE >> l) + x;
+
+      if (this.levels[l][i] == v) {
+        break;
+      }
+      this.levels[l][i] = v;
+      this.changedLevels |= 1 << l;
+    }
+
+    return true;
+  }
+
+  /**
+   * recomputes all pyramid levels from the cells, i.e. after loading them
+   */
+  void rebuildPyramid() {
+    for (int l = 1; l < LandscapeTile.LEVELS; l++) {
+      int edge = LandscapeTile.SIZE >> l;
+
+      for (int y = 0; y < edge; y++) {
+        for (int x = 0; x < edge; x++) {
+          this.levels[l][y * edge + x] = this.pool(l, x, y);
+        }
+      }
+    }
+    this.changedLevels = LandscapeTile.ALL_LEVELS;
+  }
+
+  /**
+   * maximum of the four cells of level-1 below the cell x/y of level
+   */
+  private byte pool(int level, int x, int y) {
+    byte[] below = this.levels[level - 1];
+    int edge = LandscapeTile.SIZE >> (level - 1);
+    int i = (y << 1) * edge + (x << 1);
+
+    return (byte) max(max(below[i], below[i + 1]), max(below[i + edge], below[i + edge + 1]));
+  }
+}
@@ -0,0 +1,82 @@
+import java.io.BufferedInputStream;
+import java.io.DataInputStream;
+import java.io.EOFException;
+import java.io.FileInputStream;
+
+/**
+ * Reads the records of a file written by LinkRecorder one by one.
+ *
+ * After next() returned true the record is in direction, time, length and the
+ * first length bytes of data. data is reused, copy what has to outlive the next
+ * call.
+ */
+class LinkLogReader {
+  int direction;                 // LinkRecorder.RECEIVED or SENT
+  long time;                     // in microseconds since the recording started
+  int length;
+  byte[] data;
+
+  private String path;
+  private DataInputStream in;
+
+  /**
+   * opens the file and checks its header
+   *
+   * @param String p
+   * @throws IOException      if the file can't be read or is no recording of this version
+   */
+  LinkLogReader(String p) throws IOException {
+    this.path = p;
+    this.in   = new DataInputStream(new BufferedInputStream(new FileInputStream(p), 65536));
+    this.data = new byte[1024];
+    this.time = 0;
+
+    if (this.in.readInt() != LinkRecorder.MAGIC || this.in.readInt() != LinkRecorder.VERSION) {
+      this.in.close();
+      throw new IOException(p + " is not a link recording of this version");
+    }
+  }
+
+  /**
+   * @return boolean false at the end of the file
+   * @throws IOException      if the file is truncated within a record
+   */
+  boolean next() throws IOException {
+    try {
+      this.direction = this.in.readUnsignedByte();
+    } catch (EOFException e) {
+      return false;
+    }
+    this.time  += this.readVarint();
+    this.length = (int) this.readVarint();
+
+    if (this.length > this.data.length) {
+      this.data = new byte[this.length];
+    }
+    this.in.readFully(this.data, 0, this.length);
+
+    return true;
+  }
+
+  void close() {
+    try {
+      this.in.close();
+    } catch (IOException e) {
+      println("unable to close " + this.path + ": " + e.getMessage());
+    }
+  }
+
+  private long readVarint() throws IOException {
+    long value = 0;
+    int shift = 0;
+    int b;
+
+    do {
+      b = this.in.readUnsignedByte();
+      value |= (long) (b & 0x7F) << shift;
+      shift += 7;
+    } while ((b & 0x80) != 0);
+
+    return value;
+  }
+}
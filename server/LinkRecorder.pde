@@ -0,0 +1,127 @@
+import java.io.BufferedOutputStream;
+import java.io.DataOutputStream;
+import java.io.FileOutputStream;
+
+/**
+ * Records the raw bytes of the robot link in both directions to a file.
+ *
+ * The file starts with MAGIC and VERSION as two ints, followed by one record per
+ * chunk of bytes that has been received or sent:
+ *
+ *   [direction]      one byte, RECEIVED or SENT
+ *   [delay]          microseconds since the previous record, as a varint
+ *   [length]         number of bytes, as a varint
+ *   [bytes]
+ *
+ * Varints are 7 bits per byte, low bits first, the high bit set on all but the
+ * last byte. Times are taken from System.nanoTime(), so they are monotonic. A
+ * record of a sweep's pings costs about three bytes on top of the chunk itself.
+ *
+ * record() is called from the serial event thread for received bytes and from
+ * the LinkThread for sent ones, it is synchronized. The file is flushed at most
+ * every FLUSH_INTERVAL and when the JVM shuts down. LinkReplay plays it back.
+ */
+class LinkRecorder {
+  final static int MAGIC          = 0x53424C52;    // "SBLR"
+  final static int VERSION        = 1;
+  final static int RECEIVED       = 0;
+  final static int SENT           = 1;
+  final static int FLUSH_INTERVAL = 1000;          // in ms
+
+  private DataOutputStream out;
+  private long lastTime;                           // System.nanoTime() of the last record
+  private int lastFlush;                           // millis()
+  private long records;
+  private long bytes;
+
+  /**
+   * opens the file, an existing one is overwritten
+   *
+   * @param String path
+   * @throws IOException
+   */
+  LinkRecorder(String path) throws IOException {
+    this.out       = new DataOutputStream(new BufferedOutputStream(new FileOutputStream(path), 65536));
+    this.lastTime  = System.nanoTime();
+    this.lastFlush = millis();
+    this.records   = 0;
+    this.bytes     = 0;
+
+    this.out.writeInt(LinkRecorder.MAGIC);
+    this.out.writeInt(LinkRecorder.VERSION);
+
+    Runtime.getRuntime().addShutdownHook(new Thread() {
+      public void run() {
+        LinkRecorder.this.close();
+      }
+    });
+  }
+
+  /**
+   * @return long number of bytes recorded so far
+   */
+  long getByteCount() {
+    return this.bytes;
+  }
+
+  /**
+   * appends a record, stops recording if the file can't be written
+   *
+   * @param int direction     RECEIVED or SENT
+   * @param byte[] data
+   * @param int offset
+   * @param int length
+   */
+  synchronized void record(int direction, byte[] data, int offset, int length) {
+    long now = System.nanoTime();
+
+    if (this.out == null || length <= 0) {
+      return;
+    }
+
+    try {
+      this.out.writeByte(direction);
+      this.writeVarint((now - this.lastTime) / 1000);
+      this.writeVarint(length);
+      this.out.write(data, offset, length);
+
+      // the remainder of the microsecond is carried over to the next record
+      this.lastTime = now - (now - this.lastTime) % 1000;
+      this.records++;
+      this.bytes += length;
+
+      if (millis() - this.lastFlush >= LinkRecorder.FLUSH_INTERVAL) {
+        this.out.flush();
+        this.lastFlush = millis();
+      }
+    } catch (IOException e) {
+      println("link recording stopped: " + e.getMessage());
+      this.out = null;
+    }
+  }
+
+  /**
+   * flushes and closes the file, nothing is recorded afterwards
+   */
+  synchronized void close() {
+    if (this.out == null) {
+      return;
+    }
+
+    try {
+      this.out.close();
+      println("recorded " + this.records + " chunks, " + this.bytes + " bytes of link traffic");
+    } catch (IOException e) {
+      println("unable to close link recording: " + e.getMessage());
+    }
+    this.out = null;
+  }
+
+  private void writeVarint(long value) throws IOException {
+    while (value >= 0x80) {
+      this.out.writeByte((int) (value & 0x7F) | 0x80);
+      value >>>= 7;
+    }
+    this.out.writeByte((int) value);
+  }
+}
@@ -0,0 +1,146 @@
+/**
+ * Plays a file written by LinkRecorder back into a SerialConnection that has no
+ * port, in place of the robot.
+ *
+ * Received chunks are written into the receive buffer of the connection as if
+ * they came from the serial port. Sent chunks are the commands of the recorded
+ * session: they are decoded and queued into the CommandQueue again, so the
+ * completions that follow find their command in flight. Before going on the
+ * replay waits until the LinkThread actually sent the command; it only does so
+ * once the previous command completed, so even at full speed responses never
+ * overtake the command they belong to.
+ *
+ * Records are delivered at their recorded time divided by the speed, a speed of
+ * 0 or less plays them as fast as the link and the mapping keep up. Time spent
+ * waiting for a command to be sent moves all later records along. Commands
+ * queued by anything but the replay, i.e. from the keyboard, desynchronize it.
+ *
+ * Runs on a thread of its own. When the file is through it prints how long the
+ * replay took next to how long the session lasted, which makes it a repeatable
+ * workload for profiling the parser, the CommandQueue and the mapping.
+ */
+class LinkReplay implements Runnable {
+  final static long SEND_TIMEOUT = 5000000000L;    // in ns to wait for a command to be sent
+
+  private String path;
+  private float speed;
+  private SerialConnection conn;
+  private CommandQueue commands;
+  private LinkThread link;
+  private Thread thread;
+
+  /**
+   * @param String p          file written by LinkRecorder
+   * @param float s           factor of the recorded speed, 0 for as fast as possible
+   * @param SerialConnection c
+   * @param CommandQueue q
+   * @param LinkThread l
+   */
+  LinkReplay(String p, float s, SerialConnection c, CommandQueue q, LinkThread l) {
+    this.path     = p;
+    this.speed    = s;
+    this.conn     = c;
+    this.commands = q;
+    this.link     = l;
+  }
+
+  void start() {
+    this.thread = new Thread(this, "SonarBot replay");
+    this.thread.setDaemon(true);
+    this.thread.start();
+  }
+
+  public void run() {
+    long begin = System.nanoTime();
+    long start = begin;
+    long chunks = 0;
+    long bytes = 0;
+    long due, late;
+    LinkLogReader log;
+
+    try {
+      log = new LinkLogReader(this.path);
+    } catch (IOException e) {
+      println("unable to replay " + this.path + ": " + e.getMessage());
+      return;
+    }
+    println("replaying " + this.path + (this.speed > 0 ? " at " + this.speed + "x" : " as fast as possible"));
+
+    try {
+      while (log.next()) {
+        if (this.speed > 0) {
+          due = start + (long) (1000 * log.time / this.speed);
+
+          while (System.nanoTime() < due) {
+            LockSupport.parkNanos(due - System.nanoTime());
+          }
+        }
+
+        if (log.direction == LinkRecorder.RECEIVED) {
+          this.receive(log.data, log.length);
+        } else if (!this.send(log.data, log.length)) {
+          break;
+        }
+
+        if (this.speed > 0) {
+          // waiting on the link must not make the following records pile up
+          late = System.nanoTime() - (start + (long) (1000 * log.time / this.speed));
+          if (late > 0) {
+            start += late;
+          }
+        }
+
+        chunks++;
+        bytes += log.length;
+      }
+    } catch (IOException e) {
+      println("replay of " + this.path + " stopped: " + e.getMessage());
+    }
+    log.close();
+
+    println("replayed " + chunks + " chunks, " + bytes + " bytes of " + nf(log.time / 1000000.0, 1, 1)
+            + " s in " + nf((System.nanoTime() - begin) / 1000000000.0, 1, 1) + " s");
+  }
+
+  /**
+   * hands the chunk over as received bytes, waits for room in the receive buffer
+   */
+  private void receive(byte[] chunk, int length) {
+    int written = 0;
+
+    while (written < length) {
+      written += this.conn.inject(chunk, written, length - written);
+      this.link.wake();
+
+      if (written < length) {
+        LockSupport.parkNanos(LinkThread.POLL_INTERVAL);
+      }
+    }
+  }
+
+  /**
+   * queues the command of the chunk and waits until the link thread sent it.
+   * chunks that are no command, i.e. the wake-up byte, are skipped
+   *
+   * @return boolean false if the command was not sent in time
+   */
+  private boolean send(byte[] chunk, int length) {
+    long sent = this.conn.getFramesWritten();
+    long timeout = System.nanoTime() + LinkReplay.SEND_TIMEOUT;
+
+    if (!this.commands.cmdFrame(chunk, 0, length)) {
+      return true;
+    }
+    this.link.wake();
+
+    while (this.conn.getFramesWritten() == sent) {
+      if (System.nanoTime() > timeout) {
+        println("replay stopped: the recorded command " + (char) chunk[1] + " was not sent");
+        return false;
+      }
+      LockSupport.parkNanos(LinkThread.POLL_INTERVAL);
+    }
+
+    return true;
+  }
+}
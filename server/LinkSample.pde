@@ -0,0 +1,53 @@
+/**
+ * What LinkStats measured over one SAMPLE_INTERVAL, published to the render thread.
+ *
+ * Never changes once it has been published. The latency histograms count every
+ * command since the start, the percentiles are of the interval only.
+ */
+class LinkSample {
+  int time;                      // millis() at the end of the interval
+  float rxRate;                  // in bytes per second
+  float txRate;                  // in bytes per second
+  int commandQueue;              // depth at the end of the interval
+  int commandQueueMax;
+  int inputQueueMax;
+  int parseErrors;               // since the start
+  int resyncs;                   // since the start
+
+  /**
+   * per opcode of LinkStats.OPCODES: completed commands in the interval and the
+   * 50th and 90th percentile and the maximum of their round-trip time in ms, 0 if none
+   */
+  int[] count;
+  float[] p50;
+  float[] p90;
+  float[] max;
+
+  /**
+   * per opcode: mean split of the round-trip time in ms of the commands in the
+   * interval whose completion carried the robot's timestamps, 0 if none. link is
+   * everything off the robot, wait from receiving the frame to starting it and
+   * exec its execution; the three add up to the mean round-trip time
+   */
+  int[] timed;
+  float[] link;
+  float[] wait;
+  float[] exec;
+
+  /**
+   * per opcode, commands per bucket of LinkStats.bucketOf() since the start
+   */
+  int[][] histograms;
+
+  LinkSample(int opcodes) {
+    this.count      = new int[opcodes];
+    this.p50        = new float[opcodes];
+    this.p90        = new float[opcodes];
+    this.max        = new float[opcodes];
+    this.timed      = new int[opcodes];
+    this.link       = new float[opcodes];
+    this.wait       = new float[opcodes];
+    this.exec       = new float[opcodes];
+    this.histograms = new int[opcodes][];
+  }
+}
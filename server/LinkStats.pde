@@ -0,0 +1,284 @@
+/**
+ * Measures the robot link: round-trip time per opcode, bytes per second in each
+ * direction, depths of the command and input queues, parse errors and resyncs.
+ *
+ * The round-trip time of a command runs from handing its frame to the serial
+ * port until its completion has been parsed, as seen by the LinkThread, so it
+ * includes up to one LinkThread.POLL_INTERVAL of waiting. It goes into a
+ * histogram of BUCKETS_PER_OCTAVE buckets per doubling from 1 ms on.
+ *
+ * Completions from current firmware carry the robot's us_ticker times of the
+ * command, which split the round-trip time into time on the robot, waiting and
+ * executing, and link time, the rest: serial ports, radios and the LinkThread.
+ * Only differences between the robot's times are used, so its clock never needs
+ * to be matched with ours.
+ *
+ * All counting happens on the LinkThread, through the CommandQueue. Every
+ * SAMPLE_INTERVAL the interval is summed up into a LinkSample which replaces the
+ * previous one with a single volatile write; drawLinkStats() reads that without
+ * locking. With a CSV file set, every sample is appended to it as a row.
+ */
+class LinkStats {
+  final static String OPCODES           = "blrmecwpsf";  // CommandQueue.CMD_*
+  final static int BUCKETS_PER_OCTAVE   = 4;
+  final static int OCTAVES              = 15;             // up to 32 s
+  final static int BUCKETS              = 1 + LinkStats.BUCKETS_PER_OCTAVE * LinkStats.OCTAVES;
+  final static int SAMPLE_INTERVAL      = 1000;           // in ms
+
+  private SerialConnection conn;
+  private PrintWriter csv;
+
+  private int[][] histograms;                             // since the start
+  private int[][] interval;                               // since the last sample
+  private float[] intervalMax;
+  private int[] intervalTimed;
+  private long[] intervalLink;                            // sums in us
+  private long[] intervalWait;
+  private long[] intervalExec;
+
+  private int sentOpcode;                                 // index into OPCODES, -1 if none in flight
+  private long sentAt;                                    // System.nanoTime()
+
+  private int lastSample;                                 // millis()
+  private long lastReceived;
+  private long lastSent;
+  private int commandQueue;
+  private int commandQueueMax;
+  private int inputQueueMax;
+
+  private volatile LinkSample published;
+
+  /**
+   * @param SerialConnection c      its byte counters and parser are read
+   */
+  LinkStats(SerialConnection c) {
+    int opcodes = LinkStats.OPCODES.length();
+
+    this.conn          = c;
+    this.csv           = null;
+    this.histograms    = new int[opcodes][LinkStats.BUCKETS];
+    this.interval      = new int[opcodes][LinkStats.BUCKETS];
+    this.intervalMax   = new float[opcodes];
+    this.intervalTimed = new int[opcodes];
+    this.intervalLink  = new long[opcodes];
+    this.intervalWait  = new long[opcodes];
+    this.intervalExec  = new long[opcodes];
+    this.sentOpcode    = -1;
+    this.lastSample    = millis();
+    this.published     = null;
+  }
+
+  /**
+   * appends every sample to a CSV file from now on, an existing file is overwritten
+   *
+   * @param String path
+   */
+  void writeCsv(String path) {
+    StringBuilder header = new StringBuilder("time_ms,rx_bytes_s,tx_bytes_s,command_queue,command_queue_max,input_queue_max,parse_errors,resyncs");
+
+    this.csv = createWriter(path);
+
+    for (int i = 0; i < LinkStats.OPCODES.length(); i++) {
+      char op = LinkStats.OPCODES.charAt(i);
+
+      header.append("," + op + "_count," + op + "_p50_ms," + op + "_p90_ms," + op + "_max_ms")
+            .append("," + op + "_link_ms," + op + "_wait_ms," + op + "_exec_ms");
+    }
+    this.csv.println(header);
+    this.csv.flush();
+  }
+
+  /**
+   * @return LinkSample the latest sample, null before the first one
+   */
+  LinkSample getSample() {
+    return this.published;
+  }
+
+  /**
+   * @param long us       round-trip time in microseconds
+   * @return int histogram bucket, 0 for less than 1 ms
+   */
+  int bucketOf(long us) {
+    if (us < 1000) {
+      return 0;
+    }
+
+    return min(LinkStats.BUCKETS - 1, 1 + (int) (LinkStats.BUCKETS_PER_OCTAVE * log(us / 1000.0) / log(2)));
+  }
+
+  /**
+   * @param int bucket
+   * @return float the round-trip time in ms a bucket stands for, its geometric middle
+   */
+  float bucketMs(int bucket) {
+    if (bucket == 0) {
+      return 0.5;
+    }
+
+    return pow(2, (bucket - 0.5) / LinkStats.BUCKETS_PER_OCTAVE);
+  }
+
+  /**
+   * called by the CommandQueue when a frame has been handed to the port
+   *
+   * @param char cmd
+   */
+  void commandSent(char cmd) {
+    this.sentOpcode = LinkStats.OPCODES.indexOf(cmd);
+    this.sentAt     = System.nanoTime();
+  }
+
+  /**
+   * called by the CommandQueue when the completion of the command in flight arrived
+   *
+   * @param CompletionResult completion
+   */
+  void commandCompleted(CompletionResult completion) {
+    int op = this.sentOpcode;
+    long us;
+    long bot;
+    long wait;
+    int b;
+
+    if (op < 0) {
+      return;
+    }
+
+    us = (System.nanoTime() - this.sentAt) / 1000;
+    b  = this.bucketOf(us);
+
+    this.histograms[op][b]++;
+    this.interval[op][b]++;
+    this.intervalMax[op] = max(this.intervalMax[op], us / 1000.0);
+    this.sentOpcode = -1;
+
+    if (completion.timed) {
+      // our clock and the robot's do not tick exactly alike, keep the parts within the round trip
+      bot  = min(us, completion.getBotTime());
+      wait = min(bot, completion.getWaitTime());
+
+      this.intervalTimed[op]++;
+      this.intervalLink[op] += us - bot;
+      this.intervalWait[op] += wait;
+      this.intervalExec[op] += bot - wait;
+    }
+  }
+
+  /**
+   * called by the CommandQueue once per pass, right after reading the responses
+   *
+   * @param int commands      depth of the command queue
+   * @param int responses     depth of the input queue
+   */
+  void sampleQueues(int commands, int responses) {
+    this.commandQueue    = commands;
+    this.commandQueueMax = max(this.commandQueueMax, commands);
+    this.inputQueueMax   = max(this.inputQueueMax, responses);
+  }
+
+  /**
+   * publishes a sample once per SAMPLE_INTERVAL, called by the CommandQueue once per pass
+   */
+  void tick() {
+    int now = millis();
+    float seconds = (now - this.lastSample) / 1000.0;
+    long received = this.conn.getBytesReceived();
+    long sent = this.conn.getBytesSent();
+    LinkSample sample;
+
+    if (now - this.lastSample < LinkStats.SAMPLE_INTERVAL) {
+      return;
+    }
+
+    sample                 = new LinkSample(LinkStats.OPCODES.length());
+    sample.time            = now;
+    sample.rxRate          = (received - this.lastReceived) / seconds;
+    sample.txRate          = (sent - this.lastSent) / seconds;
+    sample.commandQueue    = this.commandQueue;
+    sample.commandQueueMax = this.commandQueueMax;
+    sample.inputQueueMax   = this.inputQueueMax;
+    sample.parseErrors     = this.conn.parser.getParseErrors();
+    sample.resyncs         = this.conn.parser.getResyncs();
+
+    for (int i = 0; i < LinkStats.OPCODES.length(); i++) {
+      for (int b = 0; b < LinkStats.BUCKETS; b++) {
+        sample.count[i] += this.interval[i][b];
+      }
+      sample.p50[i]        = this.percentile(this.interval[i], sample.count[i], 0.5);
+      sample.p90[i]        = this.percentile(this.interval[i], sample.count[i], 0.9);
+      sample.max[i]        = this.intervalMax[i];
+      sample.timed[i]      = this.intervalTimed[i];
+      if (this.intervalTimed[i] > 0) {
+        sample.link[i]     = this.intervalLink[i] / 1000.0 / this.intervalTimed[i];
+        sample.wait[i]     = this.intervalWait[i] / 1000.0 / this.intervalTimed[i];
+        sample.exec[i]     = this.intervalExec[i] / 1000.0 / this.intervalTimed[i];
+      }
+      sample.histograms[i] = this.histograms[i].clone();
+
+      java.util.Arrays.fill(this.interval[i], 0);
+      this.intervalMax[i]   = 0;
+      this.intervalTimed[i] = 0;
+      this.intervalLink[i]  = 0;
+      this.intervalWait[i]  = 0;
+      this.intervalExec[i]  = 0;
+    }
+
+    this.lastSample      = now;
+    this.lastReceived    = received;
+    this.lastSent        = sent;
+    this.commandQueueMax = this.commandQueue;
+    this.inputQueueMax   = 0;
+    this.published       = sample;
+
+    if (this.csv != null) {
+      this.writeRow(sample);
+    }
+  }
+
+  /**
+   * @return float the round-trip time in ms below which the given fraction of the commands completed
+   */
+  private float percentile(int[] histogram, int count, float fraction) {
+    int seen = 0;
+
+    if (count == 0) {
+      return 0;
+    }
+
+    for (int b = 0; b < LinkStats.BUCKETS; b++) {
+      seen += histogram[b];
+
+      if (seen >= fraction * count) {
+        return this.bucketMs(b);
+      }
+    }
+
+    return this.bucketMs(LinkStats.BUCKETS - 1);
+  }
+
+  private void writeRow(LinkSample s) {
+    StringBuilder row = new StringBuilder();
+
+    row.append(s.time).append(',').append(this.hundredths(s.rxRate)).append(',').append(this.hundredths(s.txRate))
+       .append(',').append(s.commandQueue).append(',').append(s.commandQueueMax).append(',').append(s.inputQueueMax)
+       .append(',').append(s.parseErrors).append(',').append(s.resyncs);
+
+    for (int i = 0; i < LinkStats.OPCODES.length(); i++) {
+      row.append(',').append(s.count[i]).append(',').append(this.hundredths(s.p50[i]))
+         .append(',').append(this.hundredths(s.p90[i])).append(',').append(this.hundredths(s.max[i]))
+         .append(',').append(this.hundredths(s.link[i])).append(',').append(this.hundredths(s.wait[i]))
+         .append(',').append(this.hundredths(s.exec[i]));
+    }
+
+    this.csv.println(row);
+    this.csv.flush();
+  }
+
+  /**
+   * rounds for the CSV, nf() would use the decimal separator of the locale
+   */
+  private float hundredths(float value) {
+    return round(value * 100) / 100.0;
+  }
+}
@@ -0,0 +1,57 @@
+import java.util.concurrent.locks.LockSupport;
+
+/**
+ * Runs the robot link on its own thread.
+ *
+ * Reads and parses everything received over serial, resolves responses against
+ * the command in flight and sends the next queued command, independent of the 
+ * frame rate of draw(). Decoded responses are handed to draw() through the 
+ * EventQueue of the CommandQueue.
+ *
+ * The thread parks between passes and is woken up by wake() as soon as new bytes
+ * arrive, at the latest after POLL_INTERVAL.
+ */
+class LinkThread implements Runnable {
+  private SerialConnection conn;
+  private CommandQueue commandHandler;
+  private Thread thread;
+  private volatile boolean running;
+
+  final static long POLL_INTERVAL = 1000000;     // in ns
+
+  LinkThread(SerialConnection c, CommandQueue q) {
+    this.conn           = c;
+    this.commandHandler = q;
+    this.running        = false;
+  }
+
+  void start() {
+    this.running = true;
+    this.thread  = new Thread(this, "SonarBot link");
+    this.thread.setDaemon(true);
+    this.thread.start();
+  }
+
+  void stop() {
+    this.running = false;
+    this.wake();
+  }
+
+  /**
+   * wakes the link thread up, i.e. from serialEvent() when new bytes arrived
+   */
+  void wake() {
+    if (this.thread != null) {
+      LockSupport.unpark(this.thread);
+    }
+  }
+
+  public void run() {
+    while (this.running) {
+      this.conn.processSerial();
+      this.commandHandler.processQueues();
+
+      LockSupport.parkNanos(LinkThread.POLL_INTERVAL);
+    }
+  }
+}
@@ -0,0 +1,22 @@
+/**
+ * Estimates where a sweep has really been taken.
+ *
+ * Called by the MapWorker for every completed sweep before it is integrated. The
+ * returned correction moves the sweep, and through draw() the SonarBot, from the
+ * pose odometry claims to the estimated one.
+ */
+interface Localizer {
+  /**
+   * @param SonarSweep sweep
+   * @return PoseCorrection     never null, from and to are equal if there is no better estimate
+   */
+  PoseCorrection locate(SonarSweep sweep);
+
+  /**
+   * called when the pose of the last located sweep has been moved once more after
+   * locate(), i.e. by closing a loop, so the next sweep continues from there
+   *
+   * @param PoseCorrection c     from the pose locate() returned to the new one
+   */
+  void relocate(PoseCorrection c);
+}
@@ -0,0 +1,444 @@
+import java.lang.reflect.Method;
+import java.nio.file.Files;
+import java.nio.file.StandardCopyOption;
+import java.util.zip.DataFormatException;
+import java.util.zip.Deflater;
+import java.util.zip.Inflater;
+
+/**
+ * Keeps the cells of LandscapeTiles on disk, compressed, so a map survives the
+ * sketch.
+ *
+ * The file is a log. A header of HEADER_SIZE bytes holds MAGIC, VERSION and the
+ * offset of the latest tile index, then records are appended one after the other:
+ *
+ *   TAG_TILE   [tx][ty][length][length bytes]     cells of a tile, deflated
+ *   TAG_INDEX  [count]([tx][ty][offset])*count     offsets of the latest record of every tile
+ *
+ * Coordinates and lengths are ints, offsets longs. A tile that changes gets a new
+ * record, the old one becomes garbage. Opening a file reads the index the header
+ * points at and then every record after it, so the tiles written since are found
+ * too; a record cut short by a crash ends the file. The tile records after the
+ * index are thus the changes to it: checkpoint() only forces them to disk, and
+ * appends a new index and points the header at it once the tiles changed since
+ * the last one make up INDEX_RATIO of it. Writing the index costs about as much
+ * as the tiles changed, not as the map is large.
+ *
+ * Once the garbage outweighs the live records COMPACT_RATIO times, checkpoint()
+ * rewrites the file with only the latest record of each tile into a new file,
+ * which then atomically replaces the old one.
+ *
+ * Opening maps the file into memory and reads nothing but the index and what
+ * follows it, so it takes about as long as the index is large. Cells are inflated
+ * when the Landscape faults a tile in, records appended since the file has been
+ * opened are read from the channel. Used by the MapWorker only.
+ */
+class MapFile {
+  final static int MAGIC         = 0x53424D46;      // "SBMF"
+  final static int VERSION       = 1;
+  final static int HEADER_SIZE   = 16;
+  final static byte TAG_TILE     = 'T';
+  final static byte TAG_INDEX    = 'I';
+  final static int TILE_HEADER   = 13;              // tag, tx, ty, length
+  final static int INDEX_ENTRY   = 16;              // tx, ty, offset
+  final static int COMPACT_RATIO = 3;
+  final static int INDEX_RATIO   = 4;               // a new index once 1/INDEX_RATIO of the tiles changed
+  final static long COMPACT_MIN  = 1 << 20;         // in bytes, smaller files are never compacted
+  final static int CELLS         = LandscapeTile.SIZE * LandscapeTile.SIZE;
+
+  private String path;
+  private RandomAccessFile file;
+  private FileChannel channel;
+  private MappedByteBuffer mapping;                 // the file as it was opened
+  private long end;                                 // where the next record goes
+  private int changedTiles;                         // records since the last index
+
+  /**
+   * offset and size of the latest record of every tile, by tile key
+   */
+  private HashMap<Long, long[]> index;
+  private long liveBytes;
+
+  private Deflater deflater;
+  private Inflater inflater;
+  private byte[] packed;
+  private ByteBuffer packedBuffer;                  // wraps packed for the channel
+
+  /**
+   * opens a map file or creates an empty one
+   *
+   * @param String p
+   * @throws IOException      if the file can't be opened or is no map file of this version
+   */
+  MapFile(String p) throws IOException {
+    this.path     = p;
+    this.index    = new HashMap<Long, long[]>();
+    this.deflater = new Deflater(Deflater.BEST_SPEED);
+    this.inflater = new Inflater();
+    this.packed   = new byte[2 * MapFile.CELLS];
+    this.packedBuffer = ByteBuffer.wrap(this.packed);
+
+    this.open();
+  }
+
+  /**
+   * @return ArrayList<Long> keys of all tiles in the file, the same as Landscape uses
+   */
+  ArrayList<Long> getTiles() {
+    return new ArrayList<Long>(this.index.keySet());
+  }
+
+  /**
+   * @return long size of the file in bytes
+   */
+  long size() {
+    return this.end;
+  }
+
+  /**
+   * inflates the cells of a tile
+   *
+   * @param int tx
+   * @param int ty
+   * @param byte[] cells
+   * @return boolean false if the tile is not in the file or its record is damaged
+   */
+  boolean read(int tx, int ty, byte[] cells) {
+    long[] entry = this.index.get(this.tileKey(tx, ty));
+    int length;
+
+    if (entry == null) {
+      return false;
+    }
+
+    try {
+      length = (int) entry[1] - MapFile.TILE_HEADER;
+
+      if (entry[0] + entry[1] <= this.mapping.capacity()) {
+        this.mapping.position((int) entry[0] + MapFile.TILE_HEADER);
+        this.mapping.get(this.packed, 0, length);
+      } else {
+        // written after the file has been mapped
+        this.packedBuffer.clear();
+        this.packedBuffer.limit(length);
+        while (this.packedBuffer.hasRemaining()) {
+          if (this.channel.read(this.packedBuffer, entry[0] + MapFile.TILE_HEADER + this.packedBuffer.position()) < 0) {
+            throw new IOException("the record ends early");
+          }
+        }
+      }
+
+      this.inflater.reset();
+      this.inflater.setInput(this.packed, 0, length);
+
+      return this.inflater.inflate(cells, 0, MapFile.CELLS) == MapFile.CELLS;
+    } catch (IOException e) {
+      println("unable to read tile " + tx + "/" + ty + " from " + this.path + ": " + e.getMessage());
+    } catch (DataFormatException e) {
+      println("tile " + tx + "/" + ty + " in " + this.path + " is damaged");
+    }
+
+    return false;
+  }
+
+  /**
+   * appends a record with the cells of a tile, it replaces the previous one
+   *
+   * @param int tx
+   * @param int ty
+   * @param byte[] cells
+   * @return boolean false on error
+   */
+  boolean write(int tx, int ty, byte[] cells) {
+    ByteBuffer record;
+    long[] previous;
+    int length = 0;
+
+    this.deflater.reset();
+    this.deflater.setInput(cells, 0, MapFile.CELLS);
+    this.deflater.finish();
+
+    while (!this.deflater.finished()) {
+      length += this.deflater.deflate(this.packed, length, this.packed.length - length);
+    }
+
+    record = ByteBuffer.allocate(MapFile.TILE_HEADER + length);
+    record.put(MapFile.TAG_TILE).putInt(tx).putInt(ty).putInt(length).put(this.packed, 0, length);
+    record.flip();
+
+    try {
+      this.writeFully(record, this.end);
+    } catch (IOException e) {
+      println("unable to write tile " + tx + "/" + ty + " to " + this.path + ": " + e.getMessage());
+      return false;
+    }
+
+    previous = this.index.put(this.tileKey(tx, ty), new long[] {this.end, record.limit()});
+    if (previous != null) {
+      this.liveBytes -= previous[1];
+    }
+    this.liveBytes += record.limit();
+    this.end       += record.limit();
+    this.changedTiles++;
+
+    return true;
+  }
+
+  /**
+   * forces the records written so far to disk, appends the index and points the
+   * header at it if enough tiles changed since the last one. Compacts the file
+   * instead if it is mostly garbage
+   *
+   * @return boolean false on error
+   */
+  boolean checkpoint() {
+    try {
+      if (this.end > MapFile.COMPACT_MIN && this.end - this.liveBytes > MapFile.COMPACT_RATIO * this.liveBytes) {
+        this.compact();
+      } else if (this.changedTiles * MapFile.INDEX_RATIO >= this.index.size()) {
+        this.writeIndex(this.channel, this.end, this.index);
+        this.end += 5 + this.index.size() * MapFile.INDEX_ENTRY;
+        this.changedTiles = 0;
+      } else {
+        this.channel.force(false);
+      }
+      return true;
+    } catch (IOException e) {
+      println("unable to write the index of " + this.path + ": " + e.getMessage());
+      return false;
+    }
+  }
+
+  void close() {
+    this.unmap();
+
+    try {
+      this.channel.close();
+      this.file.close();
+    } catch (IOException e) {
+      println("unable to close " + this.path + ": " + e.getMessage());
+    }
+  }
+
+  /**
+   * opens the file, reads the index and the records after it
+   */
+  private void open() throws IOException {
+    long size, offset;
+    ByteBuffer header;
+
+    this.file    = new RandomAccessFile(this.path, "rw");
+    this.channel = this.file.getChannel();
+    size         = this.channel.size();
+    this.index.clear();
+    this.liveBytes    = 0;
+    this.changedTiles = 0;
+
+    if (size == 0) {
+      header = ByteBuffer.allocate(MapFile.HEADER_SIZE);
+      header.putInt(MapFile.MAGIC).putInt(MapFile.VERSION).putLong(0);
+      header.flip();
+      this.writeFully(header, 0);
+      size = MapFile.HEADER_SIZE;
+    }
+
+    this.mapping = this.channel.map(FileChannel.MapMode.READ_ONLY, 0, size);
+
+    if (size < MapFile.HEADER_SIZE || this.mapping.getInt(0) != MapFile.MAGIC || this.mapping.getInt(4) != MapFile.VERSION) {
+      this.close();
+      throw new IOException(this.path + " is not a map file of this version");
+    }
+
+    offset   = this.mapping.getLong(8);
+    this.end = this.scan(offset > 0 ? offset : MapFile.HEADER_SIZE, size);
+
+    if (this.end < size) {
+      println("ignoring " + (size - this.end) + " bytes at the end of " + this.path);
+    }
+  }
+
+  /**
+   * reads the records from offset on
+   *
+   * @return long offset of the first byte that is not part of a complete record
+   */
+  private long scan(long offset, long size) {
+    int count, length;
+    long[] previous;
+
+    while (offset < size) {
+      if (this.mapping.get((int) offset) == MapFile.TAG_TILE && offset + MapFile.TILE_HEADER <= size) {
+        length = this.mapping.getInt((int) offset + 9);
+
+        if (length < 0 || offset + MapFile.TILE_HEADER + length > size) {
+          break;
+        }
+
+        previous = this.index.put(this.tileKey(this.mapping.getInt((int) offset + 1), this.mapping.getInt((int) offset + 5)),
+                                  new long[] {offset, MapFile.TILE_HEADER + length});
+        if (previous != null) {
+          this.liveBytes -= previous[1];
+        }
+        this.liveBytes += MapFile.TILE_HEADER + length;
+        offset         += MapFile.TILE_HEADER + length;
+        this.changedTiles++;
+
+      } else if (this.mapping.get((int) offset) == MapFile.TAG_INDEX && offset + 5 <= size) {
+        count = this.mapping.getInt((int) offset + 1);
+
+        if (count < 0 || offset + 5 + (long) count * MapFile.INDEX_ENTRY > size) {
+          break;
+        }
+
+        // a complete index of all tiles, replaces whatever has been read so far
+        this.index.clear();
+        this.liveBytes    = 0;
+        this.changedTiles = 0;
+        for (int i = 0; i < count; i++) {
+          int e = (int) offset + 5 + i * MapFile.INDEX_ENTRY;
+          long at = this.mapping.getLong(e + 8);
+
+          if (at < MapFile.HEADER_SIZE || at + MapFile.TILE_HEADER > size) {
+            continue;
+          }
+          length = MapFile.TILE_HEADER + this.mapping.getInt((int) at + 9);
+          this.index.put(this.tileKey(this.mapping.getInt(e), this.mapping.getInt(e + 4)), new long[] {at, length});
+          this.liveBytes += length;
+        }
+        offset += 5 + (long) count * MapFile.INDEX_ENTRY;
+
+      } else {
+        break;
+      }
+    }
+
+    return offset;
+  }
+
+  /**
+   * writes an index record to a channel at the given offset and points the header
+   * of that channel at it
+   */
+  private void writeIndex(FileChannel target, long at, HashMap<Long, long[]> entries) throws IOException {
+    ByteBuffer buffer = ByteBuffer.allocate(5 + entries.size() * MapFile.INDEX_ENTRY);
+    ByteBuffer header = ByteBuffer.allocate(8);
+
+    buffer.put(MapFile.TAG_INDEX).putInt(entries.size());
+    for (Long key : entries.keySet()) {
+      buffer.putInt((int) (key >> 32)).putInt((int) (long) key).putLong(entries.get(key)[0]);
+    }
+    buffer.flip();
+
+    while (buffer.hasRemaining()) {
+      target.write(buffer, at + buffer.position());
+    }
+    target.force(false);
+
+    // only once the index is on disk
+    header.putLong(at);
+    header.flip();
+    while (header.hasRemaining()) {
+      target.write(header, 8 + header.position());
+    }
+    target.force(false);
+  }
+
+  /**
+   * writes the latest record of every tile into a new file and replaces this one
+   * with it in one step, a crash leaves either of them in place
+   */
+  private void compact() throws IOException {
+    File target = new File(this.path + ".tmp");
+    HashMap<Long, long[]> moved = new HashMap<Long, long[]>();
+    RandomAccessFile out;
+    FileChannel channel;
+    ByteBuffer record;
+    long[] entry;
+    long at = MapFile.HEADER_SIZE;
+    long before = this.end;
+    IOException failure = null;
+
+    target.delete();
+    out     = new RandomAccessFile(target, "rw");
+    channel = out.getChannel();
+
+    record = ByteBuffer.allocate(MapFile.HEADER_SIZE);
+    record.putInt(MapFile.MAGIC).putInt(MapFile.VERSION).putLong(0);
+    record.flip();
+    while (record.hasRemaining()) {
+      channel.write(record, record.position());
+    }
+
+    for (Long key : this.index.keySet()) {
+      entry  = this.index.get(key);
+      record = ByteBuffer.allocate((int) entry[1]);
+      while (record.hasRemaining()) {
+        this.channel.read(record, entry[0] + record.position());
+      }
+      record.flip();
+      while (record.hasRemaining()) {
+        channel.write(record, at + record.position());
+      }
+      moved.put(key, new long[] {at, entry[1]});
+      at += entry[1];
+    }
+
+    this.writeIndex(channel, at, moved);
+    channel.close();
+    out.close();
+
+    // nothing may keep the old file open, Windows refuses to replace it otherwise
+    this.close();
+    try {
+      Files.move(target.toPath(), new File(this.path).toPath(),
+                 StandardCopyOption.REPLACE_EXISTING, StandardCopyOption.ATOMIC_MOVE);
+    } catch (IOException e) {
+      failure = e;
+    }
+    this.open();
+
+    if (failure != null) {
+      throw new IOException("unable to replace " + this.path + " with " + target + ": " + failure.getMessage());
+    }
+
+    println("compacted " + this.path + " from " + before / 1024 + " to " + this.end / 1024 + " kB");
+  }
+
+  /**
+   * releases the mapping right away instead of whenever the garbage collector
+   * gets to it, a mapped file can't be replaced on Windows
+   */
+  private void unmap() {
+    Method cleaner;
+    Object c;
+
+    if (this.mapping == null) {
+      return;
+    }
+
+    try {
+      cleaner = this.mapping.getClass().getMethod("cleaner");
+      cleaner.setAccessible(true);
+      c = cleaner.invoke(this.mapping);
+      if (c != null) {
+        c.getClass().getMethod("clean").invoke(c);
+      }
+    } catch (Exception e) {
+      // not on this JVM, the mapping goes with the garbage collector
+    }
+    this.mapping = null;
+  }
+
+  private void writeFully(ByteBuffer buffer, long at) throws IOException {
+    while (buffer.hasRemaining()) {
+      this.channel.write(buffer, at + buffer.position());
+    }
+  }
+
+  /**
+   * @return Long same key as the Landscape uses for its tiles
+   */
+  private Long tileKey(int tx, int ty) {
+    return ((long) tx << 32) | (ty & 0xFFFFFFFFL);
+  }
+}
@@ -0,0 +1,376 @@
+import java.util.Iterator;
+import java.util.LinkedHashSet;
+
+/**
+ * Keeps the Landscape in line with the ObservationStore.
+ *
+ * Each pass the poses appended to the store since the last one are integrated
+ * into the Landscape. Integrated poses are indexed by the tiles their pings
+ * reach, one list of poses per tile.
+ *
+ * A pose corrected after the fact leaves its pings in the wrong cells. The tiles
+ * the moved pose reached before and reaches now are marked stale, and are redone
+ * one by one later on: the pings of all poses indexed for the tile are integrated
+ * in the order they have been taken into a buffer of the tile, the cells that
+ * come out different are written to the Landscape. Its listeners only hear of
+ * those. Tiles no moved pose ever reached are left alone, so closing a loop
+ * costs about the area it corrects, not the whole map.
+ *
+ * Tiles loaded from a MapFile have no observations behind them. Their cells are
+ * kept as they were when the first pose reached them, and a tile is redone on
+ * top of those instead of from scratch, so a loop closure doesn't erase them.
+ *
+ * Both kinds of work share BUDGET ms per pass, new poses go first. Runs on the
+ * MapWorker.
+ *
+ * The BatchMapper indexes a whole store at once with indexAll() and renders the
+ * tiles on several threads with renderTile(), each with buffers of its own.
+ */
+class MapRenderer implements Runnable {
+  final static int BUDGET = 5;                   // in ms per pass
+
+  private ObservationStore store;
+  private Landscape landscape;
+  private OccupancyUpdater updater;
+
+  /**
+   * poses below this have been integrated
+   */
+  private int integratedPoses;
+
+  /**
+   * range of tiles each integrated pose has been indexed for: min x, min y, max x, max y
+   */
+  private int[] footprints;
+
+  private HashMap<Long, IntList> tilePoses;
+  private LinkedHashSet<Long> staleTiles;
+
+  /**
+   * cells of the tiles that weren't empty before the first pose reached them
+   */
+  private HashMap<Long, byte[]> baseCells;
+
+  /**
+   * the tile being redone
+   */
+  private byte[] cells;
+
+  /**
+   * cell bounds of a ping, see pingBounds()
+   */
+  private int[] bounds;
+
+  private int renderedTiles;
+
+  /**
+   * @param ObservationStore s
+   * @param Landscape l
+   */
+  MapRenderer(ObservationStore s, Landscape l) {
+    this.store           = s;
+    this.landscape       = l;
+    this.updater         = new OccupancyUpdater(l);
+    this.integratedPoses = 0;
+    this.footprints      = new int[4 * 64];
+    this.tilePoses       = new HashMap<Long, IntList>();
+    this.staleTiles      = new LinkedHashSet<Long>();
+    this.baseCells       = new HashMap<Long, byte[]>();
+    this.cells           = new byte[LandscapeTile.SIZE * LandscapeTile.SIZE];
+    this.bounds          = new int[4];
+    this.renderedTiles   = 0;
+  }
+
+  /**
+   * @return int number of tiles waiting to be redone
+   */
+  int getStaleCount() {
+    return this.staleTiles.size();
+  }
+
+  /**
+   * @return int number of tiles that have been redone
+   */
+  int getRenderedCount() {
+    return this.renderedTiles;
+  }
+
+  /**
+   * @return int number of poses not integrated yet
+   */
+  int getBacklog() {
+    return this.store.getPoseCount() - this.integratedPoses;
+  }
+
+  /**
+   * indexes all poses of the store that are new without integrating them
+   */
+  void indexAll() {
+    for (; this.integratedPoses < this.store.getPoseCount(); this.integratedPoses++) {
+      this.grow(this.integratedPoses);
+      this.index(this.integratedPoses);
+    }
+  }
+
+  /**
+   * @return ArrayList<Long> keys of all tiles some pose reaches, see tileKey()
+   */
+  ArrayList<Long> getTiles() {
+    return new ArrayList<Long>(this.tilePoses.keySet());
+  }
+
+  /**
+   * integrates new poses and redoes stale tiles for one pass
+   */
+  public void run() {
+    int deadline = millis() + MapRenderer.BUDGET;
+    IntList moved = this.store.takeMovedPoses();
+    Iterator<Long> stale;
+    Long key;
+
+    // poses that haven't been integrated yet will be at their new pose anyway
+    for (int i = 0; i < moved.size(); i++) {
+      if (moved.get(i) < this.integratedPoses) {
+        this.reindex(moved.get(i));
+      }
+    }
+
+    while (this.integratedPoses < this.store.getPoseCount() && millis() < deadline) {
+      this.integrate(this.integratedPoses);
+      this.integratedPoses++;
+    }
+
+    stale = this.staleTiles.iterator();
+    while (stale.hasNext() && millis() < deadline) {
+      key = stale.next();
+      stale.remove();
+      this.render((int) (key >> 32), (int) (long) key);
+    }
+  }
+
+  /**
+   * integrates all pings of a pose into the Landscape and indexes it
+   */
+  private void integrate(int pose) {
+    int first = this.store.getFirstObservation(pose);
+    int last  = first + this.store.getObservationCount(pose);
+
+    // indexed first, so that the base of the tiles it reaches is kept before it changes them
+    this.grow(pose);
+    this.index(pose);
+
+    for (int o = first; o < last; o++) {
+      this.updater.integrate(this.store.getPoseX(pose), this.store.getPoseY(pose),
+                             this.store.getPoseHeading(pose) + this.store.getAngle(o), this.store.getRange(o));
+    }
+  }
+
+  private void grow(int pose) {
+    while (this.footprints.length < 4 * (pose + 1)) {
+      this.footprints = java.util.Arrays.copyOf(this.footprints, 2 * this.footprints.length);
+    }
+  }
+
+  /**
+   * moves a pose in the index and marks the tiles it reached before and after as stale
+   */
+  private void reindex(int pose) {
+    int b = 4 * pose;
+    IntList poses;
+
+    for (int ty = this.footprints[b + 1]; ty <= this.footprints[b + 3]; ty++) {
+      for (int tx = this.footprints[b]; tx <= this.footprints[b + 2]; tx++) {
+        poses = this.tilePoses.get(this.tileKey(tx, ty));
+
+        if (poses != null) {
+          poses.removeValue(pose);
+        }
+        this.staleTiles.add(this.tileKey(tx, ty));
+      }
+    }
+
+    this.index(pose);
+
+    for (int ty = this.footprints[b + 1]; ty <= this.footprints[b + 3]; ty++) {
+      for (int tx = this.footprints[b]; tx <= this.footprints[b + 2]; tx++) {
+        this.staleTiles.add(this.tileKey(tx, ty));
+      }
+    }
+  }
+
+  /**
+   * adds a pose to the lists of all tiles its pings reach at its current pose
+   */
+  private void index(int pose) {
+    int first = this.store.getFirstObservation(pose);
+    int last  = first + this.store.getObservationCount(pose);
+    int b     = 4 * pose;
+    int tMinX = Integer.MAX_VALUE;
+    int tMinY = Integer.MAX_VALUE;
+    int tMaxX = Integer.MIN_VALUE;
+    int tMaxY = Integer.MIN_VALUE;
+    IntList poses;
+
+    for (int o = first; o < last; o++) {
+      this.pingBounds(pose, o, this.bounds);
+      tMinX = min(tMinX, this.bounds[0] >> LandscapeTile.SHIFT);
+      tMinY = min(tMinY, this.bounds[1] >> LandscapeTile.SHIFT);
+      tMaxX = max(tMaxX, this.bounds[2] >> LandscapeTile.SHIFT);
+      tMaxY = max(tMaxY, this.bounds[3] >> LandscapeTile.SHIFT);
+    }
+
+    // a pose without pings reaches nothing
+    this.footprints[b]     = tMinX;
+    this.footprints[b + 1] = tMinY;
+    this.footprints[b + 2] = tMaxX;
+    this.footprints[b + 3] = tMaxY;
+
+    for (int ty = tMinY; ty <= tMaxY; ty++) {
+      for (int tx = tMinX; tx <= tMaxX; tx++) {
+        poses = this.tilePoses.get(this.tileKey(tx, ty));
+
+        if (poses == null) {
+          poses = new IntList();
+          this.tilePoses.put(this.tileKey(tx, ty), poses);
+          this.keepBase(tx, ty);
+        }
+        poses.append(pose);
+      }
+    }
+  }
+
+  /**
+   * keeps the cells of a tile no pose has reached yet, unless it is empty
+   */
+  private void keepBase(int tx, int ty) {
+    LandscapeTile tile = this.landscape.getTile(tx, ty, false);
+    byte[] base;
+    boolean empty = true;
+
+    if (tile == null) {
+      return;
+    }
+
+    base = new byte[LandscapeTile.SIZE * LandscapeTile.SIZE];
+    for (int y = 0; y < LandscapeTile.SIZE; y++) {
+      for (int x = 0; x < LandscapeTile.SIZE; x++) {
+        base[(y << LandscapeTile.SHIFT) + x] = tile.get(x, y);
+        empty = empty && tile.get(x, y) == 0;
+      }
+    }
+
+    if (!empty) {
+      this.baseCells.put(this.tileKey(tx, ty), base);
+    }
+  }
+
+  /**
+   * integrates the pings of all poses that reach a tile anew and writes the cells
+   * that changed
+   */
+  private void render(int tx, int ty) {
+    int cellX = tx << LandscapeTile.SHIFT;
+    int cellY = ty << LandscapeTile.SHIFT;
+
+    this.renderTile(tx, ty, this.updater, this.cells, this.bounds);
+
+    for (int y = 0; y < LandscapeTile.SIZE; y++) {
+      for (int x = 0; x < LandscapeTile.SIZE; x++) {
+        this.landscape.setLogOdds(cellX + x, cellY + y, this.cells[(y << LandscapeTile.SHIFT) + x]);
+      }
+    }
+
+    this.renderedTiles++;
+  }
+
+  /**
+   * integrates the pings of all poses indexed for a tile into a buffer, on top of
+   * its base if it has one. Only reads the store and the index, threads may render
+   * different tiles at the same time as long as each one passes buffers of its own
+   *
+   * @param int tx
+   * @param int ty
+   * @param OccupancyUpdater u
+   * @param byte[] c          the cells of the tile, row by row
+   * @param int[] b           scratch space for pingBounds()
+   */
+  void renderTile(int tx, int ty, OccupancyUpdater u, byte[] c, int[] b) {
+    IntList poses = this.tilePoses.get(this.tileKey(tx, ty));
+    byte[] base   = this.baseCells.get(this.tileKey(tx, ty));
+    int cellX = tx << LandscapeTile.SHIFT;
+    int cellY = ty << LandscapeTile.SHIFT;
+    int pose, first, last;
+
+    if (base != null) {
+      System.arraycopy(base, 0, c, 0, c.length);
+    } else {
+      java.util.Arrays.fill(c, (byte) 0);
+    }
+
+    if (poses != null) {
+      // in the order they have been taken, clamping makes the order matter
+      poses.sort();
+
+      for (int p = 0; p < poses.size(); p++) {
+        pose  = poses.get(p);
+        first = this.store.getFirstObservation(pose);
+        last  = first + this.store.getObservationCount(pose);
+
+        for (int o = first; o < last; o++) {
+          this.pingBounds(pose, o, b);
+
+          if (b[2] < cellX || b[3] < cellY
+              || b[0] >= cellX + LandscapeTile.SIZE || b[1] >= cellY + LandscapeTile.SIZE) {
+            continue;
+          }
+          u.integrateTile(this.store.getPoseX(pose), this.store.getPoseY(pose),
+                          this.store.getPoseHeading(pose) + this.store.getAngle(o), this.store.getRange(o),
+                          tx, ty, c);
+        }
+      }
+    }
+  }
+
+  /**
+   * cell bounds of the cone of a ping: the sensor and the far end of the axis and
+   * both edges of the beam, plus slack for the arc bulging out between them and
+   * for rounding. Written to b as min x, min y, max x, max y
+   */
+  private void pingBounds(int pose, int observation, int[] b) {
+    float x      = this.store.getPoseX(pose);
+    float y      = this.store.getPoseY(pose);
+    float axis   = radians(this.store.getPoseHeading(pose) + this.store.getAngle(observation));
+    float half   = radians(OccupancyUpdater.BEAM_WIDTH / 2);
+    float reach  = min(this.store.getRange(observation), OccupancyUpdater.TRUSTED_RANGE) + OccupancyUpdater.ARC_THICKNESS;
+    float size   = this.landscape.CELL_SIZE;
+    float ex, ey;
+    int slack;
+
+    b[0] = floor(x / size);
+    b[1] = floor(y / size);
+    b[2] = ceil(x / size);
+    b[3] = ceil(y / size);
+
+    for (int edge = -1; edge <= 1; edge++) {
+      ex = (x + reach * cos(axis + edge * half)) / size;
+      ey = (y + reach * sin(axis + edge * half)) / size;
+      b[0] = min(b[0], floor(ex));
+      b[1] = min(b[1], floor(ey));
+      b[2] = max(b[2], ceil(ex));
+      b[3] = max(b[3], ceil(ey));
+    }
+
+    slack = ceil(reach * (1 - cos(half)) / size) + 1;
+    b[0] -= slack;
+    b[1] -= slack;
+    b[2] += slack;
+    b[3] += slack;
+  }
+
+  /**
+   * @return Long same key as the Landscape uses for its tiles
+   */
+  private Long tileKey(int tx, int ty) {
+    return ((long) tx << 32) | (ty & 0xFFFFFFFFL);
+  }
+}
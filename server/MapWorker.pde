@@ -0,0 +1,277 @@
+import java.util.concurrent.locks.LockSupport;
+
+/**
+ * Runs all updates of the Landscape on its own thread.
+ *
+ * The worker owns the authoritative Landscape: sonar readings are integrated,
+ * spilled tiles are faulted in and cold ones spilled out here, never in draw().
+ * Readings are not integrated right away but recorded in the ObservationStore
+ * first, the MapRenderer brings the Landscape up to date with it once per pass.
+ * After each pass the changed tiles are published as snapshots which
+ * Landscape.draw() reads without locking, so however long a pass takes the frame
+ * rate is not affected.
+ *
+ * Work is handed over with submit() from the render thread. Sweeps are located
+ * by the Localizer first and integrated at the corrected pose, the correction goes
+ * back to draw() through pollCorrection(). With a PoseGraph the located sweeps
+ * are added to it as well, and when it closes a loop the correction already
+ * includes the optimized pose. Besides SonarSweeps and
+ * SonarReadings any Runnable can be submitted; it is run on the worker with full
+ * access to the Landscape and the ObservationStore, i.e. to save the store or to
+ * post-process the map.
+ *
+ * Neither jobs nor corrections are ever dropped, the PathPlanner and the
+ * FrontierExplorer wait for every sweep they sent to come back corrected. What
+ * does not fit into a full queue waits in a backlog on the sending side until
+ * the other thread catches up.
+ *
+ * The thread parks between passes and is woken up by submit(), at the latest
+ * after POLL_INTERVAL. Every SAVE_INTERVAL and once more when it is stopped, the
+ * changed tiles are saved to the MapFile of the Landscape.
+ */
+class MapWorker implements Runnable {
+  private Landscape landscape;
+  private ObservationStore store;
+  private MapRenderer renderer;
+  private Localizer localizer;
+  private PoseGraph graph;
+  private EventQueue jobs;
+  private EventQueue corrections;        // from the worker to draw()
+  private ArrayDeque<Object> jobBacklog;                // render thread side of jobs
+  private ArrayDeque<PoseCorrection> correctionBacklog; // worker side of corrections
+  private ArrayList<Runnable> passJobs;
+  private Thread thread;
+  private volatile boolean running;
+  private int lastSpill;
+  private int lastSave;
+
+  final static long POLL_INTERVAL = 10000000;    // in ns
+  final static int SPILL_INTERVAL = 1000;        // in ms
+  final static int SAVE_INTERVAL  = 5000;        // in ms
+  final static int STOP_TIMEOUT   = 2000;        // in ms to wait for the last pass and save
+
+  MapWorker(Landscape l) {
+    this.landscape   = l;
+    this.store       = new ObservationStore();
+    this.renderer    = new MapRenderer(this.store, l);
+    this.localizer   = null;
+    this.graph       = null;
+    this.jobs        = new EventQueue(16384);
+    this.corrections = new EventQueue(256);
+    this.jobBacklog  = new ArrayDeque<Object>();
+    this.correctionBacklog = new ArrayDeque<PoseCorrection>();
+    this.passJobs    = new ArrayList<Runnable>();
+    this.running     = false;
+    this.lastSpill   = millis();
+    this.lastSave    = millis();
+  }
+
+  void start() {
+    this.running = true;
+    this.thread  = new Thread(this, "SonarBot map");
+    this.thread.setDaemon(true);
+    this.thread.start();
+  }
+
+  /**
+   * stops the thread and waits until it finished its pass and saved the map
+   */
+  void stop() {
+    this.running = false;
+    this.wake();
+
+    if (this.thread != null && this.thread != Thread.currentThread()) {
+      try {
+        this.thread.join(MapWorker.STOP_TIMEOUT);
+      } catch (InterruptedException e) {
+        Thread.currentThread().interrupt();
+      }
+    }
+  }
+
+  void wake() {
+    if (this.thread != null) {
+      LockSupport.unpark(this.thread);
+    }
+  }
+
+  /**
+   * registers a job that is run once per pass after the queued jobs, i.e. to
+   * continue work that is spread over several passes. call this before start()
+   *
+   * @param Runnable job
+   */
+  void addPassJob(Runnable job) {
+    this.passJobs.add(job);
+  }
+
+  /**
+   * queues a SonarSweep, SonarReading or a Runnable for the worker, call this from
+   * the render thread only. If the worker fell behind, the job waits in the
+   * backlog behind the ones before it
+   *
+   * @param Object job
+   */
+  void submit(Object job) {
+    this.jobBacklog.add(job);
+    this.flush();
+  }
+
+  /**
+   * hands the backlog of submit() on as far as the queue takes it, call this from
+   * the render thread once per frame
+   */
+  void flush() {
+    while (!this.jobBacklog.isEmpty() && this.jobs.offer(this.jobBacklog.peek())) {
+      this.jobBacklog.poll();
+    }
+
+    this.wake();
+  }
+
+  /**
+   * call this from the render thread only
+   *
+   * @return PoseCorrection result of matching the next sweep, null if there is none
+   */
+  PoseCorrection pollCorrection() {
+    return (PoseCorrection) this.corrections.poll();
+  }
+
+  /**
+   * sets what corrects the pose of sweeps, null to trust odometry. call this
+   * before start()
+   *
+   * @param Localizer l
+   */
+  void setLocalizer(Localizer l) {
+    this.localizer = l;
+  }
+
+  /**
+   * sets the graph the located sweeps are added to, null to keep no history.
+   * call this before start()
+   *
+   * @param PoseGraph g
+   */
+  void setPoseGraph(PoseGraph g) {
+    this.graph = g;
+  }
+
+  /**
+   * @return ObservationStore to be used on the worker thread only, i.e. from a submitted Runnable
+   */
+  ObservationStore getObservationStore() {
+    return this.store;
+  }
+
+  /**
+   * @return MapRenderer
+   */
+  MapRenderer getRenderer() {
+    return this.renderer;
+  }
+
+  /**
+   * @return int number of jobs waiting for the worker, call this from the render thread
+   */
+  int getBacklog() {
+    return this.jobs.size() + this.jobBacklog.size();
+  }
+
+  public void run() {
+    while (this.running) {
+      this.processJobs();
+      LockSupport.parkNanos(MapWorker.POLL_INTERVAL);
+    }
+
+    this.landscape.saveTiles();
+  }
+
+  /**
+   * one pass: applies all queued jobs and publishes the result
+   */
+  private void processJobs() {
+    Object job;
+
+    this.landscape.updateClock();
+    this.publishCorrections();
+
+    while ((job = this.jobs.poll()) != null) {
+      if (job instanceof SonarSweep) {
+        this.integrateSweep((SonarSweep) job);
+      } else if (job instanceof SonarReading) {
+        this.store.append((SonarReading) job);
+      } else if (job instanceof Runnable) {
+        ((Runnable) job).run();
+      }
+    }
+
+    this.renderer.run();
+    this.landscape.processFaultRequests();
+
+    for (int i = 0; i < this.passJobs.size(); i++) {
+      this.passJobs.get(i).run();
+    }
+
+    if (millis() - this.lastSpill > MapWorker.SPILL_INTERVAL) {
+      this.landscape.spillColdTiles();
+      this.lastSpill = millis();
+    }
+
+    if (millis() - this.lastSave > MapWorker.SAVE_INTERVAL) {
+      this.landscape.saveTiles();
+      this.lastSave = millis();
+    }
+
+    this.landscape.publish();
+  }
+
+  /**
+   * hands corrections on to draw() in order, as far as the queue takes them
+   */
+  private void publishCorrections() {
+    while (!this.correctionBacklog.isEmpty() && this.corrections.offer(this.correctionBacklog.peek())) {
+      this.correctionBacklog.poll();
+    }
+  }
+
+  /**
+   * corrects the pose of a sweep and records its readings
+   */
+  private void integrateSweep(SonarSweep sweep) {
+    PoseCorrection correction, moved;
+    int pose;
+
+    if (sweep.cmd == CommandQueue.CMD_SONARSWEEP) {
+      if (this.localizer != null) {
+        correction = this.localizer.locate(sweep);
+      } else {
+        correction = new PoseCorrection(sweep.posX, sweep.posY, sweep.heading);
+      }
+
+      pose = this.store.append(sweep, correction.toX, correction.toY, correction.toHeading);
+
+      if (this.graph != null) {
+        moved = this.graph.add(sweep, pose, correction);
+
+        if (moved.matched) {
+          if (this.localizer != null) {
+            this.localizer.relocate(moved);
+          }
+          correction.toX       = moved.toX;
+          correction.toY       = moved.toY;
+          correction.toHeading = moved.toHeading;
+        }
+      }
+
+      for (SonarReading reading : sweep.readings) {
+        correction.apply(reading);
+      }
+      this.correctionBacklog.add(correction);
+      this.publishCorrections();
+    } else {
+      this.store.append(sweep, sweep.posX, sweep.posY, sweep.heading);
+    }
+  }
+}
@@ -0,0 +1,381 @@
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.nio.ByteBuffer;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+
+/**
+ * Append-only log of every sonar ping, stored column by column.
+ *
+ * Each observation is a timestamp, the id of the sonar command it belongs to,
+ * the id of the pose it has been taken at, the servo angle and the range. Poses
+ * are kept in a table of their own: all pings of a command share one pose, and
+ * when the pose is corrected later on, i.e. by the PoseGraph, only that entry
+ * changes. movePose() notes the pose as moved, the MapRenderer then
+ * re-integrates the tiles it touches.
+ *
+ * The observations of a pose are appended together, so each pose refers to a
+ * contiguous range of them. Columns are plain arrays that grow by doubling.
+ *
+ * save() writes the table and the columns into a memory-mapped file, load()
+ * reads them back in one bulk copy per column. Owned by the MapWorker.
+ */
+class ObservationStore {
+  final static int MAGIC   = 0x53424F53;      // "SBOS"
+  final static int VERSION = 1;
+
+  /**
+   * the observations
+   */
+  private int[] times;             // millis()
+  private int[] sweepIds;
+  private int[] poseIds;
+  private short[] angles;          // of the servo in degrees, relative to the heading
+  private short[] ranges;          // in mm
+  private int count;
+
+  /**
+   * the poses, each one with the range of observations taken there
+   */
+  private float[] poseX;           // in mm
+  private float[] poseY;           // in mm
+  private float[] poseHeading;     // in degrees
+  private int[] poseFirst;
+  private int[] poseCount;
+  private int poses;
+
+  private int nextSweepId;
+
+  /**
+   * poses that have been moved since takeMovedPoses()
+   */
+  private IntList movedPoses;
+
+  ObservationStore() {
+    this.times       = new int[1024];
+    this.sweepIds    = new int[1024];
+    this.poseIds     = new int[1024];
+    this.angles      = new short[1024];
+    this.ranges      = new short[1024];
+    this.count       = 0;
+    this.poseX       = new float[64];
+    this.poseY       = new float[64];
+    this.poseHeading = new float[64];
+    this.poseFirst   = new int[64];
+    this.poseCount   = new int[64];
+    this.poses       = 0;
+    this.nextSweepId = 0;
+    this.movedPoses  = new IntList();
+  }
+
+  /**
+   * @return int number of observations
+   */
+  int size() {
+    return this.count;
+  }
+
+  /**
+   * @return int number of poses
+   */
+  int getPoseCount() {
+    return this.poses;
+  }
+
+  int getTime(int observation) {
+    return this.times[observation];
+  }
+
+  int getSweepId(int observation) {
+    return this.sweepIds[observation];
+  }
+
+  int getPoseId(int observation) {
+    return this.poseIds[observation];
+  }
+
+  int getAngle(int observation) {
+    return this.angles[observation];
+  }
+
+  int getRange(int observation) {
+    return this.ranges[observation];
+  }
+
+  float getPoseX(int pose) {
+    return this.poseX[pose];
+  }
+
+  float getPoseY(int pose) {
+    return this.poseY[pose];
+  }
+
+  float getPoseHeading(int pose) {
+    return this.poseHeading[pose];
+  }
+
+  /**
+   * @param int pose
+   * @return int index of the first observation taken at the pose
+   */
+  int getFirstObservation(int pose) {
+    return this.poseFirst[pose];
+  }
+
+  /**
+   * @param int pose
+   * @return int number of observations taken at the pose
+   */
+  int getObservationCount(int pose) {
+    return this.poseCount[pose];
+  }
+
+  /**
+   * appends all readings of a sonar command, taken at one pose
+   *
+   * @param SonarSweep sweep
+   * @param float x           pose of the bot in mm
+   * @param float y           in mm
+   * @param float heading     in degrees
+   * @return int id of the pose
+   */
+  int append(SonarSweep sweep, float x, float y, float heading) {
+    int pose = this.addPose(x, y, heading);
+    int sweepId = this.nextSweepId++;
+    int now = millis();
+
+    for (SonarReading reading : sweep.readings) {
+      this.addObservation(now, sweepId, pose, reading.angle, reading.range);
+    }
+
+    return pose;
+  }
+
+  /**
+   * appends a single reading at the pose stored with it
+   *
+   * @param SonarReading reading
+   * @return int id of the pose
+   */
+  int append(SonarReading reading) {
+    int pose = this.addPose(reading.posX, reading.posY, reading.heading);
+
+    this.addObservation(millis(), this.nextSweepId++, pose, reading.angle, reading.range);
+
+    return pose;
+  }
+
+  /**
+   * corrects a pose, all observations taken there move along
+   *
+   * @param int pose
+   * @param float x           in mm
+   * @param float y           in mm
+   * @param float heading     in degrees
+   */
+  void movePose(int pose, float x, float y, float heading) {
+    if (this.poseX[pose] == x && this.poseY[pose] == y && this.poseHeading[pose] == heading) {
+      return;
+    }
+
+    this.poseX[pose]       = x;
+    this.poseY[pose]       = y;
+    this.poseHeading[pose] = heading;
+    this.movedPoses.append(pose);
+  }
+
+  /**
+   * @return IntList poses moved since the last call, possibly more than once each
+   */
+  IntList takeMovedPoses() {
+    IntList moved = this.movedPoses;
+
+    this.movedPoses = new IntList();
+
+    return moved;
+  }
+
+  /**
+   * appends all poses and observations of another store, i.e. of another session,
+   * at the poses they have there
+   *
+   * @param ObservationStore other
+   */
+  void appendAll(ObservationStore other) {
+    int pose, first;
+
+    for (int p = 0; p < other.poses; p++) {
+      pose  = this.addPose(other.poseX[p], other.poseY[p], other.poseHeading[p]);
+      first = other.poseFirst[p];
+
+      for (int o = first; o < first + other.poseCount[p]; o++) {
+        this.addObservation(other.times[o], this.nextSweepId + other.sweepIds[o], pose, other.angles[o], other.ranges[o]);
+      }
+    }
+    this.nextSweepId += other.nextSweepId;
+  }
+
+  private int addPose(float x, float y, float heading) {
+    if (this.poses == this.poseX.length) {
+      this.poseX       = java.util.Arrays.copyOf(this.poseX, 2 * this.poses);
+      this.poseY       = java.util.Arrays.copyOf(this.poseY, 2 * this.poses);
+      this.poseHeading = java.util.Arrays.copyOf(this.poseHeading, 2 * this.poses);
+      this.poseFirst   = java.util.Arrays.copyOf(this.poseFirst, 2 * this.poses);
+      this.poseCount   = java.util.Arrays.copyOf(this.poseCount, 2 * this.poses);
+    }
+
+    this.poseX[this.poses]       = x;
+    this.poseY[this.poses]       = y;
+    this.poseHeading[this.poses] = heading;
+    this.poseFirst[this.poses]   = this.count;
+    this.poseCount[this.poses]   = 0;
+
+    return this.poses++;
+  }
+
+  private void addObservation(int time, int sweepId, int pose, int angle, int range) {
+    if (this.count == this.times.length) {
+      this.times    = java.util.Arrays.copyOf(this.times, 2 * this.count);
+      this.sweepIds = java.util.Arrays.copyOf(this.sweepIds, 2 * this.count);
+      this.poseIds  = java.util.Arrays.copyOf(this.poseIds, 2 * this.count);
+      this.angles   = java.util.Arrays.copyOf(this.angles, 2 * this.count);
+      this.ranges   = java.util.Arrays.copyOf(this.ranges, 2 * this.count);
+    }
+
+    this.times[this.count]    = time;
+    this.sweepIds[this.count] = sweepId;
+    this.poseIds[this.count]  = pose;
+    this.angles[this.count]   = (short) angle;
+    this.ranges[this.count]   = (short) min(range, Short.MAX_VALUE);
+    this.count++;
+    this.poseCount[pose]++;
+  }
+
+  /**
+   * writes the store into a file: a header of five ints, then the pose table and
+   * the observations, one column after the other
+   *
+   * @param String path
+   * @return boolean false on error
+   */
+  boolean save(String path) {
+    long size = this.fileSize(this.poses, this.count);
+
+    try {
+      RandomAccessFile file = new RandomAccessFile(path, "rw");
+      FileChannel channel = file.getChannel();
+
+      file.setLength(size);
+      MappedByteBuffer buffer = channel.map(FileChannel.MapMode.READ_WRITE, 0, size);
+
+      buffer.putInt(ObservationStore.MAGIC);
+      buffer.putInt(ObservationStore.VERSION);
+      buffer.putInt(this.poses);
+      buffer.putInt(this.count);
+      buffer.putInt(this.nextSweepId);
+
+      buffer.asFloatBuffer().put(this.poseX, 0, this.poses);        this.skip(buffer, 4 * this.poses);
+      buffer.asFloatBuffer().put(this.poseY, 0, this.poses);        this.skip(buffer, 4 * this.poses);
+      buffer.asFloatBuffer().put(this.poseHeading, 0, this.poses);  this.skip(buffer, 4 * this.poses);
+      buffer.asIntBuffer().put(this.poseFirst, 0, this.poses);      this.skip(buffer, 4 * this.poses);
+      buffer.asIntBuffer().put(this.poseCount, 0, this.poses);      this.skip(buffer, 4 * this.poses);
+
+      buffer.asIntBuffer().put(this.times, 0, this.count);          this.skip(buffer, 4 * this.count);
+      buffer.asIntBuffer().put(this.sweepIds, 0, this.count);       this.skip(buffer, 4 * this.count);
+      buffer.asIntBuffer().put(this.poseIds, 0, this.count);        this.skip(buffer, 4 * this.count);
+      buffer.asShortBuffer().put(this.angles, 0, this.count);       this.skip(buffer, 2 * this.count);
+      buffer.asShortBuffer().put(this.ranges, 0, this.count);       this.skip(buffer, 2 * this.count);
+
+      buffer.force();
+      channel.close();
+      file.close();
+      return true;
+    } catch (IOException e) {
+      println("unable to save observations to " + path + ": " + e.getMessage());
+      return false;
+    }
+  }
+
+  /**
+   * replaces the content of the store with a file written by save(). All poses
+   * are new to the MapRenderer afterwards, it integrates them from scratch
+   *
+   * @param String path
+   * @return boolean false if the file could not be read, the store is unchanged then
+   */
+  boolean load(String path) {
+    int p, n;
+
+    try {
+      RandomAccessFile file = new RandomAccessFile(path, "r");
+      FileChannel channel = file.getChannel();
+      MappedByteBuffer buffer = channel.map(FileChannel.MapMode.READ_ONLY, 0, channel.size());
+
+      if (channel.size() < 5 * 4 || buffer.getInt() != ObservationStore.MAGIC || buffer.getInt() != ObservationStore.VERSION) {
+        println(path + " is not an observation file of this version");
+        channel.close();
+        file.close();
+        return false;
+      }
+
+      p = buffer.getInt();
+      n = buffer.getInt();
+
+      if (p < 0 || n < 0 || channel.size() < this.fileSize(p, n)) {
+        println(path + " is truncated");
+        channel.close();
+        file.close();
+        return false;
+      }
+      this.nextSweepId = buffer.getInt();
+
+      this.poseX       = new float[max(64, p)];
+      this.poseY       = new float[max(64, p)];
+      this.poseHeading = new float[max(64, p)];
+      this.poseFirst   = new int[max(64, p)];
+      this.poseCount   = new int[max(64, p)];
+      this.times       = new int[max(1024, n)];
+      this.sweepIds    = new int[max(1024, n)];
+      this.poseIds     = new int[max(1024, n)];
+      this.angles      = new short[max(1024, n)];
+      this.ranges      = new short[max(1024, n)];
+
+      buffer.asFloatBuffer().get(this.poseX, 0, p);        this.skip(buffer, 4 * p);
+      buffer.asFloatBuffer().get(this.poseY, 0, p);        this.skip(buffer, 4 * p);
+      buffer.asFloatBuffer().get(this.poseHeading, 0, p);  this.skip(buffer, 4 * p);
+      buffer.asIntBuffer().get(this.poseFirst, 0, p);      this.skip(buffer, 4 * p);
+      buffer.asIntBuffer().get(this.poseCount, 0, p);      this.skip(buffer, 4 * p);
+
+      buffer.asIntBuffer().get(this.times, 0, n);          this.skip(buffer, 4 * n);
+      buffer.asIntBuffer().get(this.sweepIds, 0, n);       this.skip(buffer, 4 * n);
+      buffer.asIntBuffer().get(this.poseIds, 0, n);        this.skip(buffer, 4 * n);
+      buffer.asShortBuffer().get(this.angles, 0, n);       this.skip(buffer, 2 * n);
+      buffer.asShortBuffer().get(this.ranges, 0, n);       this.skip(buffer, 2 * n);
+
+      this.poses = p;
+      this.count = n;
+      this.movedPoses.clear();
+
+      channel.close();
+      file.close();
+      return true;
+    } catch (IOException e) {
+      println("unable to load observations from " + path + ": " + e.getMessage());
+      return false;
+    }
+  }
+
+  /**
+   * @return long size of a file holding the given number of poses and observations in bytes
+   */
+  private long fileSize(int p, int n) {
+    return 5 * 4 + (long) p * (3 * 4 + 2 * 4) + (long) n * (3 * 4 + 2 * 2);
+  }
+
+  /**
+   * views on a buffer don't move its position along
+   */
+  private void skip(ByteBuffer buffer, int bytes) {
+    buffer.position(buffer.position() + bytes);
+  }
+}
@@ -0,0 +1,218 @@
+/**
+ * Integrates sonar pings into the log-odds cells of a Landscape.
+ *
+ * Each ping is modelled as a cone of BEAM_WIDTH degrees, the opening angle of the
+ * HC-SR04. Cells inside the cone closer than the measured range are evidence for
+ * free space, cells in an arc of ARC_THICKNESS around the range are evidence for
+ * an obstacle. Pings at or beyond TRUSTED_RANGE are treated as "no echo" and only
+ * clear the cone up to that range.
+ *
+ * The cone footprint is rasterized once per beam direction (in steps of ANGLE_STEP
+ * degrees) into a stencil of cell offsets sorted by distance. Integrating a ping
+ * then is a linear walk over a prefix of its stencil.
+ *
+ * integrateTile() applies a ping to the cells of a single tile only, kept in a
+ * buffer of its own. The MapRenderer uses it to redo a tile after poses moved.
+ */
+class OccupancyUpdater {
+  final static float BEAM_WIDTH     = 15.0;    // in degrees
+  final static int ANGLE_STEP       = 2;       // in degrees, resolution of the stencil cache
+  final static int TRUSTED_RANGE    = 2500;    // in mm
+  final static int MIN_RANGE        = 20;      // in mm, anything closer is a bogus reading
+  final static int ARC_THICKNESS    = 20;      // in mm
+  final static int LOGODDS_FREE     = -2;      // per ping, in Landscape log-odds units
+  final static int LOGODDS_OCCUPIED = 10;      // per ping, in Landscape log-odds units
+
+  private Landscape landscape;
+
+  /**
+   * one stencil per beam direction, built on first use.
+   *
+   * stencilCells packs the cell offset as (dx & 0xFFFF) | (dy << 16),
+   * stencilDistances holds the distance of each cell from the sensor in mm
+   */
+  private int[][] stencilCells;
+  private char[][] stencilDistances;
+
+  private int pingCount;
+
+  /**
+   * while integrateTile() runs: the buffer written instead of the Landscape and
+   * the cell coordinates of its top left cell
+   */
+  private byte[] clipCells;
+  private int clipX;
+  private int clipY;
+
+  OccupancyUpdater(Landscape l) {
+    this.landscape        = l;
+    this.stencilCells     = new int[360 / OccupancyUpdater.ANGLE_STEP][];
+    this.stencilDistances = new char[360 / OccupancyUpdater.ANGLE_STEP][];
+    this.pingCount        = 0;
+    this.clipCells        = null;
+  }
+
+  /**
+   * @return int number of pings integrated so far
+   */
+  int getPingCount() {
+    return this.pingCount;
+  }
+
+  /**
+   * integrates a ping taken by the bot at the pose stored with it
+   *
+   * @param SonarReading reading
+   */
+  void integrate(SonarReading reading) {
+    this.integrate(reading.posX, reading.posY, reading.getDirection(), reading.range);
+  }
+
+  /**
+   * integrates a single range measurement
+   *
+   * @param float sensorX     in mm
+   * @param float sensorY     in mm
+   * @param float direction   direction of the beam in degrees
+   * @param int range         in mm
+   */
+  void integrate(float sensorX, float sensorY, float direction, int range) {
+    int bin = this.angleBin(direction);
+    int[] cells = this.stencilCells[bin];
+    char[] distances;
+    int cellX, cellY, freeUntil, occupiedUntil, i, packed;
+
+    if (range < OccupancyUpdater.MIN_RANGE) {
+      return;
+    }
+
+    if (cells == null) {
+      this.buildStencil(bin);
+      cells = this.stencilCells[bin];
+    }
+    distances = this.stencilDistances[bin];
+
+    cellX = round(sensorX / this.landscape.CELL_SIZE);
+    cellY = round(sensorY / this.landscape.CELL_SIZE);
+
+    if (range >= OccupancyUpdater.TRUSTED_RANGE) {
+      freeUntil     = OccupancyUpdater.TRUSTED_RANGE;
+      occupiedUntil = OccupancyUpdater.TRUSTED_RANGE;
+    } else {
+      freeUntil     = range - OccupancyUpdater.ARC_THICKNESS / 2;
+      occupiedUntil = range + OccupancyUpdater.ARC_THICKNESS / 2;
+    }
+
+    i = 0;
+    while (i < cells.length && distances[i] < freeUntil) {
+      packed = cells[i++];
+      this.addLogOdds(cellX + (short) packed, cellY + (packed >> 16), OccupancyUpdater.LOGODDS_FREE);
+    }
+    while (i < cells.length && distances[i] <= occupiedUntil) {
+      packed = cells[i++];
+      this.addLogOdds(cellX + (short) packed, cellY + (packed >> 16), OccupancyUpdater.LOGODDS_OCCUPIED);
+    }
+
+    if (this.clipCells == null) {
+      this.pingCount++;
+    }
+  }
+
+  /**
+   * integrates a single range measurement into the cells of one tile, cells
+   * outside of it are left alone
+   *
+   * @param float sensorX     in mm
+   * @param float sensorY     in mm
+   * @param float direction   direction of the beam in degrees
+   * @param int range         in mm
+   * @param int tileX
+   * @param int tileY
+   * @param byte[] cells      log-odds of the tile, row by row
+   */
+  void integrateTile(float sensorX, float sensorY, float direction, int range, int tileX, int tileY, byte[] cells) {
+    this.clipCells = cells;
+    this.clipX     = tileX << LandscapeTile.SHIFT;
+    this.clipY     = tileY << LandscapeTile.SHIFT;
+
+    this.integrate(sensorX, sensorY, direction, range);
+
+    this.clipCells = null;
+  }
+
+  /**
+   * adds to the log-odds of a cell of the Landscape, or of the tile given to integrateTile()
+   */
+  private void addLogOdds(int x, int y, int delta) {
+    int cx, cy;
+
+    if (this.clipCells == null) {
+      this.landscape.addLogOdds(x, y, delta);
+      return;
+    }
+
+    cx = x - this.clipX;
+    cy = y - this.clipY;
+
+    if (cx >= 0 && cy >= 0 && cx < LandscapeTile.SIZE && cy < LandscapeTile.SIZE) {
+      this.clipCells[(cy << LandscapeTile.SHIFT) + cx] = (byte) constrain(this.clipCells[(cy << LandscapeTile.SHIFT) + cx] + delta, -127, 127);
+    }
+  }
+
+  /**
+   * @param float direction   in degrees
+   * @return int index into the stencil cache
+   */
+  private int angleBin(float direction) {
+    int bins = this.stencilCells.length;
+    int bin  = round(direction / OccupancyUpdater.ANGLE_STEP) % bins;
+
+    return bin < 0 ? bin + bins : bin;
+  }
+
+  /**
+   * rasterizes the cone for the given beam direction up to the largest range a
+   * ping can cover and sorts its cells by distance
+   *
+   * @param int bin
+   */
+  private void buildStencil(int bin) {
+    float direction = radians(bin * OccupancyUpdater.ANGLE_STEP);
+    float halfWidth = radians(OccupancyUpdater.BEAM_WIDTH / 2);
+    float cellSize  = this.landscape.CELL_SIZE;
+    int reach       = ceil((OccupancyUpdater.TRUSTED_RANGE + OccupancyUpdater.ARC_THICKNESS) / cellSize);
+    long[] sorted   = new long[(2 * reach + 1) * (2 * reach + 1)];
+    int count       = 0;
+    float distance, offAxis;
+
+    for (int dy = -reach; dy <= reach; dy++) {
+      for (int dx = -reach; dx <= reach; dx++) {
+        distance = sqrt(dx * dx + dy * dy) * cellSize;
+
+        if (distance > reach * cellSize) {
+          continue;
+        }
+
+        // angle between the beam axis and the cell, wrapped to [-PI, PI]
+        offAxis = atan2(dy, dx) - direction;
+        offAxis = atan2(sin(offAxis), cos(offAxis));
+
+        // the cell the sensor is in is always inside the cone
+        if (abs(offAxis) <= halfWidth || (dx == 0 && dy == 0)) {
+          sorted[count++] = ((long) round(distance) << 32) | (((dy << 16) | (dx & 0xFFFF)) & 0xFFFFFFFFL);
+        }
+      }
+    }
+
+    // distance in the upper half, so this sorts by distance
+    java.util.Arrays.sort(sorted, 0, count);
+
+    this.stencilCells[bin]     = new int[count];
+    this.stencilDistances[bin] = new char[count];
+
+    for (int i = 0; i < count; i++) {
+      this.stencilCells[bin][i]     = (int) sorted[i];
+      this.stencilDistances[bin][i] = (char) (sorted[i] >> 32);
+    }
+  }
+}
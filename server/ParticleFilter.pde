@@ -0,0 +1,410 @@
+import java.util.Random;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.ThreadFactory;
+
+/**
+ * Monte Carlo localization of the bot against the occupancy map.
+ *
+ * The pose is tracked by a cloud of particles, each one a guess of x, y and
+ * heading. Between two sweeps every particle is moved by the odometry increment
+ * plus noise drawn from the odometry motion model: the firmware turns and drives
+ * by timing only, so the noise grows with the angle turned and the distance
+ * driven. Each ping of a sweep then weights the particles by the beam model: the
+ * range the particle expects, found by casting a ray through the DistanceMap,
+ * is compared to the measured range with a mixture of a gaussian hit, short
+ * readings, no echo and random noise. The estimate is the weighted mean; the
+ * cloud is resampled once too few particles carry the weight.
+ *
+ * Particles are stored as one array per value. Weighting is split into one chunk
+ * of particles per core and run on a thread pool while the map worker waits, so
+ * the DistanceMap is not updated during the ray casts.
+ */
+class ParticleFilter implements Localizer {
+  final static float ALPHA_TURN       = 0.1;        // rotation noise per rotation
+  final static float ALPHA_TURN_DRIVE = 0.0002;     // rotation noise in radians per mm driven
+  final static float ALPHA_DRIVE      = 0.05;       // distance noise per distance
+  final static float ALPHA_DRIVE_TURN = 5;          // distance noise in mm per radian turned
+  final static float INITIAL_SPREAD   = 10;         // in mm
+  final static float INITIAL_TURN     = 2;          // in degrees
+
+  final static float HIT_SIGMA        = 30;         // in mm
+  final static float Z_HIT            = 0.7;
+  final static float Z_SHORT          = 0.1;
+  final static float Z_MAX            = 0.1;
+  final static float Z_RANDOM         = 0.1;
+  final static float SHORT_LAMBDA     = 0.001;      // per mm
+
+  /**
+   * consecutive pings of a sweep overlap and are far from independent, their log
+   * likelihoods are scaled down so a single sweep can't collapse the cloud
+   */
+  final static float LIKELIHOOD_SCALE = 0.2;
+
+  private DistanceMap distanceMap;
+  private int count;
+
+  private float[] xs;               // in mm
+  private float[] ys;               // in mm
+  private float[] headings;         // in radians
+  private float[] weights;          // normalized, log of the posterior while weighting
+
+  /**
+   * resampling writes into these, then they are swapped with the arrays above
+   */
+  private float[] nextXs;
+  private float[] nextYs;
+  private float[] nextHeadings;
+
+  /**
+   * the pings of the sweep being weighted
+   */
+  private float[] pingAngles;       // relative to the heading, in radians
+  private float[] pingRanges;       // in mm
+  private int pingCount;
+
+  private ExecutorService pool;
+  private ArrayList<Callable<Object>> chunks;
+  private Random random;
+
+  private boolean initialized;
+  private float lastX;
+  private float lastY;
+  private float lastHeading;        // in degrees
+
+  /**
+   * @param DistanceMap d
+   * @param int particles
+   */
+  ParticleFilter(DistanceMap d, int particles) {
+    int threads = Runtime.getRuntime().availableProcessors();
+    int chunk   = (particles + threads - 1) / threads;
+
+    this.distanceMap  = d;
+    this.count        = particles;
+    this.xs           = new float[particles];
+    this.ys           = new float[particles];
+    this.headings     = new float[particles];
+    this.weights      = new float[particles];
+    this.nextXs       = new float[particles];
+    this.nextYs       = new float[particles];
+    this.nextHeadings = new float[particles];
+    this.pingAngles   = new float[0];
+    this.pingRanges   = new float[0];
+    this.random       = new Random();
+    this.initialized  = false;
+
+    this.pool = Executors.newFixedThreadPool(threads, new ThreadFactory() {
+      public Thread newThread(Runnable r) {
+        Thread t = new Thread(r, "SonarBot particles");
+        t.setDaemon(true);
+        return t;
+      }
+    });
+
+    this.chunks = new ArrayList<Callable<Object>>();
+    for (int from = 0; from < particles; from += chunk) {
+      this.chunks.add(new WeightChunk(from, min(from + chunk, particles)));
+    }
+  }
+
+  /**
+   * @return int number of particles
+   */
+  int getCount() {
+    return this.count;
+  }
+
+  /**
+   * moves the particles by the odometry since the last sweep, weights them by the
+   * pings of this one and returns the estimate
+   */
+  public PoseCorrection locate(SonarSweep sweep) {
+    PoseCorrection correction = new PoseCorrection(sweep.posX, sweep.posY, sweep.heading);
+
+    if (!this.initialized) {
+      this.initialize(sweep.posX, sweep.posY, sweep.heading);
+    } else {
+      this.predict(sweep.posX, sweep.posY, sweep.heading);
+    }
+
+    if (this.collectPings(sweep) > 0) {
+      this.weigh();
+
+      if (this.getEffectiveCount() < this.count / 2) {
+        this.resample();
+      }
+    }
+
+    this.estimate(correction);
+
+    // odometry continues from the estimate once draw() applied the correction
+    this.lastX       = correction.toX;
+    this.lastY       = correction.toY;
+    this.lastHeading = correction.toHeading;
+
+    return correction;
+  }
+
+  /**
+   * moves the whole cloud along with the estimate
+   */
+  public void relocate(PoseCorrection c) {
+    float rotation = radians(c.getRotation());
+    float x;
+
+    for (int i = 0; i < this.count; i++) {
+      x = this.xs[i];
+      this.xs[i]        = c.transformX(x, this.ys[i]);
+      this.ys[i]        = c.transformY(x, this.ys[i]);
+      this.headings[i] += rotation;
+    }
+
+    this.lastX        = c.toX;
+    this.lastY        = c.toY;
+    this.lastHeading += c.getRotation();
+  }
+
+  /**
+   * spreads the particles closely around a known pose
+   */
+  private void initialize(float x, float y, float heading) {
+    for (int i = 0; i < this.count; i++) {
+      this.xs[i]       = x + (float) this.random.nextGaussian() * ParticleFilter.INITIAL_SPREAD;
+      this.ys[i]       = y + (float) this.random.nextGaussian() * ParticleFilter.INITIAL_SPREAD;
+      this.headings[i] = radians(heading + (float) this.random.nextGaussian() * ParticleFilter.INITIAL_TURN);
+      this.weights[i]  = 1.0 / this.count;
+    }
+
+    this.initialized = true;
+  }
+
+  /**
+   * samples the odometry motion model: the increment from the last estimate to the
+   * new odometry pose is split into a turn, a straight move and another turn, each
+   * one disturbed in proportion to the size of the motion
+   */
+  private void predict(float x, float y, float heading) {
+    float dx     = x - this.lastX;
+    float dy     = y - this.lastY;
+    float drive  = sqrt(dx * dx + dy * dy);
+    float turn1  = drive < 1 ? 0 : this.wrap(atan2(dy, dx) - radians(this.lastHeading));
+    float turn2  = this.wrap(radians(heading - this.lastHeading) - turn1);
+    float sigmaTurn1 = ParticleFilter.ALPHA_TURN * abs(turn1) + ParticleFilter.ALPHA_TURN_DRIVE * drive;
+    float sigmaTurn2 = ParticleFilter.ALPHA_TURN * abs(turn2) + ParticleFilter.ALPHA_TURN_DRIVE * drive;
+    float sigmaDrive = ParticleFilter.ALPHA_DRIVE * drive + ParticleFilter.ALPHA_DRIVE_TURN * (abs(turn1) + abs(turn2));
+    float t1, d, t2;
+
+    if (drive < 1 && abs(turn2) < 0.001) {
+      return;
+    }
+
+    for (int i = 0; i < this.count; i++) {
+      t1 = turn1 + (float) this.random.nextGaussian() * sigmaTurn1;
+      d  = drive + (float) this.random.nextGaussian() * sigmaDrive;
+      t2 = turn2 + (float) this.random.nextGaussian() * sigmaTurn2;
+
+      this.xs[i]       += d * cos(this.headings[i] + t1);
+      this.ys[i]       += d * sin(this.headings[i] + t1);
+      this.headings[i] += t1 + t2;
+    }
+  }
+
+  /**
+   * @return int number of pings to weight with
+   */
+  private int collectPings(SonarSweep sweep) {
+    SonarReading reading;
+
+    if (this.pingAngles.length < sweep.size()) {
+      this.pingAngles = new float[sweep.size()];
+      this.pingRanges = new float[sweep.size()];
+    }
+
+    this.pingCount = 0;
+
+    for (int i = 0; i < sweep.size(); i++) {
+      reading = sweep.readings.get(i);
+
+      if (reading.range >= OccupancyUpdater.MIN_RANGE) {
+        this.pingAngles[this.pingCount] = radians(reading.angle);
+        this.pingRanges[this.pingCount] = min(reading.range, OccupancyUpdater.TRUSTED_RANGE);
+        this.pingCount++;
+      }
+    }
+
+    return this.pingCount;
+  }
+
+  /**
+   * computes the log likelihood of every particle on the pool, then normalizes
+   */
+  private void weigh() {
+    float best = -Float.MAX_VALUE;
+    float sum  = 0;
+
+    try {
+      this.pool.invokeAll(this.chunks);
+    } catch (InterruptedException e) {
+      Thread.currentThread().interrupt();
+      return;
+    }
+
+    for (int i = 0; i < this.count; i++) {
+      best = max(best, this.weights[i]);
+    }
+    for (int i = 0; i < this.count; i++) {
+      this.weights[i] = exp(this.weights[i] - best);
+      sum += this.weights[i];
+    }
+    for (int i = 0; i < this.count; i++) {
+      this.weights[i] /= sum;
+    }
+  }
+
+  /**
+   * @param float measured    in mm
+   * @param float expected    in mm
+   * @return float likelihood of the measured range under the beam model
+   */
+  private float beamLikelihood(float measured, float expected) {
+    float maxRange = OccupancyUpdater.TRUSTED_RANGE;
+    float p = ParticleFilter.Z_RANDOM / maxRange;
+    float diff;
+
+    if (measured >= maxRange) {
+      p += ParticleFilter.Z_MAX;
+
+      if (expected >= maxRange) {
+        p += ParticleFilter.Z_HIT / (ParticleFilter.HIT_SIGMA * sqrt(TWO_PI));
+      }
+      return p;
+    }
+
+    if (expected < maxRange) {
+      diff = (measured - expected) / ParticleFilter.HIT_SIGMA;
+      p += ParticleFilter.Z_HIT * exp(-0.5 * diff * diff) / (ParticleFilter.HIT_SIGMA * sqrt(TWO_PI));
+    }
+    if (measured < expected) {
+      p += ParticleFilter.Z_SHORT * ParticleFilter.SHORT_LAMBDA * exp(-ParticleFilter.SHORT_LAMBDA * measured);
+    }
+
+    return p;
+  }
+
+  /**
+   * @return float 1 / sum of squared weights
+   */
+  private float getEffectiveCount() {
+    float squares = 0;
+
+    for (int i = 0; i < this.count; i++) {
+      squares += this.weights[i] * this.weights[i];
+    }
+
+    return 1.0 / squares;
+  }
+
+  /**
+   * low variance resampling: one random offset, then equally spaced picks along
+   * the cumulated weights
+   */
+  private void resample() {
+    float step = 1.0 / this.count;
+    float pick = this.random.nextFloat() * step;
+    float cumulated = this.weights[0];
+    int j = 0;
+    float[] swap;
+
+    for (int i = 0; i < this.count; i++) {
+      while (pick > cumulated && j < this.count - 1) {
+        cumulated += this.weights[++j];
+      }
+      this.nextXs[i]       = this.xs[j];
+      this.nextYs[i]       = this.ys[j];
+      this.nextHeadings[i] = this.headings[j];
+      pick += step;
+    }
+
+    swap = this.xs;       this.xs = this.nextXs;             this.nextXs = swap;
+    swap = this.ys;       this.ys = this.nextYs;             this.nextYs = swap;
+    swap = this.headings; this.headings = this.nextHeadings; this.nextHeadings = swap;
+
+    java.util.Arrays.fill(this.weights, step);
+  }
+
+  /**
+   * weighted mean of the particles, the heading as the mean of unit vectors
+   */
+  private void estimate(PoseCorrection correction) {
+    float x = 0;
+    float y = 0;
+    float c = 0;
+    float s = 0;
+    float heading;
+
+    for (int i = 0; i < this.count; i++) {
+      x += this.weights[i] * this.xs[i];
+      y += this.weights[i] * this.ys[i];
+      c += this.weights[i] * cos(this.headings[i]);
+      s += this.weights[i] * sin(this.headings[i]);
+    }
+
+    // keep the heading close to the odometry one, the bot counts full turns
+    heading = degrees(atan2(s, c));
+    heading = correction.fromHeading + degrees(this.wrap(radians(heading - correction.fromHeading)));
+
+    correction.toX       = x;
+    correction.toY       = y;
+    correction.toHeading = heading;
+    correction.matched   = true;
+    correction.pairs     = this.pingCount;
+  }
+
+  /**
+   * @param float a       in radians
+   * @return float a in [-PI, PI)
+   */
+  private float wrap(float a) {
+    return a - TWO_PI * floor((a + PI) / TWO_PI);
+  }
+
+  /**
+   * weights a range of particles, run on the pool
+   */
+  class WeightChunk implements Callable<Object> {
+    private int from;
+    private int to;
+
+    WeightChunk(int f, int t) {
+      this.from = f;
+      this.to   = t;
+    }
+
+    public Object call() {
+      DistanceMap map = ParticleFilter.this.distanceMap;
+      float maxRange  = OccupancyUpdater.TRUSTED_RANGE;
+      float logLikelihood, expected;
+
+      for (int i = this.from; i < this.to; i++) {
+        logLikelihood = 0;
+
+        for (int p = 0; p < ParticleFilter.this.pingCount; p++) {
+          expected = map.castRay(
+            ParticleFilter.this.xs[i],
+            ParticleFilter.this.ys[i],
+            ParticleFilter.this.headings[i] + ParticleFilter.this.pingAngles[p],
+            maxRange
+          );
+          logLikelihood += log(ParticleFilter.this.beamLikelihood(ParticleFilter.this.pingRanges[p], expected));
+        }
+
+        // on top of the weight the particle had so far
+        ParticleFilter.this.weights[i] = log(ParticleFilter.this.weights[i]) + ParticleFilter.LIKELIHOOD_SCALE * logLikelihood;
+      }
+
+      return null;
+    }
+  }
+}
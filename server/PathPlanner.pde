@@ -0,0 +1,664 @@
+/**
+ * Plans a path to a goal on the Landscape with D* Lite and drives the bot along it.
+ *
+ * Planning runs on a window of WINDOW x WINDOW nodes of the pyramid level of the
+ * DistanceMap (40mm per node, about 10m across) laid around the bot and the goal.
+ * A node is blocked if its clearance is less than the radius of the bot. Unknown
+ * cells are assumed to be free.
+ *
+ * D* Lite searches from the goal towards the bot. When sonar readings change
+ * clearances, only the nodes whose blocked state flips are updated and the search
+ * repairs its previous result instead of starting over; the moving start is
+ * accounted for by the key modifier km. The search is resumable and stops
+ * after PLAN_BUDGET ns per pass of the MapWorker, so even a plan from scratch
+ * never holds up the worker for more than a frame.
+ *
+ * The bot is driven one segment at a time: a turn and a straight move towards
+ * the farthest node along the path that is in line of sight, at most MAX_SEGMENT
+ * away. After each segment the SweepPlanner picks a sonar sweep and the path is
+ * replanned with what the sweep revealed before the next segment is sent. Where
+ * the map ahead is known well enough no sweep is taken.
+ *
+ * All state is owned by the map worker, navigateTo() and reportCompletion() may
+ * be called from the render thread and hand their arguments over as jobs. Code
+ * running on the worker, like the FrontierExplorer, calls setGoal() directly.
+ */
+class PathPlanner implements Runnable, DistanceListener {
+  final static int WINDOW_SHIFT     = 8;
+  final static int WINDOW           = 1 << PathPlanner.WINDOW_SHIFT;  // in nodes
+  final static int MARGIN           = 8;          // in nodes, kept between the window edge and bot or goal
+  final static long PLAN_BUDGET     = 8000000;    // in ns per pass
+  final static int MAX_SEGMENT      = 500;        // in mm
+  final static int GOAL_TOLERANCE   = 30;         // in mm
+  final static float SQRT2          = 1.4142135;
+  final static float INF            = Float.POSITIVE_INFINITY;
+
+  final static int STATE_IDLE     = 0;
+  final static int STATE_PLANNING = 1;            // search is running
+  final static int STATE_DRIVING  = 2;            // segment sent, waiting for the move to complete
+  final static int STATE_SCANNING = 3;            // sweep sent, waiting for it to complete
+
+  private DistanceMap distanceMap;
+  private CommandQueue commands;
+  private SweepPlanner sweeps;
+  private MapWorker worker;
+
+  private float nodeSize;                         // in mm
+  private int botRadius;                          // in mm
+
+  /**
+   * node coordinates of the top left node of the window, valid once a goal has been set
+   */
+  private int originX;
+  private int originY;
+  private boolean windowValid;
+
+  private boolean[] blocked;
+
+  /**
+   * nodes whose clearance changed since the last pass, each one listed once
+   */
+  private IntList changedNodes;
+  private boolean[] changed;
+
+  private float[] g;
+  private float[] rhs;
+  private IndexedHeap open;
+  private float km;
+  private int start;
+  private int lastStart;
+  private int goal;
+
+  private float goalX;                            // in mm
+  private float goalY;                            // in mm
+  private float poseX;                            // in mm
+  private float poseY;                            // in mm
+  private float poseHeading;                      // in degrees
+
+  private volatile int state;
+  private boolean arrived;                        // the last goal has been reached
+
+  /**
+   * @param DistanceMap d
+   * @param CommandQueue q
+   * @param SweepPlanner s
+   * @param MapWorker w       the worker the planner is run on
+   * @param int radius        of the bot in mm
+   */
+  PathPlanner(DistanceMap d, CommandQueue q, SweepPlanner s, MapWorker w, int radius) {
+    int nodes = PathPlanner.WINDOW * PathPlanner.WINDOW;
+
+    this.distanceMap  = d;
+    this.commands     = q;
+    this.sweeps       = s;
+    this.worker       = w;
+    this.nodeSize     = d.getCellSize();
+    this.botRadius    = radius;
+    this.blocked      = new boolean[nodes];
+    this.changedNodes = new IntList();
+    this.changed      = new boolean[nodes];
+    this.g            = new float[nodes];
+    this.rhs          = new float[nodes];
+    this.open         = new IndexedHeap(nodes);
+    this.windowValid  = false;
+    this.state        = PathPlanner.STATE_IDLE;
+    this.arrived      = false;
+  }
+
+  /**
+   * @return boolean true while the bot is being driven towards a goal
+   */
+  boolean isNavigating() {
+    return this.state != PathPlanner.STATE_IDLE;
+  }
+
+  /**
+   * @return boolean true if the bot reached the last goal, false if it is still on
+   *                 its way or navigation has been given up. call this from the map worker
+   */
+  boolean hasArrived() {
+    return this.arrived;
+  }
+
+  /**
+   * stops navigating while the bot stands still between two segments, call this
+   * from the map worker
+   *
+   * @return boolean false if a command is under way, try again on a later pass
+   */
+  boolean cancel() {
+    if (this.state == PathPlanner.STATE_DRIVING || this.state == PathPlanner.STATE_SCANNING) {
+      return false;
+    }
+
+    this.state = PathPlanner.STATE_IDLE;
+
+    return true;
+  }
+
+  /**
+   * starts navigating to the given position, call this from the render thread
+   *
+   * @param float x           of the goal in mm
+   * @param float y           of the goal in mm
+   * @param float posX        of the bot in mm
+   * @param float posY        of the bot in mm
+   * @param float heading     of the bot in degrees
+   */
+  void navigateTo(final float x, final float y, final float posX, final float posY, final float heading) {
+    this.worker.submit(new Runnable() {
+      public void run() {
+        PathPlanner.this.setGoal(x, y, posX, posY, heading);
+      }
+    });
+  }
+
+  /**
+   * forwards a completed command along with the pose of the bot after it, call
+   * this from the render thread
+   *
+   * @param char cmd
+   * @param float posX        in mm
+   * @param float posY        in mm
+   * @param float heading     in degrees
+   */
+  void reportCompletion(final char cmd, final float posX, final float posY, final float heading) {
+    if (cmd != CommandQueue.CMD_MOVEFORWARD && cmd != CommandQueue.CMD_SONARSWEEP) {
+      return;
+    }
+
+    this.worker.submit(new Runnable() {
+      public void run() {
+        PathPlanner.this.commandCompleted(cmd, posX, posY, heading);
+      }
+    });
+  }
+
+  /**
+   * gives up navigating when a command got no completion, the bot may be anywhere
+   * along it. call this from the render thread
+   *
+   * @param char cmd
+   */
+  void reportFailure(final char cmd) {
+    this.worker.submit(new Runnable() {
+      public void run() {
+        if (PathPlanner.this.state != PathPlanner.STATE_IDLE) {
+          PathPlanner.this.abort("command " + cmd + " got no completion");
+        }
+      }
+    });
+  }
+
+  /**
+   * applies the clearance changes, continues the search once per pass of the map
+   * worker and sends the next segment when it is done. must run after the
+   * DistanceMap has been updated
+   */
+  public void run() {
+    this.applyChanges();
+
+    if (this.state == PathPlanner.STATE_PLANNING && this.computeShortestPath(System.nanoTime() + PathPlanner.PLAN_BUDGET)) {
+      this.sendSegment();
+    }
+  }
+
+  /**
+   * notes the node, its clearance is looked at once the distance map is done
+   */
+  public void clearanceChanged(int x, int y) {
+    int wx = x - this.originX;
+    int wy = y - this.originY;
+    int n;
+
+    if (!this.windowValid || !this.inWindow(wx, wy)) {
+      return;
+    }
+
+    n = this.index(wx, wy);
+
+    if (!this.changed[n]) {
+      this.changed[n] = true;
+      this.changedNodes.append(n);
+    }
+  }
+
+  /**
+   * updates the search for every noted node whose blocked state flipped
+   */
+  private void applyChanges() {
+    int n;
+    boolean b;
+
+    for (int i = 0; i < this.changedNodes.size(); i++) {
+      n = this.changedNodes.get(i);
+      b = this.isTooClose(n);
+      this.changed[n] = false;
+
+      if (b != this.blocked[n]) {
+        this.blocked[n] = b;
+
+        if (this.state != PathPlanner.STATE_IDLE) {
+          // edges to, from and around the node changed
+          this.updateVertex(n);
+          this.updateNeighbours(n);
+        }
+      }
+    }
+    this.changedNodes.clear();
+  }
+
+  /**
+   * lays the window around bot and goal and starts a new search, call this from
+   * the map worker. isNavigating() is false afterwards if the goal can't be planned for
+   *
+   * @param float x           of the goal in mm
+   * @param float y           of the goal in mm
+   * @param float posX        of the bot in mm
+   * @param float posY        of the bot in mm
+   * @param float heading     of the bot in degrees
+   */
+  void setGoal(float x, float y, float posX, float posY, float heading) {
+    int sx = this.nodeOf(posX);
+    int sy = this.nodeOf(posY);
+    int tx = this.nodeOf(x);
+    int ty = this.nodeOf(y);
+    int reach = PathPlanner.WINDOW - 2 * PathPlanner.MARGIN;
+
+    this.state   = PathPlanner.STATE_IDLE;
+    this.arrived = false;
+
+    if (abs(tx - sx) > reach || abs(ty - sy) > reach) {
+      println("goal is too far away, at most " + round(reach * this.nodeSize) + " mm in x and y");
+      return;
+    }
+
+    this.originX = ((sx + tx) >> 1) - PathPlanner.WINDOW / 2;
+    this.originY = ((sy + ty) >> 1) - PathPlanner.WINDOW / 2;
+    this.distanceMap.cover(this.originX, this.originY, this.originX + PathPlanner.WINDOW - 1, this.originY + PathPlanner.WINDOW - 1);
+    this.loadWindow();
+
+    this.goalX = x;
+    this.goalY = y;
+    this.goal  = this.index(tx - this.originX, ty - this.originY);
+
+    if (this.blocked[this.goal]) {
+      println("goal is blocked");
+      return;
+    }
+
+    this.poseX       = posX;
+    this.poseY       = posY;
+    this.poseHeading = heading;
+    this.start       = this.index(sx - this.originX, sy - this.originY);
+    this.lastStart   = this.start;
+
+    java.util.Arrays.fill(this.g, PathPlanner.INF);
+    java.util.Arrays.fill(this.rhs, PathPlanner.INF);
+    this.open.clear();
+    this.km = 0;
+    this.rhs[this.goal] = 0;
+    this.open.insert(this.goal, this.heuristic(this.start, this.goal), 0);
+
+    this.state = PathPlanner.STATE_PLANNING;
+  }
+
+  /**
+   * advances the state machine when the move of a segment or the sweep after it completed
+   */
+  private void commandCompleted(char cmd, float posX, float posY, float heading) {
+    int[] sweep;
+
+    if (this.state == PathPlanner.STATE_DRIVING && cmd == CommandQueue.CMD_MOVEFORWARD) {
+      this.updatePose(posX, posY, heading);
+
+      if (this.state == PathPlanner.STATE_IDLE) {
+        // drifted out of the window and no new path could be set
+        return;
+      }
+
+      if (dist(posX, posY, this.goalX, this.goalY) <= PathPlanner.GOAL_TOLERANCE) {
+        println("goal reached");
+        this.state   = PathPlanner.STATE_IDLE;
+        this.arrived = true;
+        return;
+      }
+
+      sweep = this.sweeps.plan(posX, posY, heading);
+
+      if (sweep == null) {
+        // nothing new to see, go on with the next segment
+        this.state = PathPlanner.STATE_PLANNING;
+        return;
+      }
+
+      if (!this.commands.cmdSonarSweep(sweep[0], sweep[1], sweep[2])) {
+        this.abort("command queue is full");
+        return;
+      }
+      this.state = PathPlanner.STATE_SCANNING;
+
+    } else if (this.state == PathPlanner.STATE_SCANNING && cmd == CommandQueue.CMD_SONARSWEEP) {
+      this.updatePose(posX, posY, heading);
+
+      if (this.state != PathPlanner.STATE_IDLE) {
+        this.state = PathPlanner.STATE_PLANNING;
+      }
+    }
+  }
+
+  /**
+   * moves the start of the search to the new position of the bot
+   */
+  private void updatePose(float posX, float posY, float heading) {
+    int wx = this.nodeOf(posX) - this.originX;
+    int wy = this.nodeOf(posY) - this.originY;
+
+    this.poseX       = posX;
+    this.poseY       = posY;
+    this.poseHeading = heading;
+
+    if (!this.inWindow(wx, wy)) {
+      // drifted out of the window, start over around the current position
+      this.setGoal(this.goalX, this.goalY, posX, posY, heading);
+      return;
+    }
+
+    this.start = this.index(wx, wy);
+
+    if (this.start != this.lastStart) {
+      this.km += this.heuristic(this.lastStart, this.start);
+      this.lastStart = this.start;
+    }
+  }
+
+  /**
+   * sends a turn and a move towards the farthest node of the path in line of sight
+   */
+  private void sendSegment() {
+    float targetX = this.poseX;
+    float targetY = this.poseY;
+    int node = this.start;
+    int next, turn, distance;
+    float nx, ny;
+    boolean queued = true;
+
+    if (this.blocked[this.start]) {
+      this.abort("bot is too close to an obstacle");
+      return;
+    }
+    if (this.g[this.start] == PathPlanner.INF) {
+      this.abort("no path to the goal");
+      return;
+    }
+
+    for (int steps = 0; node != this.goal && steps < 4 * PathPlanner.WINDOW; steps++) {
+      next = this.bestSuccessor(node);
+
+      if (next < 0) {
+        break;
+      }
+      nx = next == this.goal ? this.goalX : this.centerOf(next & (PathPlanner.WINDOW - 1), this.originX);
+      ny = next == this.goal ? this.goalY : this.centerOf(next >> PathPlanner.WINDOW_SHIFT, this.originY);
+
+      if (dist(this.poseX, this.poseY, nx, ny) > PathPlanner.MAX_SEGMENT
+          || !this.lineOfSight(this.poseX, this.poseY, nx, ny)) {
+        // the first node always counts, the bot may sit off its center
+        if (node != this.start) {
+          break;
+        }
+      }
+      targetX = nx;
+      targetY = ny;
+      node    = next;
+    }
+
+    distance = round(dist(this.poseX, this.poseY, targetX, targetY));
+
+    if (distance == 0) {
+      println("goal reached");
+      this.state   = PathPlanner.STATE_IDLE;
+      this.arrived = true;
+      return;
+    }
+
+    turn = round(degrees(atan2(targetY - this.poseY, targetX - this.poseX)) - this.poseHeading);
+    turn = ((turn % 360) + 540) % 360 - 180;    // to [-180, 180)
+
+    if (turn > 0) {
+      queued = this.commands.cmdTurnRight(turn);
+    } else if (turn < 0) {
+      queued = this.commands.cmdTurnLeft(turn);
+    }
+
+    if (!queued || !this.commands.cmdMoveForward(distance)) {
+      this.abort("command queue is full");
+      return;
+    }
+
+    this.state = PathPlanner.STATE_DRIVING;
+  }
+
+  private void abort(String reason) {
+    println("navigation aborted: " + reason);
+    this.state = PathPlanner.STATE_IDLE;
+  }
+
+  /**
+   * runs D* Lite until the start is consistent or the deadline has passed
+   *
+   * @param long deadline     System.nanoTime()
+   * @return boolean true if the search is done, false if it has to be continued
+   */
+  private boolean computeShortestPath(long deadline) {
+    int expansions = 0;
+    int u;
+    float k1, k2, n1, n2;
+
+    while (!this.open.isEmpty()) {
+      k1 = this.open.topKey1();
+      k2 = this.open.topKey2();
+      n1 = this.key1(this.start);
+      n2 = this.key2(this.start);
+
+      if (!(k1 < n1 || (k1 == n1 && k2 < n2)) && this.rhs[this.start] == this.g[this.start]) {
+        break;
+      }
+      if ((++expansions & 63) == 0 && System.nanoTime() > deadline) {
+        return false;
+      }
+
+      u  = this.open.top();
+      n1 = this.key1(u);
+      n2 = this.key2(u);
+
+      if (k1 < n1 || (k1 == n1 && k2 < n2)) {
+        this.open.insert(u, n1, n2);
+      } else if (this.g[u] > this.rhs[u]) {
+        this.g[u] = this.rhs[u];
+        this.open.remove(u);
+        this.updateNeighbours(u);
+      } else {
+        this.g[u] = PathPlanner.INF;
+        this.updateVertex(u);
+        this.updateNeighbours(u);
+      }
+    }
+
+    return true;
+  }
+
+  private float key1(int u) {
+    return min(this.g[u], this.rhs[u]) + this.heuristic(this.start, u) + this.km;
+  }
+
+  private float key2(int u) {
+    return min(this.g[u], this.rhs[u]);
+  }
+
+  private void updateVertex(int u) {
+    int ux = u & (PathPlanner.WINDOW - 1);
+    int uy = u >> PathPlanner.WINDOW_SHIFT;
+    float best, c;
+
+    if (u != this.goal) {
+      best = PathPlanner.INF;
+
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          if ((dx != 0 || dy != 0) && this.inWindow(ux + dx, uy + dy)) {
+            c = this.cost(ux, uy, dx, dy);
+
+            if (c != PathPlanner.INF) {
+              best = min(best, c + this.g[this.index(ux + dx, uy + dy)]);
+            }
+          }
+        }
+      }
+      this.rhs[u] = best;
+    }
+
+    if (this.g[u] != this.rhs[u]) {
+      this.open.insert(u, this.key1(u), this.key2(u));
+    } else {
+      this.open.remove(u);
+    }
+  }
+
+  private void updateNeighbours(int u) {
+    int ux = u & (PathPlanner.WINDOW - 1);
+    int uy = u >> PathPlanner.WINDOW_SHIFT;
+
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        if ((dx != 0 || dy != 0) && this.inWindow(ux + dx, uy + dy)) {
+          this.updateVertex(this.index(ux + dx, uy + dy));
+        }
+      }
+    }
+  }
+
+  /**
+   * @return int neighbour of u along the cheapest path to the goal, -1 if there is none
+   */
+  private int bestSuccessor(int u) {
+    int ux = u & (PathPlanner.WINDOW - 1);
+    int uy = u >> PathPlanner.WINDOW_SHIFT;
+    int best = -1;
+    float bestCost = PathPlanner.INF;
+    float c;
+
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        if ((dx != 0 || dy != 0) && this.inWindow(ux + dx, uy + dy)) {
+          c = this.cost(ux, uy, dx, dy) + this.g[this.index(ux + dx, uy + dy)];
+
+          if (c < bestCost) {
+            bestCost = c;
+            best     = this.index(ux + dx, uy + dy);
+          }
+        }
+      }
+    }
+
+    return best;
+  }
+
+  /**
+   * cost of the edge from x/y to its neighbour in direction dx/dy, in nodes.
+   * diagonal moves must not cut the corner of a blocked node
+   */
+  private float cost(int x, int y, int dx, int dy) {
+    if (this.blocked(x, y) || this.blocked(x + dx, y + dy)) {
+      return PathPlanner.INF;
+    }
+    if (dx != 0 && dy != 0) {
+      return this.blocked(x + dx, y) || this.blocked(x, y + dy) ? PathPlanner.INF : PathPlanner.SQRT2;
+    }
+
+    return 1;
+  }
+
+  /**
+   * octile distance between two nodes
+   */
+  private float heuristic(int a, int b) {
+    int dx = abs((a & (PathPlanner.WINDOW - 1)) - (b & (PathPlanner.WINDOW - 1)));
+    int dy = abs((a >> PathPlanner.WINDOW_SHIFT) - (b >> PathPlanner.WINDOW_SHIFT));
+
+    return max(dx, dy) + (PathPlanner.SQRT2 - 1) * min(dx, dy);
+  }
+
+  /**
+   * reads the blocked state of all nodes of the window from the DistanceMap
+   */
+  private void loadWindow() {
+    for (int i = 0; i < this.changedNodes.size(); i++) {
+      this.changed[this.changedNodes.get(i)] = false;
+    }
+    this.changedNodes.clear();
+
+    for (int n = 0; n < this.blocked.length; n++) {
+      this.blocked[n] = this.isTooClose(n);
+    }
+    this.windowValid = true;
+  }
+
+  /**
+   * @return boolean true if the bot would touch an obstacle with its center on the node
+   */
+  private boolean isTooClose(int n) {
+    return this.distanceMap.getClearance(
+      (n & (PathPlanner.WINDOW - 1)) + this.originX,
+      (n >> PathPlanner.WINDOW_SHIFT) + this.originY
+    ) < this.botRadius;
+  }
+
+  private boolean blocked(int x, int y) {
+    return this.blocked[this.index(x, y)];
+  }
+
+  /**
+   * @return boolean true if the straight line between two positions only crosses free nodes
+   */
+  private boolean lineOfSight(float ax, float ay, float bx, float by) {
+    int steps = ceil(dist(ax, ay, bx, by) / (this.nodeSize / 2));
+    int wx, wy;
+
+    for (int i = 1; i <= steps; i++) {
+      wx = this.nodeOf(lerp(ax, bx, (float) i / steps)) - this.originX;
+      wy = this.nodeOf(lerp(ay, by, (float) i / steps)) - this.originY;
+
+      if (!this.inWindow(wx, wy) || this.blocked(wx, wy)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  private boolean inWindow(int x, int y) {
+    return x >= 0 && y >= 0 && x < PathPlanner.WINDOW && y < PathPlanner.WINDOW;
+  }
+
+  private int index(int x, int y) {
+    return (y << PathPlanner.WINDOW_SHIFT) + x;
+  }
+
+  /**
+   * @param float mm
+   * @return int node coordinate of a position
+   */
+  private int nodeOf(float mm) {
+    return this.distanceMap.cellOf(mm);
+  }
+
+  /**
+   * @param int w          node coordinate within the window
+   * @param int origin
+   * @return float center of the node in mm
+   */
+  private float centerOf(int w, int origin) {
+    return this.distanceMap.centerOf(w + origin);
+  }
+}
@@ -0,0 +1,124 @@
+/**
+ * Uniform grid over a set of 2D points for nearest neighbour lookups.
+ *
+ * The points are bucketed by a counting sort into cells of a fixed size, so
+ * building is O(n) and a lookup only looks at the cells within the search
+ * radius. Arrays are reused between builds.
+ */
+class PointGrid {
+  private float cellSize;
+  private int minX;
+  private int minY;
+  private int cols;
+  private int rows;
+
+  private int[] cellStart;       // per cell, index into order of its first point, one extra at the end
+  private int[] order;           // point indices sorted by cell
+  private float[] xs;
+  private float[] ys;
+
+  PointGrid() {
+    this.cellStart = new int[1];
+    this.order     = new int[0];
+    this.cols      = 0;
+    this.rows      = 0;
+  }
+
+  /**
+   * @param float[] x
+   * @param float[] y
+   * @param int count
+   * @param float size     edge length of the cells, best about the usual search radius
+   */
+  void build(float[] x, float[] y, int count, float size) {
+    int maxX = Integer.MIN_VALUE;
+    int maxY = Integer.MIN_VALUE;
+    int cells, c;
+
+    this.xs       = x;
+    this.ys       = y;
+    this.cellSize = size;
+    this.minX     = Integer.MAX_VALUE;
+    this.minY     = Integer.MAX_VALUE;
+
+    for (int i = 0; i < count; i++) {
+      this.minX = min(this.minX, floor(x[i] / size));
+      this.minY = min(this.minY, floor(y[i] / size));
+      maxX      = max(maxX, floor(x[i] / size));
+      maxY      = max(maxY, floor(y[i] / size));
+    }
+
+    if (count == 0) {
+      this.cols = 0;
+      this.rows = 0;
+      return;
+    }
+
+    this.cols = maxX - this.minX + 1;
+    this.rows = maxY - this.minY + 1;
+    cells     = this.cols * this.rows;
+
+    if (this.cellStart.length < cells + 1) {
+      this.cellStart = new int[cells + 1];
+    }
+    if (this.order.length < count) {
+      this.order = new int[count];
+    }
+    java.util.Arrays.fill(this.cellStart, 0, cells + 1, 0);
+
+    for (int i = 0; i < count; i++) {
+      this.cellStart[this.cellOf(x[i], y[i]) + 1]++;
+    }
+    for (c = 0; c < cells; c++) {
+      this.cellStart[c + 1] += this.cellStart[c];
+    }
+    for (int i = 0; i < count; i++) {
+      c = this.cellOf(x[i], y[i]);
+      this.order[this.cellStart[c]++] = i;
+    }
+    // cellStart has been advanced to the end of each cell, shift it back
+    for (c = cells; c > 0; c--) {
+      this.cellStart[c] = this.cellStart[c - 1];
+    }
+    this.cellStart[0] = 0;
+  }
+
+  /**
+   * @param float x
+   * @param float y
+   * @param float maxDistance
+   * @return int index of the closest point within maxDistance, -1 if there is none
+   */
+  int nearest(float x, float y, float maxDistance) {
+    int cx = floor(x / this.cellSize) - this.minX;
+    int cy = floor(y / this.cellSize) - this.minY;
+    int reach = ceil(maxDistance / this.cellSize);
+    float bestDistance = maxDistance * maxDistance;
+    int best = -1;
+    int c, p;
+    float dx, dy;
+
+    for (int gy = max(0, cy - reach); gy <= min(this.rows - 1, cy + reach); gy++) {
+      for (int gx = max(0, cx - reach); gx <= min(this.cols - 1, cx + reach); gx++) {
+        c = gy * this.cols + gx;
+
+        for (int i = this.cellStart[c]; i < this.cellStart[c + 1]; i++) {
+          p  = this.order[i];
+          dx = this.xs[p] - x;
+          dy = this.ys[p] - y;
+
+          if (dx * dx + dy * dy <= bestDistance) {
+            bestDistance = dx * dx + dy * dy;
+            best         = p;
+          }
+        }
+      }
+    }
+
+    return best;
+  }
+
+  private int cellOf(float x, float y) {
+    return (floor(y / this.cellSize) - this.minY) * this.cols + floor(x / this.cellSize) - this.minX;
+  }
+}
@@ -0,0 +1,81 @@
+/**
+ * Result of matching a sweep, handed from the MapWorker back to draw().
+ *
+ * Holds the pose the sweep has been taken at according to odometry and the pose
+ * scan matching found instead. When the match failed both are the same. The bot
+ * may have moved on since the sweep, so the correction is applied as the rigid
+ * transform from one pose to the other.
+ */
+class PoseCorrection {
+  float fromX;           // in mm
+  float fromY;           // in mm
+  float fromHeading;     // in degrees
+  float toX;             // in mm
+  float toY;             // in mm
+  float toHeading;       // in degrees
+
+  boolean matched;
+  int pairs;             // number of point pairs of the final match
+  float error;           // rms distance of the pairs in mm
+
+  /**
+   * @param float x           odometry pose of the sweep in mm
+   * @param float y           in mm
+   * @param float heading     in degrees
+   */
+  PoseCorrection(float x, float y, float heading) {
+    this.fromX       = x;
+    this.fromY       = y;
+    this.fromHeading = heading;
+    this.toX         = x;
+    this.toY         = y;
+    this.toHeading   = heading;
+    this.matched     = false;
+    this.pairs       = 0;
+    this.error       = 0;
+  }
+
+  /**
+   * @return float rotation from the odometry pose to the matched one in degrees
+   */
+  float getRotation() {
+    return this.toHeading - this.fromHeading;
+  }
+
+  /**
+   * moves a position the same way the pose of the sweep has been moved
+   *
+   * @param float x       in mm
+   * @param float y       in mm
+   * @return float corrected x in mm
+   */
+  float transformX(float x, float y) {
+    float r = radians(this.getRotation());
+
+    return this.toX + cos(r) * (x - this.fromX) - sin(r) * (y - this.fromY);
+  }
+
+  /**
+   * @param float x       in mm
+   * @param float y       in mm
+   * @return float corrected y in mm
+   */
+  float transformY(float x, float y) {
+    float r = radians(this.getRotation());
+
+    return this.toY + sin(r) * (x - this.fromX) + cos(r) * (y - this.fromY);
+  }
+
+  /**
+   * moves the pose a reading has been taken at
+   *
+   * @param SonarReading reading
+   */
+  void apply(SonarReading reading) {
+    float x = reading.posX;
+
+    reading.posX     = this.transformX(x, reading.posY);
+    reading.posY     = this.transformY(x, reading.posY);
+    reading.heading += this.getRotation();
+  }
+}
@@ -0,0 +1,590 @@
+/**
+ * Pose graph of all sweeps, removes the drift the Localizer leaves behind.
+ *
+ * Matching each sweep against the previous one keeps the error of a single move
+ * small, but the errors still add up and walls come out doubled once the bot
+ * returns to where it has been. The graph keeps every sweep as a node at its
+ * estimated pose. Consecutive nodes are tied together by the relative pose the
+ * Localizer found, stiffer if the scan match succeeded than if only odometry was
+ * left. Whenever a sweep is taken within LOOP_RADIUS of a node at least
+ * LOOP_MIN_GAP sweeps older, the two sweeps are matched directly. If they match,
+ * their relative pose is added as a loop closure and the whole graph is
+ * optimized.
+ *
+ * Optimization is Gauss-Newton over all poses. Every constraint ties two nodes
+ * only, so the normal equations are block sparse: a 3x3 block per node on the
+ * diagonal and one per constraint off it. They are solved by conjugate gradients
+ * preconditioned with the inverted diagonal blocks, which needs no more than
+ * products with the sparse matrix. The first node is held fixed.
+ *
+ * Each node refers to the pose its sweep has been recorded at in the
+ * ObservationStore. After an optimization the poses that moved by more than
+ * MOVE_THRESHOLD are corrected there, the MapRenderer then redoes the tiles they
+ * reach. The sweeps themselves are kept with the nodes for closing loops later.
+ * Runs on the MapWorker.
+ */
+class PoseGraph {
+  final static float LOOP_RADIUS     = 800;      // in mm
+  final static int LOOP_MIN_GAP      = 10;       // in nodes
+  final static int LOOP_COOLDOWN     = 5;        // nodes after a loop closure before the next one is tried
+  final static int MAX_ITERATIONS    = 10;
+  final static double CONVERGED      = 0.01;     // largest step of an iteration in mm
+  final static int MAX_CG_ITERATIONS = 300;
+  final static double CG_TOLERANCE   = 1e-12;    // of the squared residual, relative to the first one
+  final static float MOVE_THRESHOLD  = 2;        // in mm, moves of less than this are not passed on
+  final static float TURN_THRESHOLD  = 0.2;      // in degrees
+
+  /**
+   * standard deviations of the constraints in mm and degrees, by where they came from
+   */
+  final static float MATCHED_SIGMA       = 20;
+  final static float MATCHED_TURN_SIGMA  = 2;
+  final static float ODOMETRY_SIGMA      = 80;
+  final static float ODOMETRY_TURN_SIGMA = 8;
+  final static float LOOP_SIGMA          = 30;
+  final static float LOOP_TURN_SIGMA     = 3;
+
+  private ScanMatcher matcher;
+  private ObservationStore store;
+
+  /**
+   * the nodes, poses in mm and radians
+   */
+  private double[] xs;
+  private double[] ys;
+  private double[] thetas;
+  private ArrayList<SonarSweep> sweeps;
+  private int[] poseIds;             // in the ObservationStore
+  private int nodeCount;
+
+  /**
+   * the constraints: pose of node to relative to node from, and its information
+   */
+  private int[] edgeFrom;
+  private int[] edgeTo;
+  private double[] edgeX;
+  private double[] edgeY;
+  private double[] edgeTheta;
+  private double[] edgeInfo;         // 1 / variance of x and y
+  private double[] edgeTurnInfo;     // 1 / variance of theta
+  private int edgeCount;
+
+  private int loopCount;
+  private int lastLoop;
+
+  /**
+   * normal equations H * step = -b, 3x3 blocks stored row by row
+   */
+  private double[] diagonal;         // 9 per node
+  private double[] offDiagonal;      // 9 per edge, the block of row from, column to
+  private double[] gradient;         // b, 3 per node
+  private double[] inverse;          // of the diagonal blocks, the preconditioner
+
+  /**
+   * conjugate gradients
+   */
+  private double[] step;
+  private double[] residual;
+  private double[] direction;
+  private double[] product;
+  private double[] preconditioned;
+
+  /**
+   * jacobians of one constraint by the pose of its from and to node
+   */
+  private double[] jacobianFrom;
+  private double[] jacobianTo;
+  private double[] error;
+
+  /**
+   * @param ScanMatcher m         matches the sweeps of loop closures
+   * @param ObservationStore s    holds the poses of the sweeps
+   */
+  PoseGraph(ScanMatcher m, ObservationStore s) {
+    this.matcher      = m;
+    this.store        = s;
+    this.xs           = new double[64];
+    this.ys           = new double[64];
+    this.thetas       = new double[64];
+    this.sweeps       = new ArrayList<SonarSweep>();
+    this.poseIds      = new int[64];
+    this.nodeCount    = 0;
+    this.edgeFrom     = new int[64];
+    this.edgeTo       = new int[64];
+    this.edgeX        = new double[64];
+    this.edgeY        = new double[64];
+    this.edgeTheta    = new double[64];
+    this.edgeInfo     = new double[64];
+    this.edgeTurnInfo = new double[64];
+    this.edgeCount    = 0;
+    this.loopCount    = 0;
+    this.lastLoop     = 0;
+    this.jacobianFrom = new double[9];
+    this.jacobianTo   = new double[9];
+    this.error        = new double[3];
+  }
+
+  /**
+   * @return int number of sweeps in the graph
+   */
+  int getNodeCount() {
+    return this.nodeCount;
+  }
+
+  /**
+   * @return int number of loops that have been closed
+   */
+  int getLoopCount() {
+    return this.loopCount;
+  }
+
+  /**
+   * @param int node
+   * @return float in mm
+   */
+  float getX(int node) {
+    return (float) this.xs[node];
+  }
+
+  /**
+   * @param int node
+   * @return float in mm
+   */
+  float getY(int node) {
+    return (float) this.ys[node];
+  }
+
+  /**
+   * @param int node
+   * @return float in degrees
+   */
+  float getHeading(int node) {
+    return (float) Math.toDegrees(this.thetas[node]);
+  }
+
+  /**
+   * adds a sweep at the pose the Localizer found, tries to close a loop with it
+   * and optimizes the graph if that succeeds
+   *
+   * @param SonarSweep sweep
+   * @param int pose                     of the sweep in the ObservationStore
+   * @param PoseCorrection located       result of the Localizer for the sweep
+   * @return PoseCorrection from the located pose to the optimized one, both equal if nothing changed
+   */
+  PoseCorrection add(SonarSweep sweep, int pose, PoseCorrection located) {
+    PoseCorrection moved = new PoseCorrection(located.toX, located.toY, located.toHeading);
+    int node = this.nodeCount;
+    int previous = node - 1;
+    double theta = Math.toRadians(located.toHeading);
+
+    this.addNode(sweep, pose, located.toX, located.toY, theta);
+
+    if (previous >= 0) {
+      if (located.matched) {
+        this.addEdge(previous, node, located.toX, located.toY, theta,
+                     PoseGraph.MATCHED_SIGMA, PoseGraph.MATCHED_TURN_SIGMA);
+      } else {
+        this.addEdge(previous, node, located.toX, located.toY, theta,
+                     PoseGraph.ODOMETRY_SIGMA, PoseGraph.ODOMETRY_TURN_SIGMA);
+      }
+    }
+
+    if (node - this.lastLoop >= PoseGraph.LOOP_COOLDOWN && this.closeLoop(node)) {
+      this.lastLoop = node;
+      this.loopCount++;
+      this.optimize();
+      this.movePoses();
+
+      moved.toX       = this.getX(node);
+      moved.toY       = this.getY(node);
+      moved.toHeading = located.toHeading + (float) Math.toDegrees(this.thetas[node] - theta);
+      moved.matched   = true;
+    }
+
+    return moved;
+  }
+
+  /**
+   * looks for the closest old node and matches the sweeps of both
+   *
+   * @return boolean true if a loop closure has been added
+   */
+  private boolean closeLoop(int node) {
+    int candidate = -1;
+    double best = PoseGraph.LOOP_RADIUS;
+    double d;
+    PoseCorrection match;
+
+    for (int i = 0; i <= node - PoseGraph.LOOP_MIN_GAP; i++) {
+      d = Math.hypot(this.xs[i] - this.xs[node], this.ys[i] - this.ys[node]);
+
+      if (d < best) {
+        best      = d;
+        candidate = i;
+      }
+    }
+
+    if (candidate < 0) {
+      return false;
+    }
+
+    match = this.matcher.matchSweeps(this.sweeps.get(candidate), this.getX(candidate), this.getY(candidate), this.getHeading(candidate),
+                                     this.sweeps.get(node), this.getX(node), this.getY(node), this.getHeading(node));
+
+    if (!match.matched) {
+      return false;
+    }
+
+    this.addEdge(candidate, node, match.toX, match.toY, this.thetas[node] + Math.toRadians(match.getRotation()),
+                 PoseGraph.LOOP_SIGMA, PoseGraph.LOOP_TURN_SIGMA);
+
+    return true;
+  }
+
+  /**
+   * corrects the poses in the ObservationStore that moved noticeably
+   */
+  private void movePoses() {
+    int pose;
+
+    for (int i = 0; i < this.nodeCount; i++) {
+      pose = this.poseIds[i];
+
+      if (dist(this.getX(i), this.getY(i), this.store.getPoseX(pose), this.store.getPoseY(pose)) > PoseGraph.MOVE_THRESHOLD
+          || abs(this.getHeading(i) - this.store.getPoseHeading(pose)) > PoseGraph.TURN_THRESHOLD) {
+        this.store.movePose(pose, this.getX(i), this.getY(i), this.getHeading(i));
+      }
+    }
+  }
+
+  private void addNode(SonarSweep sweep, int pose, double x, double y, double theta) {
+    if (this.nodeCount == this.xs.length) {
+      this.xs      = java.util.Arrays.copyOf(this.xs, 2 * this.nodeCount);
+      this.ys      = java.util.Arrays.copyOf(this.ys, 2 * this.nodeCount);
+      this.thetas  = java.util.Arrays.copyOf(this.thetas, 2 * this.nodeCount);
+      this.poseIds = java.util.Arrays.copyOf(this.poseIds, 2 * this.nodeCount);
+    }
+
+    this.poseIds[this.nodeCount] = pose;
+    this.xs[this.nodeCount]     = x;
+    this.ys[this.nodeCount]     = y;
+    this.thetas[this.nodeCount] = theta;
+    this.sweeps.add(sweep);
+    this.nodeCount++;
+  }
+
+  /**
+   * adds a constraint that node to has been seen at the given pose, relative to
+   * where node from is now
+   */
+  private void addEdge(int from, int to, double x, double y, double theta, float sigma, float turnSigma) {
+    double c  = Math.cos(this.thetas[from]);
+    double s  = Math.sin(this.thetas[from]);
+    double dx = x - this.xs[from];
+    double dy = y - this.ys[from];
+    int e     = this.edgeCount;
+
+    if (e == this.edgeFrom.length) {
+      this.edgeFrom     = java.util.Arrays.copyOf(this.edgeFrom, 2 * e);
+      this.edgeTo       = java.util.Arrays.copyOf(this.edgeTo, 2 * e);
+      this.edgeX        = java.util.Arrays.copyOf(this.edgeX, 2 * e);
+      this.edgeY        = java.util.Arrays.copyOf(this.edgeY, 2 * e);
+      this.edgeTheta    = java.util.Arrays.copyOf(this.edgeTheta, 2 * e);
+      this.edgeInfo     = java.util.Arrays.copyOf(this.edgeInfo, 2 * e);
+      this.edgeTurnInfo = java.util.Arrays.copyOf(this.edgeTurnInfo, 2 * e);
+    }
+
+    this.edgeFrom[e]     = from;
+    this.edgeTo[e]       = to;
+    this.edgeX[e]        = c * dx + s * dy;
+    this.edgeY[e]        = -s * dx + c * dy;
+    this.edgeTheta[e]    = theta - this.thetas[from];
+    this.edgeInfo[e]     = 1.0 / (sigma * sigma);
+    this.edgeTurnInfo[e] = 1.0 / Math.pow(Math.toRadians(turnSigma), 2);
+    this.edgeCount++;
+  }
+
+  /**
+   * Gauss-Newton iterations until the poses stop moving
+   */
+  void optimize() {
+    int n = 3 * this.nodeCount;
+    double largest;
+
+    if (this.step == null || this.step.length < n) {
+      this.diagonal       = new double[3 * n];
+      this.gradient       = new double[n];
+      this.inverse        = new double[3 * n];
+      this.step           = new double[n];
+      this.residual       = new double[n];
+      this.direction      = new double[n];
+      this.product        = new double[n];
+      this.preconditioned = new double[n];
+    }
+    if (this.offDiagonal == null || this.offDiagonal.length < 9 * this.edgeCount) {
+      this.offDiagonal = new double[9 * this.edgeFrom.length];
+    }
+
+    for (int iteration = 0; iteration < PoseGraph.MAX_ITERATIONS; iteration++) {
+      this.linearize();
+      this.solve();
+
+      largest = 0;
+      for (int i = 1; i < this.nodeCount; i++) {
+        this.xs[i]     += this.step[3 * i];
+        this.ys[i]     += this.step[3 * i + 1];
+        this.thetas[i] += this.step[3 * i + 2];
+        largest = Math.max(largest, Math.max(Math.abs(this.step[3 * i]), Math.abs(this.step[3 * i + 1])));
+        largest = Math.max(largest, Math.abs(this.step[3 * i + 2]) * OccupancyUpdater.TRUSTED_RANGE);
+      }
+
+      if (largest < PoseGraph.CONVERGED) {
+        break;
+      }
+    }
+  }
+
+  /**
+   * builds the normal equations at the current poses. node 0 is held fixed by
+   * leaving it out: its row is the identity and its right hand side zero
+   */
+  private void linearize() {
+    int from, to;
+
+    java.util.Arrays.fill(this.diagonal, 0, 9 * this.nodeCount, 0);
+    java.util.Arrays.fill(this.gradient, 0, 3 * this.nodeCount, 0);
+    java.util.Arrays.fill(this.offDiagonal, 0, 9 * this.edgeCount, 0);
+
+    for (int e = 0; e < this.edgeCount; e++) {
+      from = this.edgeFrom[e];
+      to   = this.edgeTo[e];
+      this.linearizeEdge(e);
+
+      if (from != 0) {
+        this.accumulate(this.diagonal, 9 * from, this.jacobianFrom, this.jacobianFrom, e);
+        this.accumulateGradient(3 * from, this.jacobianFrom, e);
+      }
+      if (to != 0) {
+        this.accumulate(this.diagonal, 9 * to, this.jacobianTo, this.jacobianTo, e);
+        this.accumulateGradient(3 * to, this.jacobianTo, e);
+      }
+      if (from != 0 && to != 0) {
+        this.accumulate(this.offDiagonal, 9 * e, this.jacobianFrom, this.jacobianTo, e);
+      }
+    }
+
+    this.diagonal[0] = 1;
+    this.diagonal[4] = 1;
+    this.diagonal[8] = 1;
+
+    for (int i = 0; i < this.nodeCount; i++) {
+      this.invert(this.diagonal, 9 * i, this.inverse, 9 * i);
+    }
+  }
+
+  /**
+   * error of a constraint and its jacobians at the current poses
+   */
+  private void linearizeEdge(int e) {
+    int from  = this.edgeFrom[e];
+    int to    = this.edgeTo[e];
+    double ci = Math.cos(this.thetas[from]);
+    double si = Math.sin(this.thetas[from]);
+    double cz = Math.cos(this.edgeTheta[e]);
+    double sz = Math.sin(this.edgeTheta[e]);
+    double dx = this.xs[to] - this.xs[from];
+    double dy = this.ys[to] - this.ys[from];
+
+    // pose of to as seen from from
+    double lx = ci * dx + si * dy;
+    double ly = -si * dx + ci * dy;
+    double t  = this.thetas[to] - this.thetas[from] - this.edgeTheta[e];
+
+    // and as seen from where the constraint expects it
+    this.error[0] = cz * (lx - this.edgeX[e]) + sz * (ly - this.edgeY[e]);
+    this.error[1] = -sz * (lx - this.edgeX[e]) + cz * (ly - this.edgeY[e]);
+    this.error[2] = t - 2 * Math.PI * Math.floor((t + Math.PI) / (2 * Math.PI));
+
+    this.jacobianTo[0] = cz * ci - sz * si;
+    this.jacobianTo[1] = cz * si + sz * ci;
+    this.jacobianTo[2] = 0;
+    this.jacobianTo[3] = -sz * ci - cz * si;
+    this.jacobianTo[4] = -sz * si + cz * ci;
+    this.jacobianTo[5] = 0;
+    this.jacobianTo[6] = 0;
+    this.jacobianTo[7] = 0;
+    this.jacobianTo[8] = 1;
+
+    this.jacobianFrom[0] = -this.jacobianTo[0];
+    this.jacobianFrom[1] = -this.jacobianTo[1];
+    this.jacobianFrom[2] = cz * ly - sz * lx;
+    this.jacobianFrom[3] = -this.jacobianTo[3];
+    this.jacobianFrom[4] = -this.jacobianTo[4];
+    this.jacobianFrom[5] = -sz * ly - cz * lx;
+    this.jacobianFrom[6] = 0;
+    this.jacobianFrom[7] = 0;
+    this.jacobianFrom[8] = -1;
+  }
+
+  /**
+   * block += a^T * info * b of constraint e
+   */
+  private void accumulate(double[] block, int offset, double[] a, double[] b, int e) {
+    double info;
+
+    for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 3; k++) {
+          info = k == 2 ? this.edgeTurnInfo[e] : this.edgeInfo[e];
+          block[offset + 3 * r + c] += a[3 * k + r] * info * b[3 * k + c];
+        }
+      }
+    }
+  }
+
+  /**
+   * gradient += a^T * info * error of constraint e
+   */
+  private void accumulateGradient(int offset, double[] a, int e) {
+    double info;
+
+    for (int r = 0; r < 3; r++) {
+      for (int k = 0; k < 3; k++) {
+        info = k == 2 ? this.edgeTurnInfo[e] : this.edgeInfo[e];
+        this.gradient[offset + r] += a[3 * k + r] * info * this.error[k];
+      }
+    }
+  }
+
+  /**
+   * preconditioned conjugate gradients for H * step = -b
+   */
+  private void solve() {
+    int n = 3 * this.nodeCount;
+    double rz, rzNext, alpha, squares;
+    double first = 0;
+
+    for (int i = 0; i < n; i++) {
+      this.step[i]     = 0;
+      this.residual[i] = -this.gradient[i];
+      first += this.residual[i] * this.residual[i];
+    }
+    if (first == 0) {
+      return;
+    }
+
+    this.precondition(this.residual, this.preconditioned);
+    System.arraycopy(this.preconditioned, 0, this.direction, 0, n);
+    rz = this.dot(this.residual, this.preconditioned, n);
+
+    for (int iteration = 0; iteration < PoseGraph.MAX_CG_ITERATIONS; iteration++) {
+      this.multiply(this.direction, this.product);
+      alpha   = rz / this.dot(this.direction, this.product, n);
+      squares = 0;
+
+      for (int i = 0; i < n; i++) {
+        this.step[i]     += alpha * this.direction[i];
+        this.residual[i] -= alpha * this.product[i];
+        squares += this.residual[i] * this.residual[i];
+      }
+
+      if (squares < PoseGraph.CG_TOLERANCE * first) {
+        break;
+      }
+
+      this.precondition(this.residual, this.preconditioned);
+      rzNext = this.dot(this.residual, this.preconditioned, n);
+
+      for (int i = 0; i < n; i++) {
+        this.direction[i] = this.preconditioned[i] + rzNext / rz * this.direction[i];
+      }
+      rz = rzNext;
+    }
+  }
+
+  /**
+   * out = H * v, one diagonal block per node and one off-diagonal block per
+   * constraint, which stands for both H[from][to] and its transpose H[to][from]
+   */
+  private void multiply(double[] v, double[] out) {
+    int from, to, b;
+
+    for (int i = 0; i < this.nodeCount; i++) {
+      b = 9 * i;
+      for (int r = 0; r < 3; r++) {
+        out[3 * i + r] = this.diagonal[b + 3 * r] * v[3 * i]
+                       + this.diagonal[b + 3 * r + 1] * v[3 * i + 1]
+                       + this.diagonal[b + 3 * r + 2] * v[3 * i + 2];
+      }
+    }
+
+    for (int e = 0; e < this.edgeCount; e++) {
+      from = 3 * this.edgeFrom[e];
+      to   = 3 * this.edgeTo[e];
+      b    = 9 * e;
+
+      for (int r = 0; r < 3; r++) {
+        out[from + r] += this.offDiagonal[b + 3 * r] * v[to]
+                       + this.offDiagonal[b + 3 * r + 1] * v[to + 1]
+                       + this.offDiagonal[b + 3 * r + 2] * v[to + 2];
+        out[to + r]   += this.offDiagonal[b + r] * v[from]
+                       + this.offDiagonal[b + 3 + r] * v[from + 1]
+                       + this.offDiagonal[b + 6 + r] * v[from + 2];
+      }
+    }
+  }
+
+  /**
+   * out = inverse of the diagonal blocks * v
+   */
+  private void precondition(double[] v, double[] out) {
+    int b;
+
+    for (int i = 0; i < this.nodeCount; i++) {
+      b = 9 * i;
+      for (int r = 0; r < 3; r++) {
+        out[3 * i + r] = this.inverse[b + 3 * r] * v[3 * i]
+                       + this.inverse[b + 3 * r + 1] * v[3 * i + 1]
+                       + this.inverse[b + 3 * r + 2] * v[3 * i + 2];
+      }
+    }
+  }
+
+  private double dot(double[] a, double[] b, int n) {
+    double sum = 0;
+
+    for (int i = 0; i < n; i++) {
+      sum += a[i] * b[i];
+    }
+
+    return sum;
+  }
+
+  /**
+   * inverts a 3x3 block by its adjugate
+   */
+  private void invert(double[] m, int o, double[] out, int p) {
+    double c0 = m[o + 4] * m[o + 8] - m[o + 5] * m[o + 7];
+    double c1 = m[o + 5] * m[o + 6] - m[o + 3] * m[o + 8];
+    double c2 = m[o + 3] * m[o + 7] - m[o + 4] * m[o + 6];
+    double det = m[o] * c0 + m[o + 1] * c1 + m[o + 2] * c2;
+
+    if (det == 0) {
+      java.util.Arrays.fill(out, p, p + 9, 0);
+      out[p] = 1;
+      out[p + 4] = 1;
+      out[p + 8] = 1;
+      return;
+    }
+
+    out[p]     = c0 / det;
+    out[p + 1] = (m[o + 2] * m[o + 7] - m[o + 1] * m[o + 8]) / det;
+    out[p + 2] = (m[o + 1] * m[o + 5] - m[o + 2] * m[o + 4]) / det;
+    out[p + 3] = c1 / det;
+    out[p + 4] = (m[o] * m[o + 8] - m[o + 2] * m[o + 6]) / det;
+    out[p + 5] = (m[o + 2] * m[o + 3] - m[o] * m[o + 5]) / det;
+    out[p + 6] = c2 / det;
+    out[p + 7] = (m[o + 1] * m[o + 6] - m[o] * m[o + 7]) / det;
+    out[p + 8] = (m[o] * m[o + 4] - m[o + 1] * m[o + 3]) / det;
+  }
+}
@@ -0,0 +1,191 @@
+import java.nio.ByteBuffer;
+
+/**
+ * A preallocated slot in the CommandQueue.
+ *
+ * The cmd*() functions of the CommandQueue encode the complete frame, i.e.
+ * "#l:[angle]\n", in place into the frame array of a free slot and keep the raw
+ * parameters next to it. Slots are reused, queueing a command allocates nothing.
+ */
+class QueuedCommand {
+  final static int MAX_FRAME_LENGTH = 32;
+  final static int MAX_PARAMS       = 3;
+
+  char cmd;
+  byte[] frame;
+  int length;
+
+  /**
+   * the raw parameters of the command, kept to allow access to the values again
+   * once the confirmation from the robot has been received without unserializing
+   * the byte stream again
+   */
+  int[] params;
+  int paramCount;
+
+  /**
+   * writes into frame, ints and floats are put MSB first as the robot expects them
+   */
+  private ByteBuffer encoder;
+
+  QueuedCommand() {
+    this.frame      = new byte[QueuedCommand.MAX_FRAME_LENGTH];
+    this.encoder    = ByteBuffer.wrap(this.frame);
+    this.params     = new int[QueuedCommand.MAX_PARAMS];
+    this.cmd        = CommandQueue.CMD_NOOP;
+    this.length     = 0;
+    this.paramCount = 0;
+  }
+
+  /**
+   * starts a new frame for the given command: "#[cmd]:"
+   *
+   * @param char c
+   * @return QueuedCommand
+   */
+  QueuedCommand begin(char c) {
+    this.cmd        = c;
+    this.paramCount = 0;
+    this.encoder.clear();
+    this.encoder.put((byte) SerialConnection.SRLCMD_CHAR_START);
+    this.encoder.put((byte) c);
+    this.encoder.put((byte) SerialConnection.SRLCMD_CHAR_CMDSEP);
+
+    return this;
+  }
+
+  /**
+   * appends a 4 byte int to the frame and remembers it as a parameter
+   *
+   * @param int value
+   * @return QueuedCommand
+   */
+  QueuedCommand putInt(int value) {
+    this.encoder.putInt(value);
+    this.params[this.paramCount++] = value;
+
+    return this;
+  }
+
+  /**
+   * appends a single byte to the frame and remembers it as a parameter
+   *
+   * @param int value
+   * @return QueuedCommand
+   */
+  QueuedCommand putByte(int value) {
+    this.encoder.put((byte) value);
+    this.params[this.paramCount++] = value;
+
+    return this;
+  }
+
+  /**
+   * appends the low byte of each char of the given text, up to maxLength chars
+   *
+   * @param String text
+   * @param int maxLength
+   * @return QueuedCommand
+   */
+  QueuedCommand putText(String text, int maxLength) {
+    int len = min(text.length(), maxLength);
+
+    for (int i = 0; i < len; i++) {
+      this.encoder.put((byte) text.charAt(i));
+    }
+
+    return this;
+  }
+
+  /**
+   * appends the ',' payload separator
+   *
+   * @return QueuedCommand
+   */
+  QueuedCommand separator() {
+    this.encoder.put((byte) SerialConnection.SRLCMD_CHAR_PAYLOADSEP);
+
+    return this;
+  }
+
+  /**
+   * terminates the frame with '\n'
+   */
+  void end() {
+    this.encoder.put((byte) SerialConnection.SRLCMD_CHAR_END);
+    this.length = this.encoder.position();
+  }
+
+  /**
+   * takes over a complete frame as it has been sent, i.e. from a LinkRecorder
+   * file, and reads the parameters back out of it
+   *
+   * @param byte[] data
+   * @param int offset
+   * @param int len
+   * @return boolean false if the bytes are not a frame of a known command
+   */
+  boolean decode(byte[] data, int offset, int len) {
+    int ints;
+
+    if (len < 4 || len > QueuedCommand.MAX_FRAME_LENGTH
+        || data[offset] != SerialConnection.SRLCMD_CHAR_START
+        || data[offset + 2] != SerialConnection.SRLCMD_CHAR_CMDSEP
+        || data[offset + len - 1] != SerialConnection.SRLCMD_CHAR_END) {
+      return false;
+    }
+
+    switch ((char) data[offset + 1]) {
+      case CommandQueue.CMD_BATTERY:
+      case CommandQueue.CMD_LCDCLEAR:
+      case CommandQueue.CMD_PROFILE:
+        ints = 0;
+        break;
+      case CommandQueue.CMD_TURNLEFT:
+      case CommandQueue.CMD_TURNRIGHT:
+      case CommandQueue.CMD_MOVEFORWARD:
+      case CommandQueue.CMD_MOVEBACKWARD:
+      case CommandQueue.CMD_SONARPING:
+        ints = 1;
+        break;
+      case CommandQueue.CMD_LCDWRITE:
+      case CommandQueue.CMD_SONARSWEEP:
+        ints = 2;
+        break;
+      default:
+        return false;
+    }
+
+    // ints are followed by a separator, the step size of a sweep by the end
+    if (len < 4 + 5 * ints + (data[offset + 1] == CommandQueue.CMD_SONARSWEEP ? 1 : 0)) {
+      return false;
+    }
+
+    this.cmd        = (char) data[offset + 1];
+    this.length     = len;
+    this.paramCount = 0;
+    System.arraycopy(data, offset, this.frame, 0, len);
+
+    for (int i = 0; i < ints; i++) {
+      this.params[this.paramCount++] = this.encoder.getInt(3 + 5 * i);
+    }
+    if (this.cmd == CommandQueue.CMD_SONARSWEEP) {
+      this.params[this.paramCount++] = this.frame[13] & 0xFF;
+    }
+
+    return true;
+  }
+
+  /**
+   * copies command, parameters and frame from another slot
+   *
+   * @param QueuedCommand other
+   */
+  void copyFrom(QueuedCommand other) {
+    this.cmd        = other.cmd;
+    this.length     = other.length;
+    this.paramCount = other.paramCount;
+    System.arraycopy(other.frame, 0, this.frame, 0, other.length);
+    System.arraycopy(other.params, 0, this.params, 0, other.paramCount);
+  }
+}
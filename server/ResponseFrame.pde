@@ -0,0 +1,23 @@
+/**
+ * A complete response of a type the FrameParser does not know how to decode.
+ *
+ * Only the response type (the char following the '#') and the raw payload bytes
+ * between the ':' separator and the '\n' terminator are kept.
+ */
+class ResponseFrame extends Response {
+  byte[] payload;
+  int length;
+
+  /**
+   * @param char t
+   * @param byte[] data      payload bytes, copied
+   * @param int len          number of payload bytes in data
+   */
+  ResponseFrame(char t, byte[] data, int len) {
+    super(t);
+    this.payload = new byte[len];
+    this.length  = len;
+
+    System.arraycopy(data, 0, this.payload, 0, len);
+  }
+}
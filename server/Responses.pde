@@ -0,0 +1,165 @@
+/**
+ * Decoded responses from the robot.
+ *
+ * The FrameParser creates one of these per received frame, straight from the
+ * payload bytes. Ints and floats are sent as 4 bytes, MSB first.
+ */
+class Response {
+  final static char TYPE_COMPLETE = 'K';
+  final static char TYPE_PING     = 'P';
+  final static char TYPE_BATTERY  = 'B';
+  final static char TYPE_PROFILE  = 'F';
+  
+  char type;
+  
+  Response(char t) {
+    this.type = t;
+  }
+}
+
+/**
+ * #K:[received][parsed][started][finished]\n - the last command has been executed
+ *
+ * the CommandQueue fills in which command that has been and its first parameter.
+ * The times are the robot's us_ticker when the frame was received, parsed, its
+ * execution started and finished. They are unsigned ints that wrap after about
+ * 71 minutes, so only their differences are used. Older firmware sends a bare
+ * "#K\n" without them.
+ */
+class CompletionResult extends Response {
+  final static long TICKER_MASK = 0xFFFFFFFFL;
+  
+  char cmd;
+  int param;
+  boolean timed;             // false for a bare #K
+  long received;             // in us
+  long parsed;               // in us
+  long started;              // in us
+  long finished;             // in us
+  int droppedPings;          // pings of the command that did not fit into the events queue
+  
+  CompletionResult() {
+    super(Response.TYPE_COMPLETE);
+    this.timed = false;
+  }
+  
+  CompletionResult(long r, long p, long s, long f) {
+    super(Response.TYPE_COMPLETE);
+    this.timed    = true;
+    this.received = r;
+    this.parsed   = p;
+    this.started  = s;
+    this.finished = f;
+  }
+  
+  /**
+   * @return long microseconds from the frame's '\n' to sending the completion, all of it spent on the robot
+   */
+  long getBotTime() {
+    return (this.finished - this.received) & CompletionResult.TICKER_MASK;
+  }
+  
+  /**
+   * @return long microseconds from the frame's '\n' to the start of execution, parsing and waiting for the main loop
+   */
+  long getWaitTime() {
+    return (this.started - this.received) & CompletionResult.TICKER_MASK;
+  }
+  
+  /**
+   * @return long microseconds the command executed
+   */
+  long getExecTime() {
+    return (this.finished - this.started) & CompletionResult.TICKER_MASK;
+  }
+}
+
+/**
+ * not sent by the robot: published by the CommandQueue in place of a completion
+ * that never arrived
+ */
+class CommandTimeout {
+  char cmd;
+  int param;
+  
+  CommandTimeout(char c, int p) {
+    this.cmd   = c;
+    this.param = p;
+  }
+}
+
+/**
+ * #P:[angle],[range]\n - a single sonar measurement
+ */
+class PingResult extends Response {
+  int angle;                 // servo angle in degrees, 0 is straight ahead
+  int range;                 // in mm
+  
+  PingResult(int a, int r) {
+    super(Response.TYPE_PING);
+    this.angle = a;
+    this.range = r;
+  }
+}
+
+/**
+ * #B:[voltage]\n - battery status
+ */
+class BatteryResult extends Response {
+  float volts;
+  
+  BatteryResult(float v) {
+    super(Response.TYPE_BATTERY);
+    this.volts = v;
+  }
+}
+
+/**
+ * #F:[zone][count][min][max][total]\n - CPU cycles the firmware spent in one
+ * profiling zone since the last profile request, see m3pi/Profiler/Profiler.h.
+ *
+ * count, min and max are unsigned ints on the robot, total is 8 bytes
+ */
+class ProfileResult extends Response {
+  final static float CPU_MHZ = 96.0;   // core clock of the LPC1768, cycles per us
+  
+  int zone;                  // ProfileZone in Profiler.h
+  long count;
+  long min;                  // in cycles
+  long max;                  // in cycles
+  long total;                // in cycles
+  
+  ProfileResult(int z, long c, long mn, long mx, long t) {
+    super(Response.TYPE_PROFILE);
+    this.zone  = z;
+    this.count = c;
+    this.min   = mn;
+    this.max   = mx;
+    this.total = t;
+  }
+  
+  /**
+   * @return String name of the zone, as in Profiler.h
+   */
+  String getZoneName() {
+    switch (this.zone) {
+      case 0:  return "processPayload";
+      case 1:  return "executeCommand";
+      case 2:  return "sonar";
+      case 3:  return "reportPing";
+      case 4:  return "lcd";
+      default: return "zone " + this.zone;
+    }
+  }
+  
+  public String toString() {
+    if (this.count == 0) {
+      return this.getZoneName() + ": not entered";
+    }
+    
+    return this.getZoneName() + ": " + this.count + " calls, min " + nf(this.min / ProfileResult.CPU_MHZ, 1, 1)
+           + " us, mean " + nf(this.total / this.count / ProfileResult.CPU_MHZ, 1, 1)
+           + " us, max " + nf(this.max / ProfileResult.CPU_MHZ, 1, 1)
+           + " us, total " + nf(this.total / ProfileResult.CPU_MHZ / 1000, 1, 1) + " ms";
+  }
+}
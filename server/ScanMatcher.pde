@@ -0,0 +1,329 @@
+/**
+ * Corrects the odometry pose of a sweep by aligning its echoes with the previous sweep.
+ *
+ * The firmware moves and turns by timing alone, so the pose the SonarBot adds up
+ * from the commands drifts. Consecutive sweeps mostly see the same walls though.
+ * Each sweep is turned into a point cloud, one point per echo, and aligned with
+ * the cloud of the previous sweep by point-to-point ICP: pair every point with
+ * the closest reference point, solve for the rigid transform that best maps the
+ * pairs onto each other, repeat with the transformed points until it converges.
+ * The pair distance shrinks with the error, which keeps the few sonar outliers
+ * out of the final iterations.
+ *
+ * Closest points are looked up in a PointGrid over the reference cloud. The
+ * match is rejected if too few points pair up, the remaining error is large or
+ * the correction is implausibly large for one move.
+ *
+ * matchSweeps() aligns any two sweeps at given poses, the PoseGraph uses it to
+ * close loops. The drift may have grown large by then, so it starts with a wider
+ * pair distance and accepts larger corrections.
+ */
+class ScanMatcher implements Localizer {
+  final static int MAX_ITERATIONS       = 30;
+  final static float MATCH_DISTANCE     = 200;     // in mm, of the first iteration
+  final static float MIN_MATCH_DISTANCE = 40;      // in mm
+  final static int MIN_PAIRS            = 10;
+  final static float MIN_OVERLAP        = 0.3;     // share of the points that must pair up
+  final static float MAX_ERROR          = 50;      // rms in mm
+  final static float MAX_TRANSLATION    = 200;     // in mm
+  final static float MAX_ROTATION       = 20;      // in degrees
+  final static float CONVERGED          = 0.5;     // in mm
+
+  final static float LOOP_MATCH_DISTANCE  = 400;   // in mm
+  final static float LOOP_MAX_TRANSLATION = 600;   // in mm
+  final static float LOOP_MAX_ROTATION    = 30;    // in degrees
+
+  private PointGrid grid;
+  private float[] referenceX;
+  private float[] referenceY;
+  private int referenceCount;
+
+  /**
+   * reference of matchSweeps(), kept apart from the one of the previous sweep
+   */
+  private PointGrid loopGrid;
+  private float[] loopX;
+  private float[] loopY;
+
+  private float[] pointX;
+  private float[] pointY;
+
+  /**
+   * the pairs of the current iteration
+   */
+  private float[] pairX;
+  private float[] pairY;
+  private int[] pairRef;
+
+  private int matchCount;
+  private int failCount;
+
+  ScanMatcher() {
+    this.grid           = new PointGrid();
+    this.referenceX     = new float[0];
+    this.referenceY     = new float[0];
+    this.referenceCount = 0;
+    this.loopGrid       = new PointGrid();
+    this.loopX          = new float[0];
+    this.loopY          = new float[0];
+    this.pointX         = new float[0];
+    this.pointY         = new float[0];
+    this.matchCount     = 0;
+    this.failCount      = 0;
+  }
+
+  /**
+   * @return int number of sweeps that have been matched
+   */
+  int getMatchCount() {
+    return this.matchCount;
+  }
+
+  /**
+   * @return int number of sweeps that could not be matched
+   */
+  int getFailCount() {
+    return this.failCount;
+  }
+
+  /**
+   * matches a sweep against the previous one, which it then replaces as the reference
+   *
+   * @param SonarSweep sweep
+   * @return PoseCorrection
+   */
+  public PoseCorrection locate(SonarSweep sweep) {
+    PoseCorrection correction = new PoseCorrection(sweep.posX, sweep.posY, sweep.heading);
+    int count = this.collectPoints(sweep, sweep.posX, sweep.posY, sweep.heading);
+
+    if (count < ScanMatcher.MIN_PAIRS) {
+      // too little to match against either, keep the previous reference
+      return correction;
+    }
+
+    if (this.referenceCount >= ScanMatcher.MIN_PAIRS) {
+      this.align(correction, count, this.referenceX, this.referenceY, this.grid,
+                 ScanMatcher.MATCH_DISTANCE, ScanMatcher.MAX_TRANSLATION, ScanMatcher.MAX_ROTATION);
+
+      if (correction.matched) {
+        this.matchCount++;
+      } else {
+        this.failCount++;
+      }
+    }
+
+    // the sweep is the reference for the next one, at its corrected pose
+    if (this.referenceX.length < count) {
+      this.referenceX = new float[count];
+      this.referenceY = new float[count];
+    }
+    for (int i = 0; i < count; i++) {
+      this.referenceX[i] = correction.transformX(this.pointX[i], this.pointY[i]);
+      this.referenceY[i] = correction.transformY(this.pointX[i], this.pointY[i]);
+    }
+    this.referenceCount = count;
+    this.grid.build(this.referenceX, this.referenceY, count, ScanMatcher.MATCH_DISTANCE);
+
+    return correction;
+  }
+
+  /**
+   * moves the reference along when the pose of the previous sweep has been changed
+   * after locate(), so the next sweep is matched in the same frame
+   *
+   * @param PoseCorrection c
+   */
+  public void relocate(PoseCorrection c) {
+    float x;
+
+    for (int i = 0; i < this.referenceCount; i++) {
+      x = this.referenceX[i];
+      this.referenceX[i] = c.transformX(x, this.referenceY[i]);
+      this.referenceY[i] = c.transformY(x, this.referenceY[i]);
+    }
+    this.grid.build(this.referenceX, this.referenceY, this.referenceCount, ScanMatcher.MATCH_DISTANCE);
+  }
+
+  /**
+   * aligns a sweep with another one, taken at any time before
+   *
+   * @param SonarSweep reference
+   * @param float refX            pose of the reference in mm
+   * @param float refY            in mm
+   * @param float refHeading      in degrees
+   * @param SonarSweep sweep
+   * @param float x               estimated pose of the sweep in mm
+   * @param float y               in mm
+   * @param float heading         in degrees
+   * @return PoseCorrection       from the estimated pose to the matched one
+   */
+  PoseCorrection matchSweeps(SonarSweep reference, float refX, float refY, float refHeading,
+                             SonarSweep sweep, float x, float y, float heading) {
+    PoseCorrection correction = new PoseCorrection(x, y, heading);
+    int refCount = this.collectPoints(reference, refX, refY, refHeading);
+    int count;
+
+    if (refCount < ScanMatcher.MIN_PAIRS) {
+      return correction;
+    }
+
+    if (this.loopX.length < refCount) {
+      this.loopX = new float[refCount];
+      this.loopY = new float[refCount];
+    }
+    System.arraycopy(this.pointX, 0, this.loopX, 0, refCount);
+    System.arraycopy(this.pointY, 0, this.loopY, 0, refCount);
+    this.loopGrid.build(this.loopX, this.loopY, refCount, ScanMatcher.LOOP_MATCH_DISTANCE);
+
+    count = this.collectPoints(sweep, x, y, heading);
+
+    if (count >= ScanMatcher.MIN_PAIRS) {
+      this.align(correction, count, this.loopX, this.loopY, this.loopGrid,
+                 ScanMatcher.LOOP_MATCH_DISTANCE, ScanMatcher.LOOP_MAX_TRANSLATION, ScanMatcher.LOOP_MAX_ROTATION);
+    }
+
+    return correction;
+  }
+
+  /**
+   * converts every echo of the sweep into a point in mm, as seen from the given pose
+   *
+   * @return int number of points
+   */
+  private int collectPoints(SonarSweep sweep, float x, float y, float heading) {
+    int count = 0;
+    float direction;
+
+    if (this.pointX.length < sweep.size()) {
+      this.pointX  = new float[sweep.size()];
+      this.pointY  = new float[sweep.size()];
+      this.pairX   = new float[sweep.size()];
+      this.pairY   = new float[sweep.size()];
+      this.pairRef = new int[sweep.size()];
+    }
+
+    for (SonarReading reading : sweep.readings) {
+      if (reading.range < OccupancyUpdater.MIN_RANGE || reading.range >= OccupancyUpdater.TRUSTED_RANGE) {
+        continue;
+      }
+      direction = radians(heading + reading.angle);
+      this.pointX[count] = x + reading.range * cos(direction);
+      this.pointY[count] = y + reading.range * sin(direction);
+      count++;
+    }
+
+    return count;
+  }
+
+  /**
+   * runs ICP of the collected points against a reference and fills in the
+   * correction if the result is plausible
+   */
+  private void align(PoseCorrection correction, int count, float[] referenceX, float[] referenceY, PointGrid grid,
+                     float matchDistance, float maxTranslation, float maxRotation) {
+    float theta       = 0;              // in radians
+    float tx          = 0;              // in mm
+    float ty          = 0;              // in mm
+    float maxDistance = matchDistance;
+    float error       = 0;
+    int pairs         = 0;
+    float c, s, px, py, dx, dy, squares;
+    float meanPX, meanPY, meanQX, meanQY, sxx, sxy, syx, syy, dTheta, dtx, dty, ntx;
+    int ref;
+
+    for (int iteration = 0; iteration < ScanMatcher.MAX_ITERATIONS; iteration++) {
+      c       = cos(theta);
+      s       = sin(theta);
+      pairs   = 0;
+      squares = 0;
+      meanPX  = 0;
+      meanPY  = 0;
+      meanQX  = 0;
+      meanQY  = 0;
+
+      for (int i = 0; i < count; i++) {
+        px  = c * this.pointX[i] - s * this.pointY[i] + tx;
+        py  = s * this.pointX[i] + c * this.pointY[i] + ty;
+        ref = grid.nearest(px, py, maxDistance);
+
+        if (ref < 0) {
+          continue;
+        }
+        dx = referenceX[ref] - px;
+        dy = referenceY[ref] - py;
+
+        this.pairX[pairs]   = px;
+        this.pairY[pairs]   = py;
+        this.pairRef[pairs] = ref;
+        squares += dx * dx + dy * dy;
+        meanPX  += px;
+        meanPY  += py;
+        meanQX  += referenceX[ref];
+        meanQY  += referenceY[ref];
+        pairs++;
+      }
+
+      if (pairs < ScanMatcher.MIN_PAIRS) {
+        return;
+      }
+
+      error   = sqrt(squares / pairs);
+      meanPX /= pairs;
+      meanPY /= pairs;
+      meanQX /= pairs;
+      meanQY /= pairs;
+      sxx = 0;
+      sxy = 0;
+      syx = 0;
+      syy = 0;
+
+      for (int i = 0; i < pairs; i++) {
+        px   = this.pairX[i] - meanPX;
+        py   = this.pairY[i] - meanPY;
+        dx   = referenceX[this.pairRef[i]] - meanQX;
+        dy   = referenceY[this.pairRef[i]] - meanQY;
+        sxx += px * dx;
+        sxy += px * dy;
+        syx += py * dx;
+        syy += py * dy;
+      }
+
+      // rotation and translation that map the paired points onto their references best
+      dTheta = atan2(sxy - syx, sxx + syy);
+      c      = cos(dTheta);
+      s      = sin(dTheta);
+      dtx    = meanQX - (c * meanPX - s * meanPY);
+      dty    = meanQY - (s * meanPX + c * meanPY);
+
+      // on top of the transform so far
+      theta += dTheta;
+      ntx    = c * tx - s * ty + dtx;
+      ty     = s * tx + c * ty + dty;
+      tx     = ntx;
+
+      maxDistance = constrain(3 * error, ScanMatcher.MIN_MATCH_DISTANCE, matchDistance);
+
+      if (abs(dtx) + abs(dty) + abs(dTheta) * OccupancyUpdater.TRUSTED_RANGE < ScanMatcher.CONVERGED) {
+        break;
+      }
+    }
+
+    c = cos(theta);
+    s = sin(theta);
+    correction.pairs = pairs;
+    correction.error = error;
+
+    if (pairs < max(ScanMatcher.MIN_PAIRS, ScanMatcher.MIN_OVERLAP * count)
+        || error > ScanMatcher.MAX_ERROR
+        || abs(degrees(theta)) > maxRotation
+        || dist(0, 0, c * correction.fromX - s * correction.fromY + tx - correction.fromX,
+                      s * correction.fromX + c * correction.fromY + ty - correction.fromY) > maxTranslation) {
+      return;
+    }
+
+    correction.toX       = c * correction.fromX - s * correction.fromY + tx;
+    correction.toY       = s * correction.fromX + c * correction.fromY + ty;
+    correction.toHeading = correction.fromHeading + degrees(theta);
+    correction.matched   = true;
+  }
+}
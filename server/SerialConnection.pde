@@ -2,48 +2,114 @@ import processing.serial.*;
 
 class SerialConnection {
   Serial port;
-  ArrayList<String> inputBuffer;
+  ArrayList<Response> inputBuffer;
   
   /** 
    * byte-stream from the robot. 
    *
-   * this variable is being filled from the serialEvent() callback in the main applet
+   * this buffer is being filled from the serialEvent() callback in the main applet
    */
-  String currentBuffer;
+  ByteRingBuffer rxBuffer;
   
   /**
-   * buffer-in-progress. This is continuously being worked on as SerialConnection.processSerial() is called
+   * turns the bytes in rxBuffer into Responses as SerialConnection.processSerial() is called
    */
-  String processingBuffer;
+  FrameParser parser;
+  
+  /**
+   * scratch buffers to move bytes from the port into rxBuffer and from rxBuffer into the parser
+   */
+  private byte[] readChunk;
+  private byte[] parseChunk;
+  
+  /**
+   * Serial.write() only takes whole arrays. Frames are sent from exactly sized
+   * arrays that are allocated once per frame length and reused.
+   */
+  private byte[][] sendBuffers;
+  
+  /**
+   * when true every byte that is sent is logged to the console
+   */
+  boolean debug;
+  
+  /**
+   * gets every chunk received and every frame sent when set
+   */
+  LinkRecorder recorder;
+  
+  /**
+   * frames passed to write(), with or without a port
+   */
+  private volatile long framesWritten;
+  
+  /**
+   * bytes run through the parser and bytes passed to write(), for LinkStats
+   */
+  private volatile long bytesReceived;
+  private volatile long bytesSent;
   
   private static final char SRLCMD_CHAR_START = '#';
   private static final char SRLCMD_CHAR_CMDSEP = ':';
   private static final char SRLCMD_CHAR_PAYLOADSEP = ',';
   private static final char SRLCMD_CHAR_END = '\n';
   
-  private static final byte SRLCMD_STATE_IDLE = 0;                 // ready to receive new command
-  private static final byte SRLCMD_STATE_WAITINGFORCMDBYTE = 1;    // reveived the '#' start char, waiting for command byte
-  private static final byte SRLCMD_STATE_CMDBYTERECEIVED = 2;      // received command char (is expecting a ':' separator char now)
-  private static final byte SRLCMD_STATE_WAITINGFORPAYLOAD = 3;    // received separator ':' char, expects payload or terminator now
-  private static final byte SRLCMD_STATE_CMDAVAILABLE = 4;         // received '\n' terminator char (possibly preceeded by payload chars)
-  private static final byte SRLCMD_STATE_ERR = 10;                 // unexpected char over Serial. this error is irrecoverable at the moment
+  private static final int RX_BUFFER_SIZE = 65536;                 // power of two
+  private static final int CHUNK_SIZE = 1024;
   
-  private byte cmdState;
+  /**
+   * constructor.
+   *
+   * opens no port at all, bytes are passed in with inject() by a LinkReplay
+   */
+  SerialConnection() {
+    this.rxBuffer          = new ByteRingBuffer(SerialConnection.RX_BUFFER_SIZE);
+    this.parser            = new FrameParser();
+    this.inputBuffer       = new ArrayList<Response>();
+    this.readChunk         = new byte[SerialConnection.CHUNK_SIZE];
+    this.parseChunk        = new byte[SerialConnection.CHUNK_SIZE];
+    this.sendBuffers       = new byte[QueuedCommand.MAX_FRAME_LENGTH + 1][];
+    this.debug             = false;
+  }
   
   /**
    * constructor.
    *
+   * opens the first serial port that is found
+   *
    * @param PApplet o
    * @param int baudrate
    */
   SerialConnection(PApplet o, int baudrate) {
-    this.currentBuffer     = "";
-    this.processingBuffer  = "";
-    this.inputBuffer       = new ArrayList<String>();
-    this.cmdState          = SerialConnection.SRLCMD_STATE_IDLE;
+    this(o, null, baudrate);
+  }
+  
+  /**
+   * constructor.
+   *
+   * opens the serial port with the given name, i.e. "/dev/ttyACM0", "COM3" or the 
+   * pty of the bot emulator in tools/botemu. Falls back to the first serial port 
+   * that is found when portName is null or empty.
+   *
+   * @param PApplet o
+   * @param String portName
+   * @param int baudrate
+   */
+  SerialConnection(PApplet o, String portName, int baudrate) {
+    this.rxBuffer          = new ByteRingBuffer(SerialConnection.RX_BUFFER_SIZE);
+    this.parser            = new FrameParser();
+    this.inputBuffer       = new ArrayList<Response>();
+    this.readChunk         = new byte[SerialConnection.CHUNK_SIZE];
+    this.parseChunk        = new byte[SerialConnection.CHUNK_SIZE];
+    this.sendBuffers       = new byte[QueuedCommand.MAX_FRAME_LENGTH + 1][];
+    this.debug             = false;
     
-    if (Serial.list().length > 0) {
-      String portName = Serial.list()[0]; //change the 0 to a 1 or 2 etc. to match your port
+    if ((portName == null || "".equals(portName)) && Serial.list().length > 0) {
+      portName = Serial.list()[0];
+    }
+    
+    if (portName != null && !"".equals(portName)) {
+      println("opening serial port " + portName);
       this.port = new Serial(o, portName, baudrate);
       
       this.port.write(0x81);
@@ -55,77 +121,93 @@ class SerialConnection {
    * where 'conn' is your instance of this SerialConnection class.
    *
    * void serialEvent (Serial sp) {
-   *   conn.appendBuffer(sp.readString());
+   *   conn.receive(sp);
    * }
+   *
+   * moves all bytes the port has available into the receive buffer
+   *
+   * @param Serial sp
    */
-  void appendBuffer(String stream) {
-    this.currentBuffer += stream;
+  void receive(Serial sp) {
+    int count;
+    
+    while (sp.available() > 0) {
+      count = sp.readBytes(this.readChunk);
+      this.rxBuffer.write(this.readChunk, 0, count);
+      
+      if (this.recorder != null) {
+        this.recorder.record(LinkRecorder.RECEIVED, this.readChunk, 0, count);
+      }
+    }
   }
   
   /**
-   * processes the input buffer
+   * stores bytes as if they had been received, for a connection without a port.
+   * must only be called from one thread
+   *
+   * @param byte[] data
+   * @param int offset
+   * @param int length
+   * @return int number of bytes that fit into the receive buffer
+   */
+  int inject(byte[] data, int offset, int length) {
+    return this.rxBuffer.write(data, offset, min(length, this.rxBuffer.free()));
+  }
+  
+  /**
+   * @return long number of frames sent so far
+   */
+  long getFramesWritten() {
+    return this.framesWritten;
+  }
+  
+  /**
+   * @return long number of bytes parsed so far
+   */
+  long getBytesReceived() {
+    return this.bytesReceived;
+  }
+  
+  /**
+   * @return long number of bytes sent so far
+   */
+  long getBytesSent() {
+    return this.bytesSent;
+  }
+  
+  /**
+   * processes the input buffer.
+   *
+   * every byte that has been received so far is run through the parser, 
+   * decoded responses are queued for readResponse()
    *
    * call this in draw() or periodically from somewhere else
    */
   void processSerial() {
-    char inChar;
+    Response frame;
+    int count;
     
-    // only read Serial data when there is no current command
-    if (this.currentBuffer.length() > 0) {
-          
-      inChar = this.currentBuffer.charAt(0);
-      this.currentBuffer = this.currentBuffer.substring(1);
+    do {
+      count = this.rxBuffer.read(this.parseChunk, 0, this.parseChunk.length);
+      this.bytesReceived += count;
       
-      switch (this.cmdState) {
-        case SerialConnection.SRLCMD_STATE_IDLE:
-          if (inChar == SerialConnection.SRLCMD_CHAR_START) {
-            this.processingBuffer += inChar;
-            this.cmdState = SerialConnection.SRLCMD_STATE_WAITINGFORCMDBYTE;
-          } else {
-            this.cmdState = SerialConnection.SRLCMD_STATE_ERR;
-          }
-          break;
-          
-        case SerialConnection.SRLCMD_STATE_WAITINGFORCMDBYTE:
-          this.processingBuffer += inChar;
-          this.cmdState = SerialConnection.SRLCMD_STATE_CMDBYTERECEIVED;
-          break;
-          
-        case SerialConnection.SRLCMD_STATE_CMDBYTERECEIVED:
-          if (inChar == SerialConnection.SRLCMD_CHAR_CMDSEP) {
-            this.processingBuffer += inChar;
-            this.cmdState = SerialConnection.SRLCMD_STATE_WAITINGFORPAYLOAD;
-          } else {
-            this.cmdState = SerialConnection.SRLCMD_STATE_ERR;
-          }        
-          break;
-         
-        case SerialConnection.SRLCMD_STATE_WAITINGFORPAYLOAD:
-          if (inChar == SerialConnection.SRLCMD_CHAR_END) {
-            // payload end has been reached, move current buffer to queue
-            this.inputBuffer.add(this.processingBuffer);
-            this.processingBuffer = "";
-            this.cmdState = SerialConnection.SRLCMD_STATE_IDLE;
-          } else {
-            // add inChar to payload for later processing
-            this.processingBuffer += inChar;
-          }
-          break;
-          
-        case SerialConnection.SRLCMD_STATE_ERR:
-          println("error reading from Serial");
-          break;
+      for (int i = 0; i < count; i++) {
+        frame = this.parser.parse(this.parseChunk[i]);
+        
+        if (frame != null) {
+          this.inputBuffer.add(frame);
+        }
       }
-    }
+    } while (count > 0);
   }
   
   /**
-   * returns a response from the robot if a whole response has been received, the empty string otherwise
+   * returns a response from the robot if a whole response has been received, null otherwise
    *
-   * @return String
+   * @return Response
    */
-  String readResponse() {
-    String response = "";
+  Response readResponse() {
+    Response response = null;
     
     if (this.inputBuffer.size() > 0) {
       response = this.inputBuffer.remove(0);
@@ -144,18 +226,37 @@ class SerialConnection {
   }
   
   /**
-   * writes the byte stream to the serial connection
+   * writes the first length bytes of frame to the serial connection in a single call
    *
-   * @param ArrayList<Byte> stream
+   * @param byte[] frame
+   * @param int length
    */
-  void write(ArrayList<Byte> stream) {
+  void write(byte[] frame, int length) {
+    byte[] out;
+    
+    if (this.recorder != null) {
+      this.recorder.record(LinkRecorder.SENT, frame, 0, length);
+    }
+    this.framesWritten++;
+    this.bytesSent += length;
+    
     if (this.port != null) {
-      print("sending: ");
-      for (Byte b : stream) {
-        this.port.write((byte) b);
-        print((byte) b + " ");
+      out = this.sendBuffers[length];
+      if (out == null) {
+        out = new byte[length];
+        this.sendBuffers[length] = out;
+      }
+      System.arraycopy(frame, 0, out, 0, length);
+      
+      this.port.write(out);
+      
+      if (this.debug) {
+        print("sending: ");
+        for (int i = 0; i < length; i++) {
+          print(out[i] + " ");
+        }
+        println("");
       }
-      println("");
     }
   }
   
@@ -2,13 +2,13 @@
  * Simple data store for the m3pi bot
  */
 class SonarBot {
-  int posX;
-  int posY;
+  float posX;
+  float posY;
   float voltage;
   float angle;
   final int BOT_RADIUS = 47;                   // in mm
     
-  SonarBot(int x, int y, float a, float v) {
+  SonarBot(float x, float y, float a, float v) {
     this.setPosX(x);
     this.setPosY(y);
     this.setAngle(a);
@@ -39,7 +39,7 @@ class SonarBot {
   /**
    * @return x coordinate of the bot in mm 
    */
-  int getPosX() {
+  float getPosX() {
     return this.posX;
   }
   
@@ -48,16 +48,16 @@ class SonarBot {
   }
   
   /**
-   * @param int x x-coordinate of the bot in mm
+   * @param float x x-coordinate of the bot in mm
    */
-  void setPosX(int x) {
+  void setPosX(float x) {
     this.posX = x;
   }
   
   /**
    * @return y-coordinate of the bot in mm 
    */
-  int getPosY() {
+  float getPosY() {
     return this.posY;
   }
   
@@ -66,9 +66,9 @@ class SonarBot {
   }
   
   /**
-   * @param int y y-coordinate of the bot in mm
+   * @param float y y-coordinate of the bot in mm
    */
-  void setPosY(int y) {
+  void setPosY(float y) {
     this.posY = y;
   }
   
@@ -78,8 +78,22 @@ class SonarBot {
    * @param int distance
    */
   void move(int distance) {
-    this.posX += int(distance * cos(radians(this.angle)));
-    this.posY += int(distance * sin(radians(this.angle)));    
+    this.posX += distance * cos(radians(this.angle));
+    this.posY += distance * sin(radians(this.angle));
+  }
+  
+  /**
+   * moves the bot the way localization moved the pose of the last sweep
+   *
+   * @param PoseCorrection correction
+   */
+  void correct(PoseCorrection correction) {
+    float x = this.posX;
+    float y = this.posY;
+    
+    this.posX   = correction.transformX(x, y);
+    this.posY   = correction.transformY(x, y);
+    this.angle += correction.getRotation();
   }
   
   /**
@@ -0,0 +1,35 @@
+/**
+ * A single range measurement together with the pose of the bot it was taken at.
+ *
+ * PingResults only carry the servo angle and the range, the pose is added by
+ * draw() when the ping is applied so the map worker does not need to look at the
+ * SonarBot.
+ */
+class SonarReading {
+  float posX;           // in mm
+  float posY;           // in mm
+  float heading;        // of the bot in degrees
+  int angle;            // of the servo in degrees, relative to the heading
+  int range;            // in mm
+
+  /**
+   * @param float x
+   * @param float y
+   * @param float h
+   * @param PingResult ping
+   */
+  SonarReading(float x, float y, float h, PingResult ping) {
+    this.posX    = x;
+    this.posY    = y;
+    this.heading = h;
+    this.angle   = ping.angle;
+    this.range   = ping.range;
+  }
+
+  /**
+   * @return float direction of the beam in degrees
+   */
+  float getDirection() {
+    return this.heading + this.angle;
+  }
+}
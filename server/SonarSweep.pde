@@ -0,0 +1,42 @@
+/**
+ * All readings returned by one sonar command, a single ping or a whole sweep.
+ *
+ * The robot answers one command at a time, so every ping that arrives before the
+ * completion of a ping or sweep command belongs to it. draw() collects them here
+ * and hands the group to the MapWorker once the command completed.
+ */
+class SonarSweep {
+  char cmd;
+  float posX;           // of the bot in mm
+  float posY;           // of the bot in mm
+  float heading;        // of the bot in degrees
+  ArrayList<SonarReading> readings;
+
+  SonarSweep() {
+    this.cmd      = CommandQueue.CMD_NOOP;
+    this.readings = new ArrayList<SonarReading>();
+  }
+
+  void add(SonarReading reading) {
+    this.readings.add(reading);
+  }
+
+  int size() {
+    return this.readings.size();
+  }
+
+  /**
+   * marks the sweep as complete
+   *
+   * @param char c            CommandQueue.CMD_SONARPING or CMD_SONARSWEEP
+   * @param float x           pose of the bot in mm
+   * @param float y           in mm
+   * @param float h           in degrees
+   */
+  void close(char c, float x, float y, float h) {
+    this.cmd     = c;
+    this.posX    = x;
+    this.posY    = y;
+    this.heading = h;
+  }
+}
@@ -0,0 +1,210 @@
+/**
+ * Picks the sonar sweep that is worth the most at a pose, if any.
+ *
+ * The value of a sweep is the entropy it is expected to take out of the map
+ * ahead of the bot, its price the time it takes. Rays are cast from the pose
+ * one degree apart over the whole reach of the servo plus half a beam on either
+ * side, through the cells of level LEVEL up to the TRUSTED_RANGE. A ray passes
+ * free cells, ends in the first obstacle and gets through unknown cells with a
+ * chance that falls off over FREE_PATH mm. Each cell it passes counts with the
+ * share of the cell that falls into its one degree and with the chance of being
+ * seen at all.
+ *
+ * What c pings on a cell are expected to gain is worked out from the updates of
+ * the OccupancyUpdater: either the cell is blocked and every ping raises it, or
+ * it is free and every ping lowers it. Cells beyond SETTLED log-odds count as
+ * certain, the map gets used at that confidence and going further buys nothing.
+ * So a cell seen often enough adds nothing, and more pings on a cell add less
+ * and less.
+ *
+ * Every start angle on a grid of ANGLE_GRID degrees is combined with every step
+ * size in STEPS and every end angle. The one with the most bits gained less
+ * BIT_PRICE per second wins. If no sweep gains more than it costs, none is taken.
+ *
+ * plan() must be called on the MapWorker, it reads the Landscape.
+ * requestSweep() may be called from the render thread.
+ */
+class SweepPlanner {
+  final static int LEVEL          = 2;          // 40mm per cell
+  final static int MIN_ANGLE      = -60;        // in degrees, reach of the servo
+  final static int MAX_ANGLE      = 60;         // in degrees
+  final static int HALF_BEAM      = 7;          // in degrees, half of OccupancyUpdater.BEAM_WIDTH rounded down
+  final static int RAYS           = SweepPlanner.MAX_ANGLE - SweepPlanner.MIN_ANGLE + 2 * SweepPlanner.HALF_BEAM + 1;
+  final static int ANGLE_GRID     = 2;          // in degrees, of the start angles tried
+  final static int MAX_COVER      = 16;         // pings per ray that are told apart
+  final static int SETTLED        = 32;         // log-odds beyond which a cell counts as certain
+  final static float FREE_PATH    = 1000;       // in mm, unknown space the sonar is expected to get through
+  final static float SWEEP_TIME   = 0.3;        // in s, round trip of the command
+  final static float BIT_PRICE    = 20;         // bits a second of sweeping has to gain
+
+  /**
+   * step sizes tried, in degrees
+   */
+  final int[] STEPS = {2, 3, 4, 6, 8, 10, 12, 15};
+
+  private Landscape landscape;
+  private CommandQueue commands;
+  private MapWorker worker;
+  private float cellSize;                       // in mm
+
+  /**
+   * bits c pings on a cell of the given log-odds are expected to gain, at
+   * [(logOdds + 128) * (MAX_COVER + 1) + c]
+   */
+  private float[] cellGains;
+
+  /**
+   * bits c pings on a ray are expected to gain, at [ray * (MAX_COVER + 1) + c]
+   */
+  private float[] rayGains;
+
+  /**
+   * pings covering each ray while a candidate is scored
+   */
+  private int[] cover;
+
+  /**
+   * @param Landscape l
+   * @param CommandQueue q
+   * @param MapWorker w       the worker plan() is run on
+   */
+  SweepPlanner(Landscape l, CommandQueue q, MapWorker w) {
+    this.landscape = l;
+    this.commands  = q;
+    this.worker    = w;
+    this.cellSize  = l.CELL_SIZE << SweepPlanner.LEVEL;
+    this.cellGains = new float[256 * (SweepPlanner.MAX_COVER + 1)];
+    this.rayGains  = new float[SweepPlanner.RAYS * (SweepPlanner.MAX_COVER + 1)];
+    this.cover     = new int[SweepPlanner.RAYS];
+
+    this.initCellGains();
+  }
+
+  /**
+   * plans a sweep at the given pose and queues it, call this from the render thread
+   *
+   * @param float posX        of the bot in mm
+   * @param float posY        of the bot in mm
+   * @param float heading     of the bot in degrees
+   */
+  void requestSweep(final float posX, final float posY, final float heading) {
+    this.worker.submit(new Runnable() {
+      public void run() {
+        int[] sweep = SweepPlanner.this.plan(posX, posY, heading);
+
+        if (sweep == null) {
+          println("nothing to gain from a sweep here");
+        } else if (SweepPlanner.this.commands.cmdSonarSweep(sweep[0], sweep[1], sweep[2])) {
+          println("performing sonar sweep from " + sweep[0] + " to " + sweep[1] + " in steps of " + sweep[2]);
+        }
+      }
+    });
+  }
+
+  /**
+   * @param float posX        of the bot in mm
+   * @param float posY        of the bot in mm
+   * @param float heading     of the bot in degrees
+   * @return int[] start angle, end angle and step size of the best sweep, null if none pays off
+   */
+  int[] plan(float posX, float posY, float heading) {
+    int[] best = null;
+    float bestValue = 0;
+    float gain, value;
+    int end, c, b;
+
+    this.castRays(posX, posY, heading);
+
+    for (int s = 0; s < this.STEPS.length; s++) {
+      for (int start = SweepPlanner.MIN_ANGLE; start <= SweepPlanner.MAX_ANGLE; start += SweepPlanner.ANGLE_GRID) {
+        java.util.Arrays.fill(this.cover, 0);
+        gain = 0;
+
+        for (int pings = 1; start + (pings - 1) * this.STEPS[s] <= SweepPlanner.MAX_ANGLE; pings++) {
+          end = start + (pings - 1) * this.STEPS[s];
+
+          // the rays within half a beam of the new ping
+          for (int r = end - SweepPlanner.MIN_ANGLE; r <= end - SweepPlanner.MIN_ANGLE + 2 * SweepPlanner.HALF_BEAM; r++) {
+            c = this.cover[r];
+
+            if (c < SweepPlanner.MAX_COVER) {
+              b = r * (SweepPlanner.MAX_COVER + 1) + c;
+              gain += this.rayGains[b + 1] - this.rayGains[b];
+              this.cover[r] = c + 1;
+            }
+          }
+
+          value = gain - SweepPlanner.BIT_PRICE * (SweepPlanner.SWEEP_TIME + pings * CommandQueue.PING_TIME / 1000.0);
+
+          if (value > bestValue) {
+            bestValue = value;
+            best      = new int[] {start, end, this.STEPS[s]};
+          }
+        }
+      }
+    }
+
+    return best;
+  }
+
+  /**
+   * fills rayGains for the pose
+   */
+  private void castRays(float posX, float posY, float heading) {
+    float pass = exp(-this.cellSize / SweepPlanner.FREE_PATH);
+    float area = radians(1) * this.cellSize / (this.cellSize * this.cellSize);
+    float direction, dx, dy, t, visible, weight;
+    int v, b, g;
+
+    java.util.Arrays.fill(this.rayGains, 0);
+
+    for (int r = 0; r < SweepPlanner.RAYS; r++) {
+      direction = radians(heading + SweepPlanner.MIN_ANGLE - SweepPlanner.HALF_BEAM + r);
+      dx        = cos(direction);
+      dy        = sin(direction);
+      visible   = 1;
+      b         = r * (SweepPlanner.MAX_COVER + 1);
+
+      for (t = this.cellSize / 2; t < OccupancyUpdater.TRUSTED_RANGE && visible > 0; t += this.cellSize) {
+        v = this.landscape.getLevelLogOdds(SweepPlanner.LEVEL,
+                                           round((posX + t * dx) / this.landscape.CELL_SIZE) >> SweepPlanner.LEVEL,
+                                           round((posY + t * dy) / this.landscape.CELL_SIZE) >> SweepPlanner.LEVEL);
+        // share of the cell in the ray's degree, the wedge widens with the distance
+        weight = visible * t * area;
+        g      = (v + 128) * (SweepPlanner.MAX_COVER + 1);
+
+        for (int c = 1; c <= SweepPlanner.MAX_COVER; c++) {
+          this.rayGains[b + c] += weight * this.cellGains[g + c];
+        }
+
+        if (v > DistanceMap.OCCUPIED_LOGODDS) {
+          visible = 0;
+        } else if (v == 0) {
+          visible *= pass;
+        }
+      }
+    }
+  }
+
+  private void initCellGains() {
+    float[] entropy = new float[256];
+    float p;
+    int b;
+
+    for (int v = -128; v < 128; v++) {
+      p = 1.0 / (1.0 + exp(-v / Landscape.LOGODDS_SCALE));
+      entropy[v + 128] = abs(v) >= SweepPlanner.SETTLED ? 0 : -(p * log(p) + (1 - p) * log(1 - p)) / log(2);
+    }
+
+    for (int v = -128; v < 128; v++) {
+      p = 1.0 / (1.0 + exp(-v / Landscape.LOGODDS_SCALE));
+      b = (v + 128) * (SweepPlanner.MAX_COVER + 1);
+
+      for (int c = 1; c <= SweepPlanner.MAX_COVER; c++) {
+        this.cellGains[b + c] = max(0, entropy[v + 128]
+                                       - p * entropy[min(v + c * OccupancyUpdater.LOGODDS_OCCUPIED, 127) + 128]
+                                       - (1 - p) * entropy[max(v + c * OccupancyUpdater.LOGODDS_FREE, -128) + 128]);
+      }
+    }
+  }
+}
@@ -0,0 +1,73 @@
+/**
+ * Immutable copy of a LandscapeTile as of one publish of the map worker.
+ *
+ * The worker never changes a snapshot once it has been published, it creates a
+ * new one with a higher version instead. That's what allows Landscape.draw() to
+ * read snapshots without any locking while the worker keeps writing to the tiles.
+ * Levels that did not change are shared with the snapshot before, which is just
+ * as immutable.
+ */
+class TileSnapshot {
+  final int tileX;
+  final int tileY;
+  final int version;
+
+  /**
+   * copy of the levels of the tile, null if the tile is spilled
+   */
+  final byte[][] levels;
+
+  /**
+   * version of the tile each level last changed in, null if the tile is spilled
+   */
+  final int[] levelVersions;
+
+  final TileTextures textures;
+
+  /**
+   * @param LandscapeTile tile     must be owned by the calling thread
+   * @param TileSnapshot previous  the last snapshot of the tile, null if there is none
+   */
+  TileSnapshot(LandscapeTile tile, TileSnapshot previous) {
+    boolean shared = previous != null && previous.isResident();
+
+    this.tileX    = tile.tileX;
+    this.tileY    = tile.tileY;
+    this.version  = tile.version;
+    this.textures = tile.textures;
+
+    if (tile.isResident()) {
+      this.levels        = new byte[LandscapeTile.LEVELS][];
+      this.levelVersions = new int[LandscapeTile.LEVELS];
+
+      for (int l = 0; l < LandscapeTile.LEVELS; l++) {
+        if (shared && (tile.changedLevels & (1 << l)) == 0) {
+          this.levels[l]        = previous.levels[l];
+          this.levelVersions[l] = previous.levelVersions[l];
+        } else {
+          this.levels[l]        = tile.levels[l].clone();
+          this.levelVersions[l] = tile.version;
+        }
+      }
+    } else {
+      this.levels        = null;
+      this.levelVersions = null;
+    }
+  }
+
+  /**
+   * @return boolean true if the cells are part of the snapshot
+   */
+  boolean isResident() {
+    return this.levels != null;
+  }
+
+  /**
+   * @param int level
+   * @param int[] colors     ARGB per log-odds value, indexed by value + 128
+   * @return PImage          call from the render thread only
+   */
+  PImage getTexture(int level, int[] colors) {
+    return this.textures.get(this, level, colors);
+  }
+}
@@ -0,0 +1,107 @@
+import java.io.File;
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+
+/**
+ * Memory-mapped scratch file that holds the cells of cold LandscapeTiles.
+ *
+ * The file is split into fixed size slots of one tile each and grows in segments
+ * of SLOTS_PER_SEGMENT slots. Freed slots are reused. The file is deleted when
+ * the sketch exits.
+ */
+class TileSpill {
+  final static int SLOT_SIZE         = LandscapeTile.SIZE * LandscapeTile.SIZE;
+  final static int SLOTS_PER_SEGMENT = 1024;
+
+  private FileChannel channel;
+  private ArrayList<MappedByteBuffer> segments;
+  private IntList freeSlots;
+  private int slotCount;
+
+  TileSpill() {
+    this.segments  = new ArrayList<MappedByteBuffer>();
+    this.freeSlots = new IntList();
+    this.slotCount = 0;
+
+    try {
+      File file = File.createTempFile("sonarbot", ".tiles");
+      file.deleteOnExit();
+      this.channel = new RandomAccessFile(file, "rw").getChannel();
+    } catch (IOException e) {
+      println("unable to create tile spill file: " + e.getMessage());
+      this.channel = null;
+    }
+  }
+
+  /**
+   * @return boolean false if the spill file could not be created
+   */
+  boolean available() {
+    return this.channel != null;
+  }
+
+  /**
+   * @return int number of slots in use
+   */
+  int getSpilledCount() {
+    return this.slotCount - this.freeSlots.size();
+  }
+
+  /**
+   * writes the cells into a free slot
+   *
+   * @param byte[] cells
+   * @return int slot, -1 on error
+   */
+  int store(byte[] cells) {
+    int slot;
+
+    if (this.freeSlots.size() > 0) {
+      slot = this.freeSlots.remove(this.freeSlots.size() - 1);
+    } else {
+      if (this.slotCount % TileSpill.SLOTS_PER_SEGMENT == 0 && !this.grow()) {
+        return -1;
+      }
+      slot = this.slotCount++;
+    }
+
+    MappedByteBuffer segment = this.segments.get(slot / TileSpill.SLOTS_PER_SEGMENT);
+    segment.position((slot % TileSpill.SLOTS_PER_SEGMENT) * TileSpill.SLOT_SIZE);
+    segment.put(cells, 0, TileSpill.SLOT_SIZE);
+
+    return slot;
+  }
+
+  /**
+   * reads the cells back from a slot and frees the slot
+   *
+   * @param int slot
+   * @param byte[] cells
+   */
+  void load(int slot, byte[] cells) {
+    MappedByteBuffer segment = this.segments.get(slot / TileSpill.SLOTS_PER_SEGMENT);
+    segment.position((slot % TileSpill.SLOTS_PER_SEGMENT) * TileSpill.SLOT_SIZE);
+    segment.get(cells, 0, TileSpill.SLOT_SIZE);
+
+    this.freeSlots.append(slot);
+  }
+
+  /**
+   * maps another segment at the end of the file
+   *
+   * @return boolean
+   */
+  private boolean grow() {
+    long size = (long) TileSpill.SLOTS_PER_SEGMENT * TileSpill.SLOT_SIZE;
+
+    try {
+      this.segments.add(this.channel.map(FileChannel.MapMode.READ_WRITE, this.segments.size() * size, size));
+      return true;
+    } catch (IOException e) {
+      println("unable to grow tile spill file: " + e.getMessage());
+      return false;
+    }
+  }
+}
@@ -0,0 +1,73 @@
+/**
+ * The textures of one LandscapeTile, one per pyramid level.
+ *
+ * Created by the map worker along with the tile and shared by all TileSnapshots
+ * of it, but only ever touched by the render thread. A texture is repainted when
+ * its level in the snapshot it is drawn from changed after the one it shows.
+ */
+class TileTextures {
+  PImage[] images;
+  int[] versions;
+
+  /**
+   * version of the snapshot a fault-in has been requested for, -1 if none
+   */
+  int faultRequested;
+
+  /**
+   * millis() of the last time the tile has been drawn, read by the map worker to
+   * keep visible tiles from being spilled
+   */
+  volatile int lastDrawn;
+
+  TileTextures() {
+    this.images         = new PImage[LandscapeTile.LEVELS];
+    this.versions       = new int[LandscapeTile.LEVELS];
+    this.faultRequested = -1;
+    this.lastDrawn      = millis();
+
+    for (int l = 0; l < LandscapeTile.LEVELS; l++) {
+      this.versions[l] = -1;
+    }
+  }
+
+  /**
+   * returns the texture of the given level, repainting it if the snapshot is newer
+   *
+   * @param TileSnapshot snapshot
+   * @param int level
+   * @param int[] colors     ARGB per log-odds value, indexed by value + 128
+   * @return PImage
+   */
+  PImage get(TileSnapshot snapshot, int level, int[] colors) {
+    int edge = LandscapeTile.SIZE >> level;
+    PImage texture = this.images[level];
+    byte[] cells = snapshot.levels[level];
+
+    if (texture == null) {
+      texture = createImage(edge, edge, ARGB);
+      texture.loadPixels();
+      this.images[level] = texture;
+    }
+
+    if (this.versions[level] != snapshot.levelVersions[level]) {
+      for (int i = 0; i < cells.length; i++) {
+        texture.pixels[i] = colors[cells[i] + 128];
+      }
+      texture.updatePixels();
+      this.versions[level] = snapshot.levelVersions[level];
+    }
+
+    return texture;
+  }
+
+  /**
+   * drops all images, i.e. once the tile has been spilled
+   */
+  void release() {
+    for (int l = 0; l < LandscapeTile.LEVELS; l++) {
+      this.images[l]   = null;
+      this.versions[l] = -1;
+    }
+  }
+}
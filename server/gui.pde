@@ -30,6 +30,7 @@ float centerY = windowHeight / 2.0;
 boolean helpWindowVisibility = false;
 boolean rotationCueVisibility = false;
 boolean moveCueVisibility = false;
+boolean linkStatsVisibility = true;
 
 
 void guiInit() {
@@ -48,6 +49,7 @@ void guiRefresh() {
   
   drawCues();
   drawHUD();
+  drawLinkStats();
   drawHelp();
 }
 
@@ -107,9 +109,70 @@ void drawHUD() {
   text("scroll: " + round(scrollX) + " / " + round(scrollY), 10, 80);
 }
 
+/**
+ * draws the latest LinkSample below the HUD: throughput, queues, errors and a
+ * histogram of the round-trip time per opcode with the percentiles of the last
+ * second, and how much of it was link and how much robot time on average.
+ * Bars are scaled to the most frequent bucket of each opcode
+ */
+void drawLinkStats() {
+  LinkSample sample = linkStats.getSample();
+  int top = 110;
+  int rows = 0;
+  int peak, y;
+  
+  if (!linkStatsVisibility || sample == null) {
+    return;
+  }
+  
+  for (int i = 0; i < LinkStats.OPCODES.length(); i++) {
+    for (int b = 0; b < LinkStats.BUCKETS; b++) {
+      if (sample.histograms[i][b] > 0) {
+        rows++;
+        break;
+      }
+    }
+  }
+  
+  rectMode(CORNER);
+  noStroke();
+  fill(0, 0, 0, 80);
+  textSize(12);
+  
+  rect(0, top, 370, 70 + rows * 20, 10);
+  fill(0, 160, 0, 100);
+  text("rx: " + round(sample.rxRate) + " B/s   tx: " + round(sample.txRate) + " B/s", 10, top + 20);
+  text("queued: " + sample.commandQueue + " (max " + sample.commandQueueMax + "), input max " + sample.inputQueueMax, 10, top + 40);
+  text("parse errors: " + sample.parseErrors + "   resyncs: " + sample.resyncs, 10, top + 60);
+  
+  y = top + 80;
+  for (int i = 0; i < LinkStats.OPCODES.length(); i++) {
+    peak = 0;
+    for (int b = 0; b < LinkStats.BUCKETS; b++) {
+      peak = max(peak, sample.histograms[i][b]);
+    }
+    if (peak == 0) {
+      continue;
+    }
+    
+    text(LinkStats.OPCODES.charAt(i), 10, y);
+    for (int b = 0; b < LinkStats.BUCKETS; b++) {
+      float h = 14.0 * sample.histograms[i][b] / peak;
+      rect(25 + 2 * b, y - h, 2, h);
+    }
+    if (sample.count[i] > 0) {
+      text(nf(sample.p50[i], 1, 0) + " / " + nf(sample.p90[i], 1, 0) + " ms", 155, y);
+    }
+    if (sample.timed[i] > 0) {
+      text("link " + nf(sample.link[i], 1, 1) + " bot " + nf(sample.wait[i] + sample.exec[i], 1, 1), 240, y);
+    }
+    y += 20;
+  }
+}
+
 void drawHelp() {
   int width = 300;
-  int height = 150;
+  int height = 250;
   int border = 10;
   int left = width / 2 - border;
   int top = height / 2 - border - border;
@@ -128,10 +191,15 @@ void drawHelp() {
     text("mousewheel",          centerX - left, centerY - top + 20*0); text("zoom",                    centerX, centerY - top + 20*0);
     text("right-mouse & drag",  centerX - left, centerY - top + 20*1); text("pan the view",            centerX, centerY - top + 20*1);
     text("c",                   centerX - left, centerY - top + 20*2); text("center view, reset zoom", centerX, centerY - top + 20*2);
-    text("s",                   centerX - left, centerY - top + 20*3); text("sonar sweep",             centerX, centerY - top + 20*3);
+    text("s",                   centerX - left, centerY - top + 20*3); text("planned sonar sweep",     centerX, centerY - top + 20*3);
     text("b",                   centerX - left, centerY - top + 20*4); text("query battery",           centerX, centerY - top + 20*4);
     text("hold r & left-click", centerX - left, centerY - top + 20*5); text("rotate the robot",        centerX, centerY - top + 20*5);
-    text("hold m & left-click", centerX - left, centerY - top + 20*6); text("move the robot",          centerX, centerY - top + 20*6);
+    text("hold m & left-click", centerX - left, centerY - top + 20*6); text("navigate the robot",      centerX, centerY - top + 20*6);
+    text("o",                   centerX - left, centerY - top + 20*7); text("save observations",       centerX, centerY - top + 20*7);
+    text("e",                   centerX - left, centerY - top + 20*8); text("explore on its own",      centerX, centerY - top + 20*8);
+    text("shift & s",           centerX - left, centerY - top + 20*9); text("full sonar sweep",        centerX, centerY - top + 20*9);
+    text("l",                   centerX - left, centerY - top + 20*10); text("link stats",              centerX, centerY - top + 20*10);
+    text("f",                   centerX - left, centerY - top + 20*11); text("print firmware profile",  centerX, centerY - top + 20*11);
   }
 }
 
@@ -258,12 +326,28 @@ void keyReleased() {
       moveCueVisibility = false;
       break;
     case 's':
-      println("performing sonar sweep");
-      commandHandler.addCommand(commandHandler.CMD_SONARSWEEP, -60, 60, 2);
+      sweepPlanner.requestSweep(bot.getPosX(), bot.getPosY(), bot.getAngle());
+      break;
+    case 'S':
+      println("performing full sonar sweep");
+      commandHandler.cmdSonarSweep(SweepPlanner.MIN_ANGLE, SweepPlanner.MAX_ANGLE, 2);
       break;
     case 'b':
       println("querying battery voltage");
-      commandHandler.addCommand(commandHandler.CMD_BATTERY);
+      commandHandler.cmdBattery();
+      break;
+    case 'o':
+      saveObservations();
+      break;
+    case 'e':
+      explorer.toggle(bot.getPosX(), bot.getPosY(), bot.getAngle());
+      break;
+    case 'l':
+      linkStatsVisibility = !linkStatsVisibility;
+      break;
+    case 'f':
+      println("querying the firmware profile");
+      commandHandler.cmdProfile();
       break;
     default:
   }
@@ -303,7 +387,8 @@ void mouseDragged(MouseEvent event) {
 void mouseClicked(MouseEvent event) {
   int mX = mouseX;
   int mY = mouseY;
-  int angle, dist;
+  int angle;
+  float targetX, targetY;
 
   if (keyPressed == true) {
     switch (key) {
@@ -311,22 +396,18 @@ void mouseClicked(MouseEvent event) {
         angle = bot.getRotationToScreenPos(mX, mY);        
         println("rotating bot by " + angle + " degrees");
         if (angle > 0) {
-          commandHandler.addCommand(commandHandler.CMD_TURNRIGHT, angle);
+          commandHandler.cmdTurnRight(angle);
         } else {
-          commandHandler.addCommand(commandHandler.CMD_TURNLEFT, angle);
+          commandHandler.cmdTurnLeft(angle);
         }
         break;
       case 'm':
-        dist  = bot.getDistanceToScreenPos(mX, mY);
-        angle = bot.getRotationToScreenPos(mX, mY);        
-        println("moving bot to position for " + dist + " mm after rotating by " + angle + " degrees");
+        // the path is planned around known obstacles on the map worker
+        targetX = scalePxToMM(mX - centerX - scrollX);
+        targetY = scalePxToMM(mY - centerY - scrollY);
+        println("navigating bot to " + round(targetX) + " / " + round(targetY) + " mm");
         
-        if (angle > 0) {
-          commandHandler.addCommand(commandHandler.CMD_TURNRIGHT, angle);
-        } else {
-          commandHandler.addCommand(commandHandler.CMD_TURNLEFT, angle);
-        }
-        commandHandler.addCommand(commandHandler.CMD_MOVEFORWARD, dist);
+        planner.navigateTo(targetX, targetY, bot.getPosX(), bot.getPosY(), bot.getAngle());
         break;
       default:
     }
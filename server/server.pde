@@ -6,41 +6,371 @@
  */
 SerialConnection conn;
 CommandQueue     commandHandler;
+LinkThread       link;
 SonarBot         bot;
 Landscape        grid;
+MapWorker        mapWorker;
+DistanceMap      distanceMap;
+PathPlanner      planner;
+SweepPlanner     sweepPlanner;
+FrontierExplorer explorer;
+LinkStats        linkStats;
+SonarSweep       pendingSweep;
 int              batteryCheckTimer;
 
-void setup() {
-  size(1000, 1000);
+/**
+ * name of the serial port to open, the first port found is used when empty.
+ *
+ * can be set on the command line with --port=<name>, i.e. to connect to the 
+ * bot emulator in tools/botemu
+ */
+String           serialPortName = "";
+
+/**
+ * logs every byte sent to the robot when set with --debug-serial
+ */
+boolean          serialDebug = false;
+
+/**
+ * how the pose of sweeps is corrected, set with --localization=<mode>:
+ * "odometry" trusts the commands, "scans" matches consecutive sweeps, "graph"
+ * does so too and closes loops in a pose graph (default), "particles" runs
+ * Monte Carlo localization with --particles=<count> particles
+ */
+String           localization  = "graph";
+int              particleCount = 2000;
+
+/**
+ * file the ObservationStore is saved to with the 'o' key, set with
+ * --observations=<file>. If the file exists it is loaded on start and the map is
+ * rebuilt from it
+ */
+String           observationFile = "";
+
+/**
+ * records the raw link traffic to a file with --record=<file>
+ */
+String           recordFile = "";
+
+/**
+ * appends the link statistics to a CSV file once per second with
+ * --link-stats=<file>, they are shown in the HUD either way
+ */
+String           linkStatsFile = "";
+
+/**
+ * plays a recorded session back instead of opening a serial port with
+ * --replay=<file>, at --replay-speed=<factor> times the recorded speed or as fast
+ * as possible with a factor of 0
+ */
+String           replayFile  = "";
+float            replaySpeed = 1;
+
+/**
+ * the map is loaded from --map=<file> on start and the tiles that change are
+ * saved to it as the bot goes. Without it the map starts empty and is not kept:
+ * the bot always starts at the origin, a saved map would only line up if it
+ * starts where the map was begun. The batch mode writes to sketchPath("map.sbm")
+ * if not set
+ */
+String           mapFile    = "";
+
+/**
+ * rebuilds the map from recorded sessions without opening a window or a port
+ * with --batch=<file>[,<file>...], writes it to the map file and exits
+ */
+String[]         batchFiles = null;
+
+/**
+ * the arguments are evaluated here already, the batch mode runs and exits before
+ * a surface is created so that it works without a display
+ */
+void settings() {
+  parseArguments();
+  
+  if (batchFiles != null) {
+    boolean mapped = new BatchMapper(new Landscape(), localization).run(batchFiles, mapFile.isEmpty() ? sketchPath("map.sbm") : mapFile);
+    System.exit(mapped ? 0 : 1);
+  }
   
-  conn              = new SerialConnection(this, 115200);
+  size(1000, 1000);
+}
+
+void setup() {
+  conn              = replayFile.isEmpty() ? new SerialConnection(this, serialPortName, 115200) : new SerialConnection();
+  conn.debug        = serialDebug;
   commandHandler    = new CommandQueue(conn);
+  link              = new LinkThread(conn, commandHandler);
+  linkStats         = new LinkStats(conn);
   bot               = new SonarBot(0, 0, 0.0, 5.0);
-  grid              = new Landscape(1001, 1001);
+  grid              = new Landscape();
+  mapWorker         = new MapWorker(grid);
+  
+  if (observationFile.isEmpty()) {
+    observationFile = sketchPath("observations.sbo");
+    openMap(false);
+  } else if (new File(observationFile).exists() && mapWorker.getObservationStore().load(observationFile)) {
+    println("loaded " + mapWorker.getObservationStore().size() + " observations from " + observationFile);
+    openMap(true);
+  } else {
+    openMap(false);
+  }
+  
+  distanceMap       = new DistanceMap(grid);
+  sweepPlanner      = new SweepPlanner(grid, commandHandler, mapWorker);
+  planner           = new PathPlanner(distanceMap, commandHandler, sweepPlanner, mapWorker, bot.BOT_RADIUS);
+  explorer          = new FrontierExplorer(grid, distanceMap, planner, commandHandler, sweepPlanner, mapWorker, bot.BOT_RADIUS);
   batteryCheckTimer = 0;
+  
+  if (localization.equals("scans")) {
+    mapWorker.setLocalizer(new ScanMatcher());
+  } else if (localization.equals("graph")) {
+    ScanMatcher matcher = new ScanMatcher();
+    PoseGraph graph     = new PoseGraph(matcher, mapWorker.getObservationStore());
+    
+    mapWorker.setLocalizer(matcher);
+    mapWorker.setPoseGraph(graph);
+  } else if (localization.equals("particles")) {
+    mapWorker.setLocalizer(new ParticleFilter(distanceMap, particleCount));
+  }
+  
+  grid.addListener(distanceMap);
+  grid.addListener(explorer);
+  distanceMap.addListener(planner);
+  mapWorker.addPassJob(distanceMap);
+  mapWorker.addPassJob(planner);
+  mapWorker.addPassJob(explorer);
    
+  commandHandler.stats = linkStats;
+  if (!linkStatsFile.isEmpty()) {
+    linkStats.writeCsv(linkStatsFile);
+    println("writing link stats to " + linkStatsFile);
+  }
+  
+  if (!recordFile.isEmpty()) {
+    try {
+      conn.recorder = new LinkRecorder(recordFile);
+      println("recording the link to " + recordFile);
+    } catch (IOException e) {
+      println("unable to record the link to " + recordFile + ": " + e.getMessage());
+    }
+  }
+  
   guiInit();
+  link.start();
+  mapWorker.start();
+  
+  if (!replayFile.isEmpty()) {
+    // the log decides which commands completed, at whatever pace it is played
+    commandHandler.timeouts = false;
+    new LinkReplay(replayFile, replaySpeed, conn, commandHandler, link).start();
+  }
 }
 
 void draw() {
-  conn.processSerial();
-  commandHandler.processQueues();
+  processLinkEvents();
   guiRefresh();
   
   if (batteryCheckTimer > 3600 * 5) {
-    commandHandler.addCommand(commandHandler.CMD_BATTERY);
+    commandHandler.cmdBattery();
     batteryCheckTimer = 0;
   }
   
   batteryCheckTimer++;
 }
 
+/**
+ * applies everything the link thread has decoded since the last frame.
+ *
+ * pings are stamped with the current pose of the bot and collected until their
+ * ping or sweep command completes, then the group is handed on to the map worker.
+ * Sweeps come back as pose corrections once they have been matched, only then the
+ * planner and the explorer get to know about them
+ */
+void processLinkEvents() {
+  Object event;
+  CompletionResult completion;
+  PoseCorrection correction;
+  
+  mapWorker.flush();
+  
+  while ((event = commandHandler.events.poll()) != null) {
+    if (event instanceof CompletionResult) {
+      completion = (CompletionResult) event;
+      
+      if (completion.cmd == CommandQueue.CMD_TURNLEFT
+          || completion.cmd == CommandQueue.CMD_TURNRIGHT) {
+        bot.rotate(completion.param);
+      } else if (completion.cmd == CommandQueue.CMD_MOVEFORWARD) {
+        bot.move(completion.param);
+      } else if (completion.cmd == CommandQueue.CMD_MOVEBACKWARD) {
+        bot.move(-completion.param);
+      }
+      
+      if ((completion.cmd == CommandQueue.CMD_SONARPING
+           || completion.cmd == CommandQueue.CMD_SONARSWEEP) && completion.droppedPings > 0) {
+        // an incomplete sweep is not mapped, the planner and the explorer go on without it
+        println("discarding sweep, " + completion.droppedPings + " pings were dropped on the way");
+        pendingSweep = null;
+        
+        if (completion.cmd == CommandQueue.CMD_SONARSWEEP) {
+          planner.reportCompletion(completion.cmd, bot.getPosX(), bot.getPosY(), bot.getAngle());
+          explorer.reportCompletion(completion.cmd, bot.getPosX(), bot.getPosY(), bot.getAngle());
+        }
+      } else if (completion.cmd == CommandQueue.CMD_SONARPING
+                 || completion.cmd == CommandQueue.CMD_SONARSWEEP) {
+        if (pendingSweep == null) {
+          pendingSweep = new SonarSweep();
+        }
+        pendingSweep.close(completion.cmd, bot.getPosX(), bot.getPosY(), bot.getAngle());
+        mapWorker.submit(pendingSweep);
+        pendingSweep = null;
+      }
+      
+      if (completion.cmd != CommandQueue.CMD_SONARSWEEP) {
+        planner.reportCompletion(completion.cmd, bot.getPosX(), bot.getPosY(), bot.getAngle());
+        explorer.reportCompletion(completion.cmd, bot.getPosX(), bot.getPosY(), bot.getAngle());
+      }
+      
+    } else if (event instanceof CommandTimeout) {
+      // pings of a sweep that never completed are not trusted
+      pendingSweep = null;
+      planner.reportFailure(((CommandTimeout) event).cmd);
+      explorer.reportFailure(((CommandTimeout) event).cmd);
+      
+    } else if (event instanceof PingResult) {
+      if (pendingSweep == null) {
+        pendingSweep = new SonarSweep();
+      }
+      pendingSweep.add(new SonarReading(bot.getPosX(), bot.getPosY(), bot.getAngle(), (PingResult) event));
+      
+    } else if (event instanceof BatteryResult) {
+      bot.setVoltage(((BatteryResult) event).volts);
+      
+    } else if (event instanceof ProfileResult) {
+      println("profile " + event);
+    }
+  }
+  
+  while ((correction = mapWorker.pollCorrection()) != null) {
+    bot.correct(correction);
+    planner.reportCompletion(CommandQueue.CMD_SONARSWEEP, bot.getPosX(), bot.getPosY(), bot.getAngle());
+    explorer.reportCompletion(CommandQueue.CMD_SONARSWEEP, bot.getPosX(), bot.getPosY(), bot.getAngle());
+  }
+}
+
+/**
+ * evaluates the command line arguments passed via --args
+ */
+void parseArguments() {
+  if (args == null) {
+    return;
+  }
+  
+  for (String arg : args) {
+    if (arg.startsWith("--port=")) {
+      serialPortName = arg.substring("--port=".length());
+    } else if (arg.equals("--debug-serial")) {
+      serialDebug = true;
+    } else if (arg.startsWith("--localization=") && isLocalizationMode(arg.substring("--localization=".length()))) {
+      localization = arg.substring("--localization=".length());
+    } else if (arg.startsWith("--particles=")) {
+      particleCount = max(1, int(arg.substring("--particles=".length())));
+    } else if (arg.startsWith("--observations=")) {
+      observationFile = arg.substring("--observations=".length());
+    } else if (arg.startsWith("--record=")) {
+      recordFile = arg.substring("--record=".length());
+    } else if (arg.startsWith("--link-stats=")) {
+      linkStatsFile = arg.substring("--link-stats=".length());
+    } else if (arg.startsWith("--replay=")) {
+      replayFile = arg.substring("--replay=".length());
+    } else if (arg.startsWith("--replay-speed=")) {
+      replaySpeed = max(0, float(arg.substring("--replay-speed=".length())));
+    } else if (arg.startsWith("--batch=")) {
+      batchFiles = split(arg.substring("--batch=".length()), ',');
+    } else if (arg.startsWith("--map=")) {
+      mapFile = arg.substring("--map=".length());
+    } else {
+      println("unknown argument " + arg);
+    }
+  }
+}
+
+/**
+ * @param String mode
+ * @return boolean whether mode is one of the modes of localization
+ */
+boolean isLocalizationMode(String mode) {
+  return mode.equals("odometry") || mode.equals("scans") || mode.equals("graph") || mode.equals("particles");
+}
+
+/**
+ * opens mapFile, if one was given, and makes its tiles known to the Landscape
+ * before anything reads the map. A map that is rebuilt from loaded observations starts the file over,
+ * its pings would be integrated on top of the saved tiles otherwise
+ *
+ * @param boolean rebuilt
+ */
+void openMap(boolean rebuilt) {
+  int begin = millis();
+  MapFile file;
+  
+  if (mapFile.isEmpty()) {
+    return;
+  }
+  
+  if (rebuilt && new File(mapFile).delete()) {
+    println("starting " + mapFile + " over, the map is rebuilt from the observations");
+  }
+  
+  try {
+    file = new MapFile(mapFile);
+  } catch (IOException e) {
+    println("unable to open the map " + mapFile + ", it is not saved: " + e.getMessage());
+    return;
+  }
+  grid.attach(file);
+  
+  println("opened " + mapFile + " with " + file.getTiles().size() + " tiles in " + (millis() - begin) + " ms");
+}
+
+/**
+ * lets the map worker save the map before the sketch goes
+ */
+void exit() {
+  if (mapWorker != null) {
+    mapWorker.stop();
+  }
+  super.exit();
+}
+
+/**
+ * saves all observations so far to observationFile, on the map worker which owns them
+ */
+void saveObservations() {
+  println("saving observations to " + observationFile);
+  
+  mapWorker.submit(new Runnable() {
+    public void run() {
+      ObservationStore store = mapWorker.getObservationStore();
+      
+      if (store.save(observationFile)) {
+        println("saved " + store.size() + " observations");
+      }
+    }
+  });
+}
+
 /**
  * is being called when data is available over the serial port from the robot
  *
  *  this function then pipes that data into a queue in SerialConnection to free up
- * the buffer on the mbed microcontroller ASAP
+ * the buffer on the mbed microcontroller ASAP and wakes up the link thread to process it
  */
 void serialEvent (Serial port) {
-  conn.appendBuffer(port.readString());
+  conn.receive(port);
+  
+  if (link != null) {
+    link.wake();
+  }
 }
\ No newline at end of file
@@ -0,0 +1,746 @@
+/**
+ * SonarBot emulator
+ *
+ * Stands in for the m3pi + wixel on the host so the Processing server can be
+ * exercised without hardware. The emulator opens a pseudo-terminal, prints the
+ * name of its slave side and then speaks the same #x: protocol as m3pi/main.cpp
+ * with the timing of the real firmware (turn and move delays, servo settle time
+ * and five HC-SR04 measurements per ping).
+ *
+ * The emulated robot lives in a rectangular room with a few boxes in it, so
+ * sweeps return plausible ranges.
+ *
+ * build:  g++ -O2 -std=c++11 -o botemu botemu.cpp
+ * run:    ./botemu --link /tmp/sonarbot
+ *         then start the server with:  --args --port=/tmp/sonarbot
+ *
+ * options:
+ *   --link <path>       create a symlink to the pty slave at <path>
+ *   --latency <ms>      one-way delay added to every response frame
+ *   --jitter <ms>       random extra delay, uniform in [0, jitter]
+ *   --loss <p>          probability that a response frame is dropped
+ *   --ber <p>           probability that a transmitted bit is flipped
+ *   --baud <n>          line rate used to pace the output (default 115200)
+ *   --timescale <f>     divides all command execution times by f
+ *   --load              flood #P responses at the line rate
+ *   --seed <n>          seed for loss/bit-error/noise generation
+ */
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+//---- protocol, mirrors m3pi/main.cpp ----------------------------------------
+#define SRLCMD_CMD_BATTERY 'b'
+#define SRLCMD_CMD_TURNLEFT 'l'
+#define SRLCMD_CMD_TURNRIGHT 'r'
+#define SRLCMD_CMD_MOVEFORWARD 'm'
+#define SRLCMD_CMD_MOVEBACKWARD 'e'
+#define SRLCMD_CMD_LCDCLEAR 'c'
+#define SRLCMD_CMD_LCDWRITE 'w'
+#define SRLCMD_CMD_SONARPING 'p'
+#define SRLCMD_CMD_SONAR_SWEEP 's'
+#define SRLCMD_CMD_PROFILE 'f'
+
+#define SRLCMD_CHAR_START '#'
+#define SRLCMD_CHAR_CMDSEP ':'
+#define SRLCMD_CHAR_PAYLOADSEP ','
+#define SRLCMD_CHAR_END '\n'
+
+#define SRLCMD_STATE_IDLE 0
+#define SRLCMD_STATE_WAITINGFORCMDBYTE 1
+#define SRLCMD_STATE_CMDBYTERECEIVED 2
+#define SRLCMD_STATE_WAITINGFORPAYLOAD 3
+#define SRLCMD_STATE_ERR 10
+
+#define SRLCMD_PAYLOAD_SIZE 20              // cmdPayloadSize
+#define SRLCMD_ERROR_PAUSE_MS 5000.0        // wait(5) in the SRLCMD_STATE_ERR branch of main()
+
+//---- firmware timing, mirrors m3pi/main.cpp ---------------------------------
+#define TURNRATE_LEFT (440.0 / 45.0)
+#define TURNRATE_RIGHT (460.0 / 45.0)
+#define FORWARD_DELAY (2730.0 / 200.0)
+#define BACKWARD_DELAY (2550.0 / 200.0)
+
+#define SERVO_SETTLE_MS 10.0
+#define SONAR_MEASUREMENT_MS 25.0
+#define SONAR_MEASUREMENTS_PER_PING 5
+#define LCD_WRITE_MS 2.0
+
+#define SONAR_MAX_RANGE 4000                // in mm
+#define PROFILE_ZONES 5                     // ProfileZone in m3pi/Profiler/Profiler.h
+
+//---- emulated world ---------------------------------------------------------
+struct Box {
+    double x0, y0, x1, y1;                  // in mm
+};
+
+static const Box room = {-2000.0, -1500.0, 2000.0, 1500.0};
+static const Box obstacles[] = {
+    { 600.0, -400.0,  900.0, -100.0},
+    {-900.0,  500.0, -500.0,  800.0},
+    {1300.0,  700.0, 1600.0, 1500.0},
+};
+
+struct Options {
+    std::string link;
+    double latencyMs;
+    double jitterMs;
+    double loss;
+    double ber;
+    unsigned baud;
+    double timeScale;
+    bool load;
+    unsigned seed;
+};
+
+/**
+ * a response frame that becomes due for transmission at a given time
+ */
+struct PendingFrame {
+    double due;                             // in ms on the monotonic clock
+    std::vector<unsigned char> bytes;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static Options opts;
+static std::mt19937 rng;
+static std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+// emulated robot state
+static double posX = 0.0;                   // in mm
+static double posY = 0.0;                   // in mm
+static double heading = 0.0;                // in degrees, clockwise as on the server
+static float batteryVoltage = 4.9f;
+static double busyUntil = 0.0;              // the firmware executes one command at a time
+
+// response frames waiting for their due time, sorted by due time
+static std::deque<PendingFrame> pending;
+// bytes that are due and are now being paced out at the line rate
+static std::deque<unsigned char> txQueue;
+static double txCredit = 0.0;               // in bytes
+
+// statistics
+static unsigned long bytesIn = 0;
+static unsigned long bytesOut = 0;
+static unsigned long framesDropped = 0;
+static unsigned long bitsFlipped = 0;
+
+
+/**
+ * @return double monotonic time in ms
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void onSignal(int) {
+    running = 0;
+}
+
+void putInt(std::vector<unsigned char> & buf, int value) {
+    buf.push_back((value >> 24) & 0xFF);
+    buf.push_back((value >> 16) & 0xFF);
+    buf.push_back((value >> 8) & 0xFF);
+    buf.push_back(value & 0xFF);
+}
+
+void putFloat(std::vector<unsigned char> & buf, float value) {
+    int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putInt(buf, bits);
+}
+
+int getInt(const unsigned char * p) {
+    return (int) (((unsigned) p[0] << 24) | ((unsigned) p[1] << 16) | ((unsigned) p[2] << 8) | p[3]);
+}
+
+/**
+ * queues a response frame for transmission at the given time, applying the
+ * configured latency, jitter and loss
+ *
+ * @param double at          time in ms the firmware would have sent the frame
+ * @param std::vector<unsigned char> bytes
+ */
+void schedule(double at, const std::vector<unsigned char> & bytes) {
+    if (opts.loss > 0.0 && uniform(rng) < opts.loss) {
+        framesDropped++;
+        return;
+    }
+
+    PendingFrame f;
+    f.due = at + opts.latencyMs + opts.jitterMs * uniform(rng);
+    f.bytes = bytes;
+
+    // a serial link never reorders frames, jitter only delays them
+    if (!pending.empty() && f.due < pending.back().due) {
+        f.due = pending.back().due;
+    }
+    pending.push_back(f);
+}
+
+/**
+ * @param double ms     emulator time in ms
+ * @return int the firmware's us_ticker_read() at that time, wrapping like it does
+ */
+int usTicker(double ms) {
+    return (int) (uint32_t) (long long) (ms * 1000.0);
+}
+
+/**
+ * @param double at          time in ms the command finished
+ * @param double received    time in ms its frame was received and parsed
+ * @param double started     time in ms the firmware started executing it
+ */
+void reportCmdComplete(double at, double received, double started) {
+    std::vector<unsigned char> f;
+    f.push_back(SRLCMD_CHAR_START);
+    f.push_back('K');
+    f.push_back(SRLCMD_CHAR_CMDSEP);
+    putInt(f, usTicker(received));
+    putInt(f, usTicker(received));
+    putInt(f, usTicker(started));
+    putInt(f, usTicker(at));
+    f.push_back(SRLCMD_CHAR_END);
+    schedule(at, f);
+}
+
+void reportPing(double at, int angle, int range) {
+    std::vector<unsigned char> f;
+    f.push_back(SRLCMD_CHAR_START);
+    f.push_back('P');
+    f.push_back(SRLCMD_CHAR_CMDSEP);
+    putInt(f, angle);
+    f.push_back(SRLCMD_CHAR_PAYLOADSEP);
+    putInt(f, range);
+    f.push_back(SRLCMD_CHAR_END);
+    schedule(at, f);
+}
+
+void reportBattery(double at, float voltage) {
+    std::vector<unsigned char> f;
+    f.push_back(SRLCMD_CHAR_START);
+    f.push_back('B');
+    f.push_back(SRLCMD_CHAR_CMDSEP);
+    putFloat(f, voltage);
+    f.push_back(SRLCMD_CHAR_END);
+    schedule(at, f);
+}
+
+/**
+ * the emulator has no cycle counter, every zone is reported as not entered
+ */
+void reportProfile(double at, int zone) {
+    std::vector<unsigned char> f;
+    f.push_back(SRLCMD_CHAR_START);
+    f.push_back('F');
+    f.push_back(SRLCMD_CHAR_CMDSEP);
+    f.push_back(zone);
+    for (int i = 0; i < 5; i++) {
+        putInt(f, 0);                       // count, min, max, total as two ints
+    }
+    f.push_back(SRLCMD_CHAR_END);
+    schedule(at, f);
+}
+
+/**
+ * distance along a ray to the closest wall or obstacle edge
+ *
+ * @param double ox        ray origin in mm
+ * @param double oy        ray origin in mm
+ * @param double dx        normalized ray direction
+ * @param double dy        normalized ray direction
+ * @return double distance in mm, INFINITY when nothing is hit
+ */
+double castRay(double ox, double oy, double dx, double dy) {
+    double best = INFINITY;
+
+    // the room is hit from the inside, obstacles from the outside. Checking all four
+    // edges of each box against the ray covers both cases.
+    const Box * boxes[1 + sizeof(obstacles) / sizeof(obstacles[0])];
+    int count = 0;
+    boxes[count++] = &room;
+    for (size_t i = 0; i < sizeof(obstacles) / sizeof(obstacles[0]); i++) {
+        boxes[count++] = &obstacles[i];
+    }
+
+    for (int i = 0; i < count; i++) {
+        const Box & b = *boxes[i];
+
+        if (dx != 0.0) {
+            double xs[2] = {b.x0, b.x1};
+            for (int k = 0; k < 2; k++) {
+                double t = (xs[k] - ox) / dx;
+                double y = oy + t * dy;
+                if (t > 0.0 && t < best && y >= b.y0 && y <= b.y1) {
+                    best = t;
+                }
+            }
+        }
+        if (dy != 0.0) {
+            double ys[2] = {b.y0, b.y1};
+            for (int k = 0; k < 2; k++) {
+                double t = (ys[k] - oy) / dy;
+                double x = ox + t * dx;
+                if (t > 0.0 && t < best && x >= b.x0 && x <= b.x1) {
+                    best = t;
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
+/**
+ * emulates the averaged HC-SR04 measurement for the given servo angle
+ *
+ * @param int angle     servo angle in degrees, 0 points straight ahead
+ * @return int range in mm
+ */
+int measureRange(int angle) {
+    double a = (heading + angle) * M_PI / 180.0;
+    double d = castRay(posX, posY, cos(a), sin(a));
+
+    if (d > SONAR_MAX_RANGE) {
+        d = SONAR_MAX_RANGE;
+    }
+    // a few mm of noise per ping, the firmware averages five measurements
+    d += (uniform(rng) - 0.5) * 10.0;
+
+    return (int) (d < 0.0 ? 0.0 : d);
+}
+
+double pingDuration() {
+    return (SERVO_SETTLE_MS + SONAR_MEASUREMENTS_PER_PING * SONAR_MEASUREMENT_MS + LCD_WRITE_MS) / opts.timeScale;
+}
+
+/**
+ * executes a fully received command and schedules all of its responses
+ *
+ * @param char cmd
+ * @param unsigned char * payload
+ */
+void executeCommand(char cmd, const unsigned char * payload) {
+    double received = now();
+    double started = busyUntil > received ? busyUntil : received;
+    double t = started;
+    int value;
+
+    switch (cmd) {
+        case SRLCMD_CMD_BATTERY:
+            batteryVoltage -= 0.001f;
+            reportBattery(t, batteryVoltage);
+            break;
+        case SRLCMD_CMD_TURNLEFT:
+            value = getInt(payload);
+            // the server sends left turns as negative angles, see cmdTurnLeft() in main.cpp
+            t += TURNRATE_LEFT * -value / opts.timeScale;
+            heading += value;
+            break;
+        case SRLCMD_CMD_TURNRIGHT:
+            value = getInt(payload);
+            t += TURNRATE_RIGHT * value / opts.timeScale;
+            heading += value;
+            break;
+        case SRLCMD_CMD_MOVEFORWARD:
+        case SRLCMD_CMD_MOVEBACKWARD:
+            value = getInt(payload) * (cmd == SRLCMD_CMD_MOVEFORWARD ? 1 : -1);
+            t += (cmd == SRLCMD_CMD_MOVEFORWARD ? FORWARD_DELAY : BACKWARD_DELAY) * abs(value) / opts.timeScale;
+            posX += value * cos(heading * M_PI / 180.0);
+            posY += value * sin(heading * M_PI / 180.0);
+            break;
+        case SRLCMD_CMD_LCDCLEAR:
+        case SRLCMD_CMD_LCDWRITE:
+            t += LCD_WRITE_MS / opts.timeScale;
+            break;
+        case SRLCMD_CMD_SONARPING:
+            value = getInt(payload);
+            t += pingDuration();
+            reportPing(t, value, measureRange(value));
+            break;
+        case SRLCMD_CMD_SONAR_SWEEP: {
+            int startAngle = getInt(payload);
+            int endAngle = getInt(payload + 5);
+            // char is unsigned on the ARM target, decode it the same way
+            int stepSize = (unsigned char) payload[10];
+            int steps = stepSize != 0 ? 1 + (endAngle - startAngle) / stepSize : 1;
+
+            for (int i = 0, angle = startAngle; i < steps; i++, angle += stepSize) {
+                t += pingDuration();
+                reportPing(t, angle, measureRange(angle));
+            }
+            break;
+        }
+        case SRLCMD_CMD_PROFILE:
+            for (int zone = 0; zone < PROFILE_ZONES; zone++) {
+                reportProfile(t, zone);
+            }
+            break;
+        default:
+            fprintf(stderr, "unknown command '%c'\n", cmd);
+            return;
+    }
+
+    reportCmdComplete(t, received, started);
+    busyUntil = t;
+}
+
+/**
+ * number of payload bytes a command carries before its terminator can follow,
+ * equivalent to payloadSize() in main.cpp
+ *
+ * @param char cmd
+ * @return int
+ */
+int payloadSize(char cmd) {
+    switch (cmd) {
+        case SRLCMD_CMD_TURNLEFT:
+        case SRLCMD_CMD_TURNRIGHT:
+        case SRLCMD_CMD_MOVEFORWARD:
+        case SRLCMD_CMD_MOVEBACKWARD:
+        case SRLCMD_CMD_SONARPING:
+            return 4;
+        case SRLCMD_CMD_LCDWRITE:
+            return 10;                      // x, y and separators, followed by text up to '\n'
+        case SRLCMD_CMD_SONAR_SWEEP:
+            return 11;
+    }
+    return 0;
+}
+
+/**
+ * whether the firmware accepts the payload, equivalent to processPayload() and
+ * verifyCommand() in main.cpp
+ *
+ * @param char cmd
+ * @param unsigned char * payload
+ * @param int payloadPos
+ * @return bool
+ */
+bool validPayload(char cmd, const unsigned char * payload, int payloadPos) {
+    switch (cmd) {
+        case SRLCMD_CMD_BATTERY:
+        case SRLCMD_CMD_LCDCLEAR:
+        case SRLCMD_CMD_PROFILE:
+            return payloadPos == 0;
+        case SRLCMD_CMD_LCDWRITE:
+            return payloadPos > 10 && payload[4] == SRLCMD_CHAR_PAYLOADSEP && payload[9] == SRLCMD_CHAR_PAYLOADSEP;
+        case SRLCMD_CMD_TURNLEFT:
+        case SRLCMD_CMD_TURNRIGHT:
+        case SRLCMD_CMD_MOVEFORWARD:
+        case SRLCMD_CMD_MOVEBACKWARD:
+        case SRLCMD_CMD_SONARPING:
+        case SRLCMD_CMD_SONAR_SWEEP:
+            return payloadPos == payloadSize(cmd);
+    }
+    return false;
+}
+
+/**
+ * serial input state machine, equivalent to serialCallback() in main.cpp
+ *
+ * like the firmware a '\n' only ends a command once the fixed part of its payload
+ * is in, and after a malformed frame no completion is sent and all input is
+ * ignored for SRLCMD_ERROR_PAUSE_MS
+ *
+ * @param unsigned char inChar
+ */
+void processByte(unsigned char inChar) {
+    static int cmdState = SRLCMD_STATE_IDLE;
+    static char command = 0;
+    static unsigned char cmdPayload[SRLCMD_PAYLOAD_SIZE];
+    static int cmdPayloadPos = 0;
+    static double errorUntil = 0.0;
+
+    if (now() < errorUntil) {
+        return;
+    }
+
+    switch (cmdState) {
+        case SRLCMD_STATE_IDLE:
+            if (inChar == SRLCMD_CHAR_START) {
+                cmdPayloadPos = 0;
+                cmdState = SRLCMD_STATE_WAITINGFORCMDBYTE;
+            } else {
+                cmdState = SRLCMD_STATE_ERR;
+            }
+            break;
+
+        case SRLCMD_STATE_WAITINGFORCMDBYTE:
+            command = inChar;
+            cmdState = SRLCMD_STATE_CMDBYTERECEIVED;
+            break;
+
+        case SRLCMD_STATE_CMDBYTERECEIVED:
+            cmdState = inChar == SRLCMD_CHAR_CMDSEP ? SRLCMD_STATE_WAITINGFORPAYLOAD : SRLCMD_STATE_ERR;
+            break;
+
+        case SRLCMD_STATE_WAITINGFORPAYLOAD:
+            if (inChar == SRLCMD_CHAR_END && cmdPayloadPos >= payloadSize(command)) {
+                if (validPayload(command, cmdPayload, cmdPayloadPos)) {
+                    executeCommand(command, cmdPayload);
+                    cmdState = SRLCMD_STATE_IDLE;
+                } else {
+                    cmdState = SRLCMD_STATE_ERR;
+                }
+            } else if (cmdPayloadPos == SRLCMD_PAYLOAD_SIZE) {
+                cmdState = SRLCMD_STATE_ERR;
+            } else {
+                cmdPayload[cmdPayloadPos++] = inChar;
+            }
+            break;
+    }
+
+    if (cmdState == SRLCMD_STATE_ERR) {
+        fprintf(stderr, "malformed frame at byte 0x%02x, pausing like the firmware\n", inChar);
+        errorUntil = now() + SRLCMD_ERROR_PAUSE_MS;
+        cmdState = SRLCMD_STATE_IDLE;
+    }
+}
+
+/**
+ * keeps the pending queue stocked with #P frames so that the output runs at the line rate
+ *
+ * @param double t
+ */
+void generateLoad(double t) {
+    static int angle = -60;
+
+    // one second worth of frames is plenty to keep the line saturated
+    while (pending.size() + txQueue.size() / 13 < opts.baud / 10 / 13) {
+        reportPing(t, angle, measureRange(angle));
+        angle = angle >= 60 ? -60 : angle + 2;
+    }
+}
+
+/**
+ * moves due frames into the transmit queue, applying bit errors on the way
+ *
+ * @param double t
+ */
+void releaseDueFrames(double t) {
+    while (!pending.empty() && pending.front().due <= t) {
+        for (unsigned char b : pending.front().bytes) {
+            if (opts.ber > 0.0) {
+                for (int bit = 0; bit < 8; bit++) {
+                    if (uniform(rng) < opts.ber) {
+                        b ^= (1 << bit);
+                        bitsFlipped++;
+                    }
+                }
+            }
+            txQueue.push_back(b);
+        }
+        pending.pop_front();
+    }
+}
+
+/**
+ * writes as many queued bytes as the line rate allows since the last call
+ *
+ * @param int fd
+ * @param double elapsed     in ms
+ */
+void transmit(int fd, double elapsed) {
+    unsigned char buf[4096];
+    size_t n = 0;
+
+    // 8N1 framing, ten bits on the wire per byte
+    txCredit += elapsed * opts.baud / 10.0 / 1000.0;
+    if (txCredit > sizeof(buf)) {
+        txCredit = sizeof(buf);
+    }
+
+    while (n < (size_t) txCredit && !txQueue.empty()) {
+        buf[n++] = txQueue.front();
+        txQueue.pop_front();
+    }
+
+    if (n > 0) {
+        ssize_t written = write(fd, buf, n);
+
+        if (written < 0) {
+            written = 0;
+        }
+        // put back whatever the pty did not accept
+        for (size_t i = n; i > (size_t) written; i--) {
+            txQueue.push_front(buf[i - 1]);
+        }
+        txCredit -= written;
+        bytesOut += written;
+    }
+
+    if (txQueue.empty() && txCredit > 0.0) {
+        txCredit = 0.0;
+    }
+}
+
+void usage(const char * name) {
+    fprintf(stderr,
+            "usage: %s [--link path] [--latency ms] [--jitter ms] [--loss p] [--ber p]\n"
+            "          [--baud n] [--timescale f] [--load] [--seed n]\n", name);
+}
+
+bool parseOptions(int argc, char ** argv) {
+    opts.latencyMs = 0.0;
+    opts.jitterMs = 0.0;
+    opts.loss = 0.0;
+    opts.ber = 0.0;
+    opts.baud = 115200;
+    opts.timeScale = 1.0;
+    opts.load = false;
+    opts.seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--load") {
+            opts.load = true;
+        } else if (arg == "--link" && hasValue) {
+            opts.link = argv[++i];
+        } else if (arg == "--latency" && hasValue) {
+            opts.latencyMs = atof(argv[++i]);
+        } else if (arg == "--jitter" && hasValue) {
+            opts.jitterMs = atof(argv[++i]);
+        } else if (arg == "--loss" && hasValue) {
+            opts.loss = atof(argv[++i]);
+        } else if (arg == "--ber" && hasValue) {
+            opts.ber = atof(argv[++i]);
+        } else if (arg == "--baud" && hasValue) {
+            opts.baud = (unsigned) atoi(argv[++i]);
+        } else if (arg == "--timescale" && hasValue) {
+            opts.timeScale = atof(argv[++i]);
+        } else if (arg == "--seed" && hasValue) {
+            opts.seed = (unsigned) atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+
+    return opts.baud > 0 && opts.timeScale > 0.0;
+}
+
+/**
+ * opens the pty master and puts the slave side into raw mode, the server
+ * treats it like any other serial port
+ *
+ * @return int master fd, -1 on error
+ */
+int openPty() {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave >= 0) {
+        struct termios tio;
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        close(slave);
+    }
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    return master;
+}
+
+int main(int argc, char ** argv) {
+    if (!parseOptions(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    rng.seed(opts.seed);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    int fd = openPty();
+    if (fd < 0) {
+        return 1;
+    }
+
+    const char * slaveName = ptsname(fd);
+    printf("SonarBot emulator listening on %s\n", slaveName);
+    if (!opts.link.empty()) {
+        unlink(opts.link.c_str());
+        if (symlink(slaveName, opts.link.c_str()) != 0) {
+            perror("symlink");
+        } else {
+            printf("linked as %s\n", opts.link.c_str());
+        }
+    }
+    fflush(stdout);
+
+    double last = now();
+    double lastReport = last;
+    unsigned long lastBytesOut = 0;
+
+    while (running) {
+        fd_set readable;
+        struct timeval timeout = {0, 1000};
+
+        FD_ZERO(&readable);
+        FD_SET(fd, &readable);
+        select(fd + 1, &readable, NULL, NULL, &timeout);
+
+        if (FD_ISSET(fd, &readable)) {
+            unsigned char buf[256];
+            ssize_t n = read(fd, buf, sizeof(buf));
+
+            for (ssize_t i = 0; i < n; i++) {
+                processByte(buf[i]);
+            }
+            if (n > 0) {
+                bytesIn += n;
+            } else if (n < 0 && errno == EIO) {
+                // nobody has the slave open at the moment, the master stays
+                // readable until somebody does so don't spin on it
+                usleep(10000);
+            }
+        }
+
+        double t = now();
+        if (opts.load) {
+            generateLoad(t);
+        }
+        releaseDueFrames(t);
+        transmit(fd, t - last);
+        last = t;
+
+        if (t - lastReport >= 5000.0) {
+            fprintf(stderr, "in: %lu B  out: %lu B (%.0f B/s)  dropped frames: %lu  flipped bits: %lu\n",
+                    bytesIn, bytesOut, (bytesOut - lastBytesOut) * 1000.0 / (t - lastReport),
+                    framesDropped, bitsFlipped);
+            lastReport = t;
+            lastBytesOut = bytesOut;
+        }
+    }
+
+    if (!opts.link.empty()) {
+        unlink(opts.link.c_str());
+    }
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+/**
+ * SonarBot trace decoder
+ *
+ * Turns the binary trace records the firmware drains to its USB serial port
+ * (see m3pi/Trace/Trace.h) back into text, one line per record:
+ *
+ *     12345.678 ms  INFO   EXECUTE       executing command: m
+ *
+ * The time is taken from the cycle counter stored in each record, counted from
+ * the first record decoded. The counter wraps every 2^32 cycles, about 44 s at
+ * 96 MHz, so a pause longer than that between two records shows up shortened.
+ *
+ * Event names, levels and formats come from m3pi/TraceEvents.h, rebuild the
+ * decoder whenever that changes.
+ *
+ * build:  g++ -O2 -std=c++11 -o tracedecode tracedecode.cpp
+ * run:    stty -F /dev/ttyACM0 raw 115200 && ./tracedecode /dev/ttyACM0
+ *         ./tracedecode < trace.bin
+ *
+ * options:
+ *   --mhz <f>           core clock the cycle counter runs at (default 96)
+ *   --raw               print the args as numbers instead of formatting them
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "../../m3pi/TraceEvents.h"
+
+#define TRACE_MAGIC 0xA5        // mirrors m3pi/Trace/Trace.h
+#define TRACE_MAX_ARGS 3
+
+struct EventInfo {
+    const char * name;
+    int level;
+    int args;
+    const char * format;
+};
+
+#define TRACE_EVENT(name, level, args, format) { #name, level, args, format },
+static const EventInfo events[] = {
+    TRACE_EVENTS
+};
+#undef TRACE_EVENT
+
+static const int EVENT_COUNT = sizeof(events) / sizeof(events[0]);
+
+static struct {
+    double mhz = 96.0;
+    bool raw = false;
+} opts;
+
+const char * levelName(int level) {
+    switch (level) {
+        case TRACE_ERROR: return "ERROR";
+        case TRACE_WARN:  return "WARN";
+        case TRACE_INFO:  return "INFO";
+        case TRACE_DEBUG: return "DEBUG";
+        default:          return "?";
+    }
+}
+
+/**
+ * reads a 4 byte word, MSB first
+ *
+ * @return bool false at the end of the input
+ */
+bool readWord(FILE * in, uint32_t & value) {
+    unsigned char b[4];
+
+    if (fread(b, 1, 4, in) != 4) {
+        return false;
+    }
+    value = ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | b[3];
+
+    return true;
+}
+
+/**
+ * @return bool whether the header word belongs to a known event with its number of args
+ */
+bool validHeader(uint32_t header) {
+    int event = (header >> 8) & 0xFFFF;
+
+    return (header >> 24) == TRACE_MAGIC
+        && event < EVENT_COUNT
+        && (int) (header & 0xFF) == events[event].args;
+}
+
+void printRecord(double ms, const EventInfo & e, const uint32_t * args) {
+    char text[256];
+
+    if (opts.raw) {
+        int n = 0;
+        text[0] = '\0';
+        for (int i = 0; i < e.args; i++) {
+            n += snprintf(text + n, sizeof(text) - n, " %u", args[i]);
+        }
+    } else {
+        snprintf(text, sizeof(text), e.format, args[0], args[1], args[2]);
+    }
+
+    printf("%12.3f ms  %-6s %-13s %s\n", ms, levelName(e.level), e.name, text);
+    fflush(stdout);
+}
+
+int main(int argc, char ** argv) {
+    FILE * in = stdin;
+    uint32_t header = 0;
+    uint32_t cycles;
+    uint32_t lastCycles = 0;
+    uint32_t args[TRACE_MAX_ARGS];
+    double elapsed = 0.0;               // in cycles since the first record
+    bool first = true;
+    unsigned long skipped = 0;
+    int c;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--mhz") && i + 1 < argc) {
+            opts.mhz = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--raw")) {
+            opts.raw = true;
+        } else if (argv[i][0] != '-' && in == stdin) {
+            in = fopen(argv[i], "rb");
+            if (!in) {
+                perror(argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "usage: %s [--mhz <f>] [--raw] [file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // the port may have been opened in the middle of a record, so headers are
+    // searched byte by byte until one of a known event turns up
+    while ((c = fgetc(in)) != EOF) {
+        header = (header << 8) | (unsigned char) c;
+        if (!validHeader(header)) {
+            skipped++;
+            continue;
+        }
+
+        const EventInfo & e = events[(header >> 8) & 0xFFFF];
+
+        memset(args, 0, sizeof(args));
+        if (!readWord(in, cycles)) {
+            break;
+        }
+        for (int a = 0; a < e.args; a++) {
+            if (!readWord(in, args[a])) {
+                return 0;
+            }
+        }
+
+        if (skipped > 3) {
+            fprintf(stderr, "skipped %lu bytes\n", skipped - 3);
+        }
+        skipped = 0;
+        header  = 0;
+
+        if (!first) {
+            elapsed += (uint32_t) (cycles - lastCycles);
+        }
+        first      = false;
+        lastCycles = cycles;
+
+        printRecord(elapsed / opts.mhz / 1000.0, e, args);
+    }
+
+    return 0;
+}